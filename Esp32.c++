@@ -11,36 +11,1183 @@
 #include <BLEUtils.h>
 #include <BLE2902.h>
 #include <esp_wifi.h>
+#include <Preferences.h>
 #include <ArduinoJson.h>
+#include <atomic>
+#include <algorithm>
 #include "esp_bt_main.h"
 #include "esp_bt_device.h"
+#include "esp_bt.h"
+#include "esp_netif.h"
+#include "esp_private/wifi.h"
+#include "lwip/lwip_napt.h"
+#include "mbedtls/pkcs5.h"
+#include "mbedtls/md.h"
+#include "esp_rom_crc.h"
+#include "esp_freertos_hooks.h"
+#include "esp_timer.h"
+#include "ping/ping_sock.h"
+#include "lwip/sockets.h"
+#include "lwip/stats.h"
+#include "lwip/udp.h"
+#include "lwip/tcpip.h"
+#include "lwip/pbuf.h"
+#include "lwip/etharp.h"
+#include "esp_netif_net_stack.h"
+#include "esp_heap_caps.h"
+#include "esp_coexist.h"
+#include "esp_pm.h"
+#include "esp_task_wdt.h"
+#if CONFIG_WPA_11KV_SUPPORT
+#include "esp_rrm.h"
+#include "esp_wnm.h"
+#endif
+// Core logic shared with the host benchmark build (see CMakeLists.txt)
+#include "src/core/hal.h"
+#include "src/core/frame.h"
+#include "src/core/spsc_queue.h"
+#include "src/core/status.h"
+#include "src/core/conntrack.h"
+#include "src/core/config_doc.h"
+
+#if !IP_NAPT
+#error "NAPT forwarding needs an lwIP build with CONFIG_LWIP_IP_FORWARD and CONFIG_LWIP_IPV4_NAPT enabled"
+#endif
+
+// Logging. Callers format one line into a slot of a lock-free ring (a bounded MPMC
+// queue with per-slot sequence numbers, used here with a single consumer) and return;
+// a low-priority task drains it to the UART, so a slow serial port only ever delays
+// the drain task. A full ring drops the line and counts it rather than waiting.
+// Levels above LOG_LEVEL compile away together with their arguments; override with
+// -DLOG_LEVEL=... in the build flags.
+#define LOG_LEVEL_NONE   0
+#define LOG_LEVEL_ERROR  1
+#define LOG_LEVEL_WARN   2
+#define LOG_LEVEL_INFO   3
+#define LOG_LEVEL_DEBUG  4
+#ifndef LOG_LEVEL
+#define LOG_LEVEL        LOG_LEVEL_INFO
+#endif
+#define LOG_SLOTS        64     // Power of two; a status dump is ~25 lines
+#define LOG_LINE_MAX     100
+#define LOG_TASK_CORE    0
+#define LOG_TASK_PRIORITY 1     // Just above idle: never competes with forwarding or BLE
+#define LOG_TASK_STACK   2048
+#define LOG_DRAIN_MS     20
+#define LOG_IDLE_DRAIN_MS 500   // In idle mode, so the log task doesn't keep the CPU awake
+#define LOG_AT(level, ...) do { if ((level) <= LOG_LEVEL) logWrite(__VA_ARGS__); } while (0)
+#define LOG_ERROR(...)   LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)    LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)    LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...)   LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define MAC_FMT          "%02x:%02x:%02x:%02x:%02x:%02x"
+#define MAC_ARGS(m)      (m)[0], (m)[1], (m)[2], (m)[3], (m)[4], (m)[5]
+bool idleMode = false;           // See the idle mode section; read here for the drain rate
+struct LogSlot {
+  std::atomic<uint32_t> seq;      // == position + 1 once the line is complete
+  uint8_t len;
+  char text[LOG_LINE_MAX];
+};
+LogSlot logSlots[LOG_SLOTS];
+std::atomic<uint32_t> logHead{0};         // Next position a producer claims
+uint32_t logTail = 0;                     // Drain task only
+std::atomic<uint32_t> logDropped{0};
+TaskHandle_t logTaskHandle = NULL;
+
+void logWrite(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void logWrite(const char* fmt, ...) {
+  // Claim a slot; seq tells whether it is free (== pos), still being drained (< pos)
+  // or already claimed by another producer (> pos)
+  uint32_t pos = logHead.load(std::memory_order_relaxed);
+  LogSlot* slot;
+  for (;;) {
+    slot = &logSlots[pos % LOG_SLOTS];
+    int32_t diff = (int32_t)(slot->seq.load(std::memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (logHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      logDropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = logHead.load(std::memory_order_relaxed);
+    }
+  }
+  
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+  va_end(args);
+  slot->len = n < 0 ? 0 : (n >= (int)sizeof(slot->text) ? sizeof(slot->text) - 1 : n);
+  slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+void logTask(void* arg) {
+  for (;;) {
+    LogSlot& slot = logSlots[logTail % LOG_SLOTS];
+    if (slot.seq.load(std::memory_order_acquire) != logTail + 1) {
+      uint32_t dropped = logDropped.exchange(0, std::memory_order_relaxed);
+      if (dropped) {
+        Serial.print("(");
+        Serial.print(dropped);
+        Serial.println(" log lines dropped)");
+      }
+      vTaskDelay(pdMS_TO_TICKS(idleMode ? LOG_IDLE_DRAIN_MS : LOG_DRAIN_MS));
+      continue;
+    }
+    Serial.write((const uint8_t*)slot.text, slot.len);
+    Serial.println();
+    slot.seq.store(logTail + LOG_SLOTS, std::memory_order_release);
+    logTail++;
+  }
+}
+
+void setupLogging() {
+  for (uint32_t i = 0; i < LOG_SLOTS; i++) {
+    logSlots[i].seq.store(i, std::memory_order_relaxed);
+  }
+  xTaskCreatePinnedToCore(logTask, "log", LOG_TASK_STACK, NULL,
+                          LOG_TASK_PRIORITY, &logTaskHandle, LOG_TASK_CORE);
+}
+
+// Boot timeline: milliseconds from start-up to each milestone, logged once the uplink
+// is up (or BOOT_TIMELINE_MS has passed), and again on {"cmd":"boot"}. The clock is
+// esp_timer's, which starts with the app; the ROM and bootloader come before it.
+#define BOOT_SETUP         0
+#define BOOT_CONFIG        1
+#define BOOT_AP_UP         2
+#define BOOT_UPLINK_START  3
+#define BOOT_UPLINK_ASSOC  4
+#define BOOT_UPLINK_IP     5
+#define BOOT_BLE_UP        6
+#define BOOT_FIRST_CLIENT  7
+#define BOOT_MILESTONES    8
+#define BOOT_TIMELINE_MS   30000
+const char* const bootMilestoneNames[BOOT_MILESTONES] = {
+  "setup", "config loaded", "AP up", "uplink started", "uplink associated", "uplink IP", "BLE up", "first client"
+};
+std::atomic<uint32_t> bootMs[BOOT_MILESTONES];
+bool bootTimelineLogged = false;
+
+// First time only; called from setup, the supervisor and WiFi event handlers
+static inline void bootMark(uint8_t milestone) {
+  uint32_t expected = 0;
+  uint32_t now = esp_timer_get_time() / 1000;
+  bootMs[milestone].compare_exchange_strong(expected, now ? now : 1, std::memory_order_relaxed);
+}
+
+// Build profile. REPEATER_BLE=0 is the headless profile for provisioned sites: the
+// Bluetooth stack is never started and its controller memory goes back to the heap
+// at boot, and configuration only arrives over the authenticated UDP endpoint.
+#ifndef REPEATER_BLE
+#define REPEATER_BLE 1
+#endif
+// Key for the UDP endpoint until one is set over config; headless builds need one
+#ifndef REPEATER_CONFIG_KEY
+#define REPEATER_CONFIG_KEY ""
+#endif
 
 // WiFi configuration
 String primarySSID = "Shivam5G";
 String primaryPassword = "";
 String apSSID = "Shivam5G_Repeater";
 String apPassword = "";
-int apChannel = 7;
+int apChannel = 7;          // Manual channel; with autoChannel only used while the uplink channel is unknown
 int maxClients = 8;
+bool autoChannel = true;    // Follow the uplink's channel so the single radio never has to hop
+uint8_t activeAPChannel = 0;
+#define CHANNEL_POLL_MS     2000  // Catches upstream channel switches (CSA) after the fact
+#define CSA_SWITCH_COUNT    3     // Beacon intervals announced ahead of a planned move
+#define CSA_INTERVAL_MS     100   // One beacon interval between announcements
+uint8_t csaChannel = 0;           // Announced move in progress, 0 = none
+uint8_t csaCount = 0;             // Announcements left before the move
+uint32_t csaNextAt = 0;           // millis() of the next announcement or the move
 
 // Power saving config
 bool powerSavingEnabled = true;
 uint8_t powerSaveMode = WIFI_PS_MIN_MODEM; // WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM
 uint16_t listenInterval = 3;  // Default beacon listen interval (more = power saving but higher latency)
+#define TX_POWER_MIN_DBM 2
+#define TX_POWER_MAX_DBM 20
+uint8_t txPower = TX_POWER_MAX_DBM;  // dBm; less reaches fewer clients but saves current on every frame
+
+// PHY tuner (phyAuto). TX power follows the weakest link: the path loss to each AP
+// station and to the uplink is estimated from its RSSI and a typical transmit power,
+// and the radio runs at what the worst of them needs to arrive at the target RSSI,
+// capped by txPower. The ESP32 has one TX power for both interfaces, so it's set for
+// whichever needs more. The AP runs HT40 when a periodic survey of its 40 MHz span
+// finds it clear (and the uplink allows it), HT20 otherwise, and drops 11b while
+// every associated station can do OFDM.
+#define PHY_TARGET_RSSI_DBM    -67
+#define PHY_POWER_MARGIN_DB    6
+#define PHY_CLIENT_TX_DBM      15     // Assumed station transmit power
+#define PHY_UPLINK_TX_DBM      20     // Assumed upstream AP transmit power
+#define PHY_POWER_STEP_DB      2      // Changes smaller than this aren't applied
+#define PHY_SURVEY_MS          600000
+#define PHY_SURVEY_DWELL_MS    80
+#define PHY_NEIGHBOR_RSSI_DBM  -82    // A BSS this strong contends for the medium
+#define PHY_HT40_MAX_NEIGHBORS 2      // On the primary and secondary together
+#define PHY_HT40_CLEAR_SURVEYS 2      // Consecutive clear surveys before widening
+bool phyAuto = true;
+uint8_t phyBandwidth = 20;           // MHz the AP is set to
+bool phy11b = true;                  // 11b rates enabled on the AP
+bool phy11bFixed = false;            // Driver refused g/n-only; stop asking
+uint8_t phyTxPower = TX_POWER_MAX_DBM;   // What the tuner wants, before the txPower cap
+uint8_t phyTxApplied = 0;
+int8_t phyNeighbors = -1;            // Contending BSSs from the last survey, -1 = none yet
+uint8_t phyClearSurveys = 0;
+uint16_t phySurveyChannels = 0;      // Still to scan, bit n = channel n
+uint8_t phySurveySecond = 0;         // Secondary channel under test
+int8_t phySurveyCount = 0;
+bool phySurveying = false;
+unsigned long lastPhySurvey = 0;
+
+// Adaptive power governor. When enabled it replaces the static mode above, picking a
+// level from forwarded packet rate and client count. Steps up at once; steps down only
+// after the load has stayed below the exit threshold for GOVERNOR_DOWN_SAMPLES.
+#define GOV_PERFORMANCE      0
+#define GOV_BALANCED         1
+#define GOV_POWERSAVE        2
+#define GOVERNOR_SAMPLE_MS   1000
+#define GOVERNOR_DOWN_SAMPLES 10
+#define GOV_PERF_ENTER_PPS   200   // Sustained forwarding: latency matters more than power
+#define GOV_PERF_EXIT_PPS    100
+#define GOV_BAL_ENTER_PPS    20
+#define GOV_BAL_EXIT_PPS     5
+struct GovernorLevel {
+  wifi_ps_type_t psMode;
+  uint8_t listenInterval;
+  uint16_t cpuMhz;
+};
+const GovernorLevel governorLevels[3] = {
+  { WIFI_PS_NONE,      1,  240 },
+  { WIFI_PS_MIN_MODEM, 3,  160 },
+  { WIFI_PS_MAX_MODEM, 10, 80 },   // 80 MHz is the floor for WiFi
+};
+bool powerGovernor = false;
+uint8_t governorLevel = GOV_BALANCED;
+uint8_t governorCalmSamples = 0;
+uint16_t governorSavedMhz = 0;              // Clock from before the governor took over, 0 = not running
+uint32_t governorPps = 0;
+wifi_ps_type_t activePsMode = WIFI_PS_MIN_MODEM;  // What the driver actually accepted
+
+// Idle mode for battery and solar sites. After idleAfterSec with no AP station, no
+// BLE central and next to no traffic, the CPU goes to dynamic frequency scaling with
+// automatic light sleep (esp_pm, where the build has it), the uplink to max modem
+// sleep with a long listen interval, and the supervisor to a slow tick. A station
+// associating, a nearby probe request or a BLE connection brings everything back
+// from the event handler, without waiting for a tick. While the softAP beacons the
+// WiFi driver keeps the chip out of light sleep; what idle mode saves then comes
+// from the slower clock, modem sleep on the uplink and fewer wakeups.
+#define IDLE_TICK_MS          1000
+#define IDLE_LISTEN_INTERVAL  10     // Beacon intervals; applies from the next association
+#define IDLE_MIN_MHZ          40     // DFS floor; the WiFi driver raises it while the radio works
+#define IDLE_MAX_MHZ          80
+#define IDLE_WAKE_RSSI_DBM    -80    // Weaker probes are passers-by, not prospective clients
+#define IDLE_PROBE_HOLD_MS    20000  // A probe without an association: back to idle after this
+uint16_t idleAfterSec = 300;         // 0 = never idle
+unsigned long idleCandidateSince = 0;
+unsigned long idleHoldUntil = 0;
+bool idleProbeWake = false;          // Woken by a probe only: idleHoldUntil applies
+unsigned long idleEnteredAt = 0;
+uint16_t idleSavedMhz = 0;
+std::atomic<bool> idleWakeRequested{false};
+uint32_t idleEntries = 0;
+uint32_t idleTotalSec = 0;
 
 // IP configuration for the access point
 IPAddress apIP(192, 168, 4, 1);
 IPAddress apNetmask(255, 255, 255, 0);
 
+// NAPT forwarding between the softAP and the uplink
+// The translation table itself is allocated by lwIP on first enable and sized by
+// IP_NAPT_MAX / IP_PORTMAP_MAX from lwipopts.h, so we budget heap for it here.
+#define NAPT_TABLE_SIZE       IP_NAPT_MAX
+#define NAPT_PORTMAP_MAX      IP_PORTMAP_MAX
+#define NAPT_ENTRY_BYTES      32        // Rough size of one lwIP napt_table entry incl. allocator overhead
+#define NAPT_HEAP_FLOOR       (48 * 1024)  // Never let forwarding push free heap below this
+#define NAPT_CLIENT_BUDGET    (12 * 1024)  // Heap reserved per AP station (pbufs in flight, DHCP, ARP)
+bool naptEnabled = false;
+int effectiveMaxClients = 0;              // maxClients after heap budgeting
+
+// Forwarding mode: NAT through lwIP, or L2 relay straight from the driver RX callbacks
+#define FORWARD_NAT     0
+#define FORWARD_BRIDGE  1
+uint8_t forwardMode = FORWARD_NAT;
+
+// TCP MSS clamp applied to SYNs in both directions as they pass the RX hooks, for
+// uplinks with a smaller path MTU than the 1500 bytes clients assume (PPPoE: 1452,
+// most VPNs lower). 0 leaves MSS alone.
+#define MSS_CLAMP_MIN 536
+#define MSS_CLAMP_MAX 1460
+uint16_t mssClamp = 0;
+std::atomic<uint32_t> mssClamped{0};     // SYNs rewritten so far
+
+// DNS forwarder on apIP:53. In NAT mode the softAP's DHCP server hands out apIP as the
+// resolver; answers come from a fixed LRU cache while their TTL lasts, and a question
+// that is already waiting on the uplink is folded into that query instead of sent again.
+#define DNS_PORT              53
+#define DNS_TASK_CORE         1
+#define DNS_TASK_PRIORITY     3
+#define DNS_TASK_STACK        4096
+#define DNS_PACKET_MAX        1232   // Largest EDNS payload we pass through
+#define DNS_CACHE_ENTRIES     24
+#define DNS_NAME_MAX          96     // Wire-format QNAME; longer names are forwarded uncached
+#define DNS_WIRE_NAME_MAX     255    // RFC 1035 limit, what an answer's question is checked against
+#define DNS_RESPONSE_MAX      384    // Bigger answers are forwarded but not cached
+#define DNS_PENDING_MAX       8      // Each holds an upstream socket while it waits
+#define DNS_SOURCE_PORT_FIRST 49152  // Upstream queries go out from a random port in 49152-65535
+#define DNS_SOURCE_PORT_TRIES 4
+#define DNS_WAITERS_MAX       4
+#define DNS_QUERY_TIMEOUT_MS  2500
+#define DNS_MIN_TTL           5      // Seconds
+#define DNS_MAX_TTL           3600
+#define DNS_NEGATIVE_TTL      30     // NXDOMAIN / no data
+struct DnsQuestion {
+  uint8_t name[DNS_NAME_MAX];        // Lower-cased, wire format
+  uint8_t nameLen;                   // 0 = not cacheable
+  uint16_t type;
+  uint16_t cls;
+  uint32_t hash;
+};
+struct DnsCacheEntry {
+  DnsQuestion q;
+  uint16_t len;
+  uint32_t storedAt;                 // millis()
+  uint32_t ttlMs;                    // 0 = free slot
+  uint32_t lastUsed;
+  uint8_t response[DNS_RESPONSE_MAX];
+};
+struct DnsWaiter {
+  uint32_t addr;
+  uint16_t port;
+  uint16_t id;                       // The client's query ID
+};
+struct DnsPending {
+  DnsQuestion q;
+  bool used;
+  int sock;                          // Bound to a port of its own for this query only
+  uint32_t resolver;                 // Network byte order
+  uint16_t upstreamId;
+  uint8_t fullNameLen;
+  uint8_t fullName[DNS_WIRE_NAME_MAX]; // Lower-cased; the answer has to ask exactly this
+  uint32_t sentAt;
+  uint8_t waiterCount;
+  DnsWaiter waiters[DNS_WAITERS_MAX];
+};
+DnsCacheEntry dnsCache[DNS_CACHE_ENTRIES];
+DnsPending dnsPending[DNS_PENDING_MAX];
+TaskHandle_t dnsTaskHandle = NULL;
+bool dnsProxy = true;
+std::atomic<bool> dnsFlushRequested{false};
+uint32_t dnsHits = 0;
+uint32_t dnsMisses = 0;
+uint32_t dnsCoalesced = 0;
+
+// DHCP server for AP clients, in place of the stock one so addresses survive reboots
+// and roams. Bindings are kept per MAC in NVS; a returning station is ACKed its old
+// address straight away (INIT-REBOOT, or rapid commit per RFC 4039 on DISCOVER), and
+// because its address doesn't change the NAPT mappings it had stay valid. Reservations
+// pin a MAC to an address. Runs as a raw lwIP UDP pcb, so requests are handled in the
+// lwIP task; the table is shared with the supervisor under dhcpLock.
+// Addresses are apIP's /24 with the binding storing the host part.
+#define DHCP_SERVER_PORT      67
+#define DHCP_CLIENT_PORT      68
+#define DHCP_BINDINGS_MAX     16
+#define DHCP_RESERVATIONS_MAX 8
+#define DHCP_POOL_FIRST       2      // Host part of the first dynamic address
+#define DHCP_POOL_SIZE        32
+#define DHCP_LEASE_SECONDS    7200
+#define DHCP_COMMIT_DELAY_MS  5000   // Batch binding changes into one flash write
+#define DHCP_MSG_MAX          576
+#define DHCP_REPLY_LEN        300    // BOOTP minimum; our options fit well inside
+#define DHCP_RESERVED         0x01
+#define DHCPDISCOVER          1
+#define DHCPOFFER             2
+#define DHCPREQUEST           3
+#define DHCPDECLINE           4
+#define DHCPACK               5
+#define DHCPNAK               6
+#define DHCPRELEASE           7
+#define DHCPINFORM            8
+struct DhcpBinding {
+  uint8_t mac[6];
+  uint8_t host;                      // 0 = free slot
+  uint8_t flags;
+};
+DhcpBinding dhcpBindings[DHCP_BINDINGS_MAX];
+uint32_t dhcpLeaseEnd[DHCP_BINDINGS_MAX];   // millis(); 0 = not leased since boot
+struct udp_pcb* dhcpPcb = NULL;
+portMUX_TYPE dhcpLock = portMUX_INITIALIZER_UNLOCKED;
+unsigned long dhcpDirtySince = 0;
+uint32_t dhcpAcks = 0;
+uint32_t dhcpFastAcks = 0;                  // Returning clients ACKed without an OFFER round
+
+// Bridge learning table. The STA link is a plain 3-address client, so upstream only
+// accepts frames from our own STA MAC; the bridge masquerades AP clients behind it and
+// maps replies back by IPv4 address.
+#define BRIDGE_HOSTS_MAX 16
+struct BridgeHost {
+  uint32_t ip;        // Network byte order, 0 = free slot
+  uint8_t mac[6];
+  uint32_t lastSeen;  // millis()
+};
+BridgeHost bridgeHosts[BRIDGE_HOSTS_MAX];
+uint8_t staMAC[6];
+uint8_t apMAC[6];
+esp_netif_t* apNetifHandle = NULL;
+esp_netif_t* staNetifHandle = NULL;
+struct netif* apLwipNetif = NULL;
+struct netif* staLwipNetif = NULL;
+
+// Connection tracking fast path for NAT mode. TCP and UDP flows from AP clients are
+// translated in the forwarding task straight from the driver buffers, with lwIP NAPT
+// left for everything else (ICMP, fragments, flows it already had). The table itself
+// is in src/core/conntrack.h; it's sized at boot from free heap, or PSRAM for the
+// entries when the module has it. Only the forwarding task touches the table.
+#define CT_PORT_FIRST         40000
+#define CT_PORT_COUNT         9000   // Up to 48999, clear of lwIP NAPT's ports from 49152
+#define CT_MAX_INTERNAL       512
+#define CT_MAX_PSRAM          4096
+#define CT_MIN_ENTRIES        64
+#define CT_HEAP_SHARE         8      // At most 1/N of the internal heap above the floor
+#define CT_SWEEP_MS           1000
+#define CT_SWEEP_BATCH        64
+#define CT_REFRESH_MS         2000   // Gateway MAC and uplink address, from lwIP
+bool ctEnabled = true;                      // "fastNat"; off leaves NAT to lwIP alone
+std::atomic<uint32_t> ctUplinkIP{0};        // 0 = fast path parked (no uplink or gateway MAC)
+uint32_t ctFlowIP = 0;                      // Uplink address the entries were made for
+std::atomic<bool> ctFlushRequested{false};
+
+// Uplink address, netmask and gateway MAC as the lwIP task last saw them. It only fills
+// ctUplinkNext while ctUplinkStaged is clear; the forwarding task adopts the set in
+// ctMaintain, between frames, so a frame never goes out with half of a new MAC.
+struct CtUplink {
+  uint32_t addr;
+  uint32_t mask;
+  uint8_t gatewayMAC[6];
+};
+CtUplink ctUplinkNext;                      // lwIP task, while ctUplinkStaged is false
+std::atomic<bool> ctUplinkStaged{false};
+CtUplink ctUplink;                          // Forwarding task only
+
+// Multicast filter for the bridge. Group frames go out on the softAP at the lowest
+// basic rate, so relaying everything the uplink LAN chatters (SSDP, mDNS, ARP for
+// hosts that aren't here) eats the airtime AP clients need. From the uplink: ARP is
+// passed only for bridged hosts, as unicast; other groups only reach stations that
+// joined them (IGMP snooping), as unicast copies while there are few; mDNS and SSDP
+// are answered from a cache filled from the uplink instead of being flooded, and
+// repeated queries are suppressed both ways. NAT mode relays no multicast at all.
+// Only the forwarding task touches these tables.
+#define MCAST_MEMBERS         32
+#define MCAST_MEMBER_MS       260000 // IGMP group membership interval (2 x 125 s + 10 s)
+#define MCAST_UNICAST_MAX     4      // Members a group is copied to before it's flooded
+#define MCAST_RECENT          8
+#define MCAST_REPEAT_MS       1000   // Identical queries inside this are dropped
+#define MCAST_SWEEP_MS        10000
+#define MCAST_MDNS_IP         0xFB0000E0 // 224.0.0.251, as read off the wire
+#define MCAST_SSDP_IP         0xFAFFFFEF // 239.255.255.250
+#define MCAST_ALL_HOSTS_IP    0x010000E0 // 224.0.0.1
+#define MDNS_PORT             5353
+#define SSDP_PORT             1900
+#define MDNS_CACHE_INTERNAL   4
+#define MDNS_CACHE_PSRAM      16
+#define MDNS_FRAME_MAX        768    // Bigger responses aren't cached, only relayed to askers
+#define MDNS_TTL_MAX          120    // Seconds a cached answer is replayed for
+#define MDNS_QUESTIONS_MAX    4      // Queries asking more are relayed without a look at the cache
+#define MDNS_ASKS             8
+#define MDNS_ASK_MS           2000   // Pending client query waiting for an uplink answer
+#define SSDP_CACHE_INTERNAL   8
+#define SSDP_CACHE_PSRAM      32
+#define SSDP_AGE_MAX          1800
+struct McastMember {
+  uint32_t group;                    // Network byte order, 0 = free
+  uint8_t mac[6];
+  uint32_t lastReport;               // millis()
+};
+struct McastRecent {
+  uint32_t key;
+  uint32_t at;
+};
+struct MdnsAsk {
+  uint32_t name;                     // Hash of the lowercased question name
+  uint16_t type;
+  uint8_t mac[6];
+  uint32_t at;                       // 0 = free
+};
+struct MdnsEntry {
+  uint32_t name;                     // Of the first answer
+  uint16_t type;
+  uint16_t len;                      // 0 = free
+  uint32_t stored;                   // millis(), replayed TTLs lose the time since
+  uint32_t expires;
+  uint8_t frame[MDNS_FRAME_MAX];     // As received; replays change the MAC and the TTLs
+};
+struct SsdpEntry {
+  uint32_t ip;                       // The device's, network byte order
+  uint8_t mac[6];
+  uint16_t maxAge;
+  uint32_t expires;                  // 0 = free
+  char nt[80];
+  char usn[128];
+  char location[128];
+  char server[64];
+};
+bool mcastFilter = true;
+McastMember mcastMembers[MCAST_MEMBERS];
+McastRecent mcastRecent[MCAST_RECENT];
+uint8_t mcastRecentNext = 0;
+MdnsAsk mdnsAsks[MDNS_ASKS];
+MdnsEntry* mdnsCache = NULL;
+uint8_t mdnsCacheSize = 0;
+SsdpEntry* ssdpCache = NULL;
+uint8_t ssdpCacheSize = 0;
+uint32_t mcastQuerierAt = 0;                // Last IGMP query from the uplink, 0 = none seen
+uint8_t mcastFrame[1500 + 14];              // Unicast copies and synthesised replies
+std::atomic<uint32_t> mcastFlooded{0};
+std::atomic<uint32_t> mcastConverted{0};    // Unicast copies sent instead of a flood
+std::atomic<uint32_t> mcastDropped{0};
+std::atomic<uint32_t> mcastAnswered{0};     // mDNS/SSDP queries answered from the cache
+std::atomic<uint32_t> mcastSuppressed{0};   // Repeated queries not relayed
+
+// Task layout. The WiFi driver and lwIP live on the protocol core, so forwarding is
+// pinned next to them at high priority; supervision, serial output and BLE config
+// handling run on the application core and never touch the forwarding task directly.
+#define FORWARD_TASK_CORE       0
+#define FORWARD_TASK_PRIORITY   20   // Above lwIP (18), below the WiFi driver (23)
+#define FORWARD_TASK_STACK      4096   // Room for the multicast filter's SSDP parsing
+#define SUPERVISOR_TASK_CORE    1
+#define SUPERVISOR_TASK_PRIORITY 2
+#define SUPERVISOR_TASK_STACK   6144
+#define SUPERVISOR_TICK_MS      100
+TaskHandle_t forwardTaskHandle = NULL;
+TaskHandle_t supervisorTaskHandle = NULL;
+
+// Health supervisor. A low-priority task samples heap fragmentation, stack headroom
+// and supervisor loop latency, and feeds the task watchdog; the supervisor is
+// subscribed as well, so a wedged loop still ends in a TWDT reset. Anything short of
+// that is handled per subsystem: once a threshold has held for HEALTH_STRIKES checks
+// the supervisor restarts BLE, the softAP or the uplink on its own, each at most once
+// per HEALTH_COOLDOWN_MS, and everything else keeps running.
+#define HEALTH_TASK_CORE        SUPERVISOR_TASK_CORE
+#define HEALTH_TASK_PRIORITY    1      // Below the supervisor, so it never adds to the latency it measures
+#define HEALTH_TASK_STACK       3072
+#define HEALTH_CHECK_MS         1000
+#define HEALTH_IDLE_CHECK_MS    10000  // Idle mode: fewer wakeups, still well inside the watchdog timeout
+#define HEALTH_WDT_TIMEOUT_S    30     // Above IDLE_TICK_MS plus the slowest blocking call (Bluedroid init)
+#define HEALTH_STRIKES          5      // Consecutive bad checks before a restart
+#define HEALTH_COOLDOWN_MS      (15 * 60 * 1000UL)
+#define HEALTH_STACK_MIN        512    // Bytes of headroom below which a task is reported
+#define HEALTH_FORWARD_STALL_MS 5000   // Frames queued and none taken: only a reset fixes that
+#define HEALTH_SUB_AP           0
+#define HEALTH_SUB_UPLINK       1
+#define HEALTH_SUB_BLE          2
+#define HEALTH_SUB_COUNT        3
+#define HEALTH_SUB_NONE         HEALTH_SUB_COUNT  // Supervisor work no restart would help
+uint16_t healthBlockMin = 12288;     // Largest free block floor in bytes, 0 = off
+uint16_t healthLoopMs = 2000;        // Supervisor time one subsystem may take per loop, 0 = off
+uint16_t healthUplinkSec = 900;      // Uplink down this long: start it over from scratch, 0 = off
+TaskHandle_t healthTaskHandle = NULL;
+std::atomic<uint32_t> supervisorBeat{0};      // millis() when the current loop iteration started
+std::atomic<uint8_t> supervisorPhase{HEALTH_SUB_NONE};
+std::atomic<uint32_t> healthPhaseMax[HEALTH_SUB_COUNT];  // Longest phase since the last check, ms
+std::atomic<uint8_t> healthRestartRequest{0}; // 1 << HEALTH_SUB_*, carried out by the supervisor
+uint32_t healthPhaseStart = 0;
+uint32_t healthLoopWorst = 0;        // Longest supervisor iteration since boot, ms
+uint32_t healthStalls = 0;           // Times the supervisor was found blocked past healthLoopMs
+uint32_t healthRestarts[HEALTH_SUB_COUNT];
+uint32_t healthLastRestart[HEALTH_SUB_COUNT];  // millis(), 0 = never; health task only
+uint32_t healthLargestBlock = 0;
+uint32_t healthFreeHeap = 0;
+uint32_t healthMinFree = 0;          // Low-water mark since boot
+uint8_t healthFragPct = 0;
+bool healthForwardStalled = false;
+
+// Supervisor side: charge the time since the last mark to whatever was running, so
+// slowness can be pinned on one subsystem
+static inline void healthPhase(uint8_t sub) {
+  uint32_t now = millis();
+  uint8_t prev = supervisorPhase.load(std::memory_order_relaxed);
+  if (prev < HEALTH_SUB_COUNT && now - healthPhaseStart > healthPhaseMax[prev].load(std::memory_order_relaxed)) {
+    healthPhaseMax[prev].store(now - healthPhaseStart, std::memory_order_relaxed);
+  }
+  healthPhaseStart = now;
+  supervisorPhase.store(sub, std::memory_order_relaxed);
+}
+
+static inline void healthLoopBegin() {
+  esp_task_wdt_reset();
+  healthPhaseStart = millis();
+  supervisorPhase.store(HEALTH_SUB_NONE, std::memory_order_relaxed);
+  supervisorBeat.store(healthPhaseStart, std::memory_order_relaxed);
+}
+
+static inline void healthLoopEnd() {
+  healthPhase(HEALTH_SUB_NONE);
+  uint32_t took = millis() - supervisorBeat.load(std::memory_order_relaxed);
+  if (took > healthLoopWorst) healthLoopWorst = took;
+}
+
+// Driver RX buffers waiting for the forwarding task. Producer is the WiFi task.
+// Kept well below the driver's dynamic RX buffer count so a stalled consumer can
+// never starve reception.
+#define FORWARD_QUEUE_DEPTH 16
+struct RxFrame {
+  void* buffer;
+  void* eb;
+  uint16_t len;
+  uint8_t ifx;      // wifi_interface_t the frame arrived on
+  uint32_t rxTime;  // esp_timer microseconds at the RX hook, for queue latency
+};
+SpscQueue<RxFrame, FORWARD_QUEUE_DEPTH> forwardQueue;
+
+// AP egress scheduler. Unicast frames for AP stations are queued per destination and
+// sent by the forwarding task with deficit round robin, so one bulk download can't
+// fill the driver's TX queue ahead of everyone else. High-DSCP traffic, pure TCP ACKs
+// and DNS answers go on a per-station fast queue served first; nothing that carries
+// stream data does, so no flow gets its segments reordered. Optional per-MAC token buckets cap a station's throughput.
+// Producers are lwIP (NAT, through the AP netif's transmit) and the forwarding task
+// (bridge); they serialise on egressLock, the forwarding task is the only consumer.
+#define EGRESS_STATIONS       10     // One per possible AP client
+#define EGRESS_BULK_DEPTH     16
+#define EGRESS_FAST_DEPTH     8
+#define EGRESS_QUANTUM        1514   // Bytes per DRR round, one full frame
+#define EGRESS_PRIORITY_DSCP  40     // CS5 and above (EF, voice, network control)
+#define EGRESS_POOL_SHARE     2      // Queues may hold at most 1/N of the packet pool
+#define EGRESS_HELD_RX_MAX    8      // Driver RX buffers the queues may hold on to
+#define EGRESS_BURST_MS       20     // Token bucket depth at the capped rate
+#define EGRESS_IDLE_MS        30000  // An empty slot this old may be handed to another MAC
+#define EGRESS_RATE_RULES     8
+#define EGRESS_BRIDGED        0x01   // Relayed from the uplink, accounted like forwardTx
+#define EGRESS_HELD_RX        0x02   // data sits in a driver RX buffer (eb), not a pool copy
+struct EgressFrame {
+  uint8_t* data;
+  void* eb;                          // Driver RX buffer handle to free, EGRESS_HELD_RX only
+  uint16_t len;
+  uint8_t flags;
+  uint32_t rxTime;
+};
+struct EgressStation {
+  uint8_t mac[6];
+  bool used;
+  bool midTurn;                      // DRR turn interrupted by a full driver queue
+  int32_t deficit;
+  uint16_t rateKbps;                 // 0 = uncapped
+  int32_t tokens;
+  uint32_t refillAt;                 // esp_timer microseconds
+  uint32_t lastActive;               // millis() of the last enqueue
+  SpscQueue<EgressFrame, EGRESS_FAST_DEPTH> fast;
+  SpscQueue<EgressFrame, EGRESS_BULK_DEPTH> bulk;
+  std::atomic<uint32_t> txBytes;
+  std::atomic<uint32_t> drops;
+  uint32_t sampledBytes;             // Supervisor's throughput baseline
+  uint16_t kbps;                     // Measured over the last sample period
+};
+struct RateRule {
+  uint8_t mac[6];
+  uint16_t kbps;
+};
+struct EgressClientStat {
+  uint8_t mac[6];
+  uint8_t depth;
+  uint16_t kbps;
+};
+EgressStation egressStations[EGRESS_STATIONS];
+portMUX_TYPE egressLock = portMUX_INITIALIZER_UNLOCKED;
+std::atomic<uint32_t> egressPooled{0};
+std::atomic<uint32_t> egressHeldRx{0};
+uint8_t egressNext = 0;
+bool fairQueue = true;
+uint16_t clientRateKbps = 0;         // Default cap for stations without a rule
+RateRule rateRules[EGRESS_RATE_RULES];
+
+// Per-station link telemetry. The forwarding hooks count bytes and packets against a
+// slot by MAC; the supervisor polls the driver's station list for RSSI and PHY mode
+// and hands out slots, so the hot path only ever looks up. The driver doesn't report
+// per-station PHY rates, so the rate is estimated from RSSI and PHY mode, and the
+// airtime share from bytes over that rate. The uplink AP is row 0.
+// Served paged from STATION_CHAR_UUID: each read returns the next page; writing a
+// page number restarts there.
+#define STATION_SLOTS         EGRESS_STATIONS
+#define STATION_POLL_MS       2000
+#define STATION_PAGE_ROWS     6
+#define STATION_UPLINK        0x01   // Row flags
+#define STATION_11B           0x02
+#define STATION_11G           0x04
+#define STATION_11N           0x08
+#define STATION_LR            0x10
+struct StationStat {
+  std::atomic<uint8_t> used;
+  uint8_t mac[6];
+  int8_t rssi;
+  uint8_t flags;
+  uint16_t rate;                       // Estimated PHY rate, 100 kbit/s units
+  uint16_t airtime;                    // Estimated share of airtime, permille
+  std::atomic<uint32_t> rxBytes;       // From the station
+  std::atomic<uint32_t> txBytes;       // To the station
+  std::atomic<uint32_t> rxPackets;
+  std::atomic<uint32_t> txPackets;
+  std::atomic<uint32_t> lastSeen;      // millis() of the last frame from it
+  uint32_t sampledBytes;               // Supervisor's airtime baseline
+};
+struct __attribute__((packed)) StationRow {
+  uint8_t mac[6];
+  uint8_t flags;
+  int8_t rssi;
+  uint16_t rate;
+  uint16_t airtime;
+  uint32_t rxBytes;
+  uint32_t txBytes;
+  uint32_t rxPackets;
+  uint32_t txPackets;
+  uint16_t idleSec;
+  uint16_t reserved;
+};
+StationStat stationStats[STATION_SLOTS];
+StationStat uplinkStat;
+uint8_t stationPage = 0;
+
+// Packet buffer pool. Every frame the repeater copies (into lwIP, onto the egress
+// queues) lives in one of these fixed blocks instead of a heap pbuf, so a busy link
+// can't fragment the heap that NAPT, BLE and the driver allocate from. Sized once at
+// boot from maxClients; placed in PSRAM when the module has it. The free list is a
+// tagged-index Treiber stack in internal RAM (atomics don't work on PSRAM); blocks
+// carry their own pbuf_custom so lwIP frees them straight back here.
+#define POOL_MTU              1500
+#define POOL_HEADROOM         16     // Lets lwIP re-add the Ethernet header in place
+#define POOL_BASE_BUFFERS     16
+#define POOL_CLIENT_BUFFERS   4      // Per client, internal RAM
+#define POOL_CLIENT_BUFFERS_PSRAM 12
+#define POOL_MAX_BUFFERS      160
+#define POOL_MIN_BUFFERS      8      // Below this the pool isn't worth having
+#define POOL_EMPTY            0xFFFF
+struct PoolBlock {
+  struct pbuf_custom pbuf;
+  uint16_t index;                   // Position in the free list array
+  uint8_t headroom[POOL_HEADROOM];
+  uint8_t frame[POOL_MTU + 14];     // Ethernet header + payload
+};
+PoolBlock* poolBlocks = NULL;
+PoolBlock* poolExtra = NULL;         // Grown into once memory is freed at runtime (BLE off)
+uint16_t poolGrownFrom = POOL_EMPTY; // First index that lives in poolExtra
+uint16_t* poolNext = NULL;           // Sized for POOL_MAX_BUFFERS so the pool can grow
+uint16_t poolSize = 0;
+bool poolInPSRAM = false;
+std::atomic<uint32_t> poolHead{POOL_EMPTY};   // Tag in the top half against ABA
+std::atomic<uint32_t> poolInUse{0};
+std::atomic<uint32_t> poolHighWater{0};
+std::atomic<uint32_t> poolMisses{0};             // Allocations that found it empty
+
+// Forwarding metrics. One block per core and every update is a relaxed atomic add on
+// the local core's block, so the hot path never takes a lock or bounces a cache line;
+// readers sum the blocks. Direction is by ingress interface: AP in = upstream.
+#define DIR_UP                0
+#define DIR_DOWN              1
+#define DROP_PBUF_ALLOC       0   // lwIP could not wrap the RX buffer
+#define DROP_QUEUE_FULL       1   // Forwarding task fell behind
+#define DROP_NAT_TABLE_FULL   2   // No translation slot for a new flow: a live one was evicted for it
+#define DROP_TX_FAILED        3   // Driver refused the frame (TX buffers exhausted)
+#define DROP_REASON_COUNT     4
+#define STAGE_QUEUE           0   // RX hook -> forwarding task pickup
+#define STAGE_TX              1   // esp_wifi_internal_tx()
+#define STAGE_TOTAL           2   // RX hook -> handed to the driver
+#define STAGE_COUNT           3
+#define LATENCY_BUCKETS       12  // Power-of-two microsecond buckets: <1, <2, <4 ... >=1024
+struct ForwardMetrics {
+  std::atomic<uint32_t> rxPackets[2];
+  std::atomic<uint32_t> rxBytes[2];
+  std::atomic<uint32_t> txPackets[2];
+  std::atomic<uint32_t> txBytes[2];
+  std::atomic<uint32_t> drops[DROP_REASON_COUNT];
+  std::atomic<uint32_t> latency[STAGE_COUNT][LATENCY_BUCKETS];
+};
+ForwardMetrics forwardMetrics[portNUM_PROCESSORS];
+
+// Summed view for reporting
+struct MetricsTotals {
+  uint32_t rxPackets[2];
+  uint32_t rxBytes[2];
+  uint32_t txPackets[2];
+  uint32_t txBytes[2];
+  uint32_t drops[DROP_REASON_COUNT];
+  uint32_t latency[STAGE_COUNT][LATENCY_BUCKETS];
+};
+
+static inline ForwardMetrics& localMetrics() {
+  return forwardMetrics[xPortGetCoreID()];
+}
+
+static inline void metricsCount(std::atomic<uint32_t>& counter, uint32_t n) {
+  counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline void metricsLatency(uint8_t stage, uint32_t micros) {
+  uint8_t bucket = micros == 0 ? 0 : 32 - __builtin_clz(micros);
+  if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+  metricsCount(localMetrics().latency[stage][bucket], 1);
+}
+
+// Config writes from the BLE stack, or with BLE off from the UDP endpoint (never both:
+// the queue has one producer), consumed by the supervisor
+#define CONFIG_MSG_MAX 512
+struct ConfigMessage {
+  uint16_t len;
+  char data[CONFIG_MSG_MAX];
+};
+SpscQueue<ConfigMessage, 4> configQueue;
+
+// Authenticated config endpoint on apIP, only open while BLE is off. A client asks for
+// a nonce ('N'), then sends 'C' + JSON + HMAC-SHA256(configKey, nonce || JSON). Each
+// nonce is good for one attempt within CONFIG_NONCE_MS. Replies: 'N' + nonce, 'A'
+// (accepted), 'E' (rejected). Runs as a raw lwIP pcb, like the DHCP server.
+#define CONFIG_UDP_PORT   4210
+#define CONFIG_KEY_MIN    8
+#define CONFIG_KEY_MAX    64
+#define CONFIG_NONCE_LEN  16
+#define CONFIG_NONCE_MS   10000
+#define CONFIG_HMAC_LEN   32
+bool bleEnabled = true;              // Persisted: start BLE at boot (REPEATER_BLE builds)
+bool bleActive = false;              // Stack is up right now; once released it stays down
+bool blePending = false;             // Deferred at boot until the uplink is up
+#define BLE_START_DEADLINE_MS  5000  // Start it anyway if the uplink takes longer
+char configKey[CONFIG_KEY_MAX + 1] = REPEATER_CONFIG_KEY;
+struct udp_pcb* configPcb = NULL;
+uint8_t configNonce[CONFIG_NONCE_LEN];
+unsigned long configNonceIssued = 0;
+bool configNonceValid = false;
+uint32_t configRejected = 0;
+
+// BLE connection events, consumed by the supervisor
+#define SUPERVISOR_EVT_BLE_CONNECTED     1
+#define SUPERVISOR_EVT_BLE_DISCONNECTED  2
+SpscQueue<uint8_t, 8> bleEventQueue;
+
+// Upstream link state machine. WiFi events only queue what happened; the supervisor
+// steps the machine, so a lost uplink never blocks anything else.
+#define UPLINK_IDLE        0   // No SSID configured
+#define UPLINK_CONNECTING  1   // WiFi.begin() issued, waiting for GOT_IP
+#define UPLINK_CONNECTED   2
+#define UPLINK_BACKOFF     3   // Waiting out the retry delay
+#define UPLINK_BACKOFF_MIN_MS      100
+#define UPLINK_BACKOFF_MAX_MS      1000   // Low ceiling keeps recovery sub-second once the AP is back
+#define UPLINK_ATTEMPT_TIMEOUT_MS  10000  // No GOT_IP or DISCONNECTED at all: give up on the attempt
+uint8_t uplinkState = UPLINK_IDLE;
+uint8_t uplinkFailures = 0;          // Consecutive failed attempts, drives the backoff
+uint8_t lastDisconnectReason = 0;    // wifi_err_reason_t of the last drop
+unsigned long uplinkDeadline = 0;    // millis() at which the current wait ends
+
+#define UPLINK_EVT_GOT_IP        1
+#define UPLINK_EVT_LOST_IP       2
+#define UPLINK_EVT_DISCONNECTED  3
+struct UplinkEvent {
+  uint8_t type;
+  uint8_t reason;
+};
+SpscQueue<UplinkEvent, 8> uplinkEventQueue;  // Producer is the Arduino WiFi event task
+
+unsigned long uplinkAttemptStart = 0;
+unsigned long lastConnectMs = 0;     // Time from WiFi.begin() to GOT_IP of the last success
+
+// Upstream networks in priority order: the primary credentials first, then up to three
+// alternates. Any entry may be pinned to one BSSID (all zeros = any AP of that SSID).
+// Repeated connect failures fail over to the next entry.
+#define UPLINK_ALTERNATES          3
+#define UPLINK_NETWORKS_MAX        (1 + UPLINK_ALTERNATES)
+#define UPLINK_FAILOVER_ATTEMPTS   3      // Failed attempts on one network before trying the next
+struct __attribute__((packed)) UplinkNetwork {
+  char ssid[33];            // Empty = unused; entries are kept contiguous
+  char pass[64];
+  uint8_t bssid[6];
+};
+uint8_t primaryBSSID[6] = { 0 };
+UplinkNetwork uplinkAlternates[UPLINK_ALTERNATES];
+uint8_t uplinkActive = 0;            // Index into the list above of the network in use
+
+// Fast-connect cache: last good BSSID/channel plus the PMK derived from the passphrase,
+// one entry per uplink network keyed by its credentials, so failing over between
+// networks neither aims at another network's AP nor reruns PBKDF2. Lives in RTC memory
+// across soft resets and is mirrored to NVS for power loss. Handing the driver the
+// 64-hex-digit PMK skips PBKDF2, and BSSID+channel skips the full scan.
+#define FAST_CONNECT_MAGIC  0x46434333  // "FCC3"
+struct FastConnectEntry {
+  uint32_t credentialHash;  // CRC32 of the SSID/passphrase, 0 = free
+  uint8_t bssid[6];
+  uint8_t channel;          // 0 = no known AP, scan
+  uint8_t pmkValid;
+  uint8_t pmkRejected;      // The AP refused the PMK (e.g. WPA3-only): use the passphrase
+  uint8_t reserved[3];
+  uint8_t pmk[32];
+};
+struct FastConnectCache {
+  uint32_t magic;
+  FastConnectEntry entries[UPLINK_NETWORKS_MAX];
+  uint32_t crc;             // Over everything above
+};
+RTC_NOINIT_ATTR FastConnectCache fastConnect;
+bool fastConnectDirected = false;    // Current attempt targets the cached BSSID/channel
+bool fastConnectMiss = false;        // Last directed attempt failed; next one scans
+bool fastConnectUsedPMK = false;     // Current attempt handed the driver the cached PMK
+
+// Link quality monitor. RSSI comes from the driver each second, RTT and loss from a
+// continuous ping of the upstream gateway; each is an EWMA (1/8, scaled by 16). IDF
+// exposes no 802.11 retry counter, so probe loss stands in for it: it only rises once
+// retries are being exhausted. A link that stays degraded first asks the AP to steer
+// us (802.11v BSS transition query, with an 802.11k neighbor report narrowing the scan)
+// and otherwise scans for a clearly better BSSID of a configured network and moves to
+// it while the current link still works. Scans go one channel at a time so the softAP
+// is never off-channel for more than a single dwell.
+#define UPLINK_SAMPLE_MS           1000
+#define UPLINK_PROBE_INTERVAL_MS   2000
+#define UPLINK_PROBE_TIMEOUT_MS    1000
+#define UPLINK_WARMUP_SAMPLES      5      // Averages need a few samples before we act on them
+#define UPLINK_DEGRADED_RSSI_DBM   -72
+#define UPLINK_DEGRADED_RTT_MS     150
+#define UPLINK_DEGRADED_LOSS_PCT   20
+#define UPLINK_DEGRADED_SAMPLES    5      // Consecutive degraded samples before roaming
+#define UPLINK_USABLE_RSSI_DBM     -78    // Weakest candidate worth moving to
+#define UPLINK_ROAM_MARGIN_DB      8      // A candidate must beat the current average by this
+#define UPLINK_ROAM_HOLDOFF_MS     30000  // Between roam attempts, successful or not
+#define UPLINK_PREFERRED_SCAN_MS   300000 // On a fallback network, look for a better one this often
+#define UPLINK_BTM_WAIT_MS         3000   // Time the AP gets to steer us before we scan ourselves
+#define UPLINK_SCAN_DWELL_MS       80
+#define UPLINK_SCAN_ALL_CHANNELS   0x3FFE // Bits 1-13
+#define UPLINK_EWMA_SHIFT          3
+#define ROAM_REASON_NONE   0         // Just looking for a preferred network
+#define ROAM_REASON_LOSS   1
+#define ROAM_REASON_RSSI   2
+#define ROAM_REASON_DELAY  3
+#define ROAM_IDLE      0
+#define ROAM_BTM_WAIT  1               // Transition query sent, waiting to be moved
+#define ROAM_SCANNING  2
+int32_t uplinkRssiAvg = 0;           // dBm * 16
+int32_t uplinkRttAvg = 0;            // ms * 16
+int32_t uplinkLossAvg = 0;           // Percent * 16
+uint8_t uplinkSamples = 0;
+uint8_t uplinkDegradedSamples = 0;
+uint8_t uplinkBSSID[6];              // AP we are associated with, to notice transitions
+esp_ping_handle_t uplinkProbe = NULL;
+std::atomic<uint32_t> uplinkProbeRtt{0};     // Latest reply, ms; written by the ping task
+std::atomic<uint16_t> uplinkProbeReplies{0};
+std::atomic<uint16_t> uplinkProbeLost{0};
+std::atomic<uint16_t> uplinkNeighborChannels{0};  // Bit n = channel n, from an 802.11k report
+uint8_t roamState = ROAM_IDLE;
+uint8_t roamReason = 0;
+unsigned long roamDeadline = 0;
+unsigned long lastRoamAttempt = 0;
+uint16_t roamScanChannels = 0;       // Still to scan, bit n = channel n
+int8_t roamBestIndex = -1;           // Best candidate found so far in this scan
+int8_t roamBestRSSI = -128;
+uint8_t roamBestBSSID[6];
+uint8_t roamBestChannel = 0;
+bool roamTargetSet = false;          // Next connect goes straight to roamTarget*
+uint8_t roamTargetBSSID[6];
+uint8_t roamTargetChannel = 0;
+uint32_t uplinkRoams = 0;
+
+// Persisted configuration. One CRC-checked blob in NVS; new fields are only ever
+// appended, and a blob written by an older build loads its prefix and keeps the
+// defaults for everything after it.
+#define CONFIG_MAGIC            0x46435052  // "RPCF"
+#define CONFIG_VERSION          15
+#define CONFIG_COMMIT_DELAY_MS  2000        // Quiet time after the last change before writing
+#define CONFIG_COMMIT_MAX_MS    10000       // Upper bound while changes keep arriving
+struct __attribute__((packed)) PersistedConfig {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size;            // sizeof(PersistedConfig) of the build that wrote it
+  uint32_t crc;             // CRC32 of the remaining size - 12 bytes
+  char primarySSID[33];
+  char primaryPass[64];
+  char apSSID[33];
+  char apPass[64];
+  uint8_t apChannel;
+  uint8_t maxClients;
+  uint8_t powerSaving;
+  uint8_t powerMode;        // wifi_ps_type_t
+  uint8_t listenInterval;
+  uint8_t forwardMode;
+  // v2
+  uint8_t autoChannel;
+  // v3
+  uint8_t powerGovernor;
+  // v4
+  uint8_t txPower;          // dBm
+  // v5
+  uint8_t fairQueue;
+  uint16_t clientRateKbps;
+  RateRule rateRules[EGRESS_RATE_RULES];
+  // v6
+  uint16_t mssClamp;
+  // v7
+  uint8_t dnsProxy;
+  // v8
+  uint8_t primaryBSSID[6];
+  UplinkNetwork uplinkAlternates[UPLINK_ALTERNATES];
+  // v9
+  uint8_t coexPolicy;
+  uint8_t advFastSec;
+  uint16_t advSlowMs;
+  uint16_t advSuspendPps;
+  // v10
+  uint8_t bleEnabled;
+  char configKey[CONFIG_KEY_MAX + 1];
+  // v11
+  uint8_t phyAuto;
+  // v12
+  uint16_t idleAfterSec;
+  // v13
+  uint8_t fastNat;
+  // v14
+  uint8_t mcastFilter;
+  // v15
+  uint16_t healthBlockMin;
+  uint16_t healthLoopMs;
+  uint16_t healthUplinkSec;
+};
+#define CONFIG_HEADER_SIZE  offsetof(PersistedConfig, primarySSID)
+unsigned long configDirtySince = 0;  // 0 = nothing pending
+unsigned long configLastChange = 0;
+uint32_t configSavedCRC = 0;         // CRC of what is already in flash
+
+// What a config write touched, so applySettings only reconfigures those subsystems.
+// Only AP identity changes need the softAP restarted; the rest is applied live.
+#define CFG_DIRTY_UPLINK       (1UL << 0)   // Primary credentials: reconnect the STA
+#define CFG_DIRTY_AP_IDENTITY  (1UL << 1)   // SSID/password: stations have to reassociate
+#define CFG_DIRTY_CHANNEL      (1UL << 2)
+#define CFG_DIRTY_MAX_CLIENTS  (1UL << 3)
+#define CFG_DIRTY_POWER        (1UL << 4)   // Power save mode, listen interval, governor
+#define CFG_DIRTY_FORWARDING   (1UL << 5)
+#define CFG_DIRTY_TX_POWER     (1UL << 6)
+#define CFG_DIRTY_EGRESS       (1UL << 7)   // Fair queuing and per-client rate caps
+#define CFG_DIRTY_MSS_CLAMP    (1UL << 8)   // Read per packet; nothing to reconfigure
+#define CFG_DIRTY_RADIO        (1UL << 9)   // Coexistence policy and advertising schedule
+#define CFG_DIRTY_BOOT_ONLY    (1UL << 10)  // BLE at boot, config key: only persisted
+#define CFG_DIRTY_PHY          (1UL << 11)  // PHY tuner on/off
+#define CFG_DIRTY_HEALTH       (1UL << 12)  // Health thresholds: read on every check
+
+// BLE codec buffers. Everything on the BLE path is static so that status traffic
+// never touches the heap lwIP and the WiFi driver allocate pbufs from. statusBuffer
+// holds one notification or command reply; full snapshots get STATUS_SNAPSHOT_MAX.
+#define STATUS_BUFFER_SIZE  768
+ConfigDocument configDoc;                   // Only touched by the supervisor
+uint8_t statusBuffer[STATUS_BUFFER_SIZE];
+uint8_t statusFormat = STATUS_FORMAT_JSON;  // Chosen by the connected client
+
+// BLE/WiFi coexistence. Both share the one 2.4 GHz radio, so BLE airtime is WiFi
+// airtime lost. Advertising runs fast for a short window after boot, a disconnect or a
+// press of the BOOT button, then slows down (or stops), and is suspended altogether
+// while forwarding is busy. The coex arbiter prefers WiFi except while a central is
+// connected, when "auto" balances so configuration stays responsive.
+#define COEX_AUTO          0
+#define COEX_WIFI          1
+#define COEX_BALANCED      2
+#define COEX_BLE           3
+#define ADV_FAST           0
+#define ADV_SLOW           1
+#define ADV_OFF            2   // Slow interval 0: nothing until the next window
+#define ADV_SUSPENDED      3   // WiFi load too high
+#define ADV_CONNECTED      4   // The controller stops advertising on connect
+#define ADV_FAST_INTERVAL_MS   100
+#define ADV_SLOW_MIN_MS        100
+#define ADV_SLOW_MAX_MS        10240  // Spec maximum advertising interval
+#define ADV_INTERVAL_MAX_UNITS 0x4000 // The same in 0.625 ms units, for either bound
+#define ADV_EVENT_US           1500   // One event on all three channels, with scan response
+#define BLE_CONN_EVENT_US      400
+#define BLE_CONN_INTERVAL_MS   40     // Middle of the range requested in onConnect
+#ifndef ADV_BUTTON_PIN
+#define ADV_BUTTON_PIN         0      // BOOT button on most boards; -1 to disable
+#endif
+uint8_t coexPolicy = COEX_AUTO;
+uint8_t advFastSec = 60;
+uint16_t advSlowMs = 1000;
+uint16_t advSuspendPps = 300;         // 0 = never suspend; resumes below half of this
+uint8_t advMode = ADV_FAST;
+unsigned long advFastUntil = 0;
+bool advButtonWindow = false;         // The current fast window was asked for by hand
+int8_t coexApplied = -1;              // esp_coex_prefer_t last set
+
+// Status notifications only carry fields that changed since the last one, split to fit
+// the negotiated ATT MTU. Reads of the characteristic return a full snapshot,
+// double-buffered so the Bluedroid task never sees a half-written one. A GATT value
+// can't be longer than ESP_GATT_MAX_ATTR_LEN, which a JSON snapshot with a few clients
+// is; reads then carry every field that fits and notifications bring the rest.
+#define BLE_LOCAL_MTU              247
+#define BLE_DEFAULT_MTU            23
+#define STATUS_MIN_NOTIFY_MS       1000   // Coalesce bursts of changes
+#define STATUS_READ_MAX            ESP_GATT_MAX_ATTR_LEN
+uint16_t bleConnId = 0;
+uint8_t snapshotBuffers[2][STATUS_SNAPSHOT_MAX];
+size_t snapshotLengths[2] = { 0, 0 };
+std::atomic<uint8_t> snapshotActive{0};
+bool statusSentValid = false;               // statusSent holds what the central last saw
+bool statusFullRequested = false;
+unsigned long lastStatusNotify = 0;
+
+// Status fields, snapshot and encoder are in src/core/status.h
+static_assert(EGRESS_STATIONS <= STATUS_CLIENT_STATS, "Status snapshot has a slot per egress station");
+static_assert(DIR_UP == 0 && DIR_DOWN == 1, "Status snapshot counters are indexed by direction");
+StatusSnapshot statusSent;
+
+// Benchmark harness, started with {"cmd":"bench",...}. "relay" measures what AP clients
+// push through the repeater (run iperf on a client against a host upstream); "tcp"/"udp"
+// load the uplink from the repeater itself; "rtt" pings the upstream gateway.
+#define BENCH_RELAY   0
+#define BENCH_TCP     1
+#define BENCH_UDP     2
+#define BENCH_RTT     3
+#define BENCH_IDLE     0
+#define BENCH_RUNNING  1
+#define BENCH_DONE     2
+#define BENCH_FAILED   3
+#define BENCH_TASK_STACK      4096
+#define BENCH_DEFAULT_PORT    5001  // iperf 2's, what "iperf -s" listens on
+#define BENCH_MAX_SECONDS     60
+#define BENCH_RTT_INTERVAL_MS 100
+#define BENCH_RTT_MAX_SAMPLES (BENCH_MAX_SECONDS * 1000 / BENCH_RTT_INTERVAL_MS)
+#define BENCH_HIST_BUCKETS    8     // <1, <2, <5, <10, <20, <50, <100, >=100 ms
+#define BENCH_TLV_BASE        0x80  // Bench result TLV tags live above the status fields
+#define BENCH_UDP_FIN_TRIES   10    // iperf 2's: final datagram resent until the server reports
+#define BENCH_UDP_FIN_WAIT_MS 250
+struct BenchResult {
+  uint8_t test;
+  uint8_t state;
+  uint16_t seconds;
+  uint32_t upKbps;          // AP -> uplink (relay) or repeater -> host (tcp/udp)
+  uint32_t downKbps;        // Uplink -> AP (relay only)
+  int32_t retransmits;      // -1 when lwIP is built without TCP stats
+  uint16_t rttSent;
+  uint16_t rttLost;
+  uint16_t rttP50;          // ms
+  uint16_t rttP99;
+  uint16_t rttMax;
+  uint16_t rttHistogram[BENCH_HIST_BUCKETS];
+  uint8_t cpuLoad[2];       // Percent per core over the run
+};
+BenchResult benchResult;
+std::atomic<bool> benchRelayActive{false};
+std::atomic<uint32_t> benchRelayBytes[2];     // Indexed by ingress wifi_interface_t
+#if !configGENERATE_RUN_TIME_STATS
+std::atomic<uint32_t> benchIdleCalls[2];
+#endif
+std::atomic<bool> benchFinished{false};
+TaskHandle_t benchTaskHandle = NULL;
+char benchHost[16];
+uint16_t benchPort = BENCH_DEFAULT_PORT;
+uint16_t benchRttSamples[BENCH_RTT_MAX_SAMPLES];
+uint16_t benchRttCount = 0;
+
+static inline void wakeSupervisor() {
+  // BLE callbacks can fire before setup() has created the supervisor
+  if (supervisorTaskHandle != NULL) xTaskNotifyGive(supervisorTaskHandle);
+}
+
 // Status tracking
 bool isPrimaryConnected = false;
-unsigned long lastReconnectAttempt = 0;
-const unsigned long reconnectInterval = 30000;  // Try to reconnect every 30 seconds
 
 // Bluetooth related
 BLEServer* pServer = NULL;
 BLECharacteristic* pConfigCharacteristic = NULL;
 BLECharacteristic* pStatusCharacteristic = NULL;
+BLECharacteristic* pStationCharacteristic = NULL;
 bool deviceConnected = false;
 bool oldDeviceConnected = false;
 
@@ -48,207 +1195,1102 @@ bool oldDeviceConnected = false;
 #define SERVICE_UUID        "6E400001-B5A3-F393-E0A9-E50E24DCCA9E"
 #define CONFIG_CHAR_UUID    "6E400002-B5A3-F393-E0A9-E50E24DCCA9E" // Write characteristic for configuration
 #define STATUS_CHAR_UUID    "6E400003-B5A3-F393-E0A9-E50E24DCCA9E" // Read/notify characteristic for status
+#define STATION_CHAR_UUID   "6E400004-B5A3-F393-E0A9-E50E24DCCA9E" // Paged read of the station table
 
 // BLE callback classes
+// These run in the Bluedroid task: hand work to the supervisor and return quickly
 class ServerCallbacks: public BLEServerCallbacks {
-  void onConnect(BLEServer* pServer) {
+  void onConnect(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) {
+    bleConnId = param->connect.conn_id;
     deviceConnected = true;
-    Serial.println("BLE Client connected");
-    updateBLEStatus(); // Send status update when device connects
+    bleEventQueue.push(SUPERVISOR_EVT_BLE_CONNECTED);
+    wakeSupervisor();
+    
+    // Fewer connection events means less airtime taken from WiFi: 30-50 ms interval,
+    // 4 events of slave latency, 4 s supervision timeout
+    pServer->updateConnParams(param->connect.remote_bda, 24, 40, 4, 400);
   };
 
   void onDisconnect(BLEServer* pServer) {
     deviceConnected = false;
-    Serial.println("BLE Client disconnected");
-    // Start advertising again when disconnected
-    pServer->getAdvertising()->start();
+    bleEventQueue.push(SUPERVISOR_EVT_BLE_DISCONNECTED);
+    wakeSupervisor();
+    // The supervisor restarts advertising, on its schedule
+  }
+};
+
+class StatusCallbacks: public BLECharacteristicCallbacks {
+  void onRead(BLECharacteristic* pCharacteristic) {
+    // Explicit reads get the whole picture, not the last delta
+    uint8_t active = snapshotActive.load(std::memory_order_acquire);
+    pCharacteristic->setValue(snapshotBuffers[active], snapshotLengths[active]);
+  }
+};
+
+// Reads walk the table a page at a time; a one-byte write picks the next page.
+// Page layout: page, page count, rows in this page, total rows, then StationRows.
+class StationCallbacks: public BLECharacteristicCallbacks {
+  void onRead(BLECharacteristic* pCharacteristic) {
+    static uint8_t page[4 + STATION_PAGE_ROWS * sizeof(StationRow)];
+    size_t len = encodeStationPage(stationPage, page);
+    pCharacteristic->setValue(page, len);
+    stationPage = (page[0] + 1 < page[1]) ? page[0] + 1 : 0;
+  }
+  
+  void onWrite(BLECharacteristic* pCharacteristic) {
+    if (pCharacteristic->getLength() >= 1) stationPage = pCharacteristic->getData()[0];
   }
 };
 
 class ConfigCallbacks: public BLECharacteristicCallbacks {
+public:
   void onWrite(BLECharacteristic *pCharacteristic) {
-    std::string value = pCharacteristic->getValue();
-    if (value.length() > 0) {
-      Serial.println("Received configuration update:");
-      String jsonStr = String(value.c_str());
-      parseConfig(jsonStr);
+    // Copy straight out of the attribute value; no std::string temporary
+    size_t len = pCharacteristic->getLength();
+    if (len > 0 && len <= CONFIG_MSG_MAX) {
+      ConfigMessage msg;
+      msg.len = len;
+      memcpy(msg.data, pCharacteristic->getData(), len);
+      configQueue.push(msg);
+      wakeSupervisor();
     }
   }
 
-  void parseConfig(String jsonString) {
-    DynamicJsonDocument doc(1024);
-    DeserializationError error = deserializeJson(doc, jsonString);
+  void parseConfig(const char* json, size_t len) {
+    JsonDocument& doc = configDoc;
+    DeserializationError error = deserializeJson(doc, json, len);
     
     if (error) {
-      Serial.print("Failed to parse JSON: ");
-      Serial.println(error.c_str());
+      LOG_WARN("Failed to parse JSON: %s", error.c_str());
       return;
     }
     
-    bool configChanged = false;
-    bool wifiChanged = false;
+    uint64_t keys = configKeysPresent(doc.as<JsonObjectConst>());
+    uint32_t dirty = 0;
     
     // Parse primary WiFi settings
-    if (doc.containsKey("primarySSID") && doc.containsKey("primaryPass")) {
-      String newSSID = doc["primarySSID"].as<String>();
-      String newPass = doc["primaryPass"].as<String>();
+    if ((keys & (1ULL << CONFIG_KEY_PRIMARY_SSID)) && (keys & (1ULL << CONFIG_KEY_PRIMARY_PASS))) {
+      const char* newSSID = doc["primarySSID"] | "";
+      const char* newPass = doc["primaryPass"] | "";
       
-      if (newSSID != primarySSID || newPass != primaryPassword) {
+      if (strlen(newSSID) > 32 || strlen(newPass) > 63) {
+        LOG_WARN("Primary WiFi settings too long, ignored");
+      } else if (primarySSID != newSSID || primaryPassword != newPass) {
         primarySSID = newSSID;
         primaryPassword = newPass;
-        wifiChanged = true;
-        configChanged = true;
-        Serial.println("Primary WiFi settings updated");
+        dirty |= CFG_DIRTY_UPLINK;
+        LOG_INFO("Primary WiFi settings updated");
+      }
+    }
+    
+    // Prioritized upstream list: [{"ssid":..,"pass":..,"bssid":"aa:bb:.."},...]. The
+    // first entry replaces the primary network, the rest the alternates.
+    if ((keys & (1ULL << CONFIG_KEY_UPLINKS))) {
+      JsonArrayConst list = doc["uplinks"].as<JsonArrayConst>();
+      UplinkNetwork nets[UPLINK_NETWORKS_MAX];
+      memset(nets, 0, sizeof(nets));
+      uint8_t count = 0;
+      bool valid = list.size() >= 1 && list.size() <= UPLINK_NETWORKS_MAX;
+      for (JsonObjectConst entry : list) {
+        if (!valid) break;
+        const char* ssid = entry["ssid"] | "";
+        const char* pass = entry["pass"] | "";
+        const char* bssid = entry["bssid"] | "";
+        valid = strlen(ssid) >= 1 && strlen(ssid) <= 32 && strlen(pass) <= 63 &&
+                (bssid[0] == 0 || parseMAC(bssid, nets[count].bssid));
+        strlcpy(nets[count].ssid, ssid, sizeof(nets[count].ssid));
+        strlcpy(nets[count].pass, pass, sizeof(nets[count].pass));
+        count++;
+      }
+      
+      if (!valid) {
+        LOG_WARN("Uplink list invalid, ignored");
+      } else if (primarySSID != nets[0].ssid || primaryPassword != nets[0].pass ||
+                 memcmp(primaryBSSID, nets[0].bssid, 6) != 0 ||
+                 memcmp(uplinkAlternates, nets + 1, sizeof(uplinkAlternates)) != 0) {
+        primarySSID = nets[0].ssid;
+        primaryPassword = nets[0].pass;
+        memcpy(primaryBSSID, nets[0].bssid, 6);
+        memcpy(uplinkAlternates, nets + 1, sizeof(uplinkAlternates));
+        dirty |= CFG_DIRTY_UPLINK;
+        LOG_INFO("Uplink list updated, %d networks", count);
       }
     }
     
     // Parse repeater settings
-    if (doc.containsKey("apSSID") && doc.containsKey("apPass")) {
-      String newAPSSID = doc["apSSID"].as<String>();
-      String newAPPass = doc["apPass"].as<String>();
+    if ((keys & (1ULL << CONFIG_KEY_AP_SSID)) && (keys & (1ULL << CONFIG_KEY_AP_PASS))) {
+      const char* newAPSSID = doc["apSSID"] | "";
+      const char* newAPPass = doc["apPass"] | "";
       
-      if (newAPSSID != apSSID || newAPPass != apPassword) {
+      if (strlen(newAPSSID) > 32 || strlen(newAPPass) > 63) {
+        LOG_WARN("AP settings too long, ignored");
+      } else if (apSSID != newAPSSID || apPassword != newAPPass) {
         apSSID = newAPSSID;
         apPassword = newAPPass;
-        configChanged = true;
-        Serial.println("AP settings updated");
+        dirty |= CFG_DIRTY_AP_IDENTITY;
+        LOG_INFO("AP settings updated");
       }
     }
     
     // Parse AP channel
-    if (doc.containsKey("channel")) {
+    if ((keys & (1ULL << CONFIG_KEY_CHANNEL))) {
       int newChannel = doc["channel"].as<int>();
       if (newChannel != apChannel && newChannel >= 1 && newChannel <= 13) {
         apChannel = newChannel;
-        configChanged = true;
-        Serial.println("AP channel updated");
+        dirty |= CFG_DIRTY_CHANNEL;
+        LOG_INFO("%s", autoChannel ? "AP fallback channel updated" : "AP channel updated");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_AUTO_CHANNEL))) {
+      bool newAutoChannel = doc["autoChannel"].as<bool>();
+      if (newAutoChannel != autoChannel) {
+        autoChannel = newAutoChannel;
+        dirty |= CFG_DIRTY_CHANNEL;
+        LOG_INFO("Automatic channel alignment %s", autoChannel ? "enabled" : "disabled");
       }
     }
     
     // Parse max clients
-    if (doc.containsKey("maxClients")) {
+    if ((keys & (1ULL << CONFIG_KEY_MAX_CLIENTS))) {
       int newMaxClients = doc["maxClients"].as<int>();
       if (newMaxClients != maxClients && newMaxClients > 0 && newMaxClients <= 10) {
         maxClients = newMaxClients;
-        configChanged = true;
-        Serial.println("Max clients updated");
+        dirty |= CFG_DIRTY_MAX_CLIENTS;
+        LOG_INFO("Max clients updated");
       }
     }
     
     // Parse power saving settings
-    if (doc.containsKey("powerSaving")) {
+    if ((keys & (1ULL << CONFIG_KEY_POWER_SAVING))) {
       bool newPowerSaving = doc["powerSaving"].as<bool>();
       if (newPowerSaving != powerSavingEnabled) {
         powerSavingEnabled = newPowerSaving;
-        configChanged = true;
-        Serial.print("Power saving mode ");
-        Serial.println(powerSavingEnabled ? "enabled" : "disabled");
+        dirty |= CFG_DIRTY_POWER;
+        LOG_INFO("Power saving mode %s", powerSavingEnabled ? "enabled" : "disabled");
       }
     }
     
-    if (doc.containsKey("powerMode")) {
+    if ((keys & (1ULL << CONFIG_KEY_POWER_MODE))) {
       int newPowerMode = doc["powerMode"].as<int>();
-      if (newPowerMode >= 0 && newPowerMode <= 2) {
-        switch (newPowerMode) {
-          case 0: powerSaveMode = WIFI_PS_NONE; break;
-          case 1: powerSaveMode = WIFI_PS_MIN_MODEM; break;
-          case 2: powerSaveMode = WIFI_PS_MAX_MODEM; break;
+      uint8_t newMode = powerSaveMode;
+      switch (newPowerMode) {
+        case 0: newMode = WIFI_PS_NONE; break;
+        case 1: newMode = WIFI_PS_MIN_MODEM; break;
+        case 2: newMode = WIFI_PS_MAX_MODEM; break;
+      }
+      if (newMode != powerSaveMode) {
+        powerSaveMode = newMode;
+        dirty |= CFG_DIRTY_POWER;
+        LOG_INFO("Power save mode set to: %d", newPowerMode);
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_TX_POWER))) {
+      int newTxPower = doc["txPower"].as<int>();
+      if (newTxPower != txPower && newTxPower >= TX_POWER_MIN_DBM && newTxPower <= TX_POWER_MAX_DBM) {
+        txPower = newTxPower;
+        dirty |= CFG_DIRTY_TX_POWER;
+        LOG_INFO("TX power set to: %d dBm", txPower);
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_PHY_AUTO))) {
+      bool newPhyAuto = doc["phyAuto"].as<bool>();
+      if (newPhyAuto != phyAuto) {
+        phyAuto = newPhyAuto;
+        dirty |= CFG_DIRTY_PHY;
+        LOG_INFO("PHY tuning %s", phyAuto ? "enabled" : "disabled");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_FAIR_QUEUE))) {
+      bool newFairQueue = doc["fairQueue"].as<bool>();
+      if (newFairQueue != fairQueue) {
+        fairQueue = newFairQueue;
+        dirty |= CFG_DIRTY_EGRESS;
+        LOG_INFO("Per-client fair queuing %s", fairQueue ? "enabled" : "disabled");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_CLIENT_RATE))) {
+      long newRate = doc["clientRate"].as<long>();
+      if (newRate != clientRateKbps && newRate >= 0 && newRate <= 65535) {
+        clientRateKbps = newRate;
+        dirty |= CFG_DIRTY_EGRESS;
+        LOG_INFO("Default client rate cap: %d kbit/s", clientRateKbps);
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_CLIENT_LIMITS))) {
+      // [{"mac":"aa:bb:cc:dd:ee:ff","kbps":2000},...] replaces the whole rule table
+      RateRule newRules[EGRESS_RATE_RULES];
+      memset(newRules, 0, sizeof(newRules));
+      uint8_t count = 0;
+      for (JsonObjectConst rule : doc["clientLimits"].as<JsonArrayConst>()) {
+        if (count == EGRESS_RATE_RULES) break;
+        long kbps = rule["kbps"] | 0L;
+        if (kbps > 0 && kbps <= 65535 && parseMAC(rule["mac"] | "", newRules[count].mac)) {
+          newRules[count++].kbps = kbps;
+        } else {
+          memset(&newRules[count], 0, sizeof(RateRule));
         }
-        configChanged = true;
-        Serial.print("Power save mode set to: ");
-        Serial.println(newPowerMode);
+      }
+      if (memcmp(newRules, rateRules, sizeof(rateRules)) != 0) {
+        memcpy(rateRules, newRules, sizeof(rateRules));
+        dirty |= CFG_DIRTY_EGRESS;
+        LOG_INFO("Client rate rules updated: %d", count);
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_MSS_CLAMP))) {
+      int newClamp = doc["mssClamp"].as<int>();
+      if (newClamp != mssClamp && (newClamp == 0 || (newClamp >= MSS_CLAMP_MIN && newClamp <= MSS_CLAMP_MAX))) {
+        mssClamp = newClamp;
+        dirty |= CFG_DIRTY_MSS_CLAMP;
+        LOG_INFO("TCP MSS clamp set to: %d", mssClamp);
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_DNS_PROXY))) {
+      bool newDnsProxy = doc["dnsProxy"].as<bool>();
+      if (newDnsProxy != dnsProxy) {
+        dnsProxy = newDnsProxy;
+        dirty |= CFG_DIRTY_FORWARDING;  // The DHCP server has to offer a different resolver
+        LOG_INFO("DNS forwarder %s", dnsProxy ? "enabled" : "disabled");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_COEX))) {
+      const char* policy = doc["coex"] | "";
+      int newPolicy = -1;
+      if (strcmp(policy, "auto") == 0) newPolicy = COEX_AUTO;
+      else if (strcmp(policy, "wifi") == 0) newPolicy = COEX_WIFI;
+      else if (strcmp(policy, "balanced") == 0) newPolicy = COEX_BALANCED;
+      else if (strcmp(policy, "ble") == 0) newPolicy = COEX_BLE;
+      if (newPolicy >= 0 && newPolicy != coexPolicy) {
+        coexPolicy = newPolicy;
+        dirty |= CFG_DIRTY_RADIO;
+        LOG_INFO("Coexistence policy set to: %s", policy);
+      }
+    }
+    
+    // Advertising schedule: fast window length, then the slow interval (0 = stop), and
+    // the forwarding load above which advertising is suspended (0 = never)
+    if ((keys & (1ULL << CONFIG_KEY_ADV_FAST_SEC))) {
+      int newFast = doc["advFastSec"].as<int>();
+      if (newFast >= 0 && newFast <= 255 && newFast != advFastSec) {
+        advFastSec = newFast;
+        dirty |= CFG_DIRTY_RADIO;
+      }
+    }
+    if ((keys & (1ULL << CONFIG_KEY_ADV_SLOW_MS))) {
+      int newSlow = doc["advSlowMs"].as<int>();
+      if (newSlow != advSlowMs && (newSlow == 0 || (newSlow >= ADV_SLOW_MIN_MS && newSlow <= ADV_SLOW_MAX_MS))) {
+        advSlowMs = newSlow;
+        dirty |= CFG_DIRTY_RADIO;
+        LOG_INFO("Slow advertising interval set to: %d ms", advSlowMs);
+      }
+    }
+    if ((keys & (1ULL << CONFIG_KEY_ADV_SUSPEND_PPS))) {
+      long newSuspend = doc["advSuspendPps"] | -1L;
+      if (newSuspend >= 0 && newSuspend <= 65535 && newSuspend != advSuspendPps) {
+        advSuspendPps = newSuspend;
+        dirty |= CFG_DIRTY_RADIO;
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_CONFIG_KEY))) {
+      const char* newKey = doc["configKey"] | "";
+      size_t keyLen = strlen(newKey);
+      if (keyLen < CONFIG_KEY_MIN || keyLen > CONFIG_KEY_MAX) {
+        LOG_WARN("Config key must be 8-64 characters, ignored");
+      } else if (strcmp(newKey, configKey) != 0) {
+        strlcpy(configKey, newKey, sizeof(configKey));
+        dirty |= CFG_DIRTY_BOOT_ONLY;
+        LOG_INFO("Config key updated");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_BLE))) {
+      bool newBle = doc["ble"].as<bool>();
+      if (!newBle && configKey[0] == 0) {
+        LOG_WARN("Set a configKey before disabling BLE");
+      } else if (newBle != bleEnabled) {
+        bleEnabled = newBle;
+        dirty |= CFG_DIRTY_BOOT_ONLY;
+        LOG_INFO("BLE at boot %s", bleEnabled ? "enabled" : "disabled");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_DHCP_RESERVE))) {
+      // Stored with the lease table rather than the config blob
+      setReservations(doc["dhcpReserve"].as<JsonArrayConst>());
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_FORWARD_MODE))) {
+      const char* newMode = doc["forwardMode"] | "";
+      uint8_t mode = forwardMode;
+      if (strcmp(newMode, "nat") == 0) mode = FORWARD_NAT;
+      else if (strcmp(newMode, "bridge") == 0) mode = FORWARD_BRIDGE;
+      
+      if (mode != forwardMode) {
+        forwardMode = mode;
+        dirty |= CFG_DIRTY_FORWARDING;
+        LOG_INFO("Forwarding mode set to: %s", newMode);
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_FAST_NAT))) {
+      bool newFastNat = doc["fastNat"].as<bool>();
+      if (newFastNat != ctEnabled) {
+        ctEnabled = newFastNat;
+        ctFlushRequested = true;
+        dirty |= CFG_DIRTY_FORWARDING;
+        LOG_INFO("Conntrack fast path %s", ctEnabled ? "enabled" : "disabled");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_MCAST_FILTER))) {
+      bool newFilter = doc["mcastFilter"].as<bool>();
+      if (newFilter != mcastFilter) {
+        mcastFilter = newFilter;
+        dirty |= CFG_DIRTY_FORWARDING;
+        LOG_INFO("Multicast filter %s", mcastFilter ? "enabled" : "disabled");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_HEALTH_BLOCK_MIN))) {
+      int newBlockMin = doc["healthBlockMin"].as<int>();
+      if (newBlockMin != healthBlockMin && newBlockMin >= 0 && newBlockMin <= 65535) {
+        healthBlockMin = newBlockMin;
+        dirty |= CFG_DIRTY_HEALTH;
+        LOG_INFO("Health: largest free block floor %d bytes%s", healthBlockMin, healthBlockMin ? "" : " (off)");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_HEALTH_LOOP_MS))) {
+      int newLoopMs = doc["healthLoopMs"].as<int>();
+      if (newLoopMs != healthLoopMs && (newLoopMs == 0 || (newLoopMs >= SUPERVISOR_TICK_MS && newLoopMs <= 65535))) {
+        healthLoopMs = newLoopMs;
+        dirty |= CFG_DIRTY_HEALTH;
+        LOG_INFO("Health: supervisor loop limit %d ms%s", healthLoopMs, healthLoopMs ? "" : " (off)");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_HEALTH_UPLINK_SEC))) {
+      int newUplinkSec = doc["healthUplinkSec"].as<int>();
+      if (newUplinkSec != healthUplinkSec && newUplinkSec >= 0 && newUplinkSec <= 65535) {
+        healthUplinkSec = newUplinkSec;
+        dirty |= CFG_DIRTY_HEALTH;
+        LOG_INFO("Health: uplink restart after %d s down%s", healthUplinkSec, healthUplinkSec ? "" : " (off)");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_STATUS_FORMAT))) {
+      // Per-client preference: not persisted, reset when the central disconnects
+      const char* format = doc["statusFormat"] | "";
+      uint8_t newFormat = statusFormat;
+      if (strcmp(format, "tlv") == 0) newFormat = STATUS_FORMAT_TLV;
+      else if (strcmp(format, "json") == 0) newFormat = STATUS_FORMAT_JSON;
+      if (newFormat != statusFormat) {
+        statusFormat = newFormat;
+        statusFullRequested = true;
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_CMD))) {
+      handleCommand(doc["cmd"] | "", doc);
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_POWER_GOVERNOR))) {
+      bool newGovernor = doc["powerGovernor"].as<bool>();
+      if (newGovernor != powerGovernor) {
+        powerGovernor = newGovernor;
+        governorLevel = GOV_BALANCED;
+        governorCalmSamples = 0;
+        dirty |= CFG_DIRTY_POWER;
+        LOG_INFO("Power governor %s", powerGovernor ? "enabled" : "disabled");
+      }
+    }
+    
+    if ((keys & (1ULL << CONFIG_KEY_IDLE_AFTER))) {
+      int newIdleAfter = doc["idleAfter"].as<int>();
+      if (newIdleAfter != idleAfterSec && newIdleAfter >= 0 && newIdleAfter <= 65535) {
+        idleAfterSec = newIdleAfter;
+        dirty |= CFG_DIRTY_POWER;
+        LOG_INFO("Idle mode after %d s%s", idleAfterSec, idleAfterSec ? "" : " (off)");
       }
     }
     
-    if (doc.containsKey("listenInterval")) {
+    if ((keys & (1ULL << CONFIG_KEY_LISTEN_INTERVAL))) {
       int newInterval = doc["listenInterval"].as<int>();
       if (newInterval != listenInterval && newInterval >= 1 && newInterval <= 10) {
         listenInterval = newInterval;
-        configChanged = true;
-        Serial.print("Listen interval set to: ");
-        Serial.println(listenInterval);
+        dirty |= CFG_DIRTY_POWER;
+        LOG_INFO("Listen interval set to: %d", listenInterval);
       }
     }
     
     // Apply changes if needed
-    if (configChanged) {
-      applySettings(wifiChanged);
+    if (dirty) {
+      markConfigDirty();
+      applySettings(dirty);
     }
   }
 };
 
+ConfigCallbacks configCallbacks;
+
 void setup() {
   // Initialize serial communication
+  // The log task drains asynchronously, so nothing waits on the UART
+  bootMark(BOOT_SETUP);
   Serial.begin(115200);
-  delay(100);
+  setupLogging();
   
-  Serial.println("\n\nESP32 WiFi Repeater with BLE Control Starting...");
+  LOG_INFO("\n\nESP32 WiFi Repeater with BLE Control Starting...");
   
-  // Setup BLE
-  setupBLE();
+  // Restore the last configuration before anything is brought up with it
+  loadConfig();
+  loadLeases();
+  bootMark(BOOT_CONFIG);
+  
+  // Carve out the packet pool and the conntrack table before anything else starts taking heap
+  setupPacketPool();
+  setupConntrack();
+  setupMulticast();
+  
+  // Forwarding must be able to drain driver buffers before any interface comes up
+  xTaskCreatePinnedToCore(forwardTask, "forward", FORWARD_TASK_STACK, NULL,
+                          FORWARD_TASK_PRIORITY, &forwardTaskHandle, FORWARD_TASK_CORE);
+  
+  // BLE, unless this is a headless build or BLE was turned off for this site. Holding
+  // BOOT during power-up brings it back regardless. Its start is left to the
+  // supervisor: Bluedroid takes a few hundred ms to come up and would hold back the
+  // AP, and its advertising would compete with the uplink association.
+#if REPEATER_BLE
+  bool startBLE = bleEnabled;
+#if ADV_BUTTON_PIN >= 0
+  pinMode(ADV_BUTTON_PIN, INPUT_PULLUP);
+  if (digitalRead(ADV_BUTTON_PIN) == LOW) startBLE = true;
+#endif
+#else
+  bool startBLE = false;
+#endif
+  if (startBLE) {
+    blePending = true;
+  } else {
+    // Bluedroid and controller memory were never used; give it all to the heap
+    esp_bt_controller_mem_release(ESP_BT_MODE_BTDM);
+    advMode = ADV_OFF;
+    LOG_INFO("BLE disabled, configuration over UDP port %d", CONFIG_UDP_PORT);
+    if (configKey[0] == 0) LOG_WARN("No config key set, this build can't be reconfigured");
+  }
   
   // Set up both WiFi modes - ESP32 can operate as both station and access point
   WiFi.mode(WIFI_AP_STA);
+  WiFi.onEvent(onInterfaceStarted, ARDUINO_EVENT_WIFI_AP_START);
+  WiFi.onEvent(onInterfaceStarted, ARDUINO_EVENT_WIFI_STA_CONNECTED);
+  WiFi.onEvent(onUplinkEvent, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  WiFi.onEvent(onUplinkEvent, ARDUINO_EVENT_WIFI_STA_LOST_IP);
+  WiFi.onEvent(onUplinkEvent, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+  WiFi.onEvent(onIdleWakeEvent, ARDUINO_EVENT_WIFI_AP_STACONNECTED);
+  WiFi.onEvent(onIdleWakeEvent, ARDUINO_EVENT_WIFI_AP_PROBEREQRECVED);
+  WiFi.setAutoReconnect(false); // The uplink state machine owns retries
+  WiFi.persistent(false);        // Credentials live in our own cache, not the driver's NVS copy
+  loadFastConnectCache();
   
   // Configure the access point
   setupAccessPoint();
+  applyTxPower();
+  applyPhyMode();
+  
+  // Without BLE its released memory goes to the pool, but only now that the
+  // interfaces, conntrack and the NAPT table have taken theirs
+  if (!startBLE) growPacketPool();
   
-  // Connect to the primary WiFi
+  // The DNS forwarder binds to apIP, so it comes after the AP
+  xTaskCreatePinnedToCore(dnsTask, "dns", DNS_TASK_STACK, NULL,
+                          DNS_TASK_PRIORITY, &dnsTaskHandle, DNS_TASK_CORE);
+  
+  // Start connecting to the primary WiFi; the supervisor follows up on the events
   connectToPrimaryWiFi();
+  bootMark(BOOT_UPLINK_START);
   
   // Apply power saving settings
   applyPowerSavingSettings();
+  
+  // Both long-running supervision tasks subscribe to the task watchdog. This only
+  // reconfigures the TWDT the Arduino core runs for the idle tasks; a timeout panics
+  // and resets, the one full reboot the health task leaves in place.
+  esp_task_wdt_init(HEALTH_WDT_TIMEOUT_S, true);
+  
+  // Everything from here on runs in the supervisor
+  xTaskCreatePinnedToCore(supervisorTask, "supervisor", SUPERVISOR_TASK_STACK, NULL,
+                          SUPERVISOR_TASK_PRIORITY, &supervisorTaskHandle, SUPERVISOR_TASK_CORE);
+  
+  // Heap, stack and loop latency checks, and the decision to restart a subsystem
+  xTaskCreatePinnedToCore(healthTask, "health", HEALTH_TASK_STACK, NULL,
+                          HEALTH_TASK_PRIORITY, &healthTaskHandle, HEALTH_TASK_CORE);
 }
 
 void loop() {
-  // Check if we're connected to the primary WiFi
-  if (WiFi.status() != WL_CONNECTED) {
-    if (!isPrimaryConnected || (millis() - lastReconnectAttempt > reconnectInterval)) {
-      isPrimaryConnected = false;
-      Serial.println("Connection to primary WiFi lost. Attempting to reconnect...");
-      connectToPrimaryWiFi();
-    }
-  } else if (!isPrimaryConnected) {
-    // We just connected
-    isPrimaryConnected = true;
-    Serial.println("Connection to primary WiFi established!");
-    printWiFiStatus();
-    updateBLEStatus();
-  }
-  
-  // Handle BLE connections
-  if (deviceConnected) {
-    // Update status every 5 seconds when BLE device is connected
-    static unsigned long lastBLEStatusTime = 0;
-    if (millis() - lastBLEStatusTime > 5000) {
-      lastBLEStatusTime = millis();
+  // All periodic work lives in supervisorTask; the Arduino loop task is not needed
+  vTaskDelete(NULL);
+}
+
+void supervisorTask(void* arg) {
+  esp_task_wdt_add(NULL);
+  for (;;) {
+    // Wake on BLE traffic, or once per tick for housekeeping
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(idleMode ? IDLE_TICK_MS : SUPERVISOR_TICK_MS));
+    healthLoopBegin();
+    superviseIdle();
+    
+    if (healthRestartRequest.load(std::memory_order_relaxed)) {
+      healthRestart();
+    }
+    
+    healthPhase(HEALTH_SUB_BLE);
+    uint8_t bleEvent;
+    while (bleEventQueue.pop(bleEvent)) {
+      if (bleEvent == SUPERVISOR_EVT_BLE_CONNECTED) {
+        LOG_INFO("BLE Client connected");
+        statusSentValid = false;
+        statusFullRequested = true; // Send status update when device connects
+        advMode = ADV_CONNECTED;
+        applyCoexPolicy();
+      } else {
+        LOG_INFO("BLE Client disconnected");
+        statusFormat = STATUS_FORMAT_JSON;
+        openAdvertisingWindow();
+        applyCoexPolicy();
+      }
+    }
+    
+    healthPhase(HEALTH_SUB_NONE);
+    ConfigMessage msg;
+    while (configQueue.pop(msg)) {
+      LOG_DEBUG("Received configuration update:");
+      configCallbacks.parseConfig(msg.data, msg.len);
+    }
+    
+    healthPhase(HEALTH_SUB_UPLINK);
+    superviseChannelSwitch();
+    superviseUplink();
+    monitorUplink();
+    healthPhase(HEALTH_SUB_NONE);
+    
+    if (blePending && (uplinkState == UPLINK_CONNECTED || millis() >= BLE_START_DEADLINE_MS)) {
+      blePending = false;
+      setupBLE();
+      bootMark(BOOT_BLE_UP);
+      applyMaxClients();  // The client budget was taken without Bluedroid's heap
+    }
+    if (!bootTimelineLogged && (bootMs[BOOT_UPLINK_IP] != 0 || millis() >= BOOT_TIMELINE_MS)) {
+      bootTimelineLogged = true;
+      printBootTimeline();
+    }
+    commitConfigIfDue();
+    commitLeasesIfDue();
+    
+    static unsigned long lastGovernorSample = 0;
+    if (millis() - lastGovernorSample >= GOVERNOR_SAMPLE_MS) {
+      runGovernor(millis() - lastGovernorSample);
+      sampleEgress(millis() - lastGovernorSample);
+      lastGovernorSample = millis();
+      healthPhase(HEALTH_SUB_BLE);
+      superviseAdvertising();
+      healthPhase(HEALTH_SUB_NONE);
+    }
+    pollAdvertisingButton();
+    
+    healthPhase(HEALTH_SUB_AP);
+    static unsigned long lastStationPoll = 0;
+    if (millis() - lastStationPoll >= STATION_POLL_MS) {
+      pollStations(millis() - lastStationPoll);
+      lastStationPoll = millis();
+      tunePhy();
+    }
+    if (phySurveying) phySurveyStep();
+    
+    healthPhase(HEALTH_SUB_UPLINK);
+    static unsigned long lastConntrackRefresh = 0;
+    if (uplinkState == UPLINK_CONNECTED && millis() - lastConntrackRefresh >= CT_REFRESH_MS) {
+      lastConntrackRefresh = millis();
+      refreshConntrackUplink();
+    }
+    
+    static unsigned long lastChannelPoll = 0;
+    if (uplinkState == UPLINK_CONNECTED && millis() - lastChannelPoll > CHANNEL_POLL_MS) {
+      lastChannelPoll = millis();
+      checkChannelAlignment();
+    }
+    healthPhase(HEALTH_SUB_NONE);
+    
+    if (benchFinished.exchange(false)) {
+      printBenchResult();
+      notifyBenchResult();
+    }
+    
+    // Handle BLE connections: notify whatever changed, at most once per second
+    if (deviceConnected && millis() - lastStatusNotify >= STATUS_MIN_NOTIFY_MS) {
+      healthPhase(HEALTH_SUB_BLE);
       updateBLEStatus();
+      healthPhase(HEALTH_SUB_NONE);
     }
+    
+    // Handle connecting/disconnecting BLE devices
+    if (deviceConnected != oldDeviceConnected) {
+      oldDeviceConnected = deviceConnected;
+    }
+    
+    // Print status every 60 seconds
+    static unsigned long lastStatusTime = 0;
+    if (millis() - lastStatusTime > 60000) {
+      lastStatusTime = millis();
+      printStatus();
+    }
+    healthLoopEnd();
   }
-  
-  // Handle connecting/disconnecting BLE devices
-  if (deviceConnected != oldDeviceConnected) {
-    oldDeviceConnected = deviceConnected;
-  }
-  
-  // Print status every 60 seconds
-  static unsigned long lastStatusTime = 0;
-  if (millis() - lastStatusTime > 60000) {
-    lastStatusTime = millis();
-    printStatus();
+}
+
+const char* const healthSubNames[] = { "softAP", "uplink", "BLE", "other" };
+
+struct HealthWatchedTask {
+  const char* name;
+  TaskHandle_t* handle;
+  uint32_t lowest;          // Stack headroom low-water, bytes
+  bool reported;
+};
+HealthWatchedTask healthTasks[] = {
+  { "forward", &forwardTaskHandle, UINT32_MAX, false },
+  { "supervisor", &supervisorTaskHandle, UINT32_MAX, false },
+  { "health", &healthTaskHandle, UINT32_MAX, false },
+  { "dns", &dnsTaskHandle, UINT32_MAX, false },
+  { "log", &logTaskHandle, UINT32_MAX, false },
+};
+#define HEALTH_WATCHED_TASKS (sizeof(healthTasks) / sizeof(healthTasks[0]))
+
+// Internal RAM only: WiFi, lwIP and the packet pool can't use PSRAM, and on boards
+// that have it the 8-bit heap would hide internal exhaustion behind megabytes of it
+static void healthSampleHeap() {
+  healthFreeHeap = heap_caps_get_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  healthLargestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  healthMinFree = heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  healthFragPct = healthFreeHeap ? 100 - (uint64_t)healthLargestBlock * 100 / healthFreeHeap : 0;
+}
+
+static void healthSampleStacks() {
+  for (uint8_t i = 0; i < HEALTH_WATCHED_TASKS; i++) {
+    HealthWatchedTask& t = healthTasks[i];
+    if (*t.handle == NULL) continue;
+    // The high-water mark is in bytes on ESP-IDF, which sizes stacks in bytes
+    uint32_t left = uxTaskGetStackHighWaterMark(*t.handle);
+    if (left < t.lowest) t.lowest = left;
+    if (t.lowest < HEALTH_STACK_MIN && !t.reported) {
+      t.reported = true;
+      LOG_WARN("Health: %s task down to %lu bytes of stack", t.name, (unsigned long)t.lowest);
+    }
   }
-  
-  // Non-blocking delay
-  delay(100);
 }
 
-void setupBLE() {
-  // Create the BLE Device
-  BLEDevice::init("ESP32_WiFi_Repeater");
+static bool healthRequestRestart(uint8_t sub, uint32_t now, const char* why) {
+  if (healthLastRestart[sub] != 0 && now - healthLastRestart[sub] < HEALTH_COOLDOWN_MS) return false;
+  healthLastRestart[sub] = now | 1;
+  LOG_WARN("Health: %s, restarting %s", why, healthSubNames[sub]);
+  healthRestartRequest.fetch_or(1 << sub, std::memory_order_relaxed);
+  wakeSupervisor();
+  return true;
+}
+
+void healthTask(void* arg) {
+  esp_task_wdt_add(NULL);
   
-  // Create the BLE Server
-  pServer = BLEDevice::createServer();
-  pServer->setCallbacks(new ServerCallbacks());
+  uint8_t blockStrikes = 0, apStrikes = 0;
+  uint8_t slowStrikes[HEALTH_SUB_COUNT] = {0};
+  uint32_t lastForwarded = 0, forwardIdleSince = 0, lastDownTx = 0, lastTxFailed = 0;
+  uint32_t uplinkDownSince = 0;
+  bool supervisorLate = false;
+  for (;;) {
+    vTaskDelay(pdMS_TO_TICKS(idleMode ? HEALTH_IDLE_CHECK_MS : HEALTH_CHECK_MS));
+    uint32_t now = millis();
+    
+    // Every frame the forwarding task takes lands in the queue latency histogram, so
+    // frames waiting with that count standing still means it is wedged. A restart
+    // wouldn't reach it; stop feeding the watchdog and let it reset with a backtrace.
+    MetricsTotals totals;
+    collectMetrics(totals);
+    uint32_t forwarded = 0;
+    for (uint8_t b = 0; b < LATENCY_BUCKETS; b++) forwarded += totals.latency[STAGE_QUEUE][b];
+    if (forwarded != lastForwarded || forwardQueue.size() == 0) {
+      lastForwarded = forwarded;
+      forwardIdleSince = now;
+    } else if (now - forwardIdleSince > HEALTH_FORWARD_STALL_MS) {
+      if (!healthForwardStalled) {
+        healthForwardStalled = true;
+        LOG_ERROR("Health: forwarding stalled with %lu frames queued, leaving it to the watchdog",
+                  (unsigned long)forwardQueue.size());
+      }
+      continue;
+    }
+    esp_task_wdt_reset();
+    
+    healthSampleHeap();
+    healthSampleStacks();
+    
+    // Loop latency: a supervisor that hasn't come round is blocked in whatever phase it
+    // last marked; one that comes round slowly is charged per phase
+    uint32_t tick = idleMode ? IDLE_TICK_MS : SUPERVISOR_TICK_MS;
+    uint32_t age = now - supervisorBeat.load(std::memory_order_relaxed);
+    bool late = healthLoopMs != 0 && age > healthLoopMs + tick;
+    if (late && !supervisorLate) {
+      healthStalls++;
+      LOG_WARN("Health: supervisor blocked for %lu ms in %s", (unsigned long)age,
+               healthSubNames[supervisorPhase.load(std::memory_order_relaxed)]);
+    }
+    supervisorLate = late;
+    for (uint8_t sub = 0; sub < HEALTH_SUB_COUNT; sub++) {
+      uint32_t took = healthPhaseMax[sub].exchange(0, std::memory_order_relaxed);
+      if (late && supervisorPhase.load(std::memory_order_relaxed) == sub) took = age;
+      if (healthLoopMs == 0 || took <= healthLoopMs) {
+        slowStrikes[sub] = 0;
+      } else if (++slowStrikes[sub] >= HEALTH_STRIKES) {
+        slowStrikes[sub] = 0;
+        healthRequestRestart(sub, now, "supervisor loop over its limit");
+      }
+    }
+    
+    // Fragmentation: Bluedroid holds the most long-lived small allocations, so it goes
+    // first; with BLE off or just restarted, the softAP and its per-station state.
+    // A connected central is only dropped once the block is down to half the floor.
+    if (healthBlockMin == 0 || healthLargestBlock >= healthBlockMin) {
+      blockStrikes = 0;
+    } else if (++blockStrikes >= HEALTH_STRIKES) {
+      blockStrikes = 0;
+      bool bleFirst = bleActive && (!deviceConnected || healthLargestBlock < healthBlockMin / 2U);
+      if (!bleFirst || !healthRequestRestart(HEALTH_SUB_BLE, now, "heap fragmented")) {
+        healthRequestRestart(HEALTH_SUB_AP, now, "heap fragmented");
+      }
+    }
+    
+    // softAP: stations associated, downstream transmits all failing
+    uint32_t downTx = totals.txPackets[DIR_DOWN], txFailed = totals.drops[DROP_TX_FAILED];
+    if (downTx != lastDownTx || txFailed == lastTxFailed || WiFi.softAPgetStationNum() == 0) {
+      apStrikes = 0;
+    } else if (++apStrikes >= HEALTH_STRIKES) {
+      apStrikes = 0;
+      healthRequestRestart(HEALTH_SUB_AP, now, "softAP refusing every frame");
+    }
+    lastDownTx = downTx;
+    lastTxFailed = txFailed;
+    
+    // Uplink: retrying on its own is the state machine's job; this only starts it over
+    // when it has been at it for far too long, in case its view of the driver is stale
+    if (uplinkState == UPLINK_CONNECTED || uplinkState == UPLINK_IDLE || healthUplinkSec == 0) {
+      uplinkDownSince = 0;
+    } else if (uplinkDownSince == 0) {
+      uplinkDownSince = now | 1;
+    } else if (now - uplinkDownSince >= healthUplinkSec * 1000UL) {
+      uplinkDownSince = 0;
+      healthRequestRestart(HEALTH_SUB_UPLINK, now, "uplink down too long");
+    }
+  }
+}
+
+// Supervisor side of a health restart; the same paths a config change takes
+void healthRestart() {
+  uint8_t request = healthRestartRequest.exchange(0, std::memory_order_relaxed);
+  if (request & (1 << HEALTH_SUB_BLE)) {
+    healthRestarts[HEALTH_SUB_BLE]++;
+    restartBLE();
+  }
+  if (request & (1 << HEALTH_SUB_AP)) {
+    healthRestarts[HEALTH_SUB_AP]++;
+    applySettings(CFG_DIRTY_AP_IDENTITY);
+    LOG_INFO("Health: softAP restarted on channel %d", activeAPChannel);
+  }
+  if (request & (1 << HEALTH_SUB_UPLINK)) {
+    healthRestarts[HEALTH_SUB_UPLINK]++;
+    applySettings(CFG_DIRTY_UPLINK);
+  }
+}
+
+void configToBlob(PersistedConfig& cfg) {
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.magic = CONFIG_MAGIC;
+  cfg.version = CONFIG_VERSION;
+  cfg.size = sizeof(cfg);
+  strlcpy(cfg.primarySSID, primarySSID.c_str(), sizeof(cfg.primarySSID));
+  strlcpy(cfg.primaryPass, primaryPassword.c_str(), sizeof(cfg.primaryPass));
+  strlcpy(cfg.apSSID, apSSID.c_str(), sizeof(cfg.apSSID));
+  strlcpy(cfg.apPass, apPassword.c_str(), sizeof(cfg.apPass));
+  cfg.apChannel = apChannel;
+  cfg.maxClients = maxClients;
+  cfg.powerSaving = powerSavingEnabled;
+  cfg.powerMode = powerSaveMode;
+  cfg.listenInterval = listenInterval;
+  cfg.forwardMode = forwardMode;
+  cfg.autoChannel = autoChannel;
+  cfg.powerGovernor = powerGovernor;
+  cfg.txPower = txPower;
+  cfg.fairQueue = fairQueue;
+  cfg.clientRateKbps = clientRateKbps;
+  memcpy(cfg.rateRules, rateRules, sizeof(rateRules));
+  cfg.mssClamp = mssClamp;
+  cfg.dnsProxy = dnsProxy;
+  memcpy(cfg.primaryBSSID, primaryBSSID, sizeof(primaryBSSID));
+  memcpy(cfg.uplinkAlternates, uplinkAlternates, sizeof(uplinkAlternates));
+  cfg.coexPolicy = coexPolicy;
+  cfg.advFastSec = advFastSec;
+  cfg.advSlowMs = advSlowMs;
+  cfg.advSuspendPps = advSuspendPps;
+  cfg.bleEnabled = bleEnabled;
+  strlcpy(cfg.configKey, configKey, sizeof(cfg.configKey));
+  cfg.phyAuto = phyAuto;
+  cfg.idleAfterSec = idleAfterSec;
+  cfg.fastNat = ctEnabled;
+  cfg.mcastFilter = mcastFilter;
+  cfg.healthBlockMin = healthBlockMin;
+  cfg.healthLoopMs = healthLoopMs;
+  cfg.healthUplinkSec = healthUplinkSec;
+  cfg.crc = esp_rom_crc32_le(0, (const uint8_t*)&cfg + CONFIG_HEADER_SIZE, cfg.size - CONFIG_HEADER_SIZE);
+}
+
+void loadConfig() {
+  // Start from the current globals so fields missing from an older blob keep their defaults
+  PersistedConfig cfg;
+  configToBlob(cfg);
+  
+  Preferences prefs;
+  prefs.begin("repeater", true);
+  size_t stored = prefs.getBytesLength("cfg");
+  size_t len = 0;
+  if (stored > CONFIG_HEADER_SIZE && stored <= sizeof(cfg)) {
+    len = prefs.getBytes("cfg", &cfg, stored);
+  }
+  prefs.end();
+  
+  if (len == 0) {
+    LOG_INFO("No stored configuration, using defaults");
+    return;
+  }
+  
+  if (cfg.magic != CONFIG_MAGIC || cfg.size != len ||
+      cfg.crc != esp_rom_crc32_le(0, (const uint8_t*)&cfg + CONFIG_HEADER_SIZE, len - CONFIG_HEADER_SIZE)) {
+    LOG_WARN("Stored configuration is corrupt, using defaults");
+    return;
+  }
+  
+  cfg.primarySSID[sizeof(cfg.primarySSID) - 1] = 0;
+  cfg.primaryPass[sizeof(cfg.primaryPass) - 1] = 0;
+  cfg.apSSID[sizeof(cfg.apSSID) - 1] = 0;
+  cfg.apPass[sizeof(cfg.apPass) - 1] = 0;
+  
+  primarySSID = cfg.primarySSID;
+  primaryPassword = cfg.primaryPass;
+  apSSID = cfg.apSSID;
+  apPassword = cfg.apPass;
+  if (cfg.apChannel >= 1 && cfg.apChannel <= 13) apChannel = cfg.apChannel;
+  if (cfg.maxClients >= 1 && cfg.maxClients <= 10) maxClients = cfg.maxClients;
+  powerSavingEnabled = cfg.powerSaving;
+  if (cfg.powerMode <= WIFI_PS_MAX_MODEM) powerSaveMode = cfg.powerMode;
+  if (cfg.listenInterval >= 1 && cfg.listenInterval <= 10) listenInterval = cfg.listenInterval;
+  if (cfg.forwardMode <= FORWARD_BRIDGE) forwardMode = cfg.forwardMode;
+  autoChannel = cfg.autoChannel;
+  powerGovernor = cfg.powerGovernor;
+  if (cfg.txPower >= TX_POWER_MIN_DBM && cfg.txPower <= TX_POWER_MAX_DBM) txPower = cfg.txPower;
+  fairQueue = cfg.fairQueue;
+  clientRateKbps = cfg.clientRateKbps;
+  memcpy(rateRules, cfg.rateRules, sizeof(rateRules));
+  if (cfg.mssClamp == 0 || (cfg.mssClamp >= MSS_CLAMP_MIN && cfg.mssClamp <= MSS_CLAMP_MAX)) mssClamp = cfg.mssClamp;
+  dnsProxy = cfg.dnsProxy;
+  memcpy(primaryBSSID, cfg.primaryBSSID, sizeof(primaryBSSID));
+  for (uint8_t i = 0; i < UPLINK_ALTERNATES; i++) {
+    cfg.uplinkAlternates[i].ssid[sizeof(cfg.uplinkAlternates[i].ssid) - 1] = 0;
+    cfg.uplinkAlternates[i].pass[sizeof(cfg.uplinkAlternates[i].pass) - 1] = 0;
+  }
+  memcpy(uplinkAlternates, cfg.uplinkAlternates, sizeof(uplinkAlternates));
+  if (cfg.coexPolicy <= COEX_BLE) coexPolicy = cfg.coexPolicy;
+  advFastSec = cfg.advFastSec;
+  if (cfg.advSlowMs == 0 || (cfg.advSlowMs >= ADV_SLOW_MIN_MS && cfg.advSlowMs <= ADV_SLOW_MAX_MS)) advSlowMs = cfg.advSlowMs;
+  advSuspendPps = cfg.advSuspendPps;
+  cfg.configKey[sizeof(cfg.configKey) - 1] = 0;
+  if (cfg.configKey[0] != 0) strlcpy(configKey, cfg.configKey, sizeof(configKey));
+  // Without a key there would be no way back in
+  bleEnabled = cfg.bleEnabled || configKey[0] == 0;
+  phyAuto = cfg.phyAuto;
+  idleAfterSec = cfg.idleAfterSec;
+  ctEnabled = cfg.fastNat;
+  mcastFilter = cfg.mcastFilter;
+  healthBlockMin = cfg.healthBlockMin;
+  healthLoopMs = cfg.healthLoopMs;
+  healthUplinkSec = cfg.healthUplinkSec;
+  
+  configToBlob(cfg);
+  configSavedCRC = cfg.crc;
+  LOG_INFO("Loaded stored configuration v%d", cfg.version);
+}
+
+void markConfigDirty() {
+  // Writes are coalesced: a burst of BLE writes ends up as a single NVS commit
+  configLastChange = millis();
+  if (configDirtySince == 0) configDirtySince = configLastChange | 1;
+}
+
+void commitConfigIfDue() {
+  if (configDirtySince == 0) return;
+  
+  unsigned long now = millis();
+  if (now - configLastChange < CONFIG_COMMIT_DELAY_MS && now - configDirtySince < CONFIG_COMMIT_MAX_MS) return;
+  configDirtySince = 0;
+  
+  PersistedConfig cfg;
+  configToBlob(cfg);
+  if (cfg.crc == configSavedCRC) return; // Changed and changed back
+  
+  Preferences prefs;
+  prefs.begin("repeater", false);
+  if (prefs.putBytes("cfg", &cfg, sizeof(cfg)) == sizeof(cfg)) {
+    configSavedCRC = cfg.crc;
+    LOG_INFO("Configuration saved");
+  } else {
+    LOG_ERROR("Failed to save configuration");
+  }
+  prefs.end();
+}
+
+void handleCommand(const char* cmd, JsonDocument& doc) {
+  if (strcmp(cmd, "snapshot") == 0) {
+    // Central wants everything via notification rather than a long read
+    statusFullRequested = true;
+  } else if (strcmp(cmd, "metrics") == 0) {
+    notifyMetrics();
+  } else if (strcmp(cmd, "boot") == 0) {
+    printBootTimeline();
+  } else if (strcmp(cmd, "bleOff") == 0) {
+    shutdownBLE();
+  } else if (strcmp(cmd, "bench") == 0) {
+    startBenchmark(doc["test"] | "relay", doc["seconds"] | 10, doc["host"] | "", doc["port"] | BENCH_DEFAULT_PORT);
+  } else {
+    LOG_WARN("Unknown command: %s", cmd);
+  }
+}
+
+void onUplinkEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  UplinkEvent evt = { UPLINK_EVT_DISCONNECTED, 0 };
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    evt.type = UPLINK_EVT_GOT_IP;
+    bootMark(BOOT_UPLINK_IP);
+  } else if (event == ARDUINO_EVENT_WIFI_STA_LOST_IP) {
+    evt.type = UPLINK_EVT_LOST_IP;
+  } else {
+    evt.reason = info.wifi_sta_disconnected.reason;
+  }
+  uplinkEventQueue.push(evt);
+  wakeSupervisor();
+}
+
+void superviseUplink() {
+  UplinkEvent evt;
+  while (uplinkEventQueue.pop(evt)) {
+    if (evt.type == UPLINK_EVT_GOT_IP) {
+      // We just connected
+      uplinkState = UPLINK_CONNECTED;
+      uplinkFailures = 0;
+      isPrimaryConnected = true;
+      lastConnectMs = millis() - uplinkAttemptStart;
+      fastConnectMiss = false;
+      recordFastConnect();
+      checkChannelAlignment();
+      startUplinkMonitor();
+      LOG_INFO("Connection to primary WiFi established in %lu ms%s", lastConnectMs,
+               fastConnectDirected ? " (fast connect)" : "");
+      printWiFiStatus();
+      setupForwarding(); // Pick up the uplink's DNS server for AP clients
+      refreshConntrackUplink();
+      dnsFlushRequested = true; // Possibly a different network; don't serve its old answers
+      updateBLEStatus();
+      continue;
+    }
+    
+    if (evt.type == UPLINK_EVT_LOST_IP && uplinkState == UPLINK_CONNECTED) {
+      // Associated but the lease is gone; drop the link and go round again
+      LOG_WARN("Primary WiFi lost its IP address");
+      WiFi.disconnect();
+      lastDisconnectReason = 0;
+      uplinkLost();
+      continue;
+    }
+    
+    if (evt.type != UPLINK_EVT_DISCONNECTED) continue;
+    
+    if (uplinkState == UPLINK_CONNECTED) {
+      lastDisconnectReason = evt.reason;
+      uplinkLost();
+    } else if (uplinkState == UPLINK_CONNECTING && evt.reason != WIFI_REASON_ASSOC_LEAVE) {
+      // ASSOC_LEAVE is the echo of our own disconnect, not a failed attempt
+      lastDisconnectReason = evt.reason;
+      fastConnectFailed(evt.reason);
+      uplinkRetry();
+    }
+  }
+  
+  if ((long)(millis() - uplinkDeadline) < 0) return;
+  
+  if (uplinkState == UPLINK_BACKOFF) {
+    connectToPrimaryWiFi();
+  } else if (uplinkState == UPLINK_CONNECTING) {
+    LOG_WARN("Primary WiFi connect attempt timed out");
+    WiFi.disconnect();
+    fastConnectFailed(0);
+    uplinkRetry();
+  }
+}
+
+void uplinkLost() {
+  isPrimaryConnected = false;
+  ctUplinkIP = 0;
+  uplinkFailures = 0;
+  stopUplinkMonitor();
+  LOG_WARN("Connection to primary WiFi lost (reason %d). Attempting to reconnect...", lastDisconnectReason);
+  updateBLEStatus();
+  
+  // First retry right away, the AP may only have hiccupped
+  uplinkState = UPLINK_BACKOFF;
+  uplinkDeadline = millis();
+}
+
+void uplinkRetry() {
+  if (uplinkFailures < 255) uplinkFailures++;
+  
+  // This network isn't coming back soon; go down the list
+  if (uplinkFailures % UPLINK_FAILOVER_ATTEMPTS == 0 && uplinkNetworkCount() > 1) {
+    uplinkActive = (uplinkActive + 1) % uplinkNetworkCount();
+    fastConnectMiss = false;
+    LOG_WARN("Failing over to uplink %s", uplinkSSIDAt(uplinkActive));
+  }
+  
+  // Exponential backoff with jitter, so repeaters sharing a router don't retry in lockstep
+  unsigned long ceiling = UPLINK_BACKOFF_MIN_MS << (uplinkFailures < 5 ? uplinkFailures : 5);
+  if (ceiling > UPLINK_BACKOFF_MAX_MS) ceiling = UPLINK_BACKOFF_MAX_MS;
+  unsigned long wait = ceiling / 2 + esp_random() % (ceiling / 2 + 1);
+  
+  uplinkState = UPLINK_BACKOFF;
+  uplinkDeadline = millis() + wait;
+}
+
+void setupBLE() {
+  // Create the BLE Device
+  BLEDevice::init("ESP32_WiFi_Repeater");
+  
+  // Accept a large ATT MTU so a status delta usually fits one notification
+  BLEDevice::setMTU(BLE_LOCAL_MTU);
+  
+  // Create the BLE Server
+  pServer = BLEDevice::createServer();
+  pServer->setCallbacks(new ServerCallbacks());
   
   // Create the BLE Service
   BLEService *pService = pServer->createService(SERVICE_UUID);
@@ -258,7 +2300,7 @@ void setupBLE() {
                             CONFIG_CHAR_UUID,
                             BLECharacteristic::PROPERTY_WRITE
                           );
-  pConfigCharacteristic->setCallbacks(new ConfigCallbacks());
+  pConfigCharacteristic->setCallbacks(&configCallbacks);
   
   pStatusCharacteristic = pService->createCharacteristic(
                             STATUS_CHAR_UUID,
@@ -266,207 +2308,4405 @@ void setupBLE() {
                             BLECharacteristic::PROPERTY_NOTIFY
                           );
   pStatusCharacteristic->addDescriptor(new BLE2902());
+  pStatusCharacteristic->setCallbacks(new StatusCallbacks());
+  
+  pStationCharacteristic = pService->createCharacteristic(
+                             STATION_CHAR_UUID,
+                             BLECharacteristic::PROPERTY_READ |
+                             BLECharacteristic::PROPERTY_WRITE
+                           );
+  pStationCharacteristic->setCallbacks(new StationCallbacks());
   
   // Start the service
   pService->start();
   
-  // Start advertising
-  pServer->getAdvertising()->start();
-  Serial.println("BLE server started, waiting for connections...");
+  // Start advertising, fast for the first window after boot
+  bleActive = true;
+  applyCoexPolicy();
+  openAdvertisingWindow();
+  LOG_INFO("BLE server started, waiting for connections...");
   
   // Print the device address
   const uint8_t* point = esp_bt_dev_get_address();
   char bleAddress[18];
   sprintf(bleAddress, "%02X:%02X:%02X:%02X:%02X:%02X", point[0], point[1], point[2], point[3], point[4], point[5]);
-  Serial.print("BLE MAC Address: ");
-  Serial.println(bleAddress);
+  LOG_INFO("BLE MAC Address: %s", bleAddress);
+}
+
+void applyCoexPolicy() {
+#if CONFIG_SW_COEXIST_ENABLE || CONFIG_ESP32_WIFI_SW_COEXIST_ENABLE
+  esp_coex_prefer_t prefer = ESP_COEX_PREFER_WIFI;
+  if (coexPolicy == COEX_BALANCED || (coexPolicy == COEX_AUTO && deviceConnected)) prefer = ESP_COEX_PREFER_BALANCE;
+  else if (coexPolicy == COEX_BLE) prefer = ESP_COEX_PREFER_BT;
+  if (prefer == coexApplied) return;
+  if (esp_coex_preference_set(prefer) == ESP_OK) coexApplied = prefer;
+#endif
+}
+
+void openAdvertisingWindow() {
+  advFastUntil = millis() + advFastSec * 1000UL;
+  advButtonWindow = false;
+  setAdvertising(advertisingModeNow());
+}
+
+// What advertising should be doing right now, ignoring load
+uint8_t advertisingModeNow() {
+  if (deviceConnected) return ADV_CONNECTED;
+  if ((long)(millis() - advFastUntil) < 0) return ADV_FAST;
+  return advSlowMs ? ADV_SLOW : ADV_OFF;
+}
+
+uint16_t advIntervalMs() {
+  if (advMode == ADV_FAST) return ADV_FAST_INTERVAL_MS;
+  if (advMode == ADV_SLOW) return advSlowMs;
+  return 0;
+}
+
+// Estimated share of the radio BLE takes, in permille
+uint16_t bleAirtimePermille() {
+  if (advMode == ADV_CONNECTED) return BLE_CONN_EVENT_US / BLE_CONN_INTERVAL_MS;
+  uint16_t interval = advIntervalMs();
+  return interval ? ADV_EVENT_US / interval : 0;
+}
+
+void setAdvertising(uint8_t mode) {
+  if (!bleActive) return;
+  BLEAdvertising* adv = pServer->getAdvertising();
+  uint8_t previous = advMode;
+  advMode = mode;
+  if (mode == ADV_CONNECTED) return;
+  
+  adv->stop();
+  uint16_t interval = advIntervalMs();
+  if (interval == 0) {
+    if (previous != mode) LOG_INFO("BLE advertising %s", mode == ADV_SUSPENDED ? "suspended" : "stopped");
+    return;
+  }
+  // Units of 0.625 ms; a little slack lets the controller fit events around WiFi. The
+  // controller rejects either bound past the spec maximum, and the slack alone would
+  // take a 10.24 s interval there.
+  uint32_t units = std::min<uint32_t>(interval * 8 / 5, ADV_INTERVAL_MAX_UNITS);
+  adv->setMinInterval(units);
+  adv->setMaxInterval(std::min<uint32_t>(units + units / 4, ADV_INTERVAL_MAX_UNITS));
+  adv->start();
+  if (previous != mode) LOG_INFO("BLE advertising every %d ms", interval);
+}
+
+// Once a second from the supervisor: end the fast window, follow the forwarding load
+void superviseAdvertising() {
+  if (!bleActive || advMode == ADV_CONNECTED) return;
+  uint8_t target = advertisingModeNow();
+  if (target != ADV_FAST) advButtonWindow = false;
+  if (advSuspendPps != 0 && !advButtonWindow) {
+    bool busy = governorPps >= advSuspendPps;
+    bool calm = governorPps < advSuspendPps / 2;
+    if (busy || (advMode == ADV_SUSPENDED && !calm)) target = ADV_SUSPENDED;
+  }
+  if (target != advMode) setAdvertising(target);
+}
+
+void pollAdvertisingButton() {
+#if ADV_BUTTON_PIN >= 0
+  // Active low; a press reopens the fast window, even over a load suspension
+  static bool wasPressed = false;
+  bool pressed = digitalRead(ADV_BUTTON_PIN) == LOW;
+  if (pressed && !wasPressed && !deviceConnected && bleActive) {
+    LOG_INFO("Advertising button pressed");
+    openAdvertisingWindow();
+    advButtonWindow = true;
+  }
+  wasPressed = pressed;
+#endif
+}
+
+void restartBLE() {
+  // Bluedroid comes back from deinit(false), which keeps the controller memory; all of
+  // its heap goes and is taken again in one piece. Arduino's BLE wrapper never frees
+  // the old server objects, a few hundred bytes per restart that the cooldown bounds.
+  if (!bleActive) return;
+  uint32_t before = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  bleActive = false;
+  deviceConnected = false;
+  advMode = ADV_OFF;
+  statusFormat = STATUS_FORMAT_JSON;
+  BLEDevice::deinit(false);
+  pServer = NULL;
+  pStatusCharacteristic = NULL;
+  pStationCharacteristic = NULL;
+  setupBLE();
+  LOG_INFO("Health: BLE restarted, largest free block %lu -> %lu bytes", (unsigned long)before,
+           (unsigned long)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+// {"cmd":"bleOff"}: stop BLE until the next boot and hand its memory to forwarding.
+// Bluedroid can't be brought back once its memory is released.
+void shutdownBLE() {
+  if (!bleActive) return;
+  if (configKey[0] == 0) {
+    LOG_WARN("Set a configKey before turning BLE off");
+    return;
+  }
+  
+  uint32_t before = ESP.getFreeHeap();
+  bleActive = false;
+  deviceConnected = false;
+  advMode = ADV_OFF;
+  BLEDevice::deinit(true);
+  pServer = NULL;
+  pStatusCharacteristic = NULL;
+  pStationCharacteristic = NULL;
+  applyCoexPolicy();
+  LOG_INFO("BLE off, %lu bytes freed", (unsigned long)(ESP.getFreeHeap() - before));
+  
+  configEndpointStart();
+  growPacketPool();
+  applyMaxClients();
+}
+
+const char* coexPolicyName(uint8_t policy) {
+  switch (policy) {
+    case COEX_WIFI: return "wifi";
+    case COEX_BALANCED: return "balanced";
+    case COEX_BLE: return "ble";
+    default: return "auto";
+  }
 }
 
+const char* const advModeNames[] = { "fast", "slow", "off", "suspended", "connected" };
+
 void setupAccessPoint() {
-  Serial.println("Setting up Access Point...");
+  LOG_INFO("Setting up Access Point...");
   
   // Configure the access point with a static IP
   WiFi.softAPConfig(apIP, apIP, apNetmask);
   
   // Start the access point
-  if (WiFi.softAP(apSSID.c_str(), apPassword.c_str(), apChannel, 0, maxClients)) {
-    Serial.print("Access Point established! SSID: ");
-    Serial.println(apSSID);
-    Serial.print("IP address: ");
-    Serial.println(WiFi.softAPIP());
+  effectiveMaxClients = budgetMaxClients();
+  activeAPChannel = desiredAPChannel();
+  if (WiFi.softAP(apSSID.c_str(), apPassword.c_str(), activeAPChannel, 0, effectiveMaxClients)) {
+    LOG_INFO("Access Point established! SSID: %s", apSSID.c_str());
+    LOG_INFO("IP address: %s", WiFi.softAPIP().toString().c_str());
   } else {
-    Serial.println("Failed to create Access Point!");
+    LOG_ERROR("Failed to create Access Point!");
+  }
+  
+  // Route AP client traffic out through the uplink
+  setupForwarding();
+}
+
+uint8_t desiredAPChannel() {
+  // The cached uplink channel is where the radio will end up once the STA connects
+  FastConnectEntry* cached = fastConnectEntry(false);
+  if (autoChannel && cached != NULL && cached->channel >= 1 && cached->channel <= 13) {
+    return cached->channel;
   }
+  return apChannel;
 }
 
-void connectToPrimaryWiFi() {
-  Serial.print("Connecting to primary WiFi network ");
-  Serial.println(primarySSID);
+void checkChannelAlignment() {
+  uint8_t primary;
+  wifi_second_chan_t second;
+  if (!autoChannel || esp_wifi_get_channel(&primary, &second) != ESP_OK) return;
+  if (primary == activeAPChannel) return;
   
-  // Disconnect if previously connected
-  WiFi.disconnect();
-  delay(100);
+  // The uplink moved (reconnect elsewhere, or it followed a CSA). The radio is already
+  // there, so there is nobody left on the old channel to announce to.
+  LOG_INFO("Uplink now on channel %d", primary);
+  alignAPChannel(primary, false);
+  recordFastConnect();
+}
+
+void alignAPChannel(uint8_t channel, bool announce) {
+  if (channel < 1 || channel > 13 || channel == activeAPChannel || channel == csaChannel) return;
+  
+  if (announce && WiFi.softAPgetStationNum() > 0) {
+    // Stations get CSA_SWITCH_COUNT beacon intervals of warning. The supervisor sends
+    // the announcements and makes the move as they come due; it doesn't wait them out.
+    csaChannel = channel;
+    csaCount = CSA_SWITCH_COUNT;
+    csaNextAt = millis();
+    superviseChannelSwitch();
+    return;
+  }
+  csaChannel = 0;  // A move made now replaces one still being announced
+  moveAPChannel(channel);
+}
+
+// Supervisor, every wakeup: the next step of an announced channel move
+void superviseChannelSwitch() {
+  if (csaChannel == 0 || (long)(millis() - csaNextAt) < 0) return;
+  if (csaCount > 0) {
+    announceChannelSwitch(csaChannel, csaCount--);
+    csaNextAt += CSA_INTERVAL_MS;
+    return;
+  }
+  uint8_t channel = csaChannel;
+  csaChannel = 0;
+  moveAPChannel(channel);
+}
+
+void moveAPChannel(uint8_t channel) {
+  wifi_config_t conf;
+  esp_wifi_get_config(WIFI_IF_AP, &conf);
+  conf.ap.channel = channel;
+  if (esp_wifi_set_config(WIFI_IF_AP, &conf) == ESP_OK) {
+    LOG_INFO("AP moved from channel %d to %d", activeAPChannel, channel);
+    activeAPChannel = channel;
+    updateBLEStatus();
+  }
+}
+
+void announceChannelSwitch(uint8_t channel, uint8_t count) {
+  // Broadcast 802.11h Channel Switch Announcement action frames so associated stations
+  // follow the AP instead of timing out and rescanning
+  uint8_t frame[] = {
+    0xD0, 0x00, 0x00, 0x00,                           // Action, duration
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,               // DA: broadcast
+    0, 0, 0, 0, 0, 0,                                 // SA: our AP MAC
+    0, 0, 0, 0, 0, 0,                                 // BSSID: our AP MAC
+    0x00, 0x00,                                       // Sequence, filled by the driver
+    0x00, 0x04,                                       // Spectrum management, CSA
+    0x25, 0x03, 0x01, channel, count                  // CSA element: stop TX, new channel, count
+  };
+  esp_wifi_get_mac(WIFI_IF_AP, frame + 10);
+  memcpy(frame + 16, frame + 10, 6);
+  esp_wifi_80211_tx(WIFI_IF_AP, frame, sizeof(frame), true);
+}
+
+// Internal heap the packet pool may take: what is left above the floor after the
+// per-client allowance and the NAPT table, unless lwIP already holds the table
+static long poolHeapSpare() {
+  long spare = (long)ESP.getFreeHeap() - NAPT_HEAP_FLOOR - (long)maxClients * NAPT_CLIENT_BUDGET;
+  if (!naptEnabled) spare -= (long)NAPT_TABLE_SIZE * NAPT_ENTRY_BYTES;
+  return spare;
+}
+
+void setupPacketPool() {
+  size_t blockSize = sizeof(PoolBlock);
+  uint32_t wanted = 0;
+  if (psramFound()) {
+    wanted = POOL_BASE_BUFFERS + maxClients * POOL_CLIENT_BUFFERS_PSRAM;
+    if (wanted > POOL_MAX_BUFFERS) wanted = POOL_MAX_BUFFERS;
+    poolBlocks = (PoolBlock*)heap_caps_malloc(wanted * blockSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    poolInPSRAM = poolBlocks != NULL;
+  }
   
-  // Attempt to connect to the WiFi network
-  WiFi.begin(primarySSID.c_str(), primaryPassword.c_str());
+  if (poolBlocks == NULL) {
+    // Internal RAM: leave what NAPT and the client budget need on top of the floor
+    wanted = POOL_BASE_BUFFERS + maxClients * POOL_CLIENT_BUFFERS;
+    long spare = poolHeapSpare();
+    long affordable = spare > 0 ? spare / (long)blockSize : 0;
+    if (affordable < (long)wanted) wanted = affordable;
+    if (wanted >= POOL_MIN_BUFFERS) {
+      poolBlocks = (PoolBlock*)heap_caps_malloc(wanted * blockSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+  }
   
-  // Wait up to 20 seconds for connection
-  int connectionAttempts = 0;
-  while (WiFi.status() != WL_CONNECTED && connectionAttempts < 20) {
-    delay(1000);
-    Serial.print(".");
-    connectionAttempts++;
+  if (poolBlocks != NULL) {
+    poolNext = (uint16_t*)heap_caps_malloc(POOL_MAX_BUFFERS * sizeof(uint16_t), MALLOC_CAP_INTERNAL);
+    if (poolNext == NULL) {
+      heap_caps_free(poolBlocks);
+      poolBlocks = NULL;
+    }
+  }
+  if (poolBlocks == NULL) {
+    LOG_WARN("Packet pool: no memory, forwarding falls back to heap pbufs");
+    return;
   }
   
-  // Check if connected
-  if (WiFi.status() == WL_CONNECTED) {
-    isPrimaryConnected = true;
-    Serial.println("\nConnected to primary WiFi!");
-    printWiFiStatus();
-  } else {
-    isPrimaryConnected = false;
-    Serial.println("\nFailed to connect to primary WiFi. Will retry later.");
+  poolSize = wanted;
+  for (uint16_t i = 0; i < poolSize; i++) {
+    poolBlocks[i].index = i;
+    poolNext[i] = (i + 1 < poolSize) ? i + 1 : POOL_EMPTY;
   }
+  poolHead.store(0, std::memory_order_release);
   
-  lastReconnectAttempt = millis();
+  LOG_INFO("Packet pool: %d x %d bytes in %s", poolSize, (int)blockSize, poolInPSRAM ? "PSRAM" : "internal RAM");
 }
 
-void applySettings(bool reconnectWifi) {
-  // Apply power saving settings
-  applyPowerSavingSettings();
-  
-  // Reconfigure AP if needed
-  WiFi.softAPConfig(apIP, apIP, apNetmask);
-  WiFi.softAP(apSSID.c_str(), apPassword.c_str(), apChannel, 0, maxClients);
+// Hand memory freed at runtime to the pool: one extra segment in internal RAM, as large
+// as the heap budget allows. Blocks are pushed onto the live free list, so this is
+// safe while forwarding runs.
+void growPacketPool() {
+  if (poolExtra != NULL || poolNext == NULL || poolInPSRAM) return;
+  size_t blockSize = sizeof(PoolBlock);
+  long spare = poolHeapSpare();
+  long extra = spare > 0 ? spare / (long)blockSize : 0;
+  if (extra > POOL_MAX_BUFFERS - poolSize) extra = POOL_MAX_BUFFERS - poolSize;
+  if (extra < POOL_MIN_BUFFERS) return;
   
-  // Reconnect to primary WiFi if credentials changed
-  if (reconnectWifi) {
-    connectToPrimaryWiFi();
+  poolExtra = (PoolBlock*)heap_caps_malloc(extra * blockSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (poolExtra == NULL) return;
+  poolGrownFrom = poolSize;
+  for (uint16_t i = 0; i < extra; i++) {
+    poolExtra[i].index = poolGrownFrom + i;
+    poolPush(poolGrownFrom + i);
+  }
+  poolSize += extra;
+  LOG_INFO("Packet pool grown by %ld to %d buffers", extra, poolSize);
+}
+
+int budgetMaxClients() {
+  // Keep the NAPT table plus a per-station allowance above the heap floor
+  long available = (long)ESP.getFreeHeap() - NAPT_HEAP_FLOOR;
+  if (!naptEnabled) {
+    available -= (long)NAPT_TABLE_SIZE * NAPT_ENTRY_BYTES;
   }
   
-  // Update BLE status
-  updateBLEStatus();
+  int affordable = available > 0 ? available / NAPT_CLIENT_BUDGET : 0;
+  if (affordable < 1) affordable = 1;
+  
+  if (affordable < maxClients) {
+    LOG_WARN("Heap budget limits AP to %d clients", affordable);
+    return affordable;
+  }
+  return maxClients;
 }
 
-void applyPowerSavingSettings() {
-  if (powerSavingEnabled) {
-    // Set power save mode
-    esp_wifi_set_ps(powerSaveMode);
-    
-    // Set listen interval (advanced)
-    wifi_config_t conf;
-    esp_wifi_get_config(WIFI_IF_STA, &conf);
-    conf.sta.listen_interval = listenInterval;
-    esp_wifi_set_config(WIFI_IF_STA, &conf);
-    
-    Serial.println("Power saving mode applied");
+void setupForwarding() {
+  armRxHooks();
+  
+  if (forwardMode == FORWARD_BRIDGE) {
+    setupBridge();
   } else {
-    // Disable power saving
-    esp_wifi_set_ps(WIFI_PS_NONE);
-    Serial.println("Power saving disabled");
+    setupNAPT();
   }
 }
 
-void updateBLEStatus() {
-  if (!deviceConnected) return;
+void setupBridge() {
+  esp_netif_t* apNetif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
+  
+  // Clients take their leases from the upstream DHCP server over the bridge
+  if (apNetif != NULL) {
+    esp_netif_dhcps_stop(apNetif);
+  }
+  dhcpStop();
+  if (naptEnabled) {
+    ip_napt_enable(apIP, 0);
+    naptEnabled = false;
+  }
+  memset(bridgeHosts, 0, sizeof(bridgeHosts));
+  LOG_INFO("L2 bridge mode enabled");
+}
+
+void setupNAPT() {
+  esp_netif_t* apNetif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
+  esp_netif_t* staNetif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  if (apNetif == NULL || staNetif == NULL) {
+    LOG_WARN("NAPT: WiFi interfaces not ready");
+    return;
+  }
   
-  DynamicJsonDocument statusDoc(1024);
+  // AP clients lease from our own server, which offers the DNS forwarder (or the
+  // uplink's resolver) itself; the stock one must not also answer on port 67
+  esp_netif_dhcps_stop(apNetif);
+  dhcpStart();
   
-  // WiFi Status
-  statusDoc["primaryConnected"] = (WiFi.status() == WL_CONNECTED);
-  statusDoc["primarySSID"] = primarySSID;
-  statusDoc["primaryIP"] = WiFi.localIP().toString();
-  statusDoc["primaryRSSI"] = WiFi.RSSI();
-  statusDoc["apSSID"] = apSSID;
-  statusDoc["apIP"] = WiFi.softAPIP().toString();
-  statusDoc["connectedClients"] = WiFi.softAPgetStationNum();
+  if (naptEnabled) return;
   
-  // Power saving status
-  statusDoc["powerSaving"] = powerSavingEnabled;
-  switch (powerSaveMode) {
-    case WIFI_PS_NONE: statusDoc["powerMode"] = 0; break;
-    case WIFI_PS_MIN_MODEM: statusDoc["powerMode"] = 1; break;
-    case WIFI_PS_MAX_MODEM: statusDoc["powerMode"] = 2; break;
+  // lwIP allocates the translation table on first enable; refuse if that would breach the floor
+  uint32_t tableBytes = (uint32_t)NAPT_TABLE_SIZE * NAPT_ENTRY_BYTES;
+  if (ESP.getFreeHeap() < NAPT_HEAP_FLOOR + tableBytes) {
+    LOG_WARN("NAPT: not enough heap for translation table, forwarding disabled");
+    return;
   }
-  statusDoc["listenInterval"] = listenInterval;
   
-  // System info
-  statusDoc["freeHeap"] = ESP.getFreeHeap();
-  statusDoc["uptime"] = millis() / 1000;
+  ip_napt_enable(apIP, 1);
+  naptEnabled = true;
+  LOG_INFO("NAPT enabled, table size: %d, port maps: %d", NAPT_TABLE_SIZE, NAPT_PORTMAP_MAX);
+}
+
+// Lower the MSS option of a TCP SYN in place. Called from the RX hooks for every
+// frame, so everything that isn't an unfragmented IPv4 SYN leaves on the first checks.
+static void clampMSS(uint8_t* frame, uint16_t len) {
+  if (frameType(frame) != FRAME_TYPE_IPV4) return;
+  uint8_t* ip = frame + FRAME_HDR_LEN;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  if (ip[9] != 6 || (readBE16(ip + 6) & 0x1FFF) != 0) return;  // TCP, first fragment
+  if (len < FRAME_HDR_LEN + ihl + 20) return;
   
-  // Convert to JSON string
-  String statusJson;
-  serializeJson(statusDoc, statusJson);
+  uint8_t* tcp = ip + ihl;
+  if (!(tcp[13] & 0x02)) return;  // SYN
+  uint8_t dataOffset = (tcp[12] >> 4) * 4;
+  if (dataOffset <= 20 || len < FRAME_HDR_LEN + ihl + dataOffset) return;
   
-  // Update characteristic
-  pStatusCharacteristic->setValue(statusJson.c_str());
-  pStatusCharacteristic->notify();
+  for (uint8_t opt = 20; opt < dataOffset; ) {
+    uint8_t kind = tcp[opt];
+    if (kind == 0) break;
+    if (kind == 1) {
+      opt++;
+      continue;
+    }
+    if (opt + 1 >= dataOffset) break;
+    uint8_t optLen = tcp[opt + 1];
+    if (optLen < 2 || opt + optLen > dataOffset) break;
+    if (kind == 2 && optLen == 4) {
+      if (readBE16(tcp + opt + 2) > mssClamp) {
+        csumRewrite16(tcp, tcp + 16, opt + 2, mssClamp);
+        mssClamped.fetch_add(1, std::memory_order_relaxed);
+      }
+      return;
+    }
+    opt += optLen;
+  }
 }
 
-void printWiFiStatus() {
-  Serial.print("SSID: ");
-  Serial.println(WiFi.SSID());
-  
-  Serial.print("IP Address: ");
-  Serial.println(WiFi.localIP());
+static BridgeHost* bridgeLookup(uint32_t ip) {
+  for (int i = 0; i < BRIDGE_HOSTS_MAX; i++) {
+    if (bridgeHosts[i].ip == ip) return &bridgeHosts[i];
+  }
+  return NULL;
+}
+
+static void bridgeLearn(uint32_t ip, const uint8_t* mac) {
+  if (ip == 0 || ip == 0xFFFFFFFF) return;
   
-  Serial.print("Signal Strength (RSSI): ");
-  Serial.print(WiFi.RSSI());
-  Serial.println(" dBm");
+  BridgeHost* host = bridgeLookup(ip);
+  if (host == NULL) {
+    // Take a free slot, or recycle the stalest one
+    host = &bridgeHosts[0];
+    for (int i = 0; i < BRIDGE_HOSTS_MAX; i++) {
+      if (bridgeHosts[i].ip == 0) { host = &bridgeHosts[i]; break; }
+      if ((int32_t)(bridgeHosts[i].lastSeen - host->lastSeen) < 0) host = &bridgeHosts[i];
+    }
+    host->ip = ip;
+  }
+  memcpy(host->mac, mac, 6);
+  host->lastSeen = millis();
+}
+
+// Packet pool. Lock-free so it can be used from the WiFi, lwIP and forwarding tasks.
+static inline PoolBlock* poolBlockAt(uint16_t index) {
+  return index < poolGrownFrom ? &poolBlocks[index] : &poolExtra[index - poolGrownFrom];
+}
+
+static PoolBlock* poolAlloc() {
+  uint32_t head = poolHead.load(std::memory_order_acquire);
+  for (;;) {
+    uint16_t index = head & 0xFFFF;
+    if (index == POOL_EMPTY) {
+      poolMisses.fetch_add(1, std::memory_order_relaxed);
+      return NULL;
+    }
+    uint32_t next = ((head + 0x10000) & 0xFFFF0000) | poolNext[index];
+    if (poolHead.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+      uint32_t used = poolInUse.fetch_add(1, std::memory_order_relaxed) + 1;
+      uint32_t high = poolHighWater.load(std::memory_order_relaxed);
+      while (used > high && !poolHighWater.compare_exchange_weak(high, used, std::memory_order_relaxed)) {
+      }
+      return poolBlockAt(index);
+    }
+  }
+}
+
+void poolPush(uint16_t index) {
+  uint32_t head = poolHead.load(std::memory_order_relaxed);
+  do {
+    poolNext[index] = head & 0xFFFF;
+  } while (!poolHead.compare_exchange_weak(head, ((head + 0x10000) & 0xFFFF0000) | index,
+                                           std::memory_order_release, std::memory_order_relaxed));
+}
+
+static void poolFree(PoolBlock* block) {
+  poolPush(block->index);
+  poolInUse.fetch_sub(1, std::memory_order_relaxed);
+}
+
+static inline PoolBlock* poolBlockOf(const uint8_t* frame) {
+  return (PoolBlock*)(frame - offsetof(PoolBlock, frame));
+}
+
+static void poolPbufFree(struct pbuf* p) {
+  poolFree((PoolBlock*)p);
+}
+
+// Copy a received frame into a pool block and wrap it as a pbuf lwIP can forward and
+// free without touching the heap. The driver buffer is released at once.
+static struct pbuf* poolWrapRx(void* buffer, uint16_t len, void* eb) {
+  if (poolSize == 0 || len > sizeof(PoolBlock::frame)) return NULL;
+  PoolBlock* block = poolAlloc();
+  if (block == NULL) return NULL;
   
-  Serial.print("MAC Address: ");
-  Serial.println(WiFi.macAddress());
+  memcpy(block->frame, buffer, len);
+  esp_wifi_internal_free_rx_buffer(eb);
+  memset(&block->pbuf, 0, sizeof(block->pbuf));
+  block->pbuf.custom_free_function = poolPbufFree;
+  return pbuf_alloced_custom(PBUF_RAW, len, PBUF_RAM, &block->pbuf, block->frame, sizeof(block->frame));
 }
 
-void printStatus() {
-  Serial.println("\n--- Status Update ---");
+// Hand a frame to lwIP or to the driver, accounting for it on the way
+static esp_err_t deliverLocal(esp_netif_t* netif, void* buffer, uint16_t len, void* eb) {
+  struct netif* lwipNetif = (netif == apNetifHandle) ? apLwipNetif : staLwipNetif;
+  if (lwipNetif != NULL && netif_is_up(lwipNetif)) {
+    struct pbuf* p = poolWrapRx(buffer, len, eb);
+    if (p != NULL) {
+      if (lwipNetif->input(p, lwipNetif) != ERR_OK) {
+        pbuf_free(p);
+        metricsCount(localMetrics().drops[DROP_PBUF_ALLOC], 1);
+      }
+      return ESP_OK;
+    }
+  }
   
-  // Primary network status
-  Serial.print("Primary WiFi connection: ");
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("Connected");
-    Serial.print("IP: ");
-    Serial.print(WiFi.localIP());
-    Serial.print(", RSSI: ");
-    Serial.print(WiFi.RSSI());
-    Serial.println(" dBm");
-  } else {
-    Serial.println("Disconnected");
+  // Pool empty or not set up: let esp_netif take a heap pbuf, as before.
+  // It frees the buffer itself when it cannot get one.
+  esp_err_t err = esp_netif_receive(netif, buffer, len, eb);
+  if (err != ESP_OK) {
+    metricsCount(localMetrics().drops[DROP_PBUF_ALLOC], 1);
+  }
+  return err;
+}
+
+// Charges a frame to an AP station's telemetry slot. Stations the supervisor hasn't
+// seen in the driver's list yet (and group traffic) aren't counted.
+static inline void stationCount(const uint8_t* mac, bool fromStation, uint16_t len) {
+  if (mac[0] & 0x01) return;
+  for (uint8_t i = 0; i < STATION_SLOTS; i++) {
+    StationStat& st = stationStats[i];
+    if (!st.used.load(std::memory_order_acquire) || memcmp(st.mac, mac, 6) != 0) continue;
+    if (fromStation) {
+      st.rxBytes.fetch_add(len, std::memory_order_relaxed);
+      st.rxPackets.fetch_add(1, std::memory_order_relaxed);
+      st.lastSeen.store(millis(), std::memory_order_relaxed);
+    } else {
+      st.txBytes.fetch_add(len, std::memory_order_relaxed);
+      st.txPackets.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
   }
+}
+
+static int forwardTx(wifi_interface_t ifx, uint8_t* frame, uint16_t len, uint32_t rxTime, bool retryable = false) {
+  uint8_t dir = (ifx == WIFI_IF_STA) ? DIR_UP : DIR_DOWN;
+  ForwardMetrics& m = localMetrics();
   
-  // Access point status
-  Serial.print("Access Point: ");
-  Serial.print(apSSID);
-  Serial.print(", Connected clients: ");
-  Serial.println(WiFi.softAPgetStationNum());
+  uint32_t start = esp_timer_get_time();
+  int err = esp_wifi_internal_tx(ifx, frame, len);
+  uint32_t end = esp_timer_get_time();
   
-  // Power saving status
-  Serial.print("Power saving: ");
-  Serial.println(powerSavingEnabled ? "Enabled" : "Disabled");
-  Serial.print("Power save mode: ");
-  switch (powerSaveMode) {
-    case WIFI_PS_NONE: Serial.println("None"); break;
-    case WIFI_PS_MIN_MODEM: Serial.println("Minimum"); break;
-    case WIFI_PS_MAX_MODEM: Serial.println("Maximum"); break;
+  // A full driver queue is not a drop when the caller keeps the frame to retry
+  if (err == ESP_ERR_NO_MEM && retryable) return err;
+  
+  metricsLatency(STAGE_TX, end - start);
+  metricsLatency(STAGE_TOTAL, end - rxTime);
+  if (err != 0) {
+    metricsCount(m.drops[DROP_TX_FAILED], 1);
+    return err;
   }
+  metricsCount(m.txPackets[dir], 1);
+  metricsCount(m.txBytes[dir], len);
+  if (ifx == WIFI_IF_AP) stationCount(frame, false, len);
+  return err;
+}
+
+// Fast queue candidates. A DSCP mark covers the whole flow, so the flow stays in one
+// queue. A pure ACK may pass the flow's data, which TCP takes as it would on any
+// path. A DNS answer is the whole exchange.
+static inline bool egressInteractive(const uint8_t* frame, uint16_t len) {
+  if (frameType(frame) != FRAME_TYPE_IPV4 || len < FRAME_HDR_LEN + 20) return false;
+  const uint8_t* ip = frame + FRAME_HDR_LEN;
+  if ((ip[1] >> 2) >= EGRESS_PRIORITY_DSCP) return true;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  uint16_t ipLen = readBE16(ip + 2);
+  if (ihl < 20 || (readBE16(ip + 6) & 0x1FFF) != 0 || len < FRAME_HDR_LEN + ihl + 8 || ipLen < ihl + 8) return false;
+  const uint8_t* l4 = ip + ihl;
+  if (ip[9] == 17) return readBE16(l4) == 53;
+  if (ip[9] != 6 || len < FRAME_HDR_LEN + ihl + 20) return false;
   
-  // BLE status
-  Serial.print("BLE connection: ");
-  Serial.println(deviceConnected ? "Connected" : "Disconnected");
+  // ACK only (ECE/CWR allowed), and the segment ends with its header
+  uint8_t dataOffset = (l4[12] >> 4) * 4;
+  return (l4[13] & 0x3F) == 0x10 && ipLen == ihl + dataOffset;
+}
+
+static uint16_t egressRateFor(const uint8_t* mac) {
+  for (uint8_t i = 0; i < EGRESS_RATE_RULES; i++) {
+    if (rateRules[i].kbps != 0 && memcmp(rateRules[i].mac, mac, 6) == 0) return rateRules[i].kbps;
+  }
+  return clientRateKbps;
+}
+
+static inline int32_t egressBurst(uint16_t kbps) {
+  int32_t burst = (int32_t)kbps * EGRESS_BURST_MS / 8;
+  return burst > 2 * EGRESS_QUANTUM ? burst : 2 * EGRESS_QUANTUM;
+}
+
+// Slot for a destination, claiming a free or long-idle one. Caller holds egressLock.
+static EgressStation* egressStationFor(const uint8_t* mac) {
+  EgressStation* spare = NULL;
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < EGRESS_STATIONS; i++) {
+    EgressStation& st = egressStations[i];
+    if (st.used && memcmp(st.mac, mac, 6) == 0) return &st;
+    if (spare == NULL && (!st.used || (now - st.lastActive > EGRESS_IDLE_MS &&
+                                       st.fast.size() == 0 && st.bulk.size() == 0))) {
+      spare = &st;
+    }
+  }
+  if (spare != NULL) {
+    memcpy(spare->mac, mac, 6);
+    spare->used = true;
+    spare->midTurn = false;
+    spare->deficit = 0;
+    spare->rateKbps = egressRateFor(mac);
+    spare->tokens = egressBurst(spare->rateKbps);
+    spare->refillAt = esp_timer_get_time();
+    spare->txBytes.store(0, std::memory_order_relaxed);
+    spare->drops.store(0, std::memory_order_relaxed);
+    spare->sampledBytes = 0;
+    spare->kbps = 0;
+  }
+  return spare;
+}
+
+static void egressRelease(const EgressFrame& f) {
+  if (f.flags & EGRESS_HELD_RX) {
+    esp_wifi_internal_free_rx_buffer(f.eb);
+    egressHeldRx.fetch_sub(1, std::memory_order_relaxed);
+  } else {
+    poolFree(poolBlockOf(f.data));
+    egressPooled.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+// Queue a unicast frame for an AP station. Returns false when the scheduler doesn't
+// take it (off, broadcast, no slot) and the caller should send it directly; once it
+// returns true the frame is owned by the queue, including when it gets dropped.
+static bool egressEnqueue(uint8_t* frame, uint16_t len, void* rxEb, uint8_t flags, uint32_t rxTime) {
+  if (!fairQueue || len < FRAME_HDR_LEN || (frame[0] & 0x01)) return false;
   
-  // System stats
-  Serial.print("Free heap: ");
-  Serial.println(ESP.getFreeHeap());
+  // Hold on to a few driver buffers to save the copy, but never enough to starve RX.
+  // In the bridge the frame is the RX buffer itself.
+  bool interactive = egressInteractive(frame, len);
+  EgressFrame f = { frame, rxEb, len, flags, rxTime };
+  if (rxEb != NULL && egressHeldRx.load(std::memory_order_relaxed) < EGRESS_HELD_RX_MAX) {
+    f.flags |= EGRESS_HELD_RX;
+  } else {
+    // Without a pool (or with no block left) the frame goes out unscheduled
+    if (poolSize == 0 || len > sizeof(PoolBlock::frame)) return false;
+    if (egressPooled.load(std::memory_order_relaxed) >= poolSize / EGRESS_POOL_SHARE) {
+      metricsCount(localMetrics().drops[DROP_QUEUE_FULL], 1);
+      if (rxEb != NULL) esp_wifi_internal_free_rx_buffer(rxEb);
+      return true;
+    }
+    PoolBlock* block = poolAlloc();
+    if (block == NULL) return false;
+    f.data = block->frame;
+    memcpy(f.data, frame, len);
+    f.eb = NULL;
+    if (rxEb != NULL) esp_wifi_internal_free_rx_buffer(rxEb);
+  }
   
-  // System uptime
-  Serial.print("Uptime: ");
-  unsigned long uptime = millis() / 1000;
-  Serial.print(uptime / 3600); // hours
-  Serial.print("h ");
-  Serial.print((uptime % 3600) / 60); // minutes
-  Serial.print("m ");
-  Serial.print(uptime % 60); // seconds
-  Serial.println("s");
-  
-  Serial.println("--------------------");
+  taskENTER_CRITICAL(&egressLock);
+  EgressStation* st = egressStationFor(f.data);
+  bool queued = false;
+  if (st != NULL) {
+    if (f.flags & EGRESS_HELD_RX) egressHeldRx.fetch_add(1, std::memory_order_relaxed);
+    else egressPooled.fetch_add(1, std::memory_order_relaxed);
+    queued = interactive ? st->fast.push(f) : st->bulk.push(f);
+    st->lastActive = millis();
+  }
+  taskEXIT_CRITICAL(&egressLock);
+  
+  if (st == NULL) {
+    // Every slot busy; only possible past EGRESS_STATIONS clients. Send it unscheduled.
+    if (f.flags & EGRESS_HELD_RX) return false;
+    if (flags & EGRESS_BRIDGED) forwardTx(WIFI_IF_AP, f.data, len, rxTime);
+    else if (esp_wifi_internal_tx(WIFI_IF_AP, f.data, len) == ESP_OK) stationCount(f.data, false, len);
+    poolFree(poolBlockOf(f.data));
+    return true;
+  }
+  if (!queued) {
+    st->drops.fetch_add(1, std::memory_order_relaxed);
+    metricsCount(localMetrics().drops[DROP_QUEUE_FULL], 1);
+    egressRelease(f);
+    return true;
+  }
+  xTaskNotifyGive(forwardTaskHandle);
+  return true;
+}
+
+// Token bucket check for a capped station; charges the frame when it may go
+static bool egressAdmit(EgressStation& st, uint16_t len, uint32_t now) {
+  if (st.rateKbps == 0) return true;
+  uint32_t earned = (uint64_t)(now - st.refillAt) * st.rateKbps / 8000;
+  if (earned > 0) {
+    int32_t burst = egressBurst(st.rateKbps);
+    st.tokens = (st.tokens + (int64_t)earned > burst) ? burst : st.tokens + earned;
+    st.refillAt = now;
+  }
+  if (st.tokens < len) return false;
+  st.tokens -= len;
+  return true;
+}
+
+// Hands the head frame of a queue to the driver. False if the driver is full and the
+// frame has to stay where it is.
+template <typename Q>
+static bool egressSend(EgressStation& st, Q& queue) {
+  EgressFrame* f = queue.front();
+  int err;
+  if (f->flags & EGRESS_BRIDGED) {
+    err = forwardTx(WIFI_IF_AP, f->data, f->len, f->rxTime, true);
+  } else {
+    // lwIP's own output; it does its own accounting
+    err = esp_wifi_internal_tx(WIFI_IF_AP, f->data, f->len);
+    if (err == ESP_OK) stationCount(f->data, false, f->len);
+  }
+  if (err == ESP_ERR_NO_MEM) {
+    if (st.rateKbps != 0) st.tokens += f->len;
+    return false;
+  }
+  if (err == ESP_OK) st.txBytes.fetch_add(f->len, std::memory_order_relaxed);
+  EgressFrame done = *f;
+  queue.pop(done);
+  egressRelease(done);
+  return true;
+}
+
+// One scheduling pass in the forwarding task. Returns true while frames are left
+// that are waiting on the driver or on a rate cap, so the caller polls again soon.
+static bool egressService() {
+  uint32_t now = esp_timer_get_time();
+  bool backlog = false;
+  
+  // Fast queues first, one frame per station per round so no one monopolises them
+  bool sent;
+  do {
+    sent = false;
+    for (uint8_t i = 0; i < EGRESS_STATIONS; i++) {
+      EgressStation& st = egressStations[i];
+      EgressFrame* f = st.fast.front();
+      if (f == NULL) continue;
+      if (!egressAdmit(st, f->len, now)) {
+        backlog = true;
+        continue;
+      }
+      if (!egressSend(st, st.fast)) return true;
+      sent = true;
+    }
+  } while (sent);
+  
+  // Bulk queues by deficit round robin
+  for (uint8_t n = 0; n < EGRESS_STATIONS; n++) {
+    EgressStation& st = egressStations[egressNext];
+    EgressFrame* f = st.bulk.front();
+    if (f == NULL) {
+      st.deficit = 0;
+      st.midTurn = false;
+      egressNext = (egressNext + 1) % EGRESS_STATIONS;
+      continue;
+    }
+    if (!st.midTurn) st.deficit += EGRESS_QUANTUM;
+    st.midTurn = true;
+    
+    bool limited = false;
+    while (f != NULL && f->len <= st.deficit) {
+      if (!egressAdmit(st, f->len, now)) {
+        limited = true;
+        break;
+      }
+      uint16_t len = f->len;
+      if (!egressSend(st, st.bulk)) return true;  // Resume this turn next time
+      st.deficit -= len;
+      f = st.bulk.front();
+    }
+    
+    if (f == NULL) st.deficit = 0;
+    else backlog = true;
+    // A capped station waiting for tokens keeps its turn instead of banking quanta
+    st.midTurn = limited;
+    egressNext = (egressNext + 1) % EGRESS_STATIONS;
+  }
+  return backlog;
+}
+
+// The AP netif's driver transmit, so lwIP output (NAT replies, DHCP, our own traffic)
+// goes through the scheduler too. Called in the lwIP task; the buffer is only ours
+// until we return, hence the copy.
+static esp_err_t apTransmit(void* h, void* buffer, size_t len) {
+  if (egressEnqueue((uint8_t*)buffer, len, NULL, 0, esp_timer_get_time())) return ESP_OK;
+  esp_err_t err = esp_wifi_internal_tx(WIFI_IF_AP, buffer, len);
+  if (err == ESP_OK) stationCount((const uint8_t*)buffer, false, len);
+  return err;
+}
+
+static esp_err_t apTransmitWrap(void* h, void* buffer, size_t len, void* netstackBuffer) {
+  return apTransmit(h, buffer, len);
+}
+
+static void apFreeRxBuffer(void* h, void* buffer) {
+  esp_wifi_internal_free_rx_buffer(buffer);
+}
+
+// ICMP destination unreachable or time exceeded quoting a TCP/UDP datagram: the quoted
+// IP header, or NULL. ipLen bounds the quote, which has to reach the ports.
+static inline const uint8_t* ctQuoted(const uint8_t* ip, uint16_t ipLen, uint8_t ihl) {
+  const uint8_t* icmp = ip + ihl;
+  if (ihl < 20 || ipLen < ihl + 8 + 20 + 8 || (icmp[0] != 3 && icmp[0] != 11)) return NULL;
+  const uint8_t* inner = icmp + 8;
+  uint8_t innerIhl = (inner[0] & 0x0F) * 4;
+  if ((inner[0] >> 4) != 4 || innerIhl < 20 || ipLen < ihl + 8 + innerIhl + 8) return NULL;
+  return (inner[9] == 6 || inner[9] == 17) ? inner : NULL;
+}
+
+// NAT frames the conntrack fast path may take: unicast IPv4 TCP/UDP from a client to
+// somewhere other than the repeater, or to our uplink address on a conntrack port,
+// along with ICMP errors about those. Called per frame in the WiFi task, so it only
+// looks at headers.
+static inline bool ctCandidate(wifi_interface_t ifx, const uint8_t* frame, uint16_t len) {
+  if (ctSize == 0 || !ctEnabled || !naptEnabled || len < FRAME_HDR_LEN + 28) return false;
+  uint32_t uplinkIP = ctUplinkIP.load(std::memory_order_relaxed);
+  if (uplinkIP == 0 || (frame[0] & 0x01) || frameType(frame) != FRAME_TYPE_IPV4) return false;
+  const uint8_t* ip = frame + FRAME_HDR_LEN;
+  uint8_t proto = ip[9];
+  uint32_t dst = readIPv4(ip + 16);
+  if (ifx == WIFI_IF_AP) return (proto == 6 || proto == 17) && dst != (uint32_t)apIP;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  if (dst != uplinkIP) return false;
+  if (proto == 1) {
+    const uint8_t* inner = ctQuoted(ip, len - FRAME_HDR_LEN, ihl);
+    return inner != NULL && readIPv4(inner + 12) == uplinkIP &&
+           (uint16_t)(readBE16(inner + (inner[0] & 0x0F) * 4) - CT_PORT_FIRST) < ctSize;
+  }
+  if ((proto != 6 && proto != 17) || len < FRAME_HDR_LEN + ihl + 8) return false;
+  return (uint16_t)(readBE16(ip + ihl + 2) - CT_PORT_FIRST) < ctSize;
+}
+
+// Driver RX hooks, called in the WiFi task. NAT traffic goes straight to lwIP unless
+// the conntrack fast path may want it; that and bridged frames are queued for the
+// forwarding task so the driver is never held up.
+static esp_err_t queueOrReceive(wifi_interface_t ifx, esp_netif_t* netif, void* buffer, uint16_t len, void* eb) {
+  uint8_t dir = (ifx == WIFI_IF_AP) ? DIR_UP : DIR_DOWN;
+  ForwardMetrics& m = localMetrics();
+  metricsCount(m.rxPackets[dir], 1);
+  metricsCount(m.rxBytes[dir], len);
+  if (ifx == WIFI_IF_AP && len >= FRAME_HDR_LEN) stationCount((const uint8_t*)buffer + 6, true, len);
+  
+  if (benchRelayActive.load(std::memory_order_relaxed)) {
+    benchRelayBytes[ifx].fetch_add(len, std::memory_order_relaxed);
+  }
+  
+  // Before the mode split: NAPT and the bridge both forward the SYN as it stands
+  if (mssClamp != 0 && len >= FRAME_HDR_LEN + 40) {
+    clampMSS((uint8_t*)buffer, len);
+  }
+  
+  if (len < FRAME_HDR_LEN || (forwardMode != FORWARD_BRIDGE && !ctCandidate(ifx, (const uint8_t*)buffer, len))) {
+    return deliverLocal(netif, buffer, len, eb);
+  }
+  
+  RxFrame rx = { buffer, eb, len, (uint8_t)ifx, (uint32_t)esp_timer_get_time() };
+  if (!forwardQueue.push(rx)) {
+    metricsCount(m.drops[DROP_QUEUE_FULL], 1);
+    esp_wifi_internal_free_rx_buffer(eb);
+    return ESP_OK;
+  }
+  xTaskNotifyGive(forwardTaskHandle);
+  return ESP_OK;
+}
+
+static esp_err_t apRxCallback(void* buffer, uint16_t len, void* eb) {
+  return queueOrReceive(WIFI_IF_AP, apNetifHandle, buffer, len, eb);
+}
+
+static esp_err_t staRxCallback(void* buffer, uint16_t len, void* eb) {
+  return queueOrReceive(WIFI_IF_STA, staNetifHandle, buffer, len, eb);
+}
+
+// Send a multicast-to-unicast copy or a synthesised reply to an AP station, through
+// the egress scheduler when it takes it. Both copy the frame, so mcastFrame is free
+// again on return.
+static void mcastTransmit(uint8_t* frame, uint16_t len, uint32_t rxTime) {
+  if (egressEnqueue(frame, len, NULL, EGRESS_BRIDGED, rxTime)) return;
+  forwardTx(WIFI_IF_AP, frame, len, rxTime);
+}
+
+static void mcastUnicast(const uint8_t* frame, uint16_t len, const uint8_t* mac, uint32_t rxTime) {
+  if (len > sizeof(mcastFrame)) return;
+  memcpy(mcastFrame, frame, len);
+  memcpy(mcastFrame, mac, 6);
+  mcastTransmit(mcastFrame, len, rxTime);
+  mcastConverted.fetch_add(1, std::memory_order_relaxed);
+}
+
+static uint32_t ssdpKey(const char* st) {
+  uint32_t key = 2166136261u;
+  for (const char* c = st; *c; c++) key = (key ^ (uint8_t)tolower(*c)) * 16777619u;
+  return key;
+}
+
+// True when the same query went through inside MCAST_REPEAT_MS; otherwise remembers it
+static bool mcastRepeated(uint32_t key) {
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < MCAST_RECENT; i++) {
+    if (mcastRecent[i].key == key && mcastRecent[i].at != 0 && now - mcastRecent[i].at < MCAST_REPEAT_MS) {
+      mcastSuppressed.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  mcastRecent[mcastRecentNext].key = key;
+  mcastRecent[mcastRecentNext].at = now | 1;
+  mcastRecentNext = (mcastRecentNext + 1) % MCAST_RECENT;
+  return false;
+}
+
+static inline bool mcastMemberLive(const McastMember& m, uint32_t now) {
+  // Without a querier upstream nobody asks clients to report again, so memberships
+  // only end on a leave or when the station goes
+  bool querier = mcastQuerierAt != 0 && now - mcastQuerierAt < MCAST_MEMBER_MS;
+  return m.group != 0 && (!querier || now - m.lastReport < MCAST_MEMBER_MS);
+}
+
+static void mcastJoin(uint32_t group, const uint8_t* mac) {
+  uint32_t now = millis();
+  McastMember* slot = NULL;
+  for (uint8_t i = 0; i < MCAST_MEMBERS; i++) {
+    McastMember& m = mcastMembers[i];
+    if (m.group == group && memcmp(m.mac, mac, 6) == 0) { slot = &m; break; }
+    if (slot == NULL && !mcastMemberLive(m, now)) slot = &m;
+  }
+  if (slot == NULL) return;  // Full: the group floods when it has no listed member
+  slot->group = group;
+  memcpy(slot->mac, mac, 6);
+  slot->lastReport = now;
+}
+
+static void mcastLeave(uint32_t group, const uint8_t* mac) {
+  for (uint8_t i = 0; i < MCAST_MEMBERS; i++) {
+    if (mcastMembers[i].group == group && memcmp(mcastMembers[i].mac, mac, 6) == 0) mcastMembers[i].group = 0;
+  }
+}
+
+// IGMPv1/v2/v3 reports and leaves from a station. Source lists are ignored: a station
+// that wants any source of a group gets all of it.
+static void mcastSnoop(const uint8_t* igmp, uint16_t len, const uint8_t* mac) {
+  if (len < 8) return;
+  if (igmp[0] == 0x12 || igmp[0] == 0x16) {
+    mcastJoin(readIPv4(igmp + 4), mac);
+  } else if (igmp[0] == 0x17) {
+    mcastLeave(readIPv4(igmp + 4), mac);
+  } else if (igmp[0] == 0x22) {
+    uint16_t records = readBE16(igmp + 6);
+    uint32_t off = 8;
+    for (uint16_t r = 0; r < records && off + 8 <= len; r++) {
+      uint8_t type = igmp[off];
+      uint16_t sources = readBE16(igmp + off + 2);
+      uint32_t group = readIPv4(igmp + off + 4);
+      // Exclude mode, or include with sources, means the station wants traffic;
+      // include with none is a leave. Blocking sources doesn't change membership.
+      if (type == 2 || type == 4 || ((type == 1 || type == 3 || type == 5) && sources > 0)) mcastJoin(group, mac);
+      else if ((type == 1 || type == 3) && sources == 0) mcastLeave(group, mac);
+      off += 8 + 4 * sources + 4 * igmp[off + 1];
+    }
+  }
+}
+
+// Hash of a DNS name, lowercased and with compression followed. Leaves off just past
+// the name where it appears.
+static bool mdnsName(const uint8_t* msg, uint16_t len, uint16_t& off, uint32_t& hash) {
+  hash = 2166136261u;
+  uint16_t pos = off;
+  bool jumped = false;
+  for (uint8_t hops = 0; hops < 16 && pos < len; ) {
+    uint8_t label = msg[pos];
+    if (label == 0) {
+      if (!jumped) off = pos + 1;
+      return true;
+    }
+    if ((label & 0xC0) == 0xC0) {
+      if (pos + 1 >= len) return false;
+      if (!jumped) off = pos + 2;
+      jumped = true;
+      pos = ((label & 0x3F) << 8) | msg[pos + 1];
+      hops++;
+      continue;
+    }
+    if (label > 63 || pos + 1 + label > len) return false;
+    for (uint8_t i = 1; i <= label; i++) hash = (hash ^ (uint8_t)tolower(msg[pos + i])) * 16777619u;
+    hash = (hash ^ '.') * 16777619u;
+    pos += 1 + label;
+  }
+  return false;
+}
+
+// Name and type of the first question
+static bool mdnsQuestion(const uint8_t* msg, uint16_t len, uint32_t& name, uint16_t& type) {
+  uint16_t off = 12;
+  if (len < 12 || readBE16(msg + 4) == 0 || !mdnsName(msg, len, off, name) || off + 4 > len) return false;
+  type = readBE16(msg + off);
+  return true;
+}
+
+// Names and types of all questions; 0 when there are none, too many or they don't parse
+static uint8_t mdnsQuestions(const uint8_t* msg, uint16_t len, uint32_t* names, uint16_t* types) {
+  if (len < 12) return 0;
+  uint16_t questions = readBE16(msg + 4);
+  if (questions == 0 || questions > MDNS_QUESTIONS_MAX) return 0;
+  uint16_t off = 12;
+  for (uint8_t q = 0; q < questions; q++) {
+    if (!mdnsName(msg, len, off, names[q]) || off + 4 > len) return 0;
+    types[q] = readBE16(msg + off);
+    off += 4;
+  }
+  return questions;
+}
+
+// Name and type of the first answer, and the shortest TTL among the answers
+static bool mdnsAnswer(const uint8_t* msg, uint16_t len, uint32_t& name, uint16_t& type, uint32_t& ttl) {
+  if (len < 12) return false;
+  uint16_t questions = readBE16(msg + 4);
+  uint16_t answers = readBE16(msg + 6);
+  uint16_t off = 12;
+  uint32_t skip;
+  for (uint16_t q = 0; q < questions; q++) {
+    if (!mdnsName(msg, len, off, skip) || off + 4 > len) return false;
+    off += 4;
+  }
+  if (answers == 0) return false;
+  ttl = UINT32_MAX;
+  for (uint16_t a = 0; a < answers; a++) {
+    uint32_t recordName;
+    if (!mdnsName(msg, len, off, recordName) || off + 10 > len) return false;
+    if (a == 0) {
+      name = recordName;
+      type = readBE16(msg + off);
+    }
+    ttl = std::min(ttl, readBE32(msg + off + 4));
+    uint32_t next = off + 10 + readBE16(msg + off + 8);
+    if (next > len) return false;
+    off = next;
+  }
+  return true;
+}
+
+static MdnsEntry* mdnsLookup(uint32_t name, uint16_t type) {
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < mdnsCacheSize; i++) {
+    MdnsEntry& e = mdnsCache[i];
+    if (e.len == 0 || e.name != name || (type != 255 && e.type != type)) continue;
+    if ((int32_t)(now - e.expires) >= 0) {
+      e.len = 0;
+      continue;
+    }
+    return &e;
+  }
+  return NULL;
+}
+
+static void mdnsStore(const uint8_t* frame, uint16_t len, uint32_t name, uint16_t type, uint32_t ttl) {
+  MdnsEntry* slot = NULL;
+  for (uint8_t i = 0; i < mdnsCacheSize; i++) {
+    MdnsEntry& e = mdnsCache[i];
+    if (e.len != 0 && e.name == name && e.type == type) { slot = &e; break; }
+    if (slot == NULL || e.len == 0 || (slot->len != 0 && (int32_t)(e.expires - slot->expires) < 0)) slot = &e;
+  }
+  if (slot == NULL) return;
+  if (ttl == 0) {
+    // Goodbye: the record is gone
+    if (slot->len != 0 && slot->name == name && slot->type == type) slot->len = 0;
+    return;
+  }
+  if (len > MDNS_FRAME_MAX) return;
+  memcpy(slot->frame, frame, len);
+  slot->len = len;
+  slot->name = name;
+  slot->type = type;
+  slot->stored = millis();
+  slot->expires = slot->stored + std::min(ttl, (uint32_t)MDNS_TTL_MAX) * 1000;
+}
+
+// Send a cached response to one station. Every record's TTL loses the time the
+// response sat in the cache, so the station doesn't hold on to it past the lifetime
+// the responder gave it.
+static void mdnsReplay(const MdnsEntry& e, const uint8_t* mac, uint32_t rxTime) {
+  if (e.len > sizeof(mcastFrame)) return;
+  memcpy(mcastFrame, e.frame, e.len);
+  memcpy(mcastFrame, mac, 6);
+  
+  uint8_t* ip = mcastFrame + FRAME_HDR_LEN;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  uint8_t* l4 = ip + ihl;
+  uint8_t* msg = l4 + 8;
+  uint16_t total = std::min((uint16_t)readBE16(ip + 2), (uint16_t)(e.len - FRAME_HDR_LEN));
+  uint16_t len = total - ihl - 8;
+  uint32_t age = (millis() - e.stored) / 1000;
+  bool checksummed = readBE16(l4 + 6) != 0;
+  uint16_t off = 12;
+  uint32_t skip;
+  for (uint16_t q = readBE16(msg + 4); q > 0 && age > 0; q--) {
+    if (!mdnsName(msg, len, off, skip) || off + 4 > len) break;
+    off += 4;
+  }
+  for (uint32_t r = (uint32_t)readBE16(msg + 6) + readBE16(msg + 8) + readBE16(msg + 10); r > 0 && age > 0; r--) {
+    if (!mdnsName(msg, len, off, skip) || off + 10 > len) break;
+    uint8_t* field = msg + off + 4;
+    uint32_t ttl = readBE32(field);
+    if (ttl != 0) {
+      // A record shorter-lived than the answers the entry expires with keeps a second
+      uint32_t left = ttl > age ? ttl - age : 1;
+      if (checksummed) {
+        csumRewrite16(l4, l4 + 6, field - l4, left >> 16);
+        csumRewrite16(l4, l4 + 6, field + 2 - l4, left & 0xFFFF);
+      } else {
+        writeBE16(field, left >> 16);
+        writeBE16(field + 2, left & 0xFFFF);
+      }
+    }
+    uint32_t next = off + 10 + readBE16(msg + off + 8);
+    if (next > len) break;
+    off = next;
+  }
+  if (checksummed && readBE16(l4 + 6) == 0) writeBE16(l4 + 6, 0xFFFF);
+  
+  mcastTransmit(mcastFrame, e.len, rxTime);
+  mcastConverted.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Header value from an SSDP message, trimmed. Names match case-insensitively.
+static bool ssdpHeader(const char* msg, uint16_t len, const char* name, char* out, size_t outLen) {
+  size_t nameLen = strlen(name);
+  for (uint16_t line = 0; line < len; ) {
+    uint16_t end = line;
+    while (end < len && msg[end] != '\r' && msg[end] != '\n') end++;
+    if (end - line > nameLen && msg[line + nameLen] == ':' && strncasecmp(msg + line, name, nameLen) == 0) {
+      uint16_t v = line + nameLen + 1;
+      while (v < end && msg[v] == ' ') v++;
+      uint16_t n = std::min((size_t)(end - v), outLen - 1);
+      memcpy(out, msg + v, n);
+      out[n] = 0;
+      return true;
+    }
+    line = end;
+    while (line < len && (msg[line] == '\r' || msg[line] == '\n')) line++;
+  }
+  return false;
+}
+
+// NOTIFY from an uplink device: ssdp:alive (or update) caches it by USN, byebye drops it
+static void ssdpNotify(const uint8_t* frame, const uint8_t* ip, const char* msg, uint16_t len) {
+  char nts[20];
+  SsdpEntry e;
+  if (!ssdpHeader(msg, len, "NTS", nts, sizeof(nts)) || !ssdpHeader(msg, len, "USN", e.usn, sizeof(e.usn))) return;
+  uint32_t now = millis();
+  SsdpEntry* slot = NULL;
+  for (uint8_t i = 0; i < ssdpCacheSize; i++) {
+    SsdpEntry& c = ssdpCache[i];
+    if (c.expires != 0 && strcmp(c.usn, e.usn) == 0) { slot = &c; break; }
+    if (slot == NULL || c.expires == 0 || (int32_t)(now - c.expires) >= 0 ||
+        (slot->expires != 0 && (int32_t)(c.expires - slot->expires) < 0)) {
+      slot = &c;
+    }
+  }
+  if (slot == NULL) return;
+  if (strcasecmp(nts, "ssdp:byebye") == 0) {
+    if (slot->expires != 0 && strcmp(slot->usn, e.usn) == 0) slot->expires = 0;
+    return;
+  }
+  
+  char cacheControl[32];
+  e.maxAge = SSDP_AGE_MAX;
+  if (ssdpHeader(msg, len, "CACHE-CONTROL", cacheControl, sizeof(cacheControl))) {
+    const char* age = strchr(cacheControl, '=');
+    if (age != NULL) e.maxAge = std::min(strtoul(age + 1, NULL, 10), (unsigned long)SSDP_AGE_MAX);
+  }
+  if (e.maxAge == 0 || !ssdpHeader(msg, len, "NT", e.nt, sizeof(e.nt)) ||
+      !ssdpHeader(msg, len, "LOCATION", e.location, sizeof(e.location))) {
+    return;
+  }
+  if (!ssdpHeader(msg, len, "SERVER", e.server, sizeof(e.server))) e.server[0] = 0;
+  e.ip = readIPv4(ip + 12);
+  memcpy(e.mac, frame + 6, 6);
+  e.expires = (now + e.maxAge * 1000UL) | 1;
+  *slot = e;
+}
+
+// Answer an M-SEARCH from a station with the cached devices whose type it asked
+// for, each reply as that device would have sent it. Returns how many matched.
+static uint8_t ssdpAnswer(const uint8_t* frame, const uint8_t* ip, const uint8_t* udp, const char* msg, uint16_t len, uint32_t rxTime) {
+  char st[80];
+  if (!ssdpHeader(msg, len, "ST", st, sizeof(st))) return 0;
+  bool all = strcasecmp(st, "ssdp:all") == 0;
+  uint32_t now = millis();
+  uint8_t answered = 0;
+  for (uint8_t i = 0; i < ssdpCacheSize; i++) {
+    const SsdpEntry& e = ssdpCache[i];
+    if (e.expires == 0 || (int32_t)(now - e.expires) >= 0 || (!all && strcasecmp(st, e.nt) != 0)) continue;
+    
+    uint8_t* reply = mcastFrame;
+    char* body = (char*)reply + FRAME_HDR_LEN + 28;
+    int bodyLen = snprintf(body, sizeof(mcastFrame) - FRAME_HDR_LEN - 28,
+                           "HTTP/1.1 200 OK\r\nCACHE-CONTROL: max-age=%u\r\nEXT:\r\nLOCATION: %s\r\n%s%s%sST: %s\r\nUSN: %s\r\n\r\n",
+                           (unsigned)((e.expires - now) / 1000), e.location, e.server[0] ? "SERVER: " : "", e.server,
+                           e.server[0] ? "\r\n" : "", e.nt, e.usn);
+    if (bodyLen <= 0 || bodyLen >= (int)(sizeof(mcastFrame) - FRAME_HDR_LEN - 28)) continue;
+    
+    memcpy(reply, frame + 6, 6);
+    memcpy(reply + 6, e.mac, 6);
+    writeBE16(reply + 12, FRAME_TYPE_IPV4);
+    uint8_t* rip = reply + FRAME_HDR_LEN;
+    memset(rip, 0, 20);
+    rip[0] = 0x45;
+    writeBE16(rip + 2, 28 + bodyLen);
+    writeBE16(rip + 6, 0x4000);
+    rip[8] = 64;
+    rip[9] = 17;
+    memcpy(rip + 12, &e.ip, 4);
+    memcpy(rip + 16, ip + 12, 4);
+    writeBE16(rip + 10, ipHeaderChecksum(rip));
+    uint8_t* rudp = rip + 20;
+    writeBE16(rudp, SSDP_PORT);
+    memcpy(rudp + 2, udp, 2);                // Back to the searcher's port
+    writeBE16(rudp + 4, 8 + bodyLen);
+    writeBE16(rudp + 6, 0);                  // No checksum, allowed over IPv4
+    mcastTransmit(reply, FRAME_HDR_LEN + 28 + bodyLen, rxTime);
+    answered++;
+  }
+  if (answered) mcastAnswered.fetch_add(1, std::memory_order_relaxed);
+  return answered;
+}
+
+// Group frames from a station. Snoops IGMP and answers mDNS/SSDP queries from the
+// cache; returns false when the frame shouldn't go upstream.
+static bool mcastFromAP(const uint8_t* frame, uint16_t len, uint32_t rxTime) {
+  if (frameType(frame) != FRAME_TYPE_IPV4 || len < FRAME_HDR_LEN + 20) return true;
+  const uint8_t* ip = frame + FRAME_HDR_LEN;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  uint16_t total = std::min((uint16_t)readBE16(ip + 2), (uint16_t)(len - FRAME_HDR_LEN));
+  if (ihl < 20 || total < ihl + 8 || (readBE16(ip + 6) & 0x3FFF) != 0) return true;
+  const uint8_t* l4 = ip + ihl;
+  uint32_t dst = readIPv4(ip + 16);
+  
+  if (ip[9] == 2) {
+    mcastSnoop(l4, total - ihl, frame + 6);
+    return true;
+  }
+  if (ip[9] != 17) return true;
+  const uint8_t* payload = l4 + 8;
+  uint16_t payloadLen = total - ihl - 8;
+  
+  if (dst == MCAST_MDNS_IP && readBE16(l4 + 2) == MDNS_PORT && payloadLen >= 12 && !(payload[2] & 0x80)) {
+    uint32_t names[MDNS_QUESTIONS_MAX];
+    uint16_t types[MDNS_QUESTIONS_MAX];
+    MdnsEntry* hits[MDNS_QUESTIONS_MAX];
+    uint8_t questions = mdnsQuestions(payload, payloadLen, names, types);
+    if (questions == 0) return true;
+    uint8_t answered = 0;
+    for (uint8_t q = 0; q < questions; q++) {
+      hits[q] = mdnsLookup(names[q], types[q]);
+      if (hits[q] != NULL) answered++;
+    }
+    
+    // Only a query the cache answers in full stays here; one entry can answer several questions
+    if (answered == questions) {
+      for (uint8_t q = 0; q < questions; q++) {
+        bool sent = false;
+        for (uint8_t p = 0; p < q && !sent; p++) sent = hits[p] == hits[q];
+        if (!sent) mdnsReplay(*hits[q], frame + 6, rxTime);
+      }
+      mcastAnswered.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    
+    // Remember who asked so the uplink's answers reach them and nobody else
+    uint32_t key = 0x4D000000;
+    for (uint8_t q = 0; q < questions; q++) {
+      key = (key ^ names[q] ^ types[q]) * 16777619u;
+      if (hits[q] != NULL) continue;
+      MdnsAsk* slot = &mdnsAsks[0];
+      for (uint8_t i = 0; i < MDNS_ASKS; i++) {
+        MdnsAsk& a = mdnsAsks[i];
+        if (a.at != 0 && a.name == names[q] && a.type == types[q] && memcmp(a.mac, frame + 6, 6) == 0) {
+          slot = &a;
+          break;
+        }
+        if (a.at == 0 || (int32_t)(a.at - slot->at) < 0) slot = &a;
+      }
+      slot->name = names[q];
+      slot->type = types[q];
+      memcpy(slot->mac, frame + 6, 6);
+      slot->at = millis() | 1;
+    }
+    return !mcastRepeated(key);
+  }
+  
+  if (dst == MCAST_SSDP_IP && readBE16(l4 + 2) == SSDP_PORT && payloadLen > 9 &&
+      memcmp(payload, "M-SEARCH ", 9) == 0) {
+    const char* msg = (const char*)payload;
+    char st[80];
+    if (!ssdpHeader(msg, payloadLen, "ST", st, sizeof(st))) return true;
+    uint8_t answered = ssdpAnswer(frame, ip, l4, msg, payloadLen, rxTime);
+    // A cache can't be sure it knows everything, so a search for all still goes up
+    if (answered && strcasecmp(st, "ssdp:all") != 0) return false;
+    return !mcastRepeated(ssdpKey(st) ^ 0x53000000);
+  }
+  return true;
+}
+
+// Group frames from the uplink. Returns true when the frame should be flooded on the
+// softAP; otherwise it has been dropped, cached or sent on as unicast copies.
+static bool mcastFromSTA(const uint8_t* frame, uint16_t len, uint32_t rxTime) {
+  uint16_t type = frameType(frame);
+  bool broadcast = frame[0] == 0xFF && frame[1] == 0xFF && frame[2] == 0xFF && frame[3] == 0xFF && frame[4] == 0xFF && frame[5] == 0xFF;
+  
+  // ARP requests only concern the host they ask for
+  if (type == FRAME_TYPE_ARP) {
+    BridgeHost* host = len >= ARP_FRAME_LEN ? bridgeLookup(readIPv4(frame + ARP_TPA_OFFSET)) : NULL;
+    if (host != NULL) {
+      mcastUnicast(frame, len, host->mac, rxTime);
+    } else {
+      mcastDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return false;
+  }
+  
+  // The bridge carries IPv4 only (clients are masqueraded behind our MAC, which IPv6
+  // neighbour discovery would see through), so other group traffic is noise here
+  if (type != FRAME_TYPE_IPV4 || len < FRAME_HDR_LEN + 20) {
+    mcastDropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  const uint8_t* ip = frame + FRAME_HDR_LEN;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  uint16_t total = std::min((uint16_t)readBE16(ip + 2), (uint16_t)(len - FRAME_HDR_LEN));
+  bool whole = ihl >= 20 && total >= ihl + 8 && (readBE16(ip + 6) & 0x3FFF) == 0;
+  const uint8_t* l4 = ip + ihl;
+  const uint8_t* payload = l4 + 8;
+  uint16_t payloadLen = whole ? total - ihl - 8 : 0;
+  uint32_t dst = readIPv4(ip + 16);
+  
+  if (broadcast) {
+    // Subnet broadcasts: DHCP replies have to get through, LAN sync and NetBIOS chatter don't
+    uint16_t port = whole && ip[9] == 17 ? readBE16(l4 + 2) : 0;
+    if (port == 137 || port == 138 || port == 17500) {
+      mcastDropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    mcastFlooded.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  
+  if (dst == MCAST_ALL_HOSTS_IP) {
+    // IGMP queries keep the snooped memberships fresh
+    if (whole && ip[9] == 2 && l4[0] == 0x11) mcastQuerierAt = millis() | 1;
+    mcastFlooded.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+  
+  if (dst == MCAST_MDNS_IP && whole && ip[9] == 17 && readBE16(l4 + 2) == MDNS_PORT && payloadLen >= 12) {
+    if (!(payload[2] & 0x80)) {
+      // Someone upstream looking for a service: stations may run it, ask them once
+      uint32_t name;
+      uint16_t qtype;
+      if (mdnsQuestion(payload, payloadLen, name, qtype) && mcastRepeated(name ^ qtype ^ 0x6D000000)) return false;
+      mcastFlooded.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    
+    uint32_t name, ttl;
+    uint16_t rtype;
+    if (!mdnsAnswer(payload, payloadLen, name, rtype, ttl)) {
+      mcastDropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    mdnsStore(frame, len, name, rtype, ttl);
+    bool delivered = false;
+    uint32_t now = millis();
+    for (uint8_t i = 0; i < MDNS_ASKS; i++) {
+      MdnsAsk& a = mdnsAsks[i];
+      if (a.at == 0 || now - a.at > MDNS_ASK_MS || a.name != name || (a.type != rtype && a.type != 255)) continue;
+      mcastUnicast(frame, len, a.mac, rxTime);
+      a.at = 0;
+      delivered = true;
+    }
+    if (!delivered) mcastDropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  
+  if (dst == MCAST_SSDP_IP && whole && ip[9] == 17 && readBE16(l4 + 2) == SSDP_PORT && payloadLen > 9) {
+    const char* msg = (const char*)payload;
+    if (memcmp(msg, "NOTIFY ", 7) == 0) {
+      ssdpNotify(frame, ip, msg, payloadLen);
+      mcastDropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (memcmp(msg, "M-SEARCH ", 9) == 0) {
+      char st[80];
+      if (ssdpHeader(msg, payloadLen, "ST", st, sizeof(st)) && mcastRepeated(ssdpKey(st) ^ 0x73000000)) return false;
+      mcastFlooded.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  
+  // Everything else goes to the stations that joined the group; link-local groups
+  // nobody reported (routing protocols, LLMNR, other hosts' reports) go nowhere
+  uint32_t now = millis();
+  const uint8_t* members[MCAST_UNICAST_MAX];
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MCAST_MEMBERS; i++) {
+    const McastMember& m = mcastMembers[i];
+    if (m.group != dst || !mcastMemberLive(m, now)) continue;
+    if (count == MCAST_UNICAST_MAX) {
+      mcastFlooded.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    members[count++] = m.mac;
+  }
+  if (count == 0) {
+    mcastDropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  for (uint8_t i = 0; i < count; i++) mcastUnicast(frame, len, members[i], rxTime);
+  return false;
+}
+
+// Forwarding task: let go of memberships of stations that have left
+static void mcastMaintain() {
+  static uint32_t lastSweep = 0;
+  uint32_t now = millis();
+  if (now - lastSweep < MCAST_SWEEP_MS) return;
+  lastSweep = now;
+  for (uint8_t i = 0; i < MCAST_MEMBERS; i++) {
+    McastMember& m = mcastMembers[i];
+    if (m.group == 0) continue;
+    bool present = false;
+    for (uint8_t s = 0; s < STATION_SLOTS && !present; s++) {
+      present = stationStats[s].used.load(std::memory_order_acquire) && memcmp(stationStats[s].mac, m.mac, 6) == 0;
+    }
+    // A report can beat the supervisor's next look at the station list
+    if (!mcastMemberLive(m, now) || (!present && now - m.lastReport > 2 * STATION_POLL_MS)) m.group = 0;
+  }
+}
+
+void setupMulticast() {
+  bool psram = psramFound();
+  uint32_t caps = psram ? MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+  uint8_t mdnsEntries = psram ? MDNS_CACHE_PSRAM : MDNS_CACHE_INTERNAL;
+  uint8_t ssdpEntries = psram ? SSDP_CACHE_PSRAM : SSDP_CACHE_INTERNAL;
+  mdnsCache = (MdnsEntry*)heap_caps_calloc(mdnsEntries, sizeof(MdnsEntry), caps);
+  ssdpCache = (SsdpEntry*)heap_caps_calloc(ssdpEntries, sizeof(SsdpEntry), caps);
+  if (mdnsCache != NULL) mdnsCacheSize = mdnsEntries;
+  if (ssdpCache != NULL) ssdpCacheSize = ssdpEntries;
+  if (mdnsCache == NULL || ssdpCache == NULL) {
+    LOG_WARN("Multicast: no memory for the discovery cache, queries are only deduplicated");
+  }
+}
+
+// Frames from AP stations: learn the sender, masquerade as our STA MAC and relay upstream
+static void bridgeFromAP(const RxFrame& rx) {
+  uint8_t* frame = (uint8_t*)rx.buffer;
+  uint16_t len = rx.len;
+  
+  // Traffic addressed to the repeater itself stays local
+  if (memcmp(frame, apMAC, 6) == 0) {
+    deliverLocal(apNetifHandle, rx.buffer, len, rx.eb);
+    return;
+  }
+  
+  if ((frame[0] & 0x01) && mcastFilter && !mcastFromAP(frame, len, rx.rxTime)) {
+    esp_wifi_internal_free_rx_buffer(rx.eb);
+    return;
+  }
+  
+  uint16_t type = frameType(frame);
+  if (type == FRAME_TYPE_ARP && len >= ARP_FRAME_LEN) {
+    bridgeLearn(readIPv4(frame + ARP_SPA_OFFSET), frame + ARP_SHA_OFFSET);
+    memcpy(frame + ARP_SHA_OFFSET, staMAC, 6);
+  } else if (type == FRAME_TYPE_IPV4 && len >= FRAME_HDR_LEN + 20) {
+    uint8_t* ip = frame + FRAME_HDR_LEN;
+    uint8_t ihl = (ip[0] & 0x0F) * 4;
+    bridgeLearn(readIPv4(ip + 12), frame + 6);
+    
+    // DHCP from a client: ask the server to broadcast its reply, since it would
+    // otherwise unicast to a chaddr the upstream AP has never seen
+    if (ip[9] == 17 && len >= FRAME_HDR_LEN + ihl + 8 + 12) {
+      uint8_t* udp = ip + ihl;
+      if (udp[0] == 0 && udp[1] == 68 && udp[2] == 0 && udp[3] == 67) {
+        uint16_t bootpFlags = readBE16(udp + 8 + 10);
+        if (!(bootpFlags & 0x8000)) {
+          // Patch the checksum rather than dropping it; 0 means the sender sent none
+          if (readBE16(udp + 6) != 0) {
+            csumRewrite16(udp, udp + 6, 8 + 10, bootpFlags | 0x8000);
+            if (readBE16(udp + 6) == 0) writeBE16(udp + 6, 0xFFFF);
+          } else {
+            writeBE16(udp + 8 + 10, bootpFlags | 0x8000);  // BOOTP broadcast flag
+          }
+        }
+      }
+    }
+  }
+  
+  memcpy(frame + 6, staMAC, 6);
+  forwardTx(WIFI_IF_STA, frame, len, rx.rxTime);
+  esp_wifi_internal_free_rx_buffer(rx.eb);
+}
+
+// Frames from the uplink: map replies for bridged hosts back to their real MAC and relay
+// them onto the AP; everything else belongs to our own STA interface
+static void bridgeFromSTA(const RxFrame& rx) {
+  esp_netif_t* staNetif = staNetifHandle;
+  uint8_t* frame = (uint8_t*)rx.buffer;
+  uint16_t len = rx.len;
+  
+  // Broadcast/multicast goes to both sides, past the multicast filter on the AP side;
+  // the driver copies on TX so the RX buffer can still be handed to lwIP afterwards
+  if (frame[0] & 0x01) {
+    if (!mcastFilter || mcastFromSTA(frame, len, rx.rxTime)) forwardTx(WIFI_IF_AP, frame, len, rx.rxTime);
+    deliverLocal(staNetif, rx.buffer, len, rx.eb);
+    return;
+  }
+  
+  BridgeHost* host = NULL;
+  uint16_t type = frameType(frame);
+  if (type == FRAME_TYPE_ARP && len >= ARP_FRAME_LEN) {
+    host = bridgeLookup(readIPv4(frame + ARP_TPA_OFFSET));
+    if (host != NULL) memcpy(frame + ARP_THA_OFFSET, host->mac, 6);
+  } else if (type == FRAME_TYPE_IPV4 && len >= FRAME_HDR_LEN + 20) {
+    host = bridgeLookup(readIPv4(frame + FRAME_HDR_LEN + 16));
+  }
+  
+  if (host == NULL) {
+    deliverLocal(staNetif, rx.buffer, len, rx.eb);
+    return;
+  }
+  
+  memcpy(frame, host->mac, 6);
+  memcpy(frame + 6, apMAC, 6);
+  if (egressEnqueue(frame, len, rx.eb, EGRESS_BRIDGED, rx.rxTime)) return;
+  forwardTx(WIFI_IF_AP, frame, len, rx.rxTime);
+  esp_wifi_internal_free_rx_buffer(rx.eb);
+}
+
+static void ctPass(const RxFrame& rx) {
+  ctPassed.fetch_add(1, std::memory_order_relaxed);
+  deliverLocal(rx.ifx == WIFI_IF_AP ? apNetifHandle : staNetifHandle, rx.buffer, rx.len, rx.eb);
+}
+
+// Client to the internet: find or open the flow, masquerade as our uplink address and
+// a conntrack port, and send it to the gateway
+static void ctFromAP(const RxFrame& rx) {
+  uint8_t* frame = (uint8_t*)rx.buffer;
+  uint8_t* ip = frame + FRAME_HDR_LEN;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  uint8_t proto = ip[9];
+  uint32_t uplinkIP = ctUplinkIP.load(std::memory_order_acquire);
+  uint32_t src = readIPv4(ip + 12);
+  uint32_t dst = readIPv4(ip + 16);
+  uint32_t apNet = (uint32_t)apIP & (uint32_t)apNetmask;
+  
+  // Routed, unfragmented traffic from our subnet with TTL to spare, for somewhere past
+  // the gateway; anything on the uplink's own subnet needs ARP, which lwIP has
+  if (uplinkIP == 0 || ihl < 20 || rx.len < FRAME_HDR_LEN + ihl + (proto == 6 ? 20 : 8) ||
+      memcmp(frame, apMAC, 6) != 0 || (src & (uint32_t)apNetmask) != apNet ||
+      (readBE16(ip + 6) & 0x3FFF) != 0 || ip[8] <= 1 || ip[16] >= 224 ||
+      (dst & (uint32_t)apNetmask) == apNet || (dst & ctUplink.mask) == (uplinkIP & ctUplink.mask)) {
+    ctPass(rx);
+    return;
+  }
+  
+  uint8_t* l4 = ip + ihl;
+  uint16_t clientPort = readBE16(l4);
+  uint16_t remotePort = readBE16(l4 + 2);
+  uint8_t flags = proto == 6 ? l4[13] : 0;
+  uint32_t hash = ctHash(proto, src, dst, clientPort, remotePort);
+  uint32_t now = millis();
+  uint16_t index = ctLookup(hash, proto, src, dst, clientPort, remotePort);
+  if (index != CT_NONE && ctExpiredAt(ctEntries[index], now)) {
+    ctExpired.fetch_add(1, std::memory_order_relaxed);
+    ctRemove(index);
+    index = CT_NONE;
+  }
+  if (index == CT_NONE) {
+    // A TCP flow only starts here on a bare SYN; a segment of anything older belongs to
+    // a mapping lwIP made
+    if (proto == 6 && (flags & 0x12) != 0x02) {
+      ctPass(rx);
+      return;
+    }
+    uint32_t evictions = ctEvictions.load(std::memory_order_relaxed);
+    index = ctInsert(hash, proto, src, dst, clientPort, remotePort, frame + 6, now);
+    ctMisses.fetch_add(1, std::memory_order_relaxed);
+    if (ctEvictions.load(std::memory_order_relaxed) != evictions) {
+      // The table was full of live flows; the one pushed out is dropped
+      metricsCount(localMetrics().drops[DROP_NAT_TABLE_FULL], 1);
+    }
+  } else {
+    ctHits.fetch_add(1, std::memory_order_relaxed);
+    ctEntries[index].lastSeen = now;
+    ctTouch(index);
+  }
+  if (proto == 6) ctTrackTCP(ctEntries[index], flags, false);
+  
+  ctRewrite(ip, l4, proto, ip + 12, l4, uplinkIP, CT_PORT_FIRST + index);
+  memcpy(frame, ctUplink.gatewayMAC, 6);
+  memcpy(frame + 6, staMAC, 6);
+  forwardTx(WIFI_IF_STA, frame, rx.len, rx.rxTime);
+  esp_wifi_internal_free_rx_buffer(rx.eb);
+}
+
+// ICMP error about a fast-path flow (fragmentation needed, port unreachable, TTL
+// exceeded). lwIP NAPT has no mapping for conntrack ports and would drop it, leaving
+// DF senders past the MSS clamp in a PMTU black hole. The quoted datagram names the
+// entry by its source port; it goes back to the client with both tuples translated.
+static void ctErrorFromSTA(const RxFrame& rx) {
+  uint8_t* frame = (uint8_t*)rx.buffer;
+  uint8_t* ip = frame + FRAME_HDR_LEN;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  uint16_t ipLen = std::min<uint16_t>(readBE16(ip + 2), rx.len - FRAME_HDR_LEN);
+  uint8_t* inner = (uint8_t*)ctQuoted(ip, ipLen, ihl);
+  if (inner == NULL || (readBE16(ip + 6) & 0x3FFF) != 0 || ip[8] <= 1) {
+    ctPass(rx);
+    return;
+  }
+  
+  uint8_t* innerL4 = inner + (inner[0] & 0x0F) * 4;
+  uint16_t index = readBE16(innerL4) - CT_PORT_FIRST;
+  CtEntry& e = ctEntries[index];
+  if (e.proto != inner[9] || e.remoteIP != readIPv4(inner + 16) || e.remotePort != readBE16(innerL4 + 2) ||
+      ctExpiredAt(e, millis())) {
+    ctPass(rx);
+    return;
+  }
+  ctHits.fetch_add(1, std::memory_order_relaxed);
+  
+  ctRewriteICMPError(ip, ip + ihl, inner, ipLen - (inner - ip), e.clientIP, e.clientPort);
+  memcpy(frame, e.mac, 6);
+  memcpy(frame + 6, apMAC, 6);
+  if (egressEnqueue(frame, rx.len, rx.eb, EGRESS_BRIDGED, rx.rxTime)) return;
+  forwardTx(WIFI_IF_AP, frame, rx.len, rx.rxTime);
+  esp_wifi_internal_free_rx_buffer(rx.eb);
+}
+
+// Internet to client: the port names the entry; the remote end has to match it
+static void ctFromSTA(const RxFrame& rx) {
+  uint8_t* frame = (uint8_t*)rx.buffer;
+  uint8_t* ip = frame + FRAME_HDR_LEN;
+  uint8_t ihl = (ip[0] & 0x0F) * 4;
+  uint8_t proto = ip[9];
+  if (proto == 1) {
+    ctErrorFromSTA(rx);
+    return;
+  }
+  if (ihl < 20 || rx.len < FRAME_HDR_LEN + ihl + (proto == 6 ? 20 : 8) ||
+      (readBE16(ip + 6) & 0x3FFF) != 0 || ip[8] <= 1) {
+    ctPass(rx);
+    return;
+  }
+  
+  uint8_t* l4 = ip + ihl;
+  uint16_t index = readBE16(l4 + 2) - CT_PORT_FIRST;
+  CtEntry& e = ctEntries[index];
+  uint32_t now = millis();
+  if (e.proto != proto || e.remoteIP != readIPv4(ip + 12) || e.remotePort != readBE16(l4)) {
+    ctPass(rx);
+    return;
+  }
+  if (ctExpiredAt(e, now)) {
+    ctExpired.fetch_add(1, std::memory_order_relaxed);
+    ctRemove(index);
+    ctPass(rx);
+    return;
+  }
+  ctHits.fetch_add(1, std::memory_order_relaxed);
+  e.lastSeen = now;
+  ctTouch(index);
+  if (proto == 6) ctTrackTCP(e, l4[13], true);
+  else e.state = CT_UDP_REPLIED;
+  
+  ctRewrite(ip, l4, proto, ip + 16, l4 + 2, e.clientIP, e.clientPort);
+  memcpy(frame, e.mac, 6);
+  memcpy(frame + 6, apMAC, 6);
+  if (egressEnqueue(frame, rx.len, rx.eb, EGRESS_BRIDGED, rx.rxTime)) return;
+  forwardTx(WIFI_IF_AP, frame, rx.len, rx.rxTime);
+  esp_wifi_internal_free_rx_buffer(rx.eb);
+}
+
+// Forwarding task, between batches: flushes asked for elsewhere, and a slice of the
+// table checked for idle flows
+static void ctMaintain() {
+  if (ctSize == 0) return;
+  if (ctUplinkStaged.load(std::memory_order_acquire)) {
+    ctUplink = ctUplinkNext;
+    if (ctUplink.addr != ctFlowIP) {
+      // Flows made for another address are dead; the remote ends would reset anyway
+      ctFlowIP = ctUplink.addr;
+      ctFlush();
+    }
+    ctUplinkIP.store(isPrimaryConnected ? ctUplink.addr : 0, std::memory_order_release);
+    ctUplinkStaged.store(false, std::memory_order_release);
+  }
+  if (ctFlushRequested.exchange(false)) ctFlush();
+  
+  static uint32_t lastSweep = 0;
+  uint32_t now = millis();
+  if (ctUsed == 0 || now - lastSweep < CT_SWEEP_MS) return;
+  lastSweep = now;
+  ctSweep(CT_SWEEP_BATCH, now);
+}
+
+void forwardTask(void* arg) {
+  RxFrame rx;
+  bool egressBacklog = false;
+  for (;;) {
+    // With frames held back by the driver or a rate cap, poll every tick; with flows
+    // in the conntrack table, often enough to age them
+    ulTaskNotifyTake(pdTRUE, egressBacklog ? 1 : ctUsed ? pdMS_TO_TICKS(CT_SWEEP_MS) : portMAX_DELAY);
+    while (forwardQueue.pop(rx)) {
+      metricsLatency(STAGE_QUEUE, (uint32_t)esp_timer_get_time() - rx.rxTime);
+      if (forwardMode != FORWARD_BRIDGE) {
+        if (rx.ifx == WIFI_IF_AP) ctFromAP(rx);
+        else ctFromSTA(rx);
+      } else if (rx.ifx == WIFI_IF_AP) {
+        bridgeFromAP(rx);
+      } else {
+        bridgeFromSTA(rx);
+      }
+    }
+    ctMaintain();
+    if (forwardMode == FORWARD_BRIDGE && mcastFilter) mcastMaintain();
+    egressBacklog = egressService();
+  }
+}
+
+// Runs in the lwIP task, where the ARP table and netif addresses can be read safely
+static void ctUplinkRefresh(void* ctx) {
+  struct netif* netif = staLwipNetif;
+  if (netif == NULL || !netif_is_up(netif) || !isPrimaryConnected || ip4_addr_isany(netif_ip4_gw(netif))) {
+    ctUplinkIP.store(0, std::memory_order_release);
+    return;
+  }
+  struct eth_addr* mac = NULL;
+  const ip4_addr_t* entryIP = NULL;
+  if (etharp_find_addr(netif, netif_ip4_gw(netif), &mac, &entryIP) < 0) {
+    etharp_request(netif, netif_ip4_gw(netif));  // The next refresh picks the reply up
+    return;
+  }
+  uint32_t addr = ip4_addr_get_u32(netif_ip4_addr(netif));
+  uint32_t mask = ip4_addr_get_u32(netif_ip4_netmask(netif));
+  
+  // The forwarding task hasn't taken the last set yet; the next refresh tries again
+  if (ctUplinkStaged.load(std::memory_order_acquire)) return;
+  if (ctUplinkIP.load(std::memory_order_relaxed) != 0 && addr == ctUplinkNext.addr && mask == ctUplinkNext.mask &&
+      memcmp(mac->addr, ctUplinkNext.gatewayMAC, 6) == 0) {
+    return;
+  }
+  ctUplinkNext.addr = addr;
+  ctUplinkNext.mask = mask;
+  memcpy(ctUplinkNext.gatewayMAC, mac->addr, 6);
+  ctUplinkStaged.store(true, std::memory_order_release);
+  xTaskNotifyGive(forwardTaskHandle);
+}
+
+void refreshConntrackUplink() {
+  if (ctSize != 0) tcpip_callback(ctUplinkRefresh, NULL);
+}
+
+void setupConntrack() {
+  bool psram = psramFound();
+  long entries = psram ? CT_MAX_PSRAM : CT_MAX_INTERNAL;
+  if (!psram) {
+    long spare = (long)ESP.getFreeHeap() - NAPT_HEAP_FLOOR;
+    long affordable = spare > 0 ? spare / CT_HEAP_SHARE / (long)(sizeof(CtEntry) + 2 * sizeof(CtBucket)) : 0;
+    if (affordable < entries) entries = affordable;
+  }
+  if (entries > CT_PORT_COUNT) entries = CT_PORT_COUNT;
+  if (entries < CT_MIN_ENTRIES) {
+    LOG_WARN("Conntrack: no memory, NAT stays with lwIP");
+    return;
+  }
+  
+  uint32_t buckets = 1;
+  while (buckets < (uint32_t)entries * 2) buckets <<= 1;   // Load factor at most 1/2
+  ctEntries = (CtEntry*)heap_caps_malloc(entries * sizeof(CtEntry),
+                                         psram ? MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT : MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  ctBuckets = (CtBucket*)heap_caps_malloc(buckets * sizeof(CtBucket), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  if (ctEntries == NULL || ctBuckets == NULL) {
+    heap_caps_free(ctEntries);
+    heap_caps_free(ctBuckets);
+    ctEntries = NULL;
+    ctBuckets = NULL;
+    LOG_WARN("Conntrack: allocation failed, NAT stays with lwIP");
+    return;
+  }
+  ctBucketMask = buckets - 1;
+  ctSize = entries;
+  ctFlush();
+  LOG_INFO("Conntrack: %d flows%s, %lu buckets", ctSize, psram ? " (PSRAM)" : "", (unsigned long)buckets);
+}
+
+void armRxHooks() {
+  // The driver RX hooks carry both modes. esp_netif registers its own on every
+  // interface start/connect, so this runs again from those events.
+  esp_wifi_get_mac(WIFI_IF_STA, staMAC);
+  esp_wifi_get_mac(WIFI_IF_AP, apMAC);
+  
+  // Looked up once here: the by-key lookup walks the netif list, too slow per frame
+  apNetifHandle = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
+  staNetifHandle = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  apLwipNetif = apNetifHandle ? (struct netif*)esp_netif_get_netif_impl(apNetifHandle) : NULL;
+  staLwipNetif = staNetifHandle ? (struct netif*)esp_netif_get_netif_impl(staNetifHandle) : NULL;
+  esp_wifi_internal_reg_rxcb(WIFI_IF_AP, apRxCallback);
+  esp_wifi_internal_reg_rxcb(WIFI_IF_STA, staRxCallback);
+  
+  // Route the AP netif's output through the egress scheduler
+  if (apNetifHandle != NULL) {
+    esp_netif_driver_ifconfig_t apDriver = {};
+    apDriver.handle = esp_netif_get_io_driver(apNetifHandle);
+    apDriver.transmit = apTransmit;
+    apDriver.transmit_wrap = apTransmitWrap;
+    apDriver.driver_free_rx_buffer = apFreeRxBuffer;
+    esp_netif_set_driver_config(apNetifHandle, &apDriver);
+  }
+}
+
+void onInterfaceStarted(arduino_event_id_t event, arduino_event_info_t info) {
+  armRxHooks();
+  
+  // esp_netif starts the stock DHCP server with every AP start; ours stays in charge
+  if (event == ARDUINO_EVENT_WIFI_AP_START && forwardMode == FORWARD_NAT && apNetifHandle != NULL) {
+    esp_netif_dhcps_stop(apNetifHandle);
+    dhcpStart();  // No-op if setupNAPT already got there once the netif existed
+  }
+  if (event == ARDUINO_EVENT_WIFI_AP_START && !bleActive && !blePending) {
+    configEndpointStart();
+  }
+  bootMark(event == ARDUINO_EVENT_WIFI_AP_START ? BOOT_AP_UP : BOOT_UPLINK_ASSOC);
+}
+
+// DNS forwarder task. One socket listens on apIP:53 for clients, one talks to the
+// uplink's resolver; everything else is bookkeeping on the two fixed tables.
+void dnsTask(void* arg) {
+  static uint8_t packet[DNS_PACKET_MAX];
+  int server = -1;
+  
+  for (;;) {
+    if (server < 0) {
+      server = dnsSocket((uint32_t)apIP, DNS_PORT);
+      if (server < 0) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        continue;
+      }
+      LOG_INFO("DNS forwarder listening on port 53");
+    }
+    
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(server, &readable);
+    int highest = server;
+    for (uint8_t i = 0; i < DNS_PENDING_MAX; i++) {
+      if (!dnsPending[i].used) continue;
+      FD_SET(dnsPending[i].sock, &readable);
+      highest = std::max(highest, dnsPending[i].sock);
+    }
+    struct timeval timeout = { 0, 500000 };
+    int ready = select(highest + 1, &readable, NULL, NULL, &timeout);
+    
+    if (dnsFlushRequested.exchange(false)) {
+      memset(dnsCache, 0, sizeof(dnsCache));
+    }
+    
+    if (ready > 0) {
+      struct sockaddr_in from;
+      socklen_t fromLen = sizeof(from);
+      for (uint8_t i = 0; i < DNS_PENDING_MAX; i++) {
+        DnsPending& pq = dnsPending[i];
+        if (!pq.used || !FD_ISSET(pq.sock, &readable)) continue;
+        fromLen = sizeof(from);
+        int n = recvfrom(pq.sock, packet, sizeof(packet), 0, (struct sockaddr*)&from, &fromLen);
+        if (n > 0) dnsAnswer(server, pq, packet, n, from);
+      }
+      fromLen = sizeof(from);
+      if (FD_ISSET(server, &readable)) {
+        int n = recvfrom(server, packet, sizeof(packet), 0, (struct sockaddr*)&from, &fromLen);
+        if (n > 0) dnsQuery(server, packet, n, from);
+      }
+    }
+    
+    // Forget queries the uplink never answered; the clients will have retried by now
+    for (uint8_t i = 0; i < DNS_PENDING_MAX; i++) {
+      if (dnsPending[i].used && millis() - dnsPending[i].sentAt > DNS_QUERY_TIMEOUT_MS) {
+        dnsRelease(dnsPending[i]);
+      }
+    }
+  }
+}
+
+void dnsRelease(DnsPending& pq) {
+  close(pq.sock);
+  pq.sock = -1;
+  pq.used = false;
+}
+
+// Socket for one upstream query, on a port picked at random so an off-path spoofer
+// has to guess it on top of the 16-bit ID
+int dnsUpstreamSocket() {
+  for (uint8_t i = 0; i < DNS_SOURCE_PORT_TRIES; i++) {
+    int sock = dnsSocket(0, DNS_SOURCE_PORT_FIRST + esp_random() % (65536 - DNS_SOURCE_PORT_FIRST));
+    if (sock >= 0) return sock;
+  }
+  return -1;
+}
+
+int dnsSocket(uint32_t addr, uint16_t port) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) return -1;
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = addr;
+  local.sin_port = htons(port);
+  if (bind(sock, (struct sockaddr*)&local, sizeof(local)) != 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Skip a possibly compressed name; returns the offset after it, or -1 if malformed
+int dnsSkipName(const uint8_t* msg, size_t len, size_t off) {
+  while (off < len) {
+    uint8_t label = msg[off];
+    if (label == 0) return off + 1;
+    if ((label & 0xC0) == 0xC0) return off + 2 <= len ? (int)off + 2 : -1;
+    off += label + 1;
+  }
+  return -1;
+}
+
+// Parses the single question of a query or response. A name too long for the cache
+// key still parses, with nameLen left at 0. Returns the offset after it, or -1.
+int dnsParseQuestion(const uint8_t* msg, size_t len, DnsQuestion& q) {
+  if (len < 12 || readBE16(msg + 4) != 1) return -1;
+  size_t off = 12;
+  q.nameLen = 0;
+  while (off < len && msg[off] != 0) {
+    uint8_t label = msg[off];
+    if (label & 0xC0 || off + label + 1 >= len) return -1;
+    off += label + 1;
+  }
+  if (off + 5 > len) return -1;
+  size_t nameLen = off + 1 - 12;
+  if (nameLen > DNS_WIRE_NAME_MAX) return -1;
+  bool fits = nameLen <= DNS_NAME_MAX;
+  if (fits) {
+    for (size_t i = 0; i < nameLen; i++) {
+      q.name[i] = tolower(msg[12 + i]);  // Length bytes are < 64, unaffected
+    }
+    q.nameLen = nameLen;
+  }
+  q.type = readBE16(msg + off + 1);
+  q.cls = readBE16(msg + off + 3);
+  q.hash = fits ? esp_rom_crc32_le(q.type << 16 | q.cls, q.name, q.nameLen) : 0;
+  return off + 5;
+}
+
+static inline bool dnsSameQuestion(const DnsQuestion& a, const DnsQuestion& b) {
+  return a.nameLen != 0 && a.hash == b.hash && a.nameLen == b.nameLen && a.type == b.type &&
+         a.cls == b.cls && memcmp(a.name, b.name, a.nameLen) == 0;
+}
+
+// The wire-format question name of a message against a lower-cased copy, ignoring case
+static bool dnsSameName(const uint8_t* msg, int questionEnd, const uint8_t* name, uint8_t nameLen) {
+  if (questionEnd - 4 - 12 != nameLen) return false;
+  for (uint8_t i = 0; i < nameLen; i++) {
+    if (tolower(msg[12 + i]) != name[i]) return false;
+  }
+  return true;
+}
+
+// Walks the resource records after the question. With age > 0 every TTL is lowered by
+// that many seconds (cache hits); minTtl gets the smallest answer/authority TTL.
+bool dnsWalkRecords(uint8_t* msg, size_t len, size_t off, uint32_t age, uint32_t* minTtl) {
+  uint16_t records = readBE16(msg + 6) + readBE16(msg + 8) + readBE16(msg + 10);
+  uint16_t counted = readBE16(msg + 6) + readBE16(msg + 8);
+  uint32_t lowest = UINT32_MAX;
+  for (uint16_t i = 0; i < records; i++) {
+    int next = dnsSkipName(msg, len, off);
+    if (next < 0 || next + 10 > (int)len) return false;
+    off = next;
+    uint16_t type = readBE16(msg + off);
+    uint16_t rdLen = readBE16(msg + off + 8);
+    if (type != 41) {  // OPT carries EDNS flags where the TTL would be
+      uint32_t ttl = (uint32_t)readBE16(msg + off + 4) << 16 | readBE16(msg + off + 6);
+      if (i < counted && ttl < lowest) lowest = ttl;
+      if (age > 0) {
+        ttl = ttl > age ? ttl - age : 0;
+        writeBE16(msg + off + 4, ttl >> 16);
+        writeBE16(msg + off + 6, ttl);
+      }
+    }
+    off += 10 + rdLen;
+    if (off > len) return false;
+  }
+  if (minTtl != NULL) *minTtl = lowest;
+  return true;
+}
+
+void dnsReply(int server, const uint8_t* msg, size_t len, uint32_t addr, uint16_t port) {
+  struct sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = addr;
+  to.sin_port = port;
+  sendto(server, msg, len, 0, (struct sockaddr*)&to, sizeof(to));
+}
+
+void dnsQuery(int server, uint8_t* msg, size_t len, const struct sockaddr_in& from) {
+  // Standard queries only: QR clear, opcode 0, one question
+  if (len < 12 || (msg[2] & 0xF8) != 0) return;
+  DnsQuestion q;
+  int questionEnd = dnsParseQuestion(msg, len, q);
+  if (questionEnd < 0) return;
+  uint16_t clientId = readBE16(msg);
+  uint32_t now = millis();
+  
+  if (q.nameLen != 0) {
+    for (uint8_t i = 0; i < DNS_CACHE_ENTRIES; i++) {
+      DnsCacheEntry& e = dnsCache[i];
+      if (e.ttlMs == 0 || !dnsSameQuestion(e.q, q)) continue;
+      uint32_t age = now - e.storedAt;
+      if (age >= e.ttlMs) {
+        e.ttlMs = 0;
+        break;
+      }
+      // Hit: answer with the client's ID and the TTLs as they stand now
+      static uint8_t answer[DNS_RESPONSE_MAX];
+      memcpy(answer, e.response, e.len);
+      writeBE16(answer, clientId);
+      int off = dnsParseQuestion(answer, e.len, q);
+      if (off > 0) dnsWalkRecords(answer, e.len, off, age / 1000, NULL);
+      dnsReply(server, answer, e.len, from.sin_addr.s_addr, from.sin_port);
+      e.lastUsed = now;
+      dnsHits++;
+      return;
+    }
+    
+    for (uint8_t i = 0; i < DNS_PENDING_MAX; i++) {
+      DnsPending& pq = dnsPending[i];
+      if (!pq.used || !dnsSameQuestion(pq.q, q)) continue;
+      if (pq.waiterCount < DNS_WAITERS_MAX) {
+        DnsWaiter& w = pq.waiters[pq.waiterCount++];
+        w.addr = from.sin_addr.s_addr;
+        w.port = from.sin_port;
+        w.id = clientId;
+        dnsCoalesced++;
+      }
+      return;
+    }
+  }
+  
+  // New question: forward it under our own ID
+  DnsPending* pq = NULL;
+  for (uint8_t i = 0; i < DNS_PENDING_MAX && pq == NULL; i++) {
+    if (!dnsPending[i].used) pq = &dnsPending[i];
+  }
+  esp_netif_dns_info_t dns;
+  if (pq == NULL || staNetifHandle == NULL ||
+      esp_netif_get_dns_info(staNetifHandle, ESP_NETIF_DNS_MAIN, &dns) != ESP_OK || dns.ip.u_addr.ip4.addr == 0) {
+    return;
+  }
+  pq->sock = dnsUpstreamSocket();
+  if (pq->sock < 0) return;
+  
+  pq->q = q;
+  pq->used = true;
+  pq->resolver = dns.ip.u_addr.ip4.addr;
+  pq->upstreamId = esp_random();
+  pq->fullNameLen = questionEnd - 4 - 12;
+  for (uint8_t i = 0; i < pq->fullNameLen; i++) pq->fullName[i] = tolower(msg[12 + i]);
+  pq->sentAt = now;
+  pq->waiterCount = 1;
+  pq->waiters[0].addr = from.sin_addr.s_addr;
+  pq->waiters[0].port = from.sin_port;
+  pq->waiters[0].id = clientId;
+  writeBE16(msg, pq->upstreamId);
+  
+  struct sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = dns.ip.u_addr.ip4.addr;
+  to.sin_port = htons(DNS_PORT);
+  sendto(pq->sock, msg, len, 0, (struct sockaddr*)&to, sizeof(to));
+  dnsMisses++;
+}
+
+// Reply on a pending query's own socket
+void dnsAnswer(int server, DnsPending& pq, uint8_t* msg, size_t len, const struct sockaddr_in& from) {
+  if (len < 12 || !(msg[2] & 0x80) || readBE16(msg) != pq.upstreamId) return;
+  if (from.sin_addr.s_addr != pq.resolver || from.sin_port != htons(DNS_PORT)) return;
+  
+  // The question must match too, byte for byte, or this is a stale or spoofed reply
+  DnsQuestion q;
+  int off = dnsParseQuestion(msg, len, q);
+  if (off < 0 || q.type != pq.q.type || q.cls != pq.q.cls || !dnsSameName(msg, off, pq.fullName, pq.fullNameLen)) return;
+  
+  for (uint8_t i = 0; i < pq.waiterCount; i++) {
+    writeBE16(msg, pq.waiters[i].id);
+    dnsReply(server, msg, len, pq.waiters[i].addr, pq.waiters[i].port);
+  }
+  dnsRelease(pq);
+  
+  // Cache complete NOERROR and NXDOMAIN answers that fit
+  uint8_t rcode = msg[3] & 0x0F;
+  uint32_t ttl;
+  if (q.nameLen == 0 || len > DNS_RESPONSE_MAX || (msg[2] & 0x02) || (rcode != 0 && rcode != 3)) return;
+  if (!dnsWalkRecords(msg, len, off, 0, &ttl)) return;
+  if (rcode == 3 || readBE16(msg + 6) == 0) ttl = std::min<uint32_t>(ttl, DNS_NEGATIVE_TTL);
+  ttl = std::max<uint32_t>(DNS_MIN_TTL, std::min<uint32_t>(ttl, DNS_MAX_TTL));
+  
+  // Least recently used slot, free or expired ones first
+  uint32_t now = millis();
+  DnsCacheEntry* slot = &dnsCache[0];
+  for (uint8_t i = 0; i < DNS_CACHE_ENTRIES; i++) {
+    DnsCacheEntry& e = dnsCache[i];
+    if (e.ttlMs == 0 || now - e.storedAt >= e.ttlMs) {
+      slot = &e;
+      break;
+    }
+    if (now - e.lastUsed > now - slot->lastUsed) slot = &e;
+  }
+  slot->q = q;
+  slot->len = len;
+  slot->storedAt = now;
+  slot->ttlMs = ttl * 1000;
+  slot->lastUsed = now;
+  memcpy(slot->response, msg, len);
+}
+
+// Runs in the lwIP task
+static void dhcpRecv(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, u16_t port) {
+  static uint8_t msg[DHCP_MSG_MAX];
+  uint16_t len = pbuf_copy_partial(p, msg, sizeof(msg), 0);
+  pbuf_free(p);
+  dhcpHandle(msg, len);
+}
+
+void dhcpStart() {
+  if (dhcpPcb != NULL) return;
+  // pcbs may only be touched from the lwIP task
+  tcpip_callback([](void* ctx) {
+    if (dhcpPcb != NULL || apLwipNetif == NULL) return;
+    struct udp_pcb* pcb = udp_new();
+    if (pcb == NULL) return;
+    ip_set_option(pcb, SOF_BROADCAST);
+    if (udp_bind(pcb, IP_ADDR_ANY, DHCP_SERVER_PORT) != ERR_OK) {
+      udp_remove(pcb);
+      return;
+    }
+    udp_bind_netif(pcb, apLwipNetif);
+    udp_recv(pcb, dhcpRecv, NULL);
+    dhcpPcb = pcb;
+  }, NULL);
+}
+
+void dhcpStop() {
+  tcpip_callback([](void* ctx) {
+    if (dhcpPcb == NULL) return;
+    udp_remove(dhcpPcb);
+    dhcpPcb = NULL;
+  }, NULL);
+}
+
+void dhcpHandle(const uint8_t* msg, uint16_t len) {
+  // BOOTREQUEST over Ethernet with the DHCP magic cookie
+  if (len < 241 || msg[0] != 1 || msg[1] != 1 || msg[2] != 6 ||
+      msg[236] != 99 || msg[237] != 130 || msg[238] != 83 || msg[239] != 99) {
+    return;
+  }
+  
+  uint8_t type = 0;
+  uint32_t requested = 0;
+  uint32_t serverId = 0;
+  bool rapidCommit = false;
+  for (uint16_t off = 240; off < len && msg[off] != 255; ) {
+    uint8_t opt = msg[off];
+    if (opt == 0) {
+      off++;
+      continue;
+    }
+    if (off + 2 > len || off + 2 + msg[off + 1] > len) return;
+    uint8_t optLen = msg[off + 1];
+    const uint8_t* val = msg + off + 2;
+    if (opt == 53 && optLen == 1) type = val[0];
+    else if (opt == 50 && optLen == 4) requested = readIPv4(val);
+    else if (opt == 54 && optLen == 4) serverId = readIPv4(val);
+    else if (opt == 80) rapidCommit = true;
+    off += 2 + optLen;
+  }
+  
+  const uint8_t* mac = msg + 28;
+  uint32_t ciaddr = readIPv4(msg + 12);
+  bool known = dhcpFind(mac) >= 0;
+  switch (type) {
+    case DHCPDISCOVER: {
+      uint8_t host = dhcpAssign(mac, dhcpHostOf(requested));
+      if (host == 0) return;
+      if (rapidCommit) {
+        dhcpLease(mac);
+        dhcpReply(msg, DHCPACK, host, true);
+        if (known) dhcpFastAcks++;
+      } else {
+        dhcpReply(msg, DHCPOFFER, host, false);
+      }
+      break;
+    }
+    case DHCPREQUEST: {
+      // Another server's offer was chosen
+      if (serverId != 0 && serverId != (uint32_t)apIP) return;
+      uint8_t wanted = dhcpHostOf(requested ? requested : ciaddr);
+      uint8_t host = dhcpAssign(mac, wanted);
+      if (host != 0 && host == wanted) {
+        dhcpLease(mac);
+        dhcpReply(msg, DHCPACK, host, false);
+        // No server ID: INIT-REBOOT or renewal, the client skipped discovery
+        if (serverId == 0 && known) dhcpFastAcks++;
+      } else {
+        dhcpReply(msg, DHCPNAK, 0, false);
+      }
+      break;
+    }
+    case DHCPINFORM:
+      dhcpReply(msg, DHCPACK, 0, false);
+      break;
+    case DHCPRELEASE:
+    case DHCPDECLINE: {
+      // The binding stays for a released address, so the client gets it back later;
+      // a declined one is in use by someone else and is dropped
+      taskENTER_CRITICAL(&dhcpLock);
+      int i = dhcpFind(mac);
+      if (i >= 0) {
+        dhcpLeaseEnd[i] = 0;
+        if (type == DHCPDECLINE && !(dhcpBindings[i].flags & DHCP_RESERVED)) {
+          dhcpBindings[i].host = 0;
+          dhcpMarkDirty();
+        }
+      }
+      taskEXIT_CRITICAL(&dhcpLock);
+      break;
+    }
+  }
+}
+
+// Host part of an address in the AP subnet, 0 if it isn't one we could hand out
+uint8_t dhcpHostOf(uint32_t addr) {
+  uint32_t net = (uint32_t)apIP;
+  if (addr == 0 || (addr & 0x00FFFFFF) != (net & 0x00FFFFFF)) return 0;  // Network byte order
+  uint8_t host = addr >> 24;
+  if (host == 0 || host == 255 || host == (uint8_t)(net >> 24)) return 0;
+  return host;
+}
+
+int dhcpFind(const uint8_t* mac) {
+  for (uint8_t i = 0; i < DHCP_BINDINGS_MAX; i++) {
+    if (dhcpBindings[i].host != 0 && memcmp(dhcpBindings[i].mac, mac, 6) == 0) return i;
+  }
+  return -1;
+}
+
+bool dhcpHostBound(uint8_t host) {
+  for (uint8_t i = 0; i < DHCP_BINDINGS_MAX; i++) {
+    if (dhcpBindings[i].host == host) return true;
+  }
+  return false;
+}
+
+// The address this MAC should have: its binding if there is one, else the address it
+// asked for if free, else the first free one in the pool. Creates the binding,
+// recycling the longest-expired unreserved one when the table is full.
+uint8_t dhcpAssign(const uint8_t* mac, uint8_t wanted) {
+  taskENTER_CRITICAL(&dhcpLock);
+  int i = dhcpFind(mac);
+  if (i >= 0) {
+    uint8_t host = dhcpBindings[i].host;
+    taskEXIT_CRITICAL(&dhcpLock);
+    return host;
+  }
+  
+  int slot = -1;
+  uint32_t now = millis();
+  for (uint8_t j = 0; j < DHCP_BINDINGS_MAX && slot < 0; j++) {
+    if (dhcpBindings[j].host == 0) slot = j;
+  }
+  if (slot < 0) {
+    // Remembered but not leased since boot sort first, then the oldest expiry
+    uint32_t oldest = 0;
+    for (uint8_t j = 0; j < DHCP_BINDINGS_MAX; j++) {
+      if (dhcpBindings[j].flags & DHCP_RESERVED) continue;
+      uint32_t end = dhcpLeaseEnd[j];
+      if (end != 0 && (long)(now - end) < 0) continue;
+      uint32_t expiredFor = end == 0 ? UINT32_MAX : now - end;
+      if (slot < 0 || expiredFor > oldest) {
+        slot = j;
+        oldest = expiredFor;
+      }
+    }
+  }
+  
+  uint8_t host = 0;
+  if (slot >= 0) {
+    uint8_t poolHost = dhcpBindings[slot].host;  // Reused slot: its address is free now
+    dhcpBindings[slot].host = 0;
+    bool inPool = wanted >= DHCP_POOL_FIRST && wanted < DHCP_POOL_FIRST + DHCP_POOL_SIZE;
+    if (wanted != 0 && inPool && !dhcpHostBound(wanted)) {
+      host = wanted;
+    } else {
+      for (uint8_t h = DHCP_POOL_FIRST; h < DHCP_POOL_FIRST + DHCP_POOL_SIZE && host == 0; h++) {
+        if (dhcpHostOf(((uint32_t)apIP & 0x00FFFFFF) | (uint32_t)h << 24) != 0 && !dhcpHostBound(h)) host = h;
+      }
+      if (host == 0) host = poolHost;
+    }
+  }
+  if (host != 0) {
+    memcpy(dhcpBindings[slot].mac, mac, 6);
+    dhcpBindings[slot].host = host;
+    dhcpBindings[slot].flags = 0;
+    dhcpLeaseEnd[slot] = 0;
+    dhcpMarkDirty();
+  }
+  taskEXIT_CRITICAL(&dhcpLock);
+  return host;
+}
+
+void dhcpLease(const uint8_t* mac) {
+  taskENTER_CRITICAL(&dhcpLock);
+  int i = dhcpFind(mac);
+  if (i >= 0) {
+    dhcpLeaseEnd[i] = (millis() + DHCP_LEASE_SECONDS * 1000UL) | 1;  // Never 0
+  }
+  taskEXIT_CRITICAL(&dhcpLock);
+  dhcpAcks++;
+}
+
+static inline void dhcpPutOption(uint8_t* out, size_t& off, uint8_t opt, const void* val, uint8_t len) {
+  out[off++] = opt;
+  out[off++] = len;
+  memcpy(out + off, val, len);
+  off += len;
+}
+
+void dhcpReply(const uint8_t* req, uint8_t type, uint8_t host, bool rapidCommit) {
+  static uint8_t out[DHCP_REPLY_LEN];
+  memset(out, 0, sizeof(out));
+  out[0] = 2;                                  // BOOTREPLY
+  out[1] = 1;
+  out[2] = 6;
+  memcpy(out + 4, req + 4, 4);                 // xid
+  memcpy(out + 10, req + 10, 2);               // flags
+  if (type != DHCPNAK) memcpy(out + 12, req + 12, 4);  // ciaddr
+  uint32_t server = (uint32_t)apIP;
+  uint32_t yiaddr = host ? (server & 0x00FFFFFF) | (uint32_t)host << 24 : 0;
+  memcpy(out + 16, &yiaddr, 4);
+  memcpy(out + 24, req + 24, 4);               // giaddr
+  memcpy(out + 28, req + 28, 16);              // chaddr
+  out[236] = 99;
+  out[237] = 130;
+  out[238] = 83;
+  out[239] = 99;
+  
+  size_t off = 240;
+  dhcpPutOption(out, off, 53, &type, 1);
+  dhcpPutOption(out, off, 54, &server, 4);
+  if (type != DHCPNAK) {
+    uint32_t mask = (uint32_t)apNetmask;
+    uint32_t dns = server;
+    esp_netif_dns_info_t info;
+    if (!dnsProxy && staNetifHandle != NULL &&
+        esp_netif_get_dns_info(staNetifHandle, ESP_NETIF_DNS_MAIN, &info) == ESP_OK && info.ip.u_addr.ip4.addr != 0) {
+      dns = info.ip.u_addr.ip4.addr;
+    }
+    if (host != 0) {
+      uint32_t lease = htonl(DHCP_LEASE_SECONDS);
+      uint32_t renew = htonl(DHCP_LEASE_SECONDS / 2);
+      dhcpPutOption(out, off, 51, &lease, 4);
+      dhcpPutOption(out, off, 58, &renew, 4);
+    }
+    dhcpPutOption(out, off, 1, &mask, 4);
+    dhcpPutOption(out, off, 3, &server, 4);
+    dhcpPutOption(out, off, 6, &dns, 4);
+    if (rapidCommit) dhcpPutOption(out, off, 80, NULL, 0);
+  }
+  out[off++] = 255;
+  
+  // Clients without an address yet can only be reached by broadcast
+  ip_addr_t dest;
+  uint32_t ciaddr = readIPv4(req + 12);
+  ip_addr_set_ip4_u32(&dest, (type != DHCPNAK && ciaddr != 0) ? ciaddr : IPADDR_BROADCAST);
+  struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, sizeof(out), PBUF_RAM);
+  if (p == NULL) return;
+  pbuf_take(p, out, sizeof(out));
+  udp_sendto_if(dhcpPcb, p, &dest, DHCP_CLIENT_PORT, apLwipNetif);
+  pbuf_free(p);
+}
+
+void dhcpMarkDirty() {
+  if (dhcpDirtySince == 0) dhcpDirtySince = millis() | 1;
+}
+
+void loadLeases() {
+  Preferences prefs;
+  prefs.begin("repeater", true);
+  uint8_t blob[4 + sizeof(dhcpBindings)];
+  size_t len = prefs.getBytes("leases", blob, sizeof(blob));
+  prefs.end();
+  
+  uint32_t crc;
+  memcpy(&crc, blob, 4);
+  if (len != sizeof(blob) || crc != esp_rom_crc32_le(0, blob + 4, sizeof(dhcpBindings))) return;
+  memcpy(dhcpBindings, blob + 4, sizeof(dhcpBindings));
+  
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < DHCP_BINDINGS_MAX; i++) {
+    if (dhcpBindings[i].host != 0) count++;
+  }
+  LOG_INFO("Restored %d DHCP bindings", count);
+}
+
+void commitLeasesIfDue() {
+  if (dhcpDirtySince == 0 || millis() - dhcpDirtySince < DHCP_COMMIT_DELAY_MS) return;
+  
+  uint8_t blob[4 + sizeof(dhcpBindings)];
+  taskENTER_CRITICAL(&dhcpLock);
+  memcpy(blob + 4, dhcpBindings, sizeof(dhcpBindings));
+  dhcpDirtySince = 0;
+  taskEXIT_CRITICAL(&dhcpLock);
+  uint32_t crc = esp_rom_crc32_le(0, blob + 4, sizeof(dhcpBindings));
+  memcpy(blob, &crc, 4);
+  
+  Preferences prefs;
+  prefs.begin("repeater", false);
+  if (prefs.putBytes("leases", blob, sizeof(blob)) != sizeof(blob)) {
+    LOG_ERROR("Failed to save DHCP bindings");
+  }
+  prefs.end();
+}
+
+// Replaces all reservations: [{"mac":"aa:bb:cc:dd:ee:ff","ip":"192.168.4.20"},...]
+void setReservations(JsonArrayConst list) {
+  // Parse first: JSON and address strings have no business inside the spinlock,
+  // which holds off the lwIP task and interrupts on this core
+  DhcpBinding parsed[DHCP_RESERVATIONS_MAX];
+  uint8_t parsedCount = 0;
+  for (JsonObjectConst entry : list) {
+    if (parsedCount == DHCP_RESERVATIONS_MAX) break;
+    DhcpBinding& r = parsed[parsedCount];
+    IPAddress ip;
+    if (!parseMAC(entry["mac"] | "", r.mac) || !ip.fromString(entry["ip"] | "")) continue;
+    r.host = dhcpHostOf((uint32_t)ip);
+    r.flags = DHCP_RESERVED;
+    if (r.host != 0) parsedCount++;
+  }
+  
+  uint8_t count = 0;
+  taskENTER_CRITICAL(&dhcpLock);
+  for (uint8_t i = 0; i < DHCP_BINDINGS_MAX; i++) {
+    dhcpBindings[i].flags &= ~DHCP_RESERVED;
+  }
+  for (uint8_t r = 0; r < parsedCount; r++) {
+    const uint8_t* mac = parsed[r].mac;
+    uint8_t host = parsed[r].host;
+    
+    // Whoever holds the MAC or the address gives it up
+    int slot = -1;
+    for (uint8_t i = 0; i < DHCP_BINDINGS_MAX; i++) {
+      DhcpBinding& b = dhcpBindings[i];
+      if (b.host != 0 && (memcmp(b.mac, mac, 6) == 0 || b.host == host) && !(b.flags & DHCP_RESERVED)) {
+        b.host = 0;
+      }
+      if (b.host == 0 && slot < 0) slot = i;
+    }
+    if (slot < 0) break;
+    dhcpBindings[slot] = parsed[r];
+    dhcpLeaseEnd[slot] = 0;
+    count++;
+  }
+  dhcpMarkDirty();
+  taskEXIT_CRITICAL(&dhcpLock);
+  
+  LOG_INFO("DHCP reservations set: %d", count);
+}
+
+static void configReply(struct udp_pcb* pcb, const ip_addr_t* addr, u16_t port, const uint8_t* data, uint16_t len) {
+  struct pbuf* p = pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+  if (p == NULL) return;
+  pbuf_take(p, data, len);
+  udp_sendto(pcb, p, addr, port);
+  pbuf_free(p);
+}
+
+// Runs in the lwIP task
+static void configRecv(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, u16_t port) {
+  static uint8_t msg[1 + CONFIG_MSG_MAX + CONFIG_HMAC_LEN];
+  uint16_t len = pbuf_copy_partial(p, msg, sizeof(msg), 0);
+  bool oversize = p->tot_len > sizeof(msg);
+  pbuf_free(p);
+  if (len == 0 || oversize || configKey[0] == 0 || bleActive) return;
+  
+  if (msg[0] == 'N' && len == 1) {
+    uint8_t reply[1 + CONFIG_NONCE_LEN] = { 'N' };
+    esp_fill_random(configNonce, sizeof(configNonce));
+    memcpy(reply + 1, configNonce, sizeof(configNonce));
+    configNonceIssued = millis();
+    configNonceValid = true;
+    configReply(pcb, addr, port, reply, sizeof(reply));
+    return;
+  }
+  if (msg[0] != 'C' || len < 1 + 1 + CONFIG_HMAC_LEN) return;
+  
+  // One attempt per nonce, so guessing costs a round trip each
+  bool fresh = configNonceValid && millis() - configNonceIssued < CONFIG_NONCE_MS;
+  configNonceValid = false;
+  uint16_t bodyLen = len - 1 - CONFIG_HMAC_LEN;
+  uint8_t mac[CONFIG_HMAC_LEN];
+  mbedtls_md_context_t md;
+  mbedtls_md_init(&md);
+  int ret = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1);
+  if (ret == 0) ret = mbedtls_md_hmac_starts(&md, (const uint8_t*)configKey, strlen(configKey));
+  if (ret == 0) ret = mbedtls_md_hmac_update(&md, configNonce, sizeof(configNonce));
+  if (ret == 0) ret = mbedtls_md_hmac_update(&md, msg + 1, bodyLen);
+  if (ret == 0) ret = mbedtls_md_hmac_finish(&md, mac);
+  mbedtls_md_free(&md);
+  
+  // Constant time, so the comparison leaks nothing about how much of the tag matched
+  uint8_t diff = ret != 0;
+  for (uint8_t i = 0; i < CONFIG_HMAC_LEN; i++) {
+    diff |= mac[i] ^ msg[1 + bodyLen + i];
+  }
+  uint8_t verdict = 'E';
+  if (fresh && diff == 0) {
+    ConfigMessage config;
+    config.len = bodyLen;
+    memcpy(config.data, msg + 1, bodyLen);
+    if (configQueue.push(config)) {
+      verdict = 'A';
+      wakeSupervisor();
+    }
+  } else {
+    configRejected++;
+  }
+  configReply(pcb, addr, port, &verdict, 1);
+}
+
+void configEndpointStart() {
+  tcpip_callback([](void* ctx) {
+    if (configPcb != NULL) return;
+    struct udp_pcb* pcb = udp_new();
+    if (pcb == NULL) return;
+    // Bound to the AP address: only reachable by AP clients, never from the uplink side
+    ip_addr_t local;
+    ip_addr_set_ip4_u32(&local, (uint32_t)apIP);
+    if (udp_bind(pcb, &local, CONFIG_UDP_PORT) != ERR_OK) {
+      udp_remove(pcb);
+      return;
+    }
+    udp_recv(pcb, configRecv, NULL);
+    configPcb = pcb;
+  }, NULL);
+}
+
+void connectToPrimaryWiFi() {
+  if (uplinkNetworkCount() == 0) {
+    uplinkState = UPLINK_IDLE;
+    return;
+  }
+  if (uplinkActive >= uplinkNetworkCount()) uplinkActive = 0;
+  const char* ssid = uplinkSSIDAt(uplinkActive);
+  const uint8_t* pinned = uplinkBSSIDAt(uplinkActive);
+  
+  LOG_INFO("Connecting to WiFi network %s", ssid);
+  
+  // Prefer the cached PMK over the passphrase so the supplicant skips PBKDF2
+  char pmkHex[65];
+  const char* secret = uplinkPassAt(uplinkActive);
+  fastConnectUsedPMK = fastConnectPMK(pmkHex);
+  if (fastConnectUsedPMK) {
+    secret = pmkHex;
+  }
+  
+  // Non-blocking: the outcome arrives as GOT_IP or DISCONNECTED in superviseUplink()
+  uint8_t channel = 0;
+  const uint8_t* bssid = pinned;
+  if (roamTargetSet) {
+    // The monitor already picked the AP; one shot, a failure falls back to the usual path
+    roamTargetSet = false;
+    channel = roamTargetChannel;
+    bssid = roamTargetBSSID;
+  } else {
+    FastConnectEntry* cached = fastConnectEntry(false);
+    if (cached != NULL && cached->channel != 0 && !fastConnectMiss &&
+        (pinned == NULL || memcmp(pinned, cached->bssid, 6) == 0)) {
+      channel = cached->channel;
+      bssid = cached->bssid;
+    }
+  }
+  fastConnectDirected = channel != 0;
+  if (fastConnectDirected && autoChannel) {
+    // We know where the radio is about to go: move AP clients with it first, and
+    // connect once the AP has moved (a roam target is kept for that attempt)
+    alignAPChannel(channel, true);
+    if (csaChannel != 0) {
+      if (bssid == roamTargetBSSID) roamTargetSet = true;
+      uplinkState = UPLINK_BACKOFF;
+      uplinkDeadline = csaNextAt + csaCount * CSA_INTERVAL_MS;
+      return;
+    }
+  }
+  beginUplink(ssid, secret, channel, bssid);
+  uplinkState = UPLINK_CONNECTING;
+  uplinkAttemptStart = millis();
+  uplinkDeadline = uplinkAttemptStart + UPLINK_ATTEMPT_TIMEOUT_MS;
+}
+
+void beginUplink(const char* ssid, const char* secret, uint8_t channel, const uint8_t* bssid) {
+  // Configure without connecting, so 802.11k/v can be advertised before association
+  WiFi.begin(ssid, secret, channel, bssid, false);
+  wifi_config_t conf;
+  if (esp_wifi_get_config(WIFI_IF_STA, &conf) == ESP_OK) {
+    conf.sta.rm_enabled = 1;
+    conf.sta.btm_enabled = 1;
+    esp_wifi_set_config(WIFI_IF_STA, &conf);
+  }
+  esp_wifi_connect();
+}
+
+uint8_t uplinkNetworkCount() {
+  if (primarySSID.length() == 0) return 0;
+  uint8_t count = 1;
+  while (count < UPLINK_NETWORKS_MAX && uplinkAlternates[count - 1].ssid[0] != 0) count++;
+  return count;
+}
+
+const char* uplinkSSIDAt(uint8_t i) {
+  return i == 0 ? primarySSID.c_str() : uplinkAlternates[i - 1].ssid;
+}
+
+const char* uplinkPassAt(uint8_t i) {
+  return i == 0 ? primaryPassword.c_str() : uplinkAlternates[i - 1].pass;
+}
+
+// NULL when the entry accepts any BSSID
+const uint8_t* uplinkBSSIDAt(uint8_t i) {
+  const uint8_t* bssid = i == 0 ? primaryBSSID : uplinkAlternates[i - 1].bssid;
+  static const uint8_t any[6] = { 0 };
+  return memcmp(bssid, any, 6) == 0 ? NULL : bssid;
+}
+
+static void uplinkProbeSuccess(esp_ping_handle_t hdl, void* args) {
+  uint32_t elapsed;
+  esp_ping_get_profile(hdl, ESP_PING_PROF_TIMEGAP, &elapsed, sizeof(elapsed));
+  uplinkProbeRtt = elapsed;
+  uplinkProbeReplies++;
+}
+
+static void uplinkProbeTimeout(esp_ping_handle_t hdl, void* args) {
+  uplinkProbeLost++;
+}
+
+void startUplinkMonitor() {
+  stopUplinkMonitor();
+  uplinkSamples = 0;
+  uplinkDegradedSamples = 0;
+  roamState = ROAM_IDLE;
+  uplinkNeighborChannels = 0;
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    memcpy(uplinkBSSID, ap.bssid, 6);
+  }
+  
+  // Gateway probe for RTT and loss; runs until the link drops
+  esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+  ip_addr_set_ip4_u32(&config.target_addr, (uint32_t)WiFi.gatewayIP());
+  config.count = ESP_PING_COUNT_INFINITE;
+  config.interval_ms = UPLINK_PROBE_INTERVAL_MS;
+  config.timeout_ms = UPLINK_PROBE_TIMEOUT_MS;
+  config.data_size = 16;
+  esp_ping_callbacks_t cbs = {};
+  cbs.on_ping_success = uplinkProbeSuccess;
+  cbs.on_ping_timeout = uplinkProbeTimeout;
+  if (esp_ping_new_session(&config, &cbs, &uplinkProbe) == ESP_OK) {
+    esp_ping_start(uplinkProbe);
+  } else {
+    uplinkProbe = NULL;
+  }
+}
+
+void stopUplinkMonitor() {
+  if (uplinkProbe != NULL) {
+    esp_ping_stop(uplinkProbe);
+    esp_ping_delete_session(uplinkProbe);
+    uplinkProbe = NULL;
+  }
+  if (roamState == ROAM_SCANNING) {
+    WiFi.scanDelete();
+  }
+  roamState = ROAM_IDLE;
+  uplinkProbeReplies = 0;
+  uplinkProbeLost = 0;
+}
+
+static inline void uplinkAverage(int32_t& avg, int32_t sample, bool first) {
+  avg = first ? sample * 16 : avg + ((sample * 16 - avg) >> UPLINK_EWMA_SHIFT);
+}
+
+void monitorUplink() {
+  if (uplinkState != UPLINK_CONNECTED) return;
+  if (roamState == ROAM_SCANNING) {
+    roamScanStep();
+  } else if (roamState == ROAM_BTM_WAIT && (long)(millis() - roamDeadline) >= 0) {
+    // Not steered (or steered nowhere better): look for ourselves
+    LOG_DEBUG("No BSS transition from the AP, scanning");
+    roamStartScan();
+  }
+  
+  static unsigned long lastSample = 0;
+  if (millis() - lastSample < UPLINK_SAMPLE_MS) return;
+  lastSample = millis();
+  
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return;
+  if (memcmp(ap.bssid, uplinkBSSID, 6) != 0) {
+    // The supplicant roamed on its own (a BSS transition request from the AP)
+    memcpy(uplinkBSSID, ap.bssid, 6);
+    uplinkRoams++;
+    uplinkSamples = 0;
+    uplinkDegradedSamples = 0;
+    roamState = ROAM_IDLE;
+    LOG_INFO("Uplink transitioned to " MAC_FMT, MAC_ARGS(ap.bssid));
+    recordFastConnect();
+    checkChannelAlignment();
+  }
+  
+  bool first = uplinkSamples == 0;
+  uplinkAverage(uplinkRssiAvg, ap.rssi, first);
+  uint16_t replies = uplinkProbeReplies.exchange(0);
+  uint16_t lost = uplinkProbeLost.exchange(0);
+  if (replies) uplinkAverage(uplinkRttAvg, uplinkProbeRtt, first);
+  if (replies + lost) uplinkAverage(uplinkLossAvg, lost * 100 / (replies + lost), first);
+  if (uplinkSamples < UPLINK_WARMUP_SAMPLES) {
+    uplinkSamples++;
+    return;
+  }
+  
+  // Which symptom decides the reason we give the AP
+  int8_t rssi = uplinkRssiAvg / 16;
+  uint8_t reason = ROAM_REASON_NONE;
+  if (uplinkLossAvg >= UPLINK_DEGRADED_LOSS_PCT * 16) reason = ROAM_REASON_LOSS;
+  else if (rssi <= UPLINK_DEGRADED_RSSI_DBM) reason = ROAM_REASON_RSSI;
+  else if (uplinkRttAvg >= UPLINK_DEGRADED_RTT_MS * 16) reason = ROAM_REASON_DELAY;
+  uplinkDegradedSamples = reason ? uplinkDegradedSamples + (uplinkDegradedSamples < 255) : 0;
+  
+  if (roamState != ROAM_IDLE || millis() - lastRoamAttempt < UPLINK_ROAM_HOLDOFF_MS) return;
+  if (uplinkDegradedSamples >= UPLINK_DEGRADED_SAMPLES) {
+    lastRoamAttempt = millis();
+    roamReason = reason;
+    LOG_WARN("Uplink degraded (RSSI %d dBm, RTT %ld ms, loss %ld%%), looking for a better AP",
+             rssi, (long)(uplinkRttAvg / 16), (long)(uplinkLossAvg / 16));
+    roamBegin();
+  } else if (uplinkActive != 0 && millis() - lastRoamAttempt >= UPLINK_PREFERRED_SCAN_MS) {
+    // On a fallback network: see whether a preferred one is back in range
+    lastRoamAttempt = millis();
+    roamReason = ROAM_REASON_NONE;
+    roamStartScan();
+  }
+}
+
+#if CONFIG_WPA_11KV_SUPPORT
+// Neighbor report elements (ID 52): BSSID, BSSID info, operating class, channel, PHY type
+static void roamNeighborReport(void* ctx, const uint8_t* report, size_t len) {
+  uint16_t channels = 0;
+  for (size_t off = 0; report != NULL && off + 2 <= len; off += 2 + report[off + 1]) {
+    if (report[off] != 52 || report[off + 1] < 13 || off + 2 + report[off + 1] > len) continue;
+    uint8_t channel = report[off + 2 + 11];
+    if (channel >= 1 && channel <= 13) channels |= 1 << channel;
+  }
+  uplinkNeighborChannels = channels;
+}
+#endif
+
+void roamBegin() {
+#if CONFIG_WPA_11KV_SUPPORT
+  if (esp_rrm_is_rrm_supported_connection()) {
+    esp_rrm_send_neighbor_rep_request(roamNeighborReport, NULL);
+  }
+  btm_query_reason query = roamReason == ROAM_REASON_LOSS ? REASON_FRAME_LOSS :
+                           roamReason == ROAM_REASON_RSSI ? REASON_RSSI : REASON_DELAY;
+  if (esp_wnm_is_btm_supported_connection() && esp_wnm_send_bss_transition_mgmt_query(query, NULL, 0) == 0) {
+    // The AP knows its neighbours' load as well as their signal; let it pick first
+    roamState = ROAM_BTM_WAIT;
+    roamDeadline = millis() + UPLINK_BTM_WAIT_MS;
+    return;
+  }
+#endif
+  roamStartScan();
+}
+
+void roamStartScan() {
+  // Only the channels the AP reported neighbours on, plus our own; otherwise everything
+  uint16_t neighbors = uplinkNeighborChannels;
+  // Roaming takes the scanner over from a PHY survey; the survey just runs again later
+  phySurveying = false;
+  phySurveyChannels = 0;
+  roamScanChannels = neighbors ? neighbors | 1 << activeAPChannel : UPLINK_SCAN_ALL_CHANNELS;
+  roamBestIndex = -1;
+  roamBestRSSI = -128;
+  roamState = ROAM_SCANNING;
+  roamScanNext();
+}
+
+void roamScanNext() {
+  if (roamScanChannels == 0) {
+    roamState = ROAM_IDLE;
+    roamDecide();
+    return;
+  }
+  uint8_t channel = __builtin_ctz(roamScanChannels);
+  roamScanChannels &= roamScanChannels - 1;
+  if (WiFi.scanNetworks(true, false, false, UPLINK_SCAN_DWELL_MS, channel) == WIFI_SCAN_FAILED) {
+    roamState = ROAM_IDLE;
+  }
+}
+
+void roamScanStep() {
+  int16_t found = WiFi.scanComplete();
+  if (found == WIFI_SCAN_RUNNING) return;
+  if (found == WIFI_SCAN_FAILED) {
+    roamState = ROAM_IDLE;
+    return;
+  }
+  
+  // Highest-priority network with a usable signal wins, the strongest AP among its BSSIDs
+  uint8_t count = uplinkNetworkCount();
+  for (int16_t i = 0; i < found; i++) {
+    int8_t rssi = WiFi.RSSI(i);
+    if (rssi < UPLINK_USABLE_RSSI_DBM) continue;
+    String ssid = WiFi.SSID(i);
+    const uint8_t* bssid = WiFi.BSSID(i);
+    for (int8_t n = 0; n < count; n++) {
+      const uint8_t* pinned = uplinkBSSIDAt(n);
+      if (ssid != uplinkSSIDAt(n) || (pinned != NULL && memcmp(pinned, bssid, 6) != 0)) continue;
+      if (roamBestIndex < 0 || n < roamBestIndex || (n == roamBestIndex && rssi > roamBestRSSI)) {
+        roamBestIndex = n;
+        roamBestRSSI = rssi;
+        memcpy(roamBestBSSID, bssid, 6);
+        roamBestChannel = WiFi.channel(i);
+      }
+      break;
+    }
+  }
+  WiFi.scanDelete();
+  roamScanNext();
+}
+
+void roamDecide() {
+  if (roamBestIndex < 0 || memcmp(roamBestBSSID, uplinkBSSID, 6) == 0) return;
+  
+  // A preferred network wins on being usable; otherwise the move has to be worth the
+  // gap, and dropping to a less preferred network only happens off a degraded link
+  bool preferred = roamBestIndex < uplinkActive;
+  bool stronger = roamBestRSSI >= uplinkRssiAvg / 16 + UPLINK_ROAM_MARGIN_DB;
+  bool demotion = roamBestIndex > uplinkActive;
+  if (!preferred && (!stronger || (demotion && roamReason == ROAM_REASON_NONE))) return;
+  
+  LOG_INFO("Roaming to %s " MAC_FMT " on channel %d (%d dBm)", uplinkSSIDAt(roamBestIndex),
+           MAC_ARGS(roamBestBSSID), roamBestChannel, roamBestRSSI);
+  
+  uplinkRoams++;
+  uplinkActive = roamBestIndex;
+  memcpy(roamTargetBSSID, roamBestBSSID, 6);
+  roamTargetChannel = roamBestChannel;
+  roamTargetSet = true;
+  // The disconnect event takes the usual reconnect path, straight to the target
+  WiFi.disconnect();
+}
+
+uint32_t credentialHashAt(uint8_t index) {
+  const char* ssid = uplinkSSIDAt(index);
+  const char* pass = uplinkPassAt(index);
+  uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)ssid, strlen(ssid) + 1);
+  crc = esp_rom_crc32_le(crc, (const uint8_t*)pass, strlen(pass));
+  return crc != 0 ? crc : 1;  // 0 marks a free entry
+}
+
+uint32_t credentialHash() {
+  return credentialHashAt(uplinkActive);
+}
+
+// The active network's entry. With claim, one is made for it if there is none,
+// reusing an entry no configured network owns any more (the oldest network's
+// credentials changed) or, failing that, the first.
+FastConnectEntry* fastConnectEntry(bool claim) {
+  uint32_t hash = credentialHash();
+  for (uint8_t i = 0; i < UPLINK_NETWORKS_MAX; i++) {
+    if (fastConnect.entries[i].credentialHash == hash) return &fastConnect.entries[i];
+  }
+  if (!claim) return NULL;
+  
+  FastConnectEntry* slot = &fastConnect.entries[0];
+  for (uint8_t i = 0; i < UPLINK_NETWORKS_MAX; i++) {
+    bool owned = false;
+    for (uint8_t n = 0; n < uplinkNetworkCount() && !owned; n++) {
+      owned = fastConnect.entries[i].credentialHash == credentialHashAt(n);
+    }
+    if (!owned) {
+      slot = &fastConnect.entries[i];
+      break;
+    }
+  }
+  memset(slot, 0, sizeof(*slot));
+  slot->credentialHash = hash;
+  return slot;
+}
+
+uint32_t fastConnectChecksum() {
+  return esp_rom_crc32_le(0, (const uint8_t*)&fastConnect, offsetof(FastConnectCache, crc));
+}
+
+void loadFastConnectCache() {
+  // RTC memory survives soft resets; after power loss fall back to the NVS copy
+  if (fastConnect.magic == FAST_CONNECT_MAGIC && fastConnect.crc == fastConnectChecksum()) return;
+  
+  Preferences prefs;
+  prefs.begin("fastconn", true);
+  size_t len = prefs.getBytes("cache", &fastConnect, sizeof(fastConnect));
+  prefs.end();
+  
+  if (len != sizeof(fastConnect) || fastConnect.magic != FAST_CONNECT_MAGIC || fastConnect.crc != fastConnectChecksum()) {
+    memset(&fastConnect, 0, sizeof(fastConnect));
+  }
+}
+
+void saveFastConnectCache(bool persist) {
+  fastConnect.magic = FAST_CONNECT_MAGIC;
+  fastConnect.crc = fastConnectChecksum();
+  if (!persist) return;
+  
+  Preferences prefs;
+  prefs.begin("fastconn", false);
+  prefs.putBytes("cache", &fastConnect, sizeof(fastConnect));
+  prefs.end();
+}
+
+bool fastConnectPMK(char* hexOut) {
+  // Only WPA/WPA2-PSK passphrases go through PBKDF2; open networks and raw PSKs don't
+  const char* ssid = uplinkSSIDAt(uplinkActive);
+  const char* pass = uplinkPassAt(uplinkActive);
+  FastConnectEntry* cached = fastConnectEntry(false);
+  if (strlen(pass) < 8 || strlen(pass) > 63 || (cached != NULL && cached->pmkRejected)) return false;
+  
+  // New credentials get an entry of their own; the other networks' stay as they are
+  if (cached == NULL) cached = fastConnectEntry(true);
+  if (!cached->pmkValid) {
+    // Derive once per credential set; this is the cost every attempt used to pay
+    mbedtls_md_context_t md;
+    mbedtls_md_init(&md);
+    int ret = mbedtls_md_setup(&md, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), 1);
+    if (ret == 0) {
+      ret = mbedtls_pkcs5_pbkdf2_hmac(&md, (const uint8_t*)pass, strlen(pass),
+                                      (const uint8_t*)ssid, strlen(ssid),
+                                      4096, sizeof(cached->pmk), cached->pmk);
+    }
+    mbedtls_md_free(&md);
+    if (ret != 0) return false;
+    cached->pmkValid = 1;
+    saveFastConnectCache(true);
+  }
+  
+  for (int i = 0; i < 32; i++) {
+    sprintf(hexOut + i * 2, "%02x", cached->pmk[i]);
+  }
+  return true;
+}
+
+void recordFastConnect() {
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) return;
+  
+  // Only touch flash when the AP actually changed
+  FastConnectEntry* cached = fastConnectEntry(true);
+  bool changed = cached->channel != ap.primary || memcmp(cached->bssid, ap.bssid, 6) != 0;
+  cached->channel = ap.primary;
+  memcpy(cached->bssid, ap.bssid, 6);
+  saveFastConnectCache(changed);
+}
+
+void fastConnectFailed(uint8_t reason) {
+  // A directed attempt that failed means the AP moved; scan on the next one
+  if (fastConnectDirected) {
+    fastConnectMiss = true;
+  }
+  
+  // A handshake failure with the PMK (e.g. a WPA3-only AP) sends every later attempt
+  // with these credentials to the passphrase. Flagged once, so a flapping uplink
+  // neither reruns PBKDF2 nor writes flash on each retry.
+  FastConnectEntry* cached = fastConnectEntry(false);
+  if (fastConnectUsedPMK && cached != NULL && !cached->pmkRejected &&
+      (reason == WIFI_REASON_AUTH_FAIL || reason == WIFI_REASON_MIC_FAILURE ||
+       reason == WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT || reason == WIFI_REASON_HANDSHAKE_TIMEOUT)) {
+    cached->pmkRejected = 1;
+    saveFastConnectCache(true);
+    LOG_WARN("Uplink refused the cached PMK, connecting with the passphrase");
+  }
+}
+
+void applySettings(uint32_t dirty) {
+  if (dirty & CFG_DIRTY_AP_IDENTITY) {
+    // A new SSID or passphrase can't be applied without dropping everyone, so restart
+    // the softAP outright; that also picks up channel and client limit changes
+    WiFi.softAPConfig(apIP, apIP, apNetmask);
+    effectiveMaxClients = budgetMaxClients();
+    activeAPChannel = desiredAPChannel();
+    csaChannel = 0;
+    WiFi.softAP(apSSID.c_str(), apPassword.c_str(), activeAPChannel, 0, effectiveMaxClients);
+    
+    // Restarting the softAP resets its DHCP options, TX power and PHY; re-arm them
+    setupForwarding();
+    applyTxPower();
+    applyPhyMode();
+  } else {
+    if (dirty & CFG_DIRTY_CHANNEL) {
+      // With autoChannel on and the uplink up the radio is pinned to the uplink's channel
+      uint8_t channel = desiredAPChannel();
+      wifi_second_chan_t second;
+      if (autoChannel && isPrimaryConnected) esp_wifi_get_channel(&channel, &second);
+      alignAPChannel(channel, true);
+    }
+    
+    if (dirty & CFG_DIRTY_MAX_CLIENTS) {
+      applyMaxClients();
+    }
+    
+    if (dirty & CFG_DIRTY_FORWARDING) {
+      setupForwarding();
+    }
+    
+    if (dirty & CFG_DIRTY_TX_POWER) {
+      applyTxPower();
+    }
+  }
+  
+  if (dirty & CFG_DIRTY_PHY) {
+    // Off puts everything back to fixed: full txPower, HT20, all rates
+    phyTxPower = TX_POWER_MAX_DBM;
+    phyClearSurveys = 0;
+    phyBandwidth = 20;
+    phy11b = true;
+    applyPhyMode();
+    applyTxPower();
+  }
+  
+  if (dirty & CFG_DIRTY_EGRESS) {
+    applyEgressRates();
+  }
+  
+  if (dirty & CFG_DIRTY_RADIO) {
+    applyCoexPolicy();
+    // Re-evaluate the schedule now rather than at the next mode change
+    if (advMode == ADV_FAST || advMode == ADV_SLOW || advMode == ADV_OFF) {
+      setAdvertising(advertisingModeNow());
+    }
+  }
+  
+  if (dirty & CFG_DIRTY_POWER) {
+    applyPowerSavingSettings();
+  }
+  
+  // Reconnect to primary WiFi if credentials changed
+  if (dirty & CFG_DIRTY_UPLINK) {
+    WiFi.disconnect();
+    isPrimaryConnected = false;
+    uplinkFailures = 0;
+    uplinkActive = 0;
+    roamTargetSet = false;
+    stopUplinkMonitor();
+    fastConnectMiss = false;
+    connectToPrimaryWiFi();
+  }
+  
+  // Update BLE status
+  updateBLEStatus();
+}
+
+void applyMaxClients() {
+  // Takes effect for new associations; stations already above a lowered limit stay on
+  effectiveMaxClients = budgetMaxClients();
+  wifi_config_t conf;
+  esp_wifi_get_config(WIFI_IF_AP, &conf);
+  if (conf.ap.max_connection == effectiveMaxClients) return;
+  conf.ap.max_connection = effectiveMaxClients;
+  if (esp_wifi_set_config(WIFI_IF_AP, &conf) == ESP_OK) {
+    LOG_INFO("AP client limit now %d", effectiveMaxClients);
+  }
+}
+
+void applyEgressRates() {
+  // Stations keep their slot and queue; only the cap and its bucket are reset
+  uint32_t now = esp_timer_get_time();
+  taskENTER_CRITICAL(&egressLock);
+  for (uint8_t i = 0; i < EGRESS_STATIONS; i++) {
+    EgressStation& st = egressStations[i];
+    if (!st.used) continue;
+    st.rateKbps = egressRateFor(st.mac);
+    st.tokens = egressBurst(st.rateKbps);
+    st.refillAt = now;
+  }
+  taskEXIT_CRITICAL(&egressLock);
+}
+
+bool parseMAC(const char* text, uint8_t* mac) {
+  unsigned int b[6];
+  if (sscanf(text, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) return false;
+  for (uint8_t i = 0; i < 6; i++) {
+    if (b[i] > 0xFF) return false;
+    mac[i] = b[i];
+  }
+  return true;
+}
+
+void applyTxPower() {
+  uint8_t dbm = (phyAuto && phyTxPower < txPower) ? phyTxPower : txPower;
+  // The driver takes quarter-dBm steps and rounds to what the PHY supports
+  if (esp_wifi_set_max_tx_power(dbm * 4) != ESP_OK) {
+    LOG_ERROR("Failed to set TX power");
+    return;
+  }
+  phyTxApplied = dbm;
+}
+
+// Bandwidth and protocol for the AP, as the tuner (or the fixed defaults) last chose
+void applyPhyMode() {
+  esp_wifi_set_bandwidth(WIFI_IF_AP, phyBandwidth == 40 ? WIFI_BW_HT40 : WIFI_BW_HT20);
+  if (phy11bFixed) return;
+  uint8_t protocols = WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N | (phy11b ? WIFI_PROTOCOL_11B : 0);
+  if (esp_wifi_set_protocol(WIFI_IF_AP, protocols) != ESP_OK && !phy11b) {
+    // Some driver versions only take b, bg or bgn
+    LOG_WARN("AP can't run without 11b on this driver");
+    phy11bFixed = true;
+    phy11b = true;
+  }
+}
+
+// The AP's current secondary channel, or none when HT40 isn't possible: while the uplink
+// is up the radio sits on its channel pair, so only an HT40 uplink leaves room
+static uint8_t phySecondaryChannel() {
+  uint8_t primary;
+  wifi_second_chan_t second = WIFI_SECOND_CHAN_NONE;
+  if (isPrimaryConnected) {
+    if (esp_wifi_get_channel(&primary, &second) != ESP_OK) return 0;
+  } else {
+    primary = activeAPChannel;
+    second = primary <= 7 ? WIFI_SECOND_CHAN_ABOVE : WIFI_SECOND_CHAN_BELOW;
+  }
+  if (second == WIFI_SECOND_CHAN_ABOVE && primary <= 9) return primary + 4;
+  if (second == WIFI_SECOND_CHAN_BELOW && primary >= 5) return primary - 4;
+  return 0;
+}
+
+// Survey of the primary and secondary channel, one per-channel scan at a time so
+// the AP is never away for long; skipped while roaming owns the scanner
+void phyStartSurvey() {
+  lastPhySurvey = millis();
+  phySurveySecond = phySecondaryChannel();
+  if (phySurveySecond == 0 || roamState == ROAM_SCANNING) {
+    phyNeighbors = -1;
+    return;
+  }
+  phySurveyChannels = (1 << activeAPChannel) | (1 << phySurveySecond);
+  phySurveyCount = 0;
+  phySurveying = true;
+  phySurveyNext();
+}
+
+void phySurveyNext() {
+  if (phySurveyChannels == 0) {
+    phySurveying = false;
+    phyNeighbors = phySurveyCount;
+    phyClearSurveys = phyNeighbors <= PHY_HT40_MAX_NEIGHBORS ? phyClearSurveys + 1 : 0;
+    LOG_DEBUG("PHY survey: %d neighbours on channels %d+%d", phyNeighbors, activeAPChannel, phySurveySecond);
+    return;
+  }
+  uint8_t channel = __builtin_ctz(phySurveyChannels);
+  phySurveyChannels &= phySurveyChannels - 1;
+  if (WiFi.scanNetworks(true, false, false, PHY_SURVEY_DWELL_MS, channel) == WIFI_SCAN_FAILED) {
+    phySurveying = false;
+  }
+}
+
+void phySurveyStep() {
+  int16_t found = WiFi.scanComplete();
+  if (found == WIFI_SCAN_RUNNING) return;
+  if (found == WIFI_SCAN_FAILED) {
+    phySurveying = false;
+    return;
+  }
+  for (int16_t i = 0; i < found; i++) {
+    // Our own uplink doesn't count: it's the same conversation
+    if (isPrimaryConnected && memcmp(WiFi.BSSID(i), uplinkBSSID, 6) == 0) continue;
+    if (WiFi.RSSI(i) >= PHY_NEIGHBOR_RSSI_DBM) phySurveyCount++;
+  }
+  WiFi.scanDelete();
+  phySurveyNext();
+}
+
+// Two seconds of station data in: pick TX power, bandwidth and 11b
+void tunePhy() {
+  if (!phyAuto) return;
+  if (phySurveying) return;
+  if (millis() - lastPhySurvey >= PHY_SURVEY_MS || lastPhySurvey == 0) {
+    phyStartSurvey();
+    if (phySurveying) return;
+  }
+  
+  // Power the weakest link needs; an empty AP keeps full power so it can be found
+  int need = TX_POWER_MIN_DBM;
+  bool anyStation = false;
+  bool all11bFree = true;
+  for (uint8_t i = 0; i < STATION_SLOTS; i++) {
+    StationStat& st = stationStats[i];
+    if (!st.used.load(std::memory_order_relaxed)) continue;
+    anyStation = true;
+    int loss = PHY_CLIENT_TX_DBM - st.rssi;
+    int dbm = PHY_TARGET_RSSI_DBM + loss + PHY_POWER_MARGIN_DB;
+    if (dbm > need) need = dbm;
+    if (!(st.flags & (STATION_11G | STATION_11N))) all11bFree = false;
+  }
+  if (!anyStation) need = TX_POWER_MAX_DBM;
+  if (uplinkStat.used.load(std::memory_order_relaxed)) {
+    int dbm = PHY_TARGET_RSSI_DBM + PHY_UPLINK_TX_DBM - uplinkStat.rssi + PHY_POWER_MARGIN_DB;
+    if (dbm > need) need = dbm;
+  }
+  if (need > TX_POWER_MAX_DBM) need = TX_POWER_MAX_DBM;
+  // Up at once, down one step at a time, so a station that moved away isn't stranded
+  if (need >= phyTxPower + PHY_POWER_STEP_DB) {
+    phyTxPower = need;
+    applyTxPower();
+  } else if (need <= phyTxPower - PHY_POWER_STEP_DB) {
+    phyTxPower -= PHY_POWER_STEP_DB;
+    applyTxPower();
+  }
+  
+  uint8_t bandwidth = 20;
+  if (phySecondaryChannel() != 0 && phyNeighbors >= 0 && phyClearSurveys >= PHY_HT40_CLEAR_SURVEYS) {
+    bandwidth = 40;
+  }
+  // Stations only learn they may use 11b again once it's back, so 11b stays on while idle
+  bool use11b = phy11bFixed || !anyStation || !all11bFree;
+  if (bandwidth != phyBandwidth || use11b != phy11b) {
+    LOG_INFO("PHY: HT%d, 11b %s", bandwidth, use11b ? "on" : "off");
+    phyBandwidth = bandwidth;
+    phy11b = use11b;
+    applyPhyMode();
+  }
+}
+
+void applyPowerSavingSettings() {
+  if (!powerGovernor && governorSavedMhz != 0 && !idleMode) {
+    // The governor is off: the clock goes back to what it was before (exitIdle gets here too)
+    if (getCpuFrequencyMhz() != governorSavedMhz) setCpuFrequencyMhz(governorSavedMhz);
+    governorSavedMhz = 0;
+  }
+  
+  if (powerGovernor) {
+    applyGovernorLevel(governorLevel);
+    LOG_INFO("Power governor active");
+  } else if (powerSavingEnabled) {
+    // Set power save mode
+    setPowerSaveMode((wifi_ps_type_t)powerSaveMode);
+    
+    // Set listen interval (advanced)
+    setListenInterval(listenInterval);
+    
+    LOG_INFO("Power saving mode applied");
+  } else {
+    // Disable power saving
+    setPowerSaveMode(WIFI_PS_NONE);
+    LOG_INFO("Power saving disabled");
+  }
+}
+
+void setPowerSaveMode(wifi_ps_type_t mode) {
+  // With BLE running the coexistence layer requires modem sleep and rejects NONE
+  if (esp_wifi_set_ps(mode) != ESP_OK && mode == WIFI_PS_NONE) {
+    mode = WIFI_PS_MIN_MODEM;
+    esp_wifi_set_ps(mode);
+  }
+  activePsMode = mode;
+}
+
+void setListenInterval(uint8_t interval) {
+  // Sent in the association request, so a change applies from the next (re)association
+  wifi_config_t conf;
+  esp_wifi_get_config(WIFI_IF_STA, &conf);
+  if (conf.sta.listen_interval == interval) return;
+  conf.sta.listen_interval = interval;
+  esp_wifi_set_config(WIFI_IF_STA, &conf);
+}
+
+void applyGovernorLevel(uint8_t level) {
+  const GovernorLevel& l = governorLevels[level];
+  if (governorSavedMhz == 0) governorSavedMhz = idleMode ? idleSavedMhz : getCpuFrequencyMhz();
+  setPowerSaveMode(l.psMode);
+  setListenInterval(l.listenInterval);
+  if (getCpuFrequencyMhz() != l.cpuMhz) {
+    setCpuFrequencyMhz(l.cpuMhz);
+  }
+}
+
+// Arduino event task: a station joining, or probing close enough to be a likely client.
+// Probe events are only unmasked while idle.
+void onIdleWakeEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  if (event == ARDUINO_EVENT_WIFI_AP_STACONNECTED) bootMark(BOOT_FIRST_CLIENT);
+  if (!idleMode) return;
+  if (event == ARDUINO_EVENT_WIFI_AP_PROBEREQRECVED && info.wifi_ap_probereqrecved.rssi < IDLE_WAKE_RSSI_DBM) return;
+  idleWakeRequested = true;
+  wakeSupervisor();
+}
+
+static void configureClock(uint16_t maxMhz, uint16_t minMhz, bool lightSleep) {
+#if CONFIG_PM_ENABLE
+  esp_pm_config_esp32_t pm = { (int)maxMhz, (int)minMhz, lightSleep };
+  if (esp_pm_configure(&pm) == ESP_OK) return;
+#endif
+  // No power management in this build: a fixed clock is the best there is
+  if (getCpuFrequencyMhz() != maxMhz) setCpuFrequencyMhz(maxMhz);
+}
+
+void enterIdle() {
+  idleMode = true;
+  idleEnteredAt = millis();
+  idleEntries++;
+  idleSavedMhz = getCpuFrequencyMhz();
+  setPowerSaveMode(WIFI_PS_MAX_MODEM);
+  setListenInterval(IDLE_LISTEN_INTERVAL);
+  esp_wifi_set_event_mask(WIFI_EVENT_MASK_NONE);  // Deliver probe requests
+  configureClock(IDLE_MAX_MHZ, IDLE_MIN_MHZ, true);
+  LOG_INFO("Idle mode: no clients for %d s", idleAfterSec);
+}
+
+void exitIdle(const char* why) {
+  idleMode = false;
+  idleCandidateSince = 0;
+  idleTotalSec += (millis() - idleEnteredAt) / 1000;
+  configureClock(idleSavedMhz, idleSavedMhz, false);
+  esp_wifi_set_event_mask(WIFI_EVENT_MASK_AP_PROBEREQRECVED);
+  applyPowerSavingSettings();
+  LOG_INFO("Leaving idle mode (%s) after %lu s", why, (millis() - idleEnteredAt) / 1000);
+  updateBLEStatus();
+}
+
+// Supervisor, every wakeup: leave idle on any sign of use, enter it after a quiet spell
+void superviseIdle() {
+  bool quiet = WiFi.softAPgetStationNum() == 0 && !deviceConnected && governorPps < GOV_BAL_EXIT_PPS &&
+               benchResult.state != BENCH_RUNNING && roamState == ROAM_IDLE && !phySurveying;
+  if (idleMode) {
+    if (idleWakeRequested.exchange(false)) {
+      bool station = WiFi.softAPgetStationNum() > 0;
+      exitIdle(station ? "station" : "probe");
+      // A probe alone only buys a short hold before going back to idle
+      idleProbeWake = !station;
+      idleHoldUntil = millis() + IDLE_PROBE_HOLD_MS;
+    } else if (!quiet || idleAfterSec == 0) {
+      exitIdle(deviceConnected ? "BLE" : "activity");
+    }
+    return;
+  }
+  idleWakeRequested = false;
+  
+  if (!quiet || idleAfterSec == 0) {
+    idleCandidateSince = 0;
+    idleProbeWake = false;
+    return;
+  }
+  if (idleCandidateSince == 0) idleCandidateSince = millis() | 1;
+  bool due = idleProbeWake ? (long)(millis() - idleHoldUntil) >= 0
+                           : millis() - idleCandidateSince >= (unsigned long)idleAfterSec * 1000;
+  if (due) {
+    idleProbeWake = false;
+    enterIdle();
+  }
+}
+
+void runGovernor(unsigned long elapsedMs) {
+  static uint32_t lastPackets = 0;
+  
+  MetricsTotals totals;
+  collectMetrics(totals);
+  uint32_t packets = totals.rxPackets[DIR_UP] + totals.rxPackets[DIR_DOWN];
+  governorPps = elapsedMs ? (uint64_t)(packets - lastPackets) * 1000 / elapsedMs : 0;
+  lastPackets = packets;
+  
+  // Idle mode owns the clock and modem settings until it wakes
+  if (!powerGovernor || idleMode) return;
+  
+  uint8_t clients = WiFi.softAPgetStationNum();
+  uint8_t target;
+  if (governorPps >= GOV_PERF_ENTER_PPS) {
+    target = GOV_PERFORMANCE;
+  } else if (governorPps >= GOV_BAL_ENTER_PPS || clients > 0) {
+    target = GOV_BALANCED;
+  } else {
+    target = GOV_POWERSAVE;
+  }
+  
+  // The exit thresholds sit below the entry ones so a level doesn't flap on its boundary
+  bool calm = (governorLevel == GOV_PERFORMANCE && governorPps < GOV_PERF_EXIT_PPS) ||
+              (governorLevel == GOV_BALANCED && governorPps < GOV_BAL_EXIT_PPS && clients == 0);
+  
+  uint8_t next = governorLevel;
+  if (target < governorLevel) {
+    next = target;
+    governorCalmSamples = 0;
+  } else if (target > governorLevel && calm) {
+    if (++governorCalmSamples >= GOVERNOR_DOWN_SAMPLES) {
+      next = governorLevel + 1;
+      governorCalmSamples = 0;
+    }
+  } else {
+    governorCalmSamples = 0;
+  }
+  
+  if (next != governorLevel) {
+    governorLevel = next;
+    applyGovernorLevel(next);
+    LOG_DEBUG("Power governor: %s at %lu pkt/s", governorLevelName(next), (unsigned long)governorPps);
+    updateBLEStatus();
+  }
+}
+
+void sampleEgress(unsigned long elapsedMs) {
+  for (uint8_t i = 0; i < EGRESS_STATIONS; i++) {
+    EgressStation& st = egressStations[i];
+    uint32_t bytes = st.txBytes.load(std::memory_order_relaxed);
+    uint32_t kbps = elapsedMs ? (uint64_t)(bytes - st.sampledBytes) * 8 / elapsedMs : 0;
+    st.kbps = kbps > 0xFFFF ? 0xFFFF : kbps;
+    st.sampledBytes = bytes;
+  }
+}
+
+// Rough PHY rate for a link from its RSSI, in 100 kbit/s: the highest HT20 MCS (or
+// 11g rate) whose typical receive sensitivity the signal clears
+uint16_t estimatePhyRate(int8_t rssi, uint8_t flags) {
+  static const int8_t htRssi[] = { -64, -65, -66, -70, -74, -77, -79, -82 };
+  static const uint16_t htRate[] = { 650, 585, 520, 390, 260, 195, 130, 65 };
+  static const int8_t ofdmRssi[] = { -65, -66, -70, -74, -77, -79, -81, -82 };
+  static const uint16_t ofdmRate[] = { 540, 480, 360, 240, 180, 120, 90, 60 };
+  const int8_t* limits = (flags & STATION_11N) ? htRssi : ofdmRssi;
+  const uint16_t* rates = (flags & STATION_11N) ? htRate : ofdmRate;
+  if (flags & (STATION_11N | STATION_11G)) {
+    for (uint8_t i = 0; i < 8; i++) {
+      if (rssi >= limits[i]) return rates[i];
+    }
+  }
+  if (flags & STATION_LR) return 5;
+  return rssi >= -76 ? 110 : 10;  // 11b
+}
+
+static uint8_t stationFlags(bool b, bool g, bool n, bool lr) {
+  return (b ? STATION_11B : 0) | (g ? STATION_11G : 0) | (n ? STATION_11N : 0) | (lr ? STATION_LR : 0);
+}
+
+static void resetStation(StationStat& st) {
+  st.rxBytes.store(0, std::memory_order_relaxed);
+  st.txBytes.store(0, std::memory_order_relaxed);
+  st.rxPackets.store(0, std::memory_order_relaxed);
+  st.txPackets.store(0, std::memory_order_relaxed);
+  st.lastSeen.store(millis(), std::memory_order_relaxed);
+  st.sampledBytes = 0;
+  st.airtime = 0;
+}
+
+// Supervisor: refresh RSSI and PHY mode from the driver, claim and release slots as
+// stations come and go, and split the last period's airtime between them
+void pollStations(unsigned long elapsedMs) {
+  wifi_sta_list_t list;
+  if (esp_wifi_ap_get_sta_list(&list) != ESP_OK) list.num = 0;
+  
+  for (uint8_t i = 0; i < STATION_SLOTS; i++) {
+    StationStat& st = stationStats[i];
+    if (!st.used.load(std::memory_order_relaxed)) continue;
+    bool present = false;
+    for (int n = 0; n < list.num && !present; n++) {
+      present = memcmp(list.sta[n].mac, st.mac, 6) == 0;
+    }
+    if (!present) st.used.store(0, std::memory_order_release);
+  }
+  
+  for (int n = 0; n < list.num; n++) {
+    const wifi_sta_info_t& info = list.sta[n];
+    StationStat* st = NULL;
+    StationStat* spare = NULL;
+    for (uint8_t i = 0; i < STATION_SLOTS && st == NULL; i++) {
+      if (!stationStats[i].used.load(std::memory_order_relaxed)) {
+        if (spare == NULL) spare = &stationStats[i];
+      } else if (memcmp(stationStats[i].mac, info.mac, 6) == 0) {
+        st = &stationStats[i];
+      }
+    }
+    if (st == NULL) {
+      if (spare == NULL) continue;
+      st = spare;
+      resetStation(*st);
+      memcpy(st->mac, info.mac, 6);
+      st->used.store(1, std::memory_order_release);
+    }
+    st->rssi = info.rssi;
+    st->flags = stationFlags(info.phy_11b, info.phy_11g, info.phy_11n, info.phy_lr);
+    st->rate = estimatePhyRate(st->rssi, st->flags);
+  }
+  
+  // The uplink: counters are everything relayed to and from it
+  wifi_ap_record_t ap;
+  if (uplinkState == UPLINK_CONNECTED && esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    if (!uplinkStat.used.load(std::memory_order_relaxed) || memcmp(uplinkStat.mac, ap.bssid, 6) != 0) {
+      resetStation(uplinkStat);
+      memcpy(uplinkStat.mac, ap.bssid, 6);
+      uplinkStat.used.store(1, std::memory_order_release);
+    }
+    MetricsTotals totals;
+    collectMetrics(totals);
+    uplinkStat.rxBytes.store(totals.rxBytes[DIR_DOWN], std::memory_order_relaxed);
+    uplinkStat.rxPackets.store(totals.rxPackets[DIR_DOWN], std::memory_order_relaxed);
+    uplinkStat.txBytes.store(totals.txBytes[DIR_UP], std::memory_order_relaxed);
+    uplinkStat.txPackets.store(totals.txPackets[DIR_UP], std::memory_order_relaxed);
+    uplinkStat.lastSeen.store(millis(), std::memory_order_relaxed);
+    if (uplinkStat.sampledBytes == 0) uplinkStat.sampledBytes = totals.rxBytes[DIR_DOWN] + totals.txBytes[DIR_UP];
+    uplinkStat.rssi = ap.rssi;
+    uplinkStat.flags = STATION_UPLINK | stationFlags(ap.phy_11b, ap.phy_11g, ap.phy_11n, ap.phy_lr);
+    uplinkStat.rate = estimatePhyRate(ap.rssi, uplinkStat.flags);
+  } else {
+    uplinkStat.used.store(0, std::memory_order_release);
+  }
+  
+  // Airtime on the AP's channel: bytes over rate for each station. The uplink shares
+  // the channel whenever the AP follows it, so it's counted alongside.
+  uint32_t airtime[STATION_SLOTS + 1] = { 0 };
+  uint64_t total = 0;
+  for (uint8_t i = 0; i <= STATION_SLOTS; i++) {
+    StationStat& st = (i == STATION_SLOTS) ? uplinkStat : stationStats[i];
+    if (!st.used.load(std::memory_order_relaxed)) continue;
+    uint32_t bytes = st.rxBytes.load(std::memory_order_relaxed) + st.txBytes.load(std::memory_order_relaxed);
+    // 100 kbit/s units: bytes * 8 / (rate * 100) ms, kept in microseconds
+    airtime[i] = (uint64_t)(bytes - st.sampledBytes) * 80 / (st.rate ? st.rate : 1);
+    st.sampledBytes = bytes;
+    total += airtime[i];
+  }
+  for (uint8_t i = 0; i <= STATION_SLOTS; i++) {
+    StationStat& st = (i == STATION_SLOTS) ? uplinkStat : stationStats[i];
+    st.airtime = total ? (uint64_t)airtime[i] * 1000 / total : 0;
+  }
+}
+
+static void stationToRow(const StationStat& st, StationRow& row) {
+  memcpy(row.mac, st.mac, 6);
+  row.flags = st.flags;
+  row.rssi = st.rssi;
+  row.rate = st.rate;
+  row.airtime = st.airtime;
+  row.rxBytes = st.rxBytes.load(std::memory_order_relaxed);
+  row.txBytes = st.txBytes.load(std::memory_order_relaxed);
+  row.rxPackets = st.rxPackets.load(std::memory_order_relaxed);
+  row.txPackets = st.txPackets.load(std::memory_order_relaxed);
+  uint32_t idle = (millis() - st.lastSeen.load(std::memory_order_relaxed)) / 1000;
+  row.idleSec = idle > 0xFFFF ? 0xFFFF : idle;
+  row.reserved = 0;
+}
+
+// One page of the station table into out, which holds 4 + STATION_PAGE_ROWS rows.
+// Pages past the end come back as the last one. Runs in the Bluedroid task.
+size_t encodeStationPage(uint8_t page, uint8_t* out) {
+  const StationStat* rows[STATION_SLOTS + 1];
+  uint8_t count = 0;
+  if (uplinkStat.used.load(std::memory_order_acquire)) rows[count++] = &uplinkStat;
+  for (uint8_t i = 0; i < STATION_SLOTS; i++) {
+    if (stationStats[i].used.load(std::memory_order_acquire)) rows[count++] = &stationStats[i];
+  }
+  
+  uint8_t pages = count ? (count + STATION_PAGE_ROWS - 1) / STATION_PAGE_ROWS : 1;
+  if (page >= pages) page = pages - 1;
+  uint8_t first = page * STATION_PAGE_ROWS;
+  uint8_t inPage = count - first < STATION_PAGE_ROWS ? count - first : STATION_PAGE_ROWS;
+  out[0] = page;
+  out[1] = pages;
+  out[2] = inPage;
+  out[3] = count;
+  for (uint8_t i = 0; i < inPage; i++) {
+    StationRow row;
+    stationToRow(*rows[first + i], row);
+    memcpy(out + 4 + i * sizeof(StationRow), &row, sizeof(StationRow));
+  }
+  return 4 + inPage * sizeof(StationRow);
+}
+
+const char* governorLevelName(uint8_t level) {
+  switch (level) {
+    case GOV_PERFORMANCE: return "performance";
+    case GOV_BALANCED: return "balanced";
+    default: return "powersave";
+  }
+}
+
+void collectStatus(StatusSnapshot& snap) {
+  // WiFi Status
+  snap.primaryConnected = (WiFi.status() == WL_CONNECTED);
+  snap.primaryIP = (uint32_t)WiFi.localIP();
+  snap.primaryRSSI = WiFi.RSSI();
+  snap.uplinkState = uplinkState;
+  snap.uplinkRetries = uplinkFailures;
+  snap.disconnectReason = lastDisconnectReason;
+  snap.connectMs = lastConnectMs;
+  snap.apIP = (uint32_t)WiFi.softAPIP();
+  snap.clients = WiFi.softAPgetStationNum();
+  snap.maxClients = effectiveMaxClients;
+  snap.napt = naptEnabled;
+  snap.forwardMode = forwardMode;
+  snap.apChannel = activeAPChannel;
+  snap.autoChannel = autoChannel;
+  
+  // Power saving status
+  snap.powerSaving = powerSavingEnabled;
+  snap.governor = powerGovernor ? governorLevel : -1;
+  snap.cpuMhz = getCpuFrequencyMhz();
+  switch (powerGovernor ? activePsMode : powerSaveMode) {
+    case WIFI_PS_NONE: snap.powerMode = 0; break;
+    case WIFI_PS_MIN_MODEM: snap.powerMode = 1; break;
+    case WIFI_PS_MAX_MODEM: snap.powerMode = 2; break;
+  }
+  snap.listenInterval = powerGovernor ? governorLevels[governorLevel].listenInterval : listenInterval;
+  
+  snap.pool[0] = poolInUse.load(std::memory_order_relaxed);
+  snap.pool[1] = poolHighWater.load(std::memory_order_relaxed);
+  snap.pool[2] = poolSize;
+  snap.pool[3] = poolMisses.load(std::memory_order_relaxed);
+  snap.bleRadio[0] = coexPolicy;
+  snap.bleRadio[1] = advMode;
+  snap.bleRadio[2] = advIntervalMs();
+  snap.bleRadio[3] = bleAirtimePermille();
+  snap.phy[0] = phyAuto;
+  snap.phy[1] = phyBandwidth;
+  snap.phy[2] = phy11b;
+  snap.phy[3] = phyTxApplied;
+  snap.phy[4] = phyNeighbors;
+  snap.idle = idleMode;
+  snap.health[0] = healthLargestBlock;
+  snap.health[1] = healthMinFree;
+  snap.health[2] = healthFragPct;
+  snap.health[3] = healthRestarts[HEALTH_SUB_AP] + healthRestarts[HEALTH_SUB_UPLINK] + healthRestarts[HEALTH_SUB_BLE];
+  
+  // Per-client egress queues, for stations seen recently
+  snap.clientStatCount = 0;
+  for (uint8_t i = 0; i < EGRESS_STATIONS; i++) {
+    EgressStation& st = egressStations[i];
+    if (!st.used || millis() - st.lastActive > EGRESS_IDLE_MS) continue;
+    EgressClientStat& c = snap.clientStats[snap.clientStatCount++];
+    memcpy(c.mac, st.mac, 6);
+    c.depth = st.fast.size() + st.bulk.size();
+    c.kbps = st.kbps;
+  }
+  
+  // System info
+  snap.freeHeap = ESP.getFreeHeap();
+  snap.uptime = millis() / 1000;
+  
+  snap.primarySSIDHash = esp_rom_crc32_le(0, (const uint8_t*)primarySSID.c_str(), primarySSID.length());
+  snap.apSSIDHash = esp_rom_crc32_le(0, (const uint8_t*)apSSID.c_str(), apSSID.length());
+  
+  // Forwarding metrics
+  MetricsTotals totals;
+  collectMetrics(totals);
+  for (int dir = 0; dir < 2; dir++) {
+    snap.fwdPackets[dir] = totals.rxPackets[dir];
+    snap.fwdKBytes[dir] = totals.rxBytes[dir] / 1024;
+  }
+  snap.drops = 0;
+  for (int reason = 0; reason < DROP_REASON_COUNT; reason++) {
+    snap.drops += totals.drops[reason];
+  }
+  snap.latencyP99 = latencyPercentile(totals.latency[STAGE_TOTAL], 99);
+}
+
+void collectMetrics(MetricsTotals& totals) {
+  memset(&totals, 0, sizeof(totals));
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    ForwardMetrics& m = forwardMetrics[core];
+    for (int dir = 0; dir < 2; dir++) {
+      totals.rxPackets[dir] += m.rxPackets[dir].load(std::memory_order_relaxed);
+      totals.rxBytes[dir] += m.rxBytes[dir].load(std::memory_order_relaxed);
+      totals.txPackets[dir] += m.txPackets[dir].load(std::memory_order_relaxed);
+      totals.txBytes[dir] += m.txBytes[dir].load(std::memory_order_relaxed);
+    }
+    for (int reason = 0; reason < DROP_REASON_COUNT; reason++) {
+      totals.drops[reason] += m.drops[reason].load(std::memory_order_relaxed);
+    }
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+      for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        totals.latency[stage][b] += m.latency[stage][b].load(std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+uint32_t latencyPercentile(const uint32_t* buckets, uint8_t percentile) {
+  // Returns the upper bound of the bucket holding the percentile, 0 with no samples
+  uint32_t total = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) total += buckets[b];
+  if (total == 0) return 0;
+  
+  uint32_t rank = ((uint64_t)total * percentile + 99) / 100;
+  uint32_t seen = 0;
+  for (int b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen >= rank) return 1UL << b;
+  }
+  return 1UL << (LATENCY_BUCKETS - 1);
+}
+
+size_t encodeStatus(const StatusSnapshot& snap, uint64_t fields, uint8_t format, uint8_t* buf, size_t cap) {
+  StatusText text = {
+    primarySSID.c_str(), apSSID.c_str(), snap.forwardMode == FORWARD_BRIDGE ? "bridge" : "nat",
+    snap.governor < 0 ? "off" : governorLevelName(snap.governor)
+  };
+  return encodeStatus(snap, text, fields, format, buf, cap);
+}
+
+size_t encodeStatusFitting(const StatusSnapshot& snap, uint64_t fields, uint8_t format, uint8_t* buf, size_t cap) {
+  StatusText text = {
+    primarySSID.c_str(), apSSID.c_str(), snap.forwardMode == FORWARD_BRIDGE ? "bridge" : "nat",
+    snap.governor < 0 ? "off" : governorLevelName(snap.governor)
+  };
+  return encodeStatusFitting(snap, text, fields, format, buf, cap, NULL);
+}
+
+void updateBLEStatus() {
+  if (!deviceConnected) return;
+  
+  StatusSnapshot snap;
+  collectStatus(snap);
+  
+  // Refresh the snapshot served to reads: fill the idle buffer, then flip. Should
+  // nothing fit, the last good snapshot stays up rather than an empty one.
+  uint8_t idle = snapshotActive.load(std::memory_order_relaxed) ^ 1;
+  size_t snapshotLen = encodeStatus(snap, STATUS_ALL_FIELDS, statusFormat, snapshotBuffers[idle], STATUS_SNAPSHOT_MAX);
+  if (snapshotLen == 0 || snapshotLen > STATUS_READ_MAX) {
+    snapshotLen = encodeStatusFitting(snap, STATUS_ALL_FIELDS, statusFormat, snapshotBuffers[idle], STATUS_READ_MAX);
+  }
+  if (snapshotLen != 0) {
+    snapshotLengths[idle] = snapshotLen;
+    snapshotActive.store(idle, std::memory_order_release);
+  }
+  
+  uint64_t pending = (statusFullRequested || !statusSentValid) ? STATUS_ALL_FIELDS : statusChanges(snap, statusSent);
+  statusFullRequested = false;
+  if (pending == 0) return;
+  
+  // Pack as many changed fields as fit each ATT payload; every chunk is a complete
+  // JSON object or TLV stream on its own
+  uint16_t mtu = pServer->getPeerMTU(bleConnId);
+  size_t maxPayload = (mtu > BLE_DEFAULT_MTU ? mtu : BLE_DEFAULT_MTU) - 3;
+  if (maxPayload > sizeof(statusBuffer)) maxPayload = sizeof(statusBuffer);
+  
+  uint64_t chunk = 0;
+  size_t chunkLen = 0;
+  for (uint8_t field = 0; field < STATUS_FIELD_COUNT; field++) {
+    uint64_t bit = 1ULL << field;
+    if (!(pending & bit)) continue;
+    
+    size_t len = encodeStatus(snap, chunk | bit, statusFormat, statusBuffer, maxPayload);
+    if (len == 0 && chunk != 0) {
+      notifyStatus(snap, chunk, maxPayload);
+      chunk = 0;
+      len = encodeStatus(snap, bit, statusFormat, statusBuffer, maxPayload);
+    }
+    if (len == 0) {
+      // A single field larger than the MTU (long SSID on a 23-byte link); reads still have it
+      continue;
+    }
+    chunk |= bit;
+    chunkLen = len;
+  }
+  if (chunk != 0 && chunkLen > 0) {
+    notifyStatus(snap, chunk, maxPayload);
+  }
+  
+  // Hysteresis fields keep their old baseline until they are actually reported,
+  // otherwise a slow drift would never cross the threshold
+  StatusSnapshot previous = statusSent;
+  statusSent = snap;
+  if (!(pending & (1ULL << STATUS_PRIMARY_RSSI))) statusSent.primaryRSSI = previous.primaryRSSI;
+  if (!(pending & (1ULL << STATUS_FREE_HEAP))) statusSent.freeHeap = previous.freeHeap;
+  if (!(pending & (1ULL << STATUS_POOL))) statusSent.pool[0] = previous.pool[0];
+  if (!(pending & (1ULL << STATUS_HEALTH))) {
+    statusSent.health[0] = previous.health[0];
+    statusSent.health[1] = previous.health[1];
+  }
+  if (!(pending & (1ULL << STATUS_CLIENT_QUEUES))) {
+    statusSent.clientStatCount = previous.clientStatCount;
+    memcpy(statusSent.clientStats, previous.clientStats, sizeof(previous.clientStats));
+  }
+  statusSentValid = true;
+  lastStatusNotify = millis();
+}
+
+void notifyStatus(const StatusSnapshot& snap, uint64_t fields, size_t maxPayload) {
+  size_t len = encodeStatus(snap, fields, statusFormat, statusBuffer, maxPayload);
+  pStatusCharacteristic->setValue(statusBuffer, len);
+  pStatusCharacteristic->notify();
+}
+
+void startBenchmark(const char* test, int seconds, const char* host, int port) {
+  if (benchResult.state == BENCH_RUNNING) {
+    LOG_WARN("Benchmark already running");
+    return;
+  }
+  
+  uint8_t kind;
+  if (strcmp(test, "relay") == 0) kind = BENCH_RELAY;
+  else if (strcmp(test, "tcp") == 0) kind = BENCH_TCP;
+  else if (strcmp(test, "udp") == 0) kind = BENCH_UDP;
+  else if (strcmp(test, "rtt") == 0) kind = BENCH_RTT;
+  else {
+    LOG_WARN("Unknown benchmark: %s", test);
+    return;
+  }
+  
+  // Load tests and pings default to the upstream gateway
+  if (host[0] == 0) {
+    strlcpy(benchHost, WiFi.gatewayIP().toString().c_str(), sizeof(benchHost));
+  } else {
+    strlcpy(benchHost, host, sizeof(benchHost));
+  }
+  benchPort = port;
+  
+  memset(&benchResult, 0, sizeof(benchResult));
+  benchResult.test = kind;
+  benchResult.state = BENCH_RUNNING;
+  benchResult.seconds = constrain(seconds, 1, BENCH_MAX_SECONDS);
+  benchResult.retransmits = -1;
+  
+  // Low priority on the application core, so the numbers reflect forwarding, not the bench
+  if (xTaskCreatePinnedToCore(benchTask, "bench", BENCH_TASK_STACK, NULL, 1, &benchTaskHandle, SUPERVISOR_TASK_CORE) != pdPASS) {
+    benchResult.state = BENCH_FAILED;
+    benchFinished = true;
+  }
+  LOG_INFO("Benchmark started: %s", test);
+}
+
+#if configGENERATE_RUN_TIME_STATS
+// Time each core's idle task has run, in run-time-stats counter units
+static uint32_t benchIdleRunTime(int core) {
+  TaskStatus_t status;
+  vTaskGetInfo(xTaskGetIdleTaskHandleForCPU(core), &status, pdFALSE, eRunning);
+  return status.ulRunTimeCounter;
+}
+#else
+// Without run-time stats: count the ticks in which each idle task got to run at all,
+// which overstates idle on a core that is busy for most of every tick
+static bool benchIdleHook0() {
+  benchIdleCalls[0].fetch_add(1, std::memory_order_relaxed);
+  return true; // Once per tick: an idle core scores one call per tick
+}
+
+static bool benchIdleHook1() {
+  benchIdleCalls[1].fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+#endif
+
+void benchTask(void* arg) {
+  uint32_t seconds = benchResult.seconds;
+  
+  // CPU load is what's left of the run after the idle tasks' share
+#if configGENERATE_RUN_TIME_STATS
+  uint32_t idleBefore[2] = { benchIdleRunTime(0), benchIdleRunTime(1) };
+  uint32_t startTime = portGET_RUN_TIME_COUNTER_VALUE();
+#else
+  benchIdleCalls[0] = 0;
+  benchIdleCalls[1] = 0;
+  esp_register_freertos_idle_hook_for_cpu(benchIdleHook0, 0);
+  esp_register_freertos_idle_hook_for_cpu(benchIdleHook1, 1);
+  TickType_t startTick = xTaskGetTickCount();
+#endif
+  
+#if LWIP_STATS && TCP_STATS
+  uint32_t rexmitBefore = lwip_stats.tcp.rexmit;
+#endif
+  
+  bool ok = true;
+  switch (benchResult.test) {
+    case BENCH_RELAY: benchRelay(seconds); break;
+    case BENCH_TCP: ok = benchStream(SOCK_STREAM, seconds); break;
+    case BENCH_UDP: ok = benchStream(SOCK_DGRAM, seconds); break;
+    case BENCH_RTT: ok = benchRTT(seconds); break;
+  }
+  
+#if LWIP_STATS && TCP_STATS
+  benchResult.retransmits = lwip_stats.tcp.rexmit - rexmitBefore;
+#endif
+  
+#if configGENERATE_RUN_TIME_STATS
+  uint32_t ticks = portGET_RUN_TIME_COUNTER_VALUE() - startTime;
+  for (int core = 0; core < 2; core++) {
+    uint32_t idle = benchIdleRunTime(core) - idleBefore[core];
+    benchResult.cpuLoad[core] = (ticks == 0 || idle >= ticks) ? 0 : 100 - (uint64_t)idle * 100 / ticks;
+  }
+#else
+  TickType_t ticks = xTaskGetTickCount() - startTick;
+  esp_deregister_freertos_idle_hook_for_cpu(benchIdleHook0, 0);
+  esp_deregister_freertos_idle_hook_for_cpu(benchIdleHook1, 1);
+  for (int core = 0; core < 2; core++) {
+    uint32_t idle = benchIdleCalls[core].load();
+    benchResult.cpuLoad[core] = (ticks == 0 || idle >= ticks) ? 0 : 100 - (idle * 100) / ticks;
+  }
+#endif
+  
+  benchResult.state = ok ? BENCH_DONE : BENCH_FAILED;
+  benchFinished = true;
+  wakeSupervisor();
+  benchTaskHandle = NULL;
+  vTaskDelete(NULL);
+}
+
+void benchRelay(uint32_t seconds) {
+  // Passive: count what clients forward through us while they run their own load
+  benchRelayBytes[WIFI_IF_STA] = 0;
+  benchRelayBytes[WIFI_IF_AP] = 0;
+  benchRelayActive = true;
+  vTaskDelay(pdMS_TO_TICKS(seconds * 1000));
+  benchRelayActive = false;
+  
+  benchResult.upKbps = (uint64_t)benchRelayBytes[WIFI_IF_AP].load() * 8 / (seconds * 1000);
+  benchResult.downKbps = (uint64_t)benchRelayBytes[WIFI_IF_STA].load() * 8 / (seconds * 1000);
+}
+
+// iperf 2's UDP datagram header: signed sequence number, negative on the last one, then
+// the send time the server measures jitter from. Everything after it stays zero so the
+// client header that follows carries no flags and asks for no settings or reverse test.
+static void benchDatagramHeader(uint8_t* payload, int32_t id) {
+  int64_t now = esp_timer_get_time();
+  uint32_t words[3] = { htonl((uint32_t)id), htonl((uint32_t)(now / 1000000)), htonl((uint32_t)(now % 1000000)) };
+  memcpy(payload, words, sizeof(words));
+}
+
+static void benchUdpFinish(int sock, uint8_t* payload, size_t len, int32_t id, const struct sockaddr_in& dest) {
+  // Resent until the server answers with its report, as the iperf 2 client does
+  struct timeval wait = { 0, BENCH_UDP_FIN_WAIT_MS * 1000 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+  uint8_t report[128];
+  for (uint8_t i = 0; i < BENCH_UDP_FIN_TRIES; i++) {
+    benchDatagramHeader(payload, -id);
+    sendto(sock, payload, len, 0, (const struct sockaddr*)&dest, sizeof(dest));
+    if (recv(sock, report, sizeof(report), 0) > 0) break;
+  }
+}
+
+bool benchStream(int type, uint32_t seconds) {
+  // iperf 2 on the wire: point it at "iperf -s" (tcp) or "iperf -s -u" (udp). TCP sends
+  // a zero client header (no flags), UDP numbers its datagrams and ends with a negative id.
+  struct sockaddr_in dest;
+  memset(&dest, 0, sizeof(dest));
+  dest.sin_family = AF_INET;
+  dest.sin_port = htons(benchPort);
+  if (inet_pton(AF_INET, benchHost, &dest.sin_addr) != 1) return false;
+  
+  int sock = socket(AF_INET, type, 0);
+  if (sock < 0) return false;
+  if (type == SOCK_STREAM && connect(sock, (struct sockaddr*)&dest, sizeof(dest)) != 0) {
+    close(sock);
+    return false;
+  }
+  
+  static uint8_t payload[1460];
+  memset(payload, 0, sizeof(payload));
+  uint64_t sent = 0;
+  int32_t id = 0;
+  unsigned long start = millis();
+  while (millis() - start < seconds * 1000) {
+    if (type == SOCK_DGRAM) benchDatagramHeader(payload, id);
+    int n = (type == SOCK_STREAM) ? send(sock, payload, sizeof(payload), 0)
+                                  : sendto(sock, payload, sizeof(payload), 0, (struct sockaddr*)&dest, sizeof(dest));
+    if (n > 0) {
+      sent += n;
+      id++;
+    } else if (errno == ENOMEM || errno == EAGAIN) {
+      vTaskDelay(1); // UDP outran the driver's TX queue
+    } else {
+      break;
+    }
+  }
+  unsigned long elapsed = millis() - start;
+  if (type == SOCK_DGRAM && id > 0) benchUdpFinish(sock, payload, sizeof(payload), id, dest);
+  close(sock);
+  
+  benchResult.upKbps = elapsed ? sent * 8 / elapsed : 0;
+  return sent > 0;
+}
+
+static void benchPingSuccess(esp_ping_handle_t hdl, void* args) {
+  uint32_t elapsed;
+  esp_ping_get_profile(hdl, ESP_PING_PROF_TIMEGAP, &elapsed, sizeof(elapsed));
+  if (benchRttCount < BENCH_RTT_MAX_SAMPLES) {
+    benchRttSamples[benchRttCount++] = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+  }
+}
+
+static void benchPingEnd(esp_ping_handle_t hdl, void* args) {
+  xTaskNotifyGive((TaskHandle_t)args);
+}
+
+bool benchRTT(uint32_t seconds) {
+  ip_addr_t target;
+  if (!ipaddr_aton(benchHost, &target)) return false;
+  
+  esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+  config.target_addr = target;
+  config.count = seconds * 1000 / BENCH_RTT_INTERVAL_MS;
+  config.interval_ms = BENCH_RTT_INTERVAL_MS;
+  config.timeout_ms = 1000;
+  
+  esp_ping_callbacks_t cbs = {};
+  cbs.on_ping_success = benchPingSuccess;
+  cbs.on_ping_end = benchPingEnd;
+  cbs.cb_args = xTaskGetCurrentTaskHandle();
+  
+  esp_ping_handle_t ping;
+  benchRttCount = 0;
+  if (esp_ping_new_session(&config, &cbs, &ping) != ESP_OK) return false;
+  esp_ping_start(ping);
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS((seconds + 2) * 1000));
+  esp_ping_stop(ping);
+  esp_ping_delete_session(ping);
+  
+  benchResult.rttSent = config.count;
+  benchResult.rttLost = config.count - benchRttCount;
+  if (benchRttCount == 0) return false;
+  
+  // Few hundred samples at most: sort for exact percentiles
+  std::sort(benchRttSamples, benchRttSamples + benchRttCount);
+  benchResult.rttP50 = benchRttSamples[benchRttCount / 2];
+  benchResult.rttP99 = benchRttSamples[(benchRttCount * 99) / 100];
+  benchResult.rttMax = benchRttSamples[benchRttCount - 1];
+  
+  static const uint16_t bounds[BENCH_HIST_BUCKETS - 1] = { 1, 2, 5, 10, 20, 50, 100 };
+  for (uint16_t i = 0; i < benchRttCount; i++) {
+    int b = 0;
+    while (b < BENCH_HIST_BUCKETS - 1 && benchRttSamples[i] >= bounds[b]) b++;
+    benchResult.rttHistogram[b]++;
+  }
+  return true;
+}
+
+const char* benchName(uint8_t test) {
+  switch (test) {
+    case BENCH_TCP: return "tcp";
+    case BENCH_UDP: return "udp";
+    case BENCH_RTT: return "rtt";
+    default: return "relay";
+  }
+}
+
+void notifyBenchResult() {
+  if (!deviceConnected) return;
+  
+  // Sent on the status characteristic as its own message; JSON clients tell it apart
+  // by the "bench" key, TLV clients by tags at BENCH_TLV_BASE and up
+  StatusWriter w(statusBuffer, sizeof(statusBuffer), statusFormat);
+  w.addString(BENCH_TLV_BASE + 0, "bench", benchName(benchResult.test));
+  w.addString(BENCH_TLV_BASE + 1, "state", benchResult.state == BENCH_DONE ? "done" : "failed");
+  w.addInt(BENCH_TLV_BASE + 2, "seconds", benchResult.seconds);
+  if (benchResult.test == BENCH_RTT) {
+    w.addInt(BENCH_TLV_BASE + 3, "rttP50", benchResult.rttP50);
+    w.addInt(BENCH_TLV_BASE + 4, "rttP99", benchResult.rttP99);
+    w.addInt(BENCH_TLV_BASE + 5, "rttMax", benchResult.rttMax);
+    w.addInt(BENCH_TLV_BASE + 6, "rttLost", benchResult.rttLost);
+    w.addInt(BENCH_TLV_BASE + 7, "rttSent", benchResult.rttSent);
+  } else {
+    w.addInt(BENCH_TLV_BASE + 8, "upKbps", benchResult.upKbps);
+    w.addInt(BENCH_TLV_BASE + 9, "downKbps", benchResult.downKbps);
+    w.addInt(BENCH_TLV_BASE + 10, "retransmits", benchResult.retransmits);
+  }
+  w.addInt(BENCH_TLV_BASE + 11, "cpu0", benchResult.cpuLoad[0]);
+  w.addInt(BENCH_TLV_BASE + 12, "cpu1", benchResult.cpuLoad[1]);
+  size_t len = w.finish();
+  if (len == 0) return;
+  
+  pStatusCharacteristic->setValue(statusBuffer, len);
+  pStatusCharacteristic->notify();
+}
+
+void printBenchResult() {
+  if (benchResult.state != BENCH_DONE && benchResult.state != BENCH_FAILED) return;
+  
+  const char* name = benchName(benchResult.test);
+  if (benchResult.state == BENCH_FAILED) {
+    LOG_WARN("Benchmark %s (%d s): failed", name, benchResult.seconds);
+    return;
+  }
+  
+  if (benchResult.test == BENCH_RTT) {
+    LOG_INFO("Benchmark %s (%d s): p50 %d ms, p99 %d ms, max %d ms, lost %d/%d", name, benchResult.seconds,
+             benchResult.rttP50, benchResult.rttP99, benchResult.rttMax, benchResult.rttLost, benchResult.rttSent);
+    const uint16_t* h = benchResult.rttHistogram;
+    LOG_INFO("  RTT histogram <1/<2/<5/<10/<20/<50/<100/100+ ms: %d %d %d %d %d %d %d %d",
+             h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+  } else {
+    LOG_INFO("Benchmark %s (%d s): up %.2f Mbit/s, down %.2f Mbit/s, retransmits %ld", name, benchResult.seconds,
+             benchResult.upKbps / 1000.0, benchResult.downKbps / 1000.0, (long)benchResult.retransmits);
+  }
+  LOG_INFO("  CPU load: core0 %d%%, core1 %d%%", benchResult.cpuLoad[0], benchResult.cpuLoad[1]);
+}
+
+const char* const dropReasonNames[DROP_REASON_COUNT] = { "pbufAlloc", "queueFull", "natFull", "txFailed" };
+const char* const stageNames[STAGE_COUNT] = { "queue", "tx", "total" };
+
+void notifyMetrics() {
+  if (!deviceConnected) return;
+  
+  // Detailed breakdown on demand; the periodic status only carries the totals.
+  // TLV tags start at 0x90: drops by reason, then p50/p99 per stage.
+  MetricsTotals totals;
+  collectMetrics(totals);
+  StatusWriter w(statusBuffer, sizeof(statusBuffer), statusFormat);
+  w.addString(0x90, "metrics", "forward");
+  for (int reason = 0; reason < DROP_REASON_COUNT; reason++) {
+    w.addInt(0x91 + reason, dropReasonNames[reason], totals.drops[reason]);
+  }
+  char key[16];
+  for (int stage = 0; stage < STAGE_COUNT; stage++) {
+    snprintf(key, sizeof(key), "%sP50Us", stageNames[stage]);
+    w.addInt(0xA0 + stage * 2, key, latencyPercentile(totals.latency[stage], 50));
+    snprintf(key, sizeof(key), "%sP99Us", stageNames[stage]);
+    w.addInt(0xA1 + stage * 2, key, latencyPercentile(totals.latency[stage], 99));
+  }
+  size_t len = w.finish();
+  if (len == 0) return;
+  
+  pStatusCharacteristic->setValue(statusBuffer, len);
+  pStatusCharacteristic->notify();
+}
+
+void printMetrics() {
+  MetricsTotals totals;
+  collectMetrics(totals);
+  
+  LOG_INFO("Forwarded up: %lu pkts / %lu KB, down: %lu pkts / %lu KB",
+           (unsigned long)totals.rxPackets[DIR_UP], (unsigned long)(totals.rxBytes[DIR_UP] / 1024),
+           (unsigned long)totals.rxPackets[DIR_DOWN], (unsigned long)(totals.rxBytes[DIR_DOWN] / 1024));
+  
+  char line[LOG_LINE_MAX];
+  size_t n = strlcpy(line, "Drops:", sizeof(line));
+  for (int reason = 0; reason < DROP_REASON_COUNT && n < sizeof(line); reason++) {
+    n += snprintf(line + n, sizeof(line) - n, " %s=%lu", dropReasonNames[reason], (unsigned long)totals.drops[reason]);
+  }
+  LOG_INFO("%s", line);
+  
+  n = strlcpy(line, "Latency p50/p99 (us):", sizeof(line));
+  for (int stage = 0; stage < STAGE_COUNT && n < sizeof(line); stage++) {
+    n += snprintf(line + n, sizeof(line) - n, " %s=%lu/%lu", stageNames[stage],
+                  (unsigned long)latencyPercentile(totals.latency[stage], 50),
+                  (unsigned long)latencyPercentile(totals.latency[stage], 99));
+  }
+  LOG_INFO("%s", line);
+}
+
+void printBootTimeline() {
+  static const char* const resetNames[] = {
+    "unknown", "power-on", "external", "software", "panic", "interrupt watchdog", "task watchdog",
+    "watchdog", "deep sleep", "brownout", "SDIO"
+  };
+  esp_reset_reason_t reason = esp_reset_reason();
+  LOG_INFO("Boot timeline (%s reset):", reason < sizeof(resetNames) / sizeof(resetNames[0]) ? resetNames[reason] : "?");
+  for (uint8_t i = 0; i < BOOT_MILESTONES; i++) {
+    uint32_t ms = bootMs[i].load(std::memory_order_relaxed);
+    if (ms != 0) LOG_INFO("  %6lu ms  %s", (unsigned long)ms, bootMilestoneNames[i]);
+  }
+}
+
+void printLeases() {
+  uint8_t bound = 0;
+  uint8_t reserved = 0;
+  uint8_t leased = 0;
+  for (uint8_t i = 0; i < DHCP_BINDINGS_MAX; i++) {
+    if (dhcpBindings[i].host == 0) continue;
+    bound++;
+    if (dhcpBindings[i].flags & DHCP_RESERVED) reserved++;
+    if (dhcpLeaseEnd[i] != 0 && (long)(millis() - dhcpLeaseEnd[i]) < 0) leased++;
+  }
+  LOG_INFO("DHCP: %d leased, %d bindings (%d reserved), %lu ACKs, %lu without discovery",
+           leased, bound, reserved, (unsigned long)dhcpAcks, (unsigned long)dhcpFastAcks);
+}
+
+void printPool() {
+  if (poolSize == 0) {
+    LOG_INFO("Packet pool: none");
+    return;
+  }
+  LOG_INFO("Packet pool: %lu/%d in use, high water %lu, %lu misses%s",
+           (unsigned long)poolInUse.load(std::memory_order_relaxed), poolSize,
+           (unsigned long)poolHighWater.load(std::memory_order_relaxed),
+           (unsigned long)poolMisses.load(std::memory_order_relaxed), poolInPSRAM ? " (PSRAM)" : "");
+}
+
+void printConntrack() {
+  if (ctSize == 0) return;
+  LOG_INFO("Conntrack: %d/%d flows%s, %lu hits, %lu new, %lu evicted, %lu expired, %lu to lwIP",
+           ctUsed, ctSize, ctEnabled ? "" : " (off)", (unsigned long)ctHits.load(std::memory_order_relaxed),
+           (unsigned long)ctMisses.load(std::memory_order_relaxed), (unsigned long)ctEvictions.load(std::memory_order_relaxed),
+           (unsigned long)ctExpired.load(std::memory_order_relaxed), (unsigned long)ctPassed.load(std::memory_order_relaxed));
+}
+
+void printMulticast() {
+  if (forwardMode != FORWARD_BRIDGE) return;
+  if (!mcastFilter) {
+    LOG_INFO("Multicast: filter off, all group traffic flooded");
+    return;
+  }
+  uint8_t groups = 0, mdns = 0, ssdp = 0;
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < MCAST_MEMBERS; i++) groups += mcastMemberLive(mcastMembers[i], now);
+  for (uint8_t i = 0; i < mdnsCacheSize; i++) mdns += mdnsCache[i].len != 0 && (int32_t)(now - mdnsCache[i].expires) < 0;
+  for (uint8_t i = 0; i < ssdpCacheSize; i++) ssdp += ssdpCache[i].expires != 0 && (int32_t)(now - ssdpCache[i].expires) < 0;
+  LOG_INFO("Multicast: %d memberships, %lu flooded, %lu as unicast, %lu dropped, %lu suppressed",
+           groups, (unsigned long)mcastFlooded.load(std::memory_order_relaxed),
+           (unsigned long)mcastConverted.load(std::memory_order_relaxed), (unsigned long)mcastDropped.load(std::memory_order_relaxed),
+           (unsigned long)mcastSuppressed.load(std::memory_order_relaxed));
+  LOG_INFO("Discovery cache: %d/%d mDNS, %d/%d SSDP, %lu queries answered", mdns, mdnsCacheSize, ssdp, ssdpCacheSize,
+           (unsigned long)mcastAnswered.load(std::memory_order_relaxed));
+}
+
+void printHealth() {
+  LOG_INFO("Health: largest block %lu of %lu free (%d%% fragmented), low water %lu, slowest loop %lu ms, %lu stalls",
+           (unsigned long)healthLargestBlock, (unsigned long)healthFreeHeap, healthFragPct,
+           (unsigned long)healthMinFree, (unsigned long)healthLoopWorst, (unsigned long)healthStalls);
+  char line[128];
+  int n = snprintf(line, sizeof(line), "Stack headroom:");
+  for (uint8_t i = 0; i < HEALTH_WATCHED_TASKS && n < (int)sizeof(line); i++) {
+    if (healthTasks[i].lowest == UINT32_MAX) continue;
+    n += snprintf(line + n, sizeof(line) - n, " %s=%lu", healthTasks[i].name, (unsigned long)healthTasks[i].lowest);
+  }
+  LOG_INFO("%s", line);
+  if (healthRestarts[HEALTH_SUB_AP] || healthRestarts[HEALTH_SUB_UPLINK] || healthRestarts[HEALTH_SUB_BLE]) {
+    LOG_INFO("Soft restarts: %lu softAP, %lu uplink, %lu BLE", (unsigned long)healthRestarts[HEALTH_SUB_AP],
+             (unsigned long)healthRestarts[HEALTH_SUB_UPLINK], (unsigned long)healthRestarts[HEALTH_SUB_BLE]);
+  }
+}
+
+void printEgress() {
+  if (!fairQueue) return;
+  if (clientRateKbps) {
+    LOG_INFO("Fair queuing on, default cap %d kbit/s", clientRateKbps);
+  } else {
+    LOG_INFO("Fair queuing on, default cap none");
+  }
+  for (uint8_t i = 0; i < EGRESS_STATIONS; i++) {
+    EgressStation& st = egressStations[i];
+    if (!st.used || millis() - st.lastActive > EGRESS_IDLE_MS) continue;
+    char cap[16] = "";
+    if (st.rateKbps) snprintf(cap, sizeof(cap), ", cap %d", st.rateKbps);
+    LOG_INFO("  " MAC_FMT ": queued %d+%d, %d kbit/s, %lu drops%s", MAC_ARGS(st.mac),
+             (int)st.fast.size(), (int)st.bulk.size(), st.kbps,
+             (unsigned long)st.drops.load(std::memory_order_relaxed), cap);
+  }
+}
+
+static void printStation(const StationStat& st) {
+  StationRow row;
+  stationToRow(st, row);
+  LOG_INFO("  " MAC_FMT "%s: %d dBm, ~%d.%d Mbit/s, airtime %d.%d%%, rx %lu/%lu KB, tx %lu/%lu KB, idle %d s",
+           MAC_ARGS(row.mac), (row.flags & STATION_UPLINK) ? " (uplink)" : "", row.rssi, row.rate / 10, row.rate % 10,
+           row.airtime / 10, row.airtime % 10, (unsigned long)row.rxPackets, (unsigned long)(row.rxBytes / 1024),
+           (unsigned long)row.txPackets, (unsigned long)(row.txBytes / 1024), row.idleSec);
+}
+
+void printStations() {
+  if (uplinkStat.used.load(std::memory_order_acquire)) printStation(uplinkStat);
+  for (uint8_t i = 0; i < STATION_SLOTS; i++) {
+    if (stationStats[i].used.load(std::memory_order_acquire)) printStation(stationStats[i]);
+  }
+}
+
+void printWiFiStatus() {
+  LOG_INFO("SSID: %s", WiFi.SSID().c_str());
+  LOG_INFO("IP Address: %s", WiFi.localIP().toString().c_str());
+  LOG_INFO("Signal Strength (RSSI): %d dBm", WiFi.RSSI());
+  LOG_INFO("MAC Address: %s", WiFi.macAddress().c_str());
+}
+
+void printStatus() {
+  LOG_INFO("\n--- Status Update ---");
+  
+  // Primary network status
+  if (WiFi.status() == WL_CONNECTED) {
+    LOG_INFO("Primary WiFi connection: Connected");
+    LOG_INFO("IP: %s, RSSI: %d dBm, connected in %lu ms", WiFi.localIP().toString().c_str(), WiFi.RSSI(), lastConnectMs);
+    LOG_INFO("Uplink %d/%d via " MAC_FMT ": avg RSSI %ld dBm, RTT %ld ms, loss %ld%%, %lu roams",
+             uplinkActive + 1, uplinkNetworkCount(), MAC_ARGS(uplinkBSSID), (long)(uplinkRssiAvg / 16),
+             (long)(uplinkRttAvg / 16), (long)(uplinkLossAvg / 16), (unsigned long)uplinkRoams);
+  } else {
+    LOG_INFO("Primary WiFi connection: Disconnected (reason %d, %d failed attempts)", lastDisconnectReason, uplinkFailures);
+  }
+  
+  // Access point status
+  LOG_INFO("Access Point: %s, Channel: %d%s, Connected clients: %d/%d", apSSID.c_str(), activeAPChannel,
+           autoChannel ? " (auto)" : " (manual)", WiFi.softAPgetStationNum(), effectiveMaxClients);
+  LOG_INFO("Forwarding: %s", forwardMode == FORWARD_BRIDGE ? "L2 bridge" : naptEnabled ? "NAPT" : "NAPT (disabled)");
+  if (forwardMode == FORWARD_NAT) {
+    printLeases();
+  }
+  if (dnsProxy && forwardMode == FORWARD_NAT) {
+    LOG_INFO("DNS forwarder: %lu hits, %lu forwarded, %lu coalesced",
+             (unsigned long)dnsHits, (unsigned long)dnsMisses, (unsigned long)dnsCoalesced);
+  }
+  if (mssClamp != 0) {
+    LOG_INFO("TCP MSS clamp: %d, %lu SYNs clamped", mssClamp, (unsigned long)mssClamped.load(std::memory_order_relaxed));
+  }
+  printMetrics();
+  printPool();
+  printConntrack();
+  printMulticast();
+  printHealth();
+  printEgress();
+  printStations();
+  
+  // Power saving status
+  LOG_INFO("Power saving: %s", powerSavingEnabled ? "Enabled" : "Disabled");
+  if (powerGovernor) {
+    LOG_INFO("Power governor: %s (%lu pkt/s, %lu MHz)", governorLevelName(governorLevel),
+             (unsigned long)governorPps, (unsigned long)getCpuFrequencyMhz());
+  }
+  if (idleMode) {
+    LOG_INFO("Idle mode: for %lu s, %lu times, %lu s in total", (millis() - idleEnteredAt) / 1000,
+             (unsigned long)idleEntries, (unsigned long)idleTotalSec);
+  }
+  switch (powerGovernor ? activePsMode : powerSaveMode) {
+    case WIFI_PS_NONE: LOG_INFO("Power save mode: None"); break;
+    case WIFI_PS_MIN_MODEM: LOG_INFO("Power save mode: Minimum"); break;
+    case WIFI_PS_MAX_MODEM: LOG_INFO("Power save mode: Maximum"); break;
+  }
+  int8_t txQuarterDbm = 0;
+  esp_wifi_get_max_tx_power(&txQuarterDbm);
+  LOG_INFO("TX power: %.2f dBm", txQuarterDbm / 4.0);
+  
+  // BLE status
+  if (!bleActive) {
+    LOG_INFO("BLE: off, UDP config on port %d, %lu rejected", CONFIG_UDP_PORT, (unsigned long)configRejected);
+  }
+  LOG_INFO("BLE connection: %s", deviceConnected ? "Connected" : "Disconnected");
+  uint16_t airtime = bleAirtimePermille();
+  LOG_INFO("PHY: HT%d, 11b %s, TX %d/%d dBm%s, %d neighbours", phyBandwidth, phy11b ? "on" : "off",
+           phyTxApplied, txPower, phyAuto ? " (auto)" : "", phyNeighbors);
+  LOG_INFO("BLE radio: coex %s, advertising %s (%d ms), ~%d.%d%% airtime", coexPolicyName(coexPolicy),
+           advModeNames[advMode], advIntervalMs(), airtime / 10, airtime % 10);
+  
+  // Last benchmark, so runs can be compared across power-mode and channel changes
+  printBenchResult();
+  
+  // System stats
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < NAPT_HEAP_FLOOR) {
+    LOG_WARN("Free heap: %lu (below forwarding floor of %d)", (unsigned long)freeHeap, NAPT_HEAP_FLOOR);
+  } else {
+    LOG_INFO("Free heap: %lu", (unsigned long)freeHeap);
+  }
+  
+  // System uptime: hours, minutes, seconds
+  unsigned long uptime = millis() / 1000;
+  LOG_INFO("Uptime: %luh %lum %lus", uptime / 3600, (uptime % 3600) / 60, uptime % 60);
+  
+  LOG_INFO("--------------------");
 }
\ No newline at end of file
@@ -0,0 +1,41 @@
+/*
+ * Counts global heap allocations so benchmarks can report allocations per operation.
+ * Everything on the device's packet and status paths is meant to stay at zero.
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "bench_util.h"
+
+static std::atomic<uint64_t> allocations{0};
+
+uint64_t allocCount() {
+  return allocations.load(std::memory_order_relaxed);
+}
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  std::free(p);
+}
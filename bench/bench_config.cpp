@@ -0,0 +1,49 @@
+/*
+ * Config message parsing: deserialising representative BLE/UDP config writes into
+ * the device's document and dispatching its keys with parseConfig's own key table.
+ * Built only when ArduinoJson is available.
+ */
+
+#include "bench_util.h"
+#include "config_doc.h"
+
+namespace {
+
+const char smallMessage[] = "{\"powerMode\":2,\"listenInterval\":3}";
+
+const char fullMessage[] =
+  "{\"uplinks\":[{\"ssid\":\"HomeNetwork-5G\",\"pass\":\"correct horse battery\",\"bssid\":\"a4:c1:38:f0:e1:d2\"},"
+  "{\"ssid\":\"HomeNetwork\",\"pass\":\"correct horse battery\"}],"
+  "\"apSSID\":\"ESP32-Repeater\",\"apPass\":\"repeater-pass\",\"maxClients\":8,\"channel\":6,\"autoChannel\":true,"
+  "\"powerSaving\":true,\"powerMode\":1,\"listenInterval\":3,\"powerGovernor\":true,\"txPower\":17,"
+  "\"forwardMode\":\"nat\",\"fastNat\":true,\"mssClamp\":1400,\"fairQueue\":true,\"clientRate\":0,"
+  "\"clientLimits\":[{\"mac\":\"a4:c1:38:00:00:01\",\"kbps\":2000}],\"statusFormat\":\"tlv\",\"phyAuto\":true,"
+  "\"idleAfter\":300}";
+
+void parse(benchmark::State& state, const char* json, size_t len) {
+  static ConfigDocument doc;        // Static on the device too
+  Probe probe;
+  for (auto _ : state) {
+    DeserializationError error = deserializeJson(doc, json, len);
+    if (error) {
+      state.SkipWithError(error.c_str());
+      break;
+    }
+    uint64_t present = configKeysPresent(doc.as<JsonObjectConst>());
+    benchmark::DoNotOptimize(present);
+  }
+  state.counters["bytes"] = len;
+  probe.report(state, 1, "cycles/msg");
+}
+
+void BM_ConfigParseSmall(benchmark::State& state) {
+  parse(state, smallMessage, sizeof(smallMessage) - 1);
+}
+BENCHMARK(BM_ConfigParseSmall);
+
+void BM_ConfigParseFull(benchmark::State& state) {
+  parse(state, fullMessage, sizeof(fullMessage) - 1);
+}
+BENCHMARK(BM_ConfigParseFull);
+
+}  // namespace
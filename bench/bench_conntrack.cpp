@@ -0,0 +1,218 @@
+/*
+ * Conntrack table: lookups, flow churn against a full table, the per-packet work of
+ * the NAT fast path in both directions, and the idle sweep.
+ */
+
+#include <vector>
+#include "bench_util.h"
+#include "conntrack.h"
+#include "hal.h"
+
+#define BENCH_PORT_FIRST 40000  // As CT_PORT_FIRST in the sketch
+
+namespace {
+
+struct Tuple {
+  uint32_t clientIP;
+  uint32_t remoteIP;
+  uint16_t clientPort;
+  uint16_t remotePort;
+  uint32_t hash;
+};
+
+// Flow n: one of 8 clients on 192.168.4.0/24 to one of 251 servers on 443
+Tuple tuple(uint32_t n) {
+  Tuple t;
+  uint8_t client[4] = { 192, 168, 4, (uint8_t)(2 + n % 8) };
+  uint8_t remote[4] = { 93, 184, (uint8_t)(n / 251 % 256), (uint8_t)(1 + n % 251) };
+  t.clientIP = readIPv4(client);
+  t.remoteIP = readIPv4(remote);
+  t.clientPort = 10000 + n % 50000;
+  t.remotePort = 443;
+  t.hash = ctHash(6, t.clientIP, t.remoteIP, t.clientPort, t.remotePort);
+  return t;
+}
+
+// Owns the storage the sketch would take from heap or PSRAM
+class Table {
+public:
+  explicit Table(uint16_t size) {
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)size * 2) buckets <<= 1;
+    entries.resize(size);
+    bucketStore.resize(buckets);
+    ctEntries = entries.data();
+    ctBuckets = bucketStore.data();
+    ctSize = size;
+    ctBucketMask = buckets - 1;
+    ctFlush();
+  }
+  
+  ~Table() {
+    ctEntries = NULL;
+    ctBuckets = NULL;
+    ctSize = 0;
+  }
+  
+  void fill(uint32_t flows, uint32_t now) {
+    static const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+    for (uint32_t n = 0; n < flows; n++) {
+      Tuple t = tuple(n);
+      ctInsert(t.hash, 6, t.clientIP, t.remoteIP, t.clientPort, t.remotePort, mac, now);
+    }
+  }
+  
+private:
+  std::vector<CtEntry> entries;
+  std::vector<CtBucket> bucketStore;
+};
+
+// Ethernet + IPv4 + TCP header of a client's segment, checksums valid
+void buildSegment(uint8_t* frame, const Tuple& t) {
+  memset(frame, 0, FRAME_HDR_LEN + 40);
+  writeBE16(frame + 12, FRAME_TYPE_IPV4);
+  uint8_t* ip = frame + FRAME_HDR_LEN;
+  ip[0] = 0x45;
+  writeBE16(ip + 2, 40);
+  ip[8] = 64;
+  ip[9] = 6;
+  memcpy(ip + 12, &t.clientIP, 4);
+  memcpy(ip + 16, &t.remoteIP, 4);
+  writeBE16(ip + 10, ipHeaderChecksum(ip));
+  uint8_t* tcp = ip + 20;
+  writeBE16(tcp, t.clientPort);
+  writeBE16(tcp + 2, t.remotePort);
+  tcp[12] = 5 << 4;
+  tcp[13] = 0x10;                 // ACK
+  writeBE16(tcp + 16, 0x1234);
+}
+
+std::vector<Tuple> tuples(uint32_t first, uint32_t count) {
+  std::vector<Tuple> list;
+  for (uint32_t n = 0; n < count; n++) list.push_back(tuple(first + n));
+  return list;
+}
+
+void BM_CtLookupHit(benchmark::State& state) {
+  uint16_t size = state.range(0);
+  Table table(size);
+  table.fill(size, halMillis());
+  std::vector<Tuple> flows = tuples(0, size);
+  Probe probe;
+  uint32_t i = 0;
+  for (auto _ : state) {
+    const Tuple& t = flows[i++ % size];
+    benchmark::DoNotOptimize(ctLookup(t.hash, 6, t.clientIP, t.remoteIP, t.clientPort, t.remotePort));
+  }
+  probe.report(state);
+}
+BENCHMARK(BM_CtLookupHit)->Arg(512)->Arg(4096);
+
+void BM_CtLookupMiss(benchmark::State& state) {
+  uint16_t size = state.range(0);
+  Table table(size);
+  table.fill(size, halMillis());
+  std::vector<Tuple> absent = tuples(size, size);
+  Probe probe;
+  uint32_t i = 0;
+  for (auto _ : state) {
+    const Tuple& t = absent[i++ % size];
+    benchmark::DoNotOptimize(ctLookup(t.hash, 6, t.clientIP, t.remoteIP, t.clientPort, t.remotePort));
+  }
+  probe.report(state);
+}
+BENCHMARK(BM_CtLookupMiss)->Arg(512)->Arg(4096);
+
+// New flows into a full table: every insert evicts the least recently used one
+void BM_CtInsertChurn(benchmark::State& state) {
+  uint16_t size = state.range(0);
+  Table table(size);
+  uint32_t now = halMillis();
+  table.fill(size, now);
+  std::vector<Tuple> fresh = tuples(size, 4 * size);
+  static const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, 2 };
+  Probe probe;
+  uint32_t i = 0;
+  for (auto _ : state) {
+    const Tuple& t = fresh[i++ % fresh.size()];
+    benchmark::DoNotOptimize(ctInsert(t.hash, 6, t.clientIP, t.remoteIP, t.clientPort, t.remotePort, mac, now));
+  }
+  probe.report(state);
+}
+BENCHMARK(BM_CtInsertChurn)->Arg(512)->Arg(4096);
+
+// What ctFromAP does for a segment of a known flow, minus the driver calls
+void BM_CtOutboundPacket(benchmark::State& state) {
+  uint16_t size = state.range(0);
+  Table table(size);
+  uint32_t now = halMillis();
+  table.fill(size, now);
+  std::vector<Tuple> flows = tuples(0, size);
+  uint8_t uplink[4] = { 10, 0, 0, 23 };
+  uint32_t uplinkIP = readIPv4(uplink);
+  uint8_t frame[FRAME_HDR_LEN + 40];
+  Probe probe;
+  uint32_t i = 0;
+  for (auto _ : state) {
+    const Tuple& t = flows[i++ % size];
+    buildSegment(frame, t);
+    uint8_t* ip = frame + FRAME_HDR_LEN;
+    uint8_t* l4 = ip + 20;
+    uint32_t hash = ctHash(6, readIPv4(ip + 12), readIPv4(ip + 16), readBE16(l4), readBE16(l4 + 2));
+    uint16_t index = ctLookup(hash, 6, readIPv4(ip + 12), readIPv4(ip + 16), readBE16(l4), readBE16(l4 + 2));
+    ctEntries[index].lastSeen = now;
+    ctTouch(index);
+    ctTrackTCP(ctEntries[index], l4[13], false);
+    ctRewrite(ip, l4, 6, ip + 12, l4, uplinkIP, BENCH_PORT_FIRST + index);
+    benchmark::DoNotOptimize(frame);
+  }
+  probe.report(state, 1, "cycles/pkt");
+}
+BENCHMARK(BM_CtOutboundPacket)->Arg(512)->Arg(4096);
+
+// What ctFromSTA does for a reply: index by port, check the remote end, rewrite back
+void BM_CtInboundPacket(benchmark::State& state) {
+  uint16_t size = state.range(0);
+  Table table(size);
+  uint32_t now = halMillis();
+  table.fill(size, now);
+  std::vector<Tuple> flows = tuples(0, size);
+  uint8_t frame[FRAME_HDR_LEN + 40];
+  Probe probe;
+  uint32_t i = 0;
+  for (auto _ : state) {
+    uint16_t slot = i++ % size;
+    const CtEntry& e = ctEntries[slot];
+    Tuple reply = { e.remoteIP, 0, e.remotePort, (uint16_t)(BENCH_PORT_FIRST + slot), 0 };
+    buildSegment(frame, reply);
+    uint8_t* ip = frame + FRAME_HDR_LEN;
+    uint8_t* l4 = ip + 20;
+    uint16_t index = readBE16(l4 + 2) - BENCH_PORT_FIRST;
+    CtEntry& entry = ctEntries[index];
+    if (entry.proto == 6 && entry.remoteIP == readIPv4(ip + 12) && entry.remotePort == readBE16(l4) && !ctExpiredAt(entry, now)) {
+      entry.lastSeen = now;
+      ctTouch(index);
+      ctTrackTCP(entry, l4[13], true);
+      ctRewrite(ip, l4, 6, ip + 16, l4 + 2, entry.clientIP, entry.clientPort);
+    }
+    benchmark::DoNotOptimize(frame);
+  }
+  probe.report(state, 1, "cycles/pkt");
+}
+BENCHMARK(BM_CtInboundPacket)->Arg(512)->Arg(4096);
+
+// One forwarding task sweep batch over a full table of live flows
+void BM_CtSweep(benchmark::State& state) {
+  Table table(4096);
+  uint32_t now = halMillis();
+  table.fill(4096, now);
+  uint16_t batch = state.range(0);
+  Probe probe;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ctSweep(batch, now));
+  }
+  probe.report(state, batch, "cycles/slot");
+}
+BENCHMARK(BM_CtSweep)->Arg(64);
+
+}  // namespace
@@ -0,0 +1,72 @@
+/*
+ * SPSC ring operations with the forwarding queue's element and depth: the same-core
+ * cost of a push/pop pair, and a producer and a consumer on separate threads the way
+ * the WiFi task and the forwarding task use it.
+ */
+
+#include <atomic>
+#include "bench_util.h"
+#include "spsc_queue.h"
+
+namespace {
+
+// Same layout as the sketch's RxFrame
+struct Frame {
+  void* buffer;
+  void* eb;
+  uint16_t len;
+  uint8_t ifx;
+  uint32_t rxTime;
+};
+
+#define BENCH_QUEUE_DEPTH 16    // As FORWARD_QUEUE_DEPTH
+
+void BM_SpscPushPop(benchmark::State& state) {
+  static SpscQueue<Frame, BENCH_QUEUE_DEPTH> queue;
+  Frame in = { NULL, NULL, 1514, 0, 0 };
+  Frame out;
+  Probe probe;
+  for (auto _ : state) {
+    in.rxTime++;
+    queue.push(in);
+    queue.pop(out);
+    benchmark::DoNotOptimize(out);
+  }
+  probe.report(state);
+}
+BENCHMARK(BM_SpscPushPop);
+
+// A burst filling the ring, then draining it, as the consumer sees after a wakeup
+void BM_SpscBurst(benchmark::State& state) {
+  static SpscQueue<Frame, BENCH_QUEUE_DEPTH> queue;
+  Frame in = { NULL, NULL, 1514, 0, 0 };
+  Frame out;
+  Probe probe;
+  for (auto _ : state) {
+    while (queue.push(in)) in.rxTime++;
+    while (queue.pop(out)) benchmark::DoNotOptimize(out);
+  }
+  probe.report(state, BENCH_QUEUE_DEPTH, "cycles/op");
+}
+BENCHMARK(BM_SpscBurst);
+
+// Thread 0 produces, thread 1 consumes; both move the same number of frames and spin
+// while the ring is full or empty
+SpscQueue<Frame, BENCH_QUEUE_DEPTH> crossQueue;
+
+void BM_SpscCrossThread(benchmark::State& state) {
+  Frame f = { NULL, NULL, 1514, 0, 0 };
+  for (auto _ : state) {
+    if (state.thread_index() == 0) {
+      while (!crossQueue.push(f)) {}
+      f.rxTime++;
+    } else {
+      while (!crossQueue.pop(f)) {}
+      benchmark::DoNotOptimize(f);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SpscCrossThread)->Threads(2)->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,136 @@
+/*
+ * Status model: building the full snapshot document in both formats, a typical
+ * notification carrying a few changed fields, and change detection between snapshots.
+ */
+
+#include "bench_util.h"
+#include "status.h"
+#include "worst_status.h"
+
+namespace {
+
+StatusSnapshot busySnapshot() {
+  StatusSnapshot s;
+  memset(&s, 0, sizeof(s));
+  s.primaryConnected = true;
+  s.primaryRSSI = -61;
+  s.uplinkState = 3;
+  s.clients = 6;
+  s.maxClients = 8;
+  s.napt = true;
+  s.powerMode = 1;
+  s.listenInterval = 3;
+  uint8_t ip[4] = { 192, 168, 1, 23 };
+  memcpy(&s.primaryIP, ip, 4);
+  uint8_t ap[4] = { 192, 168, 4, 1 };
+  memcpy(&s.apIP, ap, 4);
+  s.connectMs = 412;
+  s.freeHeap = 118000;
+  s.uptime = 86400;
+  s.fwdPackets[0] = 12345678;
+  s.fwdPackets[1] = 23456789;
+  s.fwdKBytes[0] = 987654;
+  s.fwdKBytes[1] = 4567890;
+  s.drops = 17;
+  s.latencyP99 = 2048;
+  s.apChannel = 6;
+  s.autoChannel = true;
+  s.cpuMhz = 160;
+  s.clientStatCount = 6;
+  for (uint8_t i = 0; i < s.clientStatCount; i++) {
+    uint8_t mac[6] = { 0xa4, 0xc1, 0x38, 0xf0, 0xe1, (uint8_t)i };
+    memcpy(s.clientStats[i].mac, mac, 6);
+    s.clientStats[i].depth = i;
+    s.clientStats[i].kbps = 1200 * (i + 1);
+  }
+  int32_t pool[4] = { 11, 40, 48, 0 };
+  memcpy(s.pool, pool, sizeof(pool));
+  int32_t ble[4] = { 1, 2, 1000, 12 };
+  memcpy(s.bleRadio, ble, sizeof(ble));
+  int32_t phy[5] = { 1, 20, 0, 17, 9 };
+  memcpy(s.phy, phy, sizeof(phy));
+  return s;
+}
+
+const StatusText text = { "HomeNetwork-5G", "ESP32-Repeater", "nat", "balanced" };
+
+// The size check itself is core_test's; this only times the largest document
+void BM_StatusEncodeWorst(benchmark::State& state) {
+  StatusSnapshot snap = worstStatusSnapshot();
+  const StatusText worstText = worstStatusText();
+  uint8_t buf[STATUS_SNAPSHOT_MAX];
+  uint8_t format = state.range(0);
+  Probe probe;
+  size_t len = 0;
+  for (auto _ : state) {
+    len = encodeStatus(snap, worstText, STATUS_ALL_FIELDS, format, buf, sizeof(buf));
+    benchmark::DoNotOptimize(buf);
+  }
+  state.counters["bytes"] = len;
+  probe.report(state, 1, "cycles/doc");
+}
+BENCHMARK(BM_StatusEncodeWorst)->ArgName("tlv")->Arg(STATUS_FORMAT_JSON)->Arg(STATUS_FORMAT_TLV);
+
+// A read snapshot cut down to one GATT attribute (600 bytes in ESP-IDF 4.4)
+void BM_StatusEncodeFitting(benchmark::State& state) {
+  StatusSnapshot snap = busySnapshot();
+  uint8_t buf[600];
+  Probe probe;
+  size_t len = 0;
+  uint64_t packed = 0;
+  for (auto _ : state) {
+    len = encodeStatusFitting(snap, text, STATUS_ALL_FIELDS, STATUS_FORMAT_JSON, buf, sizeof(buf), &packed);
+    benchmark::DoNotOptimize(buf);
+  }
+  state.counters["bytes"] = len;
+  state.counters["fields"] = __builtin_popcountll(packed);
+  probe.report(state, 1, "cycles/doc");
+}
+BENCHMARK(BM_StatusEncodeFitting);
+
+void BM_StatusEncodeFull(benchmark::State& state) {
+  StatusSnapshot snap = busySnapshot();
+  uint8_t buf[STATUS_SNAPSHOT_MAX];
+  uint8_t format = state.range(0);
+  Probe probe;
+  size_t len = 0;
+  for (auto _ : state) {
+    len = encodeStatus(snap, text, STATUS_ALL_FIELDS, format, buf, sizeof(buf));
+    benchmark::DoNotOptimize(buf);
+  }
+  state.counters["bytes"] = len;
+  probe.report(state, 1, "cycles/doc");
+}
+BENCHMARK(BM_StatusEncodeFull)->ArgName("tlv")->Arg(STATUS_FORMAT_JSON)->Arg(STATUS_FORMAT_TLV);
+
+// A change notification: something moved, plus the counters that ride along
+void BM_StatusEncodeDelta(benchmark::State& state) {
+  StatusSnapshot snap = busySnapshot();
+  uint8_t buf[244];                 // One notification at the local MTU
+  uint8_t format = state.range(0);
+  uint64_t fields = (1ULL << STATUS_CLIENTS) | (1ULL << STATUS_CLIENT_QUEUES) | (1ULL << STATUS_UPTIME) |
+                    (1ULL << STATUS_FWD_PACKETS_UP) | (1ULL << STATUS_FWD_PACKETS_DOWN) |
+                    (1ULL << STATUS_FWD_KBYTES_UP) | (1ULL << STATUS_FWD_KBYTES_DOWN);
+  Probe probe;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(encodeStatus(snap, text, fields, format, buf, sizeof(buf)));
+    benchmark::DoNotOptimize(buf);
+  }
+  probe.report(state, 1, "cycles/doc");
+}
+BENCHMARK(BM_StatusEncodeDelta)->ArgName("tlv")->Arg(STATUS_FORMAT_JSON)->Arg(STATUS_FORMAT_TLV);
+
+void BM_StatusChanges(benchmark::State& state) {
+  StatusSnapshot sent = busySnapshot();
+  StatusSnapshot now = sent;
+  now.clients++;
+  now.clientStats[3].kbps += 500;
+  Probe probe;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(statusChanges(now, sent));
+  }
+  probe.report(state);
+}
+BENCHMARK(BM_StatusChanges);
+
+}  // namespace
@@ -0,0 +1,33 @@
+/*
+ * Shared reporting for the core benchmarks: heap allocations per iteration, items
+ * (packets, operations) per second and CPU cycles per item.
+ */
+
+#pragma once
+
+#include <benchmark/benchmark.h>
+#include <stdint.h>
+#include <chrono>
+
+// Global operator new calls since start, counted by alloc_counter.cpp
+uint64_t allocCount();
+
+// Started just before the timed loop, reported right after it. Cycles come from the
+// wall time and the CPU's nominal clock, so compare runs on the same machine only.
+class Probe {
+public:
+  Probe() : allocs(allocCount()), start(std::chrono::steady_clock::now()) {}
+  
+  void report(benchmark::State& state, int64_t itemsPerIteration = 1, const char* unit = "cycles/op") {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    int64_t items = state.iterations() * itemsPerIteration;
+    state.SetItemsProcessed(items);
+    // Whole allocations per iteration: the framework's own few per run round away
+    state.counters["allocs/op"] = state.iterations() ? (double)((allocCount() - allocs) / state.iterations()) : 0;
+    if (items > 0) state.counters[unit] = seconds * benchmark::CPUInfo::Get().cycles_per_second / items;
+  }
+  
+private:
+  uint64_t allocs;
+  std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,78 @@
+/*
+ * The JSON document config messages are parsed into, and the top-level keys parseConfig
+ * acts on. Shared with the host benchmarks so they measure the same capacity and the
+ * same key dispatch the device runs with.
+ */
+
+#pragma once
+
+#include <ArduinoJson.h>
+#include <string.h>
+
+#define CONFIG_DOC_CAPACITY 768
+typedef StaticJsonDocument<CONFIG_DOC_CAPACITY> ConfigDocument;
+
+// Top-level config keys, bit n of configKeysPresent(). Only a parsing aid, never stored,
+// so they can be renumbered freely; configKeyNames has to follow.
+#define CONFIG_KEY_PRIMARY_SSID      0
+#define CONFIG_KEY_PRIMARY_PASS      1
+#define CONFIG_KEY_UPLINKS           2
+#define CONFIG_KEY_AP_SSID           3
+#define CONFIG_KEY_AP_PASS           4
+#define CONFIG_KEY_CHANNEL           5
+#define CONFIG_KEY_AUTO_CHANNEL      6
+#define CONFIG_KEY_MAX_CLIENTS       7
+#define CONFIG_KEY_POWER_SAVING      8
+#define CONFIG_KEY_POWER_MODE        9
+#define CONFIG_KEY_TX_POWER          10
+#define CONFIG_KEY_PHY_AUTO          11
+#define CONFIG_KEY_FAIR_QUEUE        12
+#define CONFIG_KEY_CLIENT_RATE       13
+#define CONFIG_KEY_CLIENT_LIMITS     14
+#define CONFIG_KEY_MSS_CLAMP         15
+#define CONFIG_KEY_DNS_PROXY         16
+#define CONFIG_KEY_COEX              17
+#define CONFIG_KEY_ADV_FAST_SEC      18
+#define CONFIG_KEY_ADV_SLOW_MS       19
+#define CONFIG_KEY_ADV_SUSPEND_PPS   20
+#define CONFIG_KEY_CONFIG_KEY        21
+#define CONFIG_KEY_BLE               22
+#define CONFIG_KEY_DHCP_RESERVE      23
+#define CONFIG_KEY_FORWARD_MODE      24
+#define CONFIG_KEY_FAST_NAT          25
+#define CONFIG_KEY_MCAST_FILTER      26
+#define CONFIG_KEY_HEALTH_BLOCK_MIN  27
+#define CONFIG_KEY_HEALTH_LOOP_MS    28
+#define CONFIG_KEY_HEALTH_UPLINK_SEC 29
+#define CONFIG_KEY_STATUS_FORMAT     30
+#define CONFIG_KEY_CMD               31
+#define CONFIG_KEY_POWER_GOVERNOR    32
+#define CONFIG_KEY_IDLE_AFTER        33
+#define CONFIG_KEY_LISTEN_INTERVAL   34
+#define CONFIG_KEY_COUNT             35     // The presence mask is a uint64_t
+
+static const char* const configKeyNames[] = {
+  "primarySSID", "primaryPass", "uplinks", "apSSID", "apPass", "channel", "autoChannel",
+  "maxClients", "powerSaving", "powerMode", "txPower", "phyAuto", "fairQueue",
+  "clientRate", "clientLimits", "mssClamp", "dnsProxy", "coex", "advFastSec", "advSlowMs",
+  "advSuspendPps", "configKey", "ble", "dhcpReserve", "forwardMode", "fastNat",
+  "mcastFilter", "healthBlockMin", "healthLoopMs", "healthUplinkSec", "statusFormat",
+  "cmd", "powerGovernor", "idleAfter", "listenInterval"
+};
+static_assert(sizeof(configKeyNames) / sizeof(configKeyNames[0]) == CONFIG_KEY_COUNT, "A name per config key");
+static_assert(CONFIG_KEY_COUNT <= 64, "Config keys have to fit the presence mask");
+
+// One pass over the message's members instead of a containsKey() scan per known key
+static inline uint64_t configKeysPresent(JsonObjectConst obj) {
+  uint64_t present = 0;
+  for (JsonPairConst member : obj) {
+    const char* key = member.key().c_str();
+    for (uint8_t k = 0; k < CONFIG_KEY_COUNT; k++) {
+      if (strcmp(key, configKeyNames[k]) == 0) {
+        present |= 1ULL << k;
+        break;
+      }
+    }
+  }
+  return present;
+}
@@ -0,0 +1,198 @@
+/*
+ * Connection tracking table, see conntrack.h.
+ */
+
+#include "conntrack.h"
+
+CtEntry* ctEntries = NULL;
+CtBucket* ctBuckets = NULL;
+uint16_t ctSize = 0;
+uint32_t ctBucketMask = 0;
+uint16_t ctUsed = 0;
+static uint16_t ctHead = CT_NONE;
+static uint16_t ctTail = CT_NONE;
+static uint16_t ctFree = CT_NONE;
+static uint16_t ctSweepCursor = 0;
+std::atomic<uint32_t> ctHits{0};
+std::atomic<uint32_t> ctMisses{0};
+std::atomic<uint32_t> ctEvictions{0};
+std::atomic<uint32_t> ctExpired{0};
+std::atomic<uint32_t> ctPassed{0};
+
+static void ctUnlink(uint16_t index) {
+  CtEntry& e = ctEntries[index];
+  if (e.prev != CT_NONE) ctEntries[e.prev].next = e.next;
+  else ctHead = e.next;
+  if (e.next != CT_NONE) ctEntries[e.next].prev = e.prev;
+  else ctTail = e.prev;
+}
+
+static void ctPushFront(uint16_t index) {
+  CtEntry& e = ctEntries[index];
+  e.prev = CT_NONE;
+  e.next = ctHead;
+  if (ctHead != CT_NONE) ctEntries[ctHead].prev = index;
+  ctHead = index;
+  if (ctTail == CT_NONE) ctTail = index;
+}
+
+void ctTouch(uint16_t index) {
+  if (ctHead == index) return;
+  ctUnlink(index);
+  ctPushFront(index);
+}
+
+uint16_t ctLookup(uint32_t hash, uint8_t proto, uint32_t clientIP, uint32_t remoteIP,
+                  uint16_t clientPort, uint16_t remotePort) {
+  uint16_t tag = hash >> 16;
+  for (uint32_t b = hash & ctBucketMask; ; b = (b + 1) & ctBucketMask) {
+    const CtBucket& bucket = ctBuckets[b];
+    if (bucket.entry == 0) return CT_NONE;
+    if (bucket.tag != tag) continue;
+    const CtEntry& e = ctEntries[bucket.entry - 1];
+    if (e.clientIP == clientIP && e.remoteIP == remoteIP && e.clientPort == clientPort &&
+        e.remotePort == remotePort && e.proto == proto) {
+      return bucket.entry - 1;
+    }
+  }
+}
+
+// Drop an entry: backward-shift deletion keeps every probe chain unbroken without
+// tombstones, so lookups stay short however long the device runs
+void ctRemove(uint16_t index) {
+  CtEntry& e = ctEntries[index];
+  uint32_t hole = e.hash & ctBucketMask;
+  while (ctBuckets[hole].entry != index + 1) hole = (hole + 1) & ctBucketMask;
+  for (uint32_t b = (hole + 1) & ctBucketMask; ctBuckets[b].entry != 0; b = (b + 1) & ctBucketMask) {
+    uint32_t home = ctEntries[ctBuckets[b].entry - 1].hash & ctBucketMask;
+    if (((b - home) & ctBucketMask) >= ((b - hole) & ctBucketMask)) {
+      ctBuckets[hole] = ctBuckets[b];
+      hole = b;
+    }
+  }
+  ctBuckets[hole].entry = 0;
+  
+  ctUnlink(index);
+  e.proto = 0;
+  e.next = ctFree;
+  ctFree = index;
+  ctUsed--;
+}
+
+uint16_t ctInsert(uint32_t hash, uint8_t proto, uint32_t clientIP, uint32_t remoteIP,
+                  uint16_t clientPort, uint16_t remotePort, const uint8_t* mac, uint32_t now) {
+  if (ctFree == CT_NONE) {
+    // Full: the least recently used flow makes room
+    if (ctExpiredAt(ctEntries[ctTail], now)) ctExpired.fetch_add(1, std::memory_order_relaxed);
+    else ctEvictions.fetch_add(1, std::memory_order_relaxed);
+    ctRemove(ctTail);
+  }
+  uint16_t index = ctFree;
+  CtEntry& e = ctEntries[index];
+  ctFree = e.next;
+  e.clientIP = clientIP;
+  e.remoteIP = remoteIP;
+  e.clientPort = clientPort;
+  e.remotePort = remotePort;
+  e.proto = proto;
+  e.state = proto == 6 ? CT_TCP_SYN : CT_UDP_NEW;
+  memcpy(e.mac, mac, 6);
+  e.hash = hash;
+  e.lastSeen = now;
+  ctPushFront(index);
+  ctUsed++;
+  
+  uint32_t b = hash & ctBucketMask;
+  while (ctBuckets[b].entry != 0) b = (b + 1) & ctBucketMask;
+  ctBuckets[b].entry = index + 1;
+  ctBuckets[b].tag = hash >> 16;
+  return index;
+}
+
+void ctFlush() {
+  memset(ctBuckets, 0, (ctBucketMask + 1) * sizeof(CtBucket));
+  for (uint16_t i = 0; i < ctSize; i++) {
+    ctEntries[i].proto = 0;
+    ctEntries[i].next = i + 1 < ctSize ? i + 1 : CT_NONE;
+  }
+  ctFree = 0;
+  ctHead = CT_NONE;
+  ctTail = CT_NONE;
+  ctUsed = 0;
+}
+
+uint16_t ctSweep(uint16_t batch, uint32_t now) {
+  uint16_t expired = 0;
+  for (uint16_t n = 0; n < batch && n < ctSize && ctUsed != 0; n++) {
+    uint16_t index = ctSweepCursor;
+    ctSweepCursor = ctSweepCursor + 1 < ctSize ? ctSweepCursor + 1 : 0;
+    if (ctEntries[index].proto != 0 && ctExpiredAt(ctEntries[index], now)) {
+      ctExpired.fetch_add(1, std::memory_order_relaxed);
+      ctRemove(index);
+      expired++;
+    }
+  }
+  return expired;
+}
+
+// Swap one address and port in place, patching the IP and TCP/UDP checksums and
+// taking the hop off the TTL. UDP without a checksum stays without one.
+void ctRewrite(uint8_t* ip, uint8_t* l4, uint8_t proto, uint8_t* addr, uint8_t* port,
+               uint32_t newAddr, uint16_t newPort) {
+  uint32_t oldAddr = readBE32(addr);
+  uint32_t to = readBE32((const uint8_t*)&newAddr);
+  uint16_t ipSum = csumReplace32(readBE16(ip + 10), oldAddr, to);
+  uint16_t ttlWord = readBE16(ip + 8);
+  ip[8]--;
+  writeBE16(ip + 10, csumReplace16(ipSum, ttlWord, readBE16(ip + 8)));
+  
+  uint8_t* csum = l4 + (proto == 6 ? 16 : 6);
+  uint16_t sum = readBE16(csum);
+  if (proto == 6 || sum != 0) {
+    sum = csumReplace16(csumReplace32(sum, oldAddr, to), readBE16(port), newPort);
+    if (proto == 17 && sum == 0) sum = 0xFFFF;
+    writeBE16(csum, sum);
+  }
+  memcpy(addr, &newAddr, 4);
+  writeBE16(port, newPort);
+}
+
+void ctRewriteICMPError(uint8_t* ip, uint8_t* icmp, uint8_t* inner, size_t quoted,
+                        uint32_t newAddr, uint16_t newPort) {
+  uint32_t to = readBE32((const uint8_t*)&newAddr);
+  uint8_t* innerL4 = inner + (inner[0] & 0x0F) * 4;
+  uint32_t oldAddr = readBE32(inner + 12);
+  uint16_t oldPort = readBE16(innerL4);
+  uint16_t icmpSum = readBE16(icmp + 2);
+  
+  // The quote sits at an even offset of the ICMP message, so every word changed in it
+  // goes into the ICMP checksum as it stands
+  uint16_t from = readBE16(inner + 10);
+  uint16_t sum = csumReplace32(from, oldAddr, to);
+  writeBE16(inner + 10, sum);
+  icmpSum = csumReplace32(csumReplace16(icmpSum, from, sum), oldAddr, to);
+  memcpy(inner + 12, &newAddr, 4);
+  
+  uint8_t proto = inner[9];
+  size_t csumAt = proto == 6 ? 16 : 6;
+  if (quoted >= (size_t)(innerL4 - inner) + csumAt + 2) {
+    uint8_t* csum = innerL4 + csumAt;
+    from = readBE16(csum);
+    if (proto == 6 || from != 0) {
+      sum = csumReplace16(csumReplace32(from, oldAddr, to), oldPort, newPort);
+      if (proto == 17 && sum == 0) sum = 0xFFFF;
+      writeBE16(csum, sum);
+      icmpSum = csumReplace16(icmpSum, from, sum);
+    }
+  }
+  writeBE16(innerL4, newPort);
+  writeBE16(icmp + 2, csumReplace16(icmpSum, oldPort, newPort));
+  
+  // Outer header; ICMP has no pseudo-header, so its checksum doesn't see this
+  uint32_t oldDst = readBE32(ip + 16);
+  uint16_t ipSum = csumReplace32(readBE16(ip + 10), oldDst, to);
+  uint16_t ttlWord = readBE16(ip + 8);
+  ip[8]--;
+  writeBE16(ip + 10, csumReplace16(ipSum, ttlWord, readBE16(ip + 8)));
+  memcpy(ip + 16, &newAddr, 4);
+}
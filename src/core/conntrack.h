@@ -0,0 +1,115 @@
+/*
+ * Connection tracking table for the NAT fast path. Entries live in a fixed array whose
+ * index is the flow's external port, so replies find theirs without a lookup; the
+ * client side goes through an open-addressed, linearly probed index of 4-byte buckets
+ * (entry and hash tag) so a miss rarely touches an entry. Idle entries expire per
+ * protocol and state; when the table is full the least recently used flow is evicted.
+ * The storage is the caller's (sized at boot from heap or PSRAM); only one task may
+ * use the table.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "frame.h"
+
+#define CT_NONE               0xFFFF
+#define CT_TCP_SYN            1      // Entry states
+#define CT_TCP_ESTABLISHED    2
+#define CT_TCP_CLOSING        3      // FIN or RST seen
+#define CT_UDP_NEW            4
+#define CT_UDP_REPLIED        5
+#define CT_TCP_SYN_MS         30000
+#define CT_TCP_ESTABLISHED_MS 1800000
+#define CT_TCP_CLOSING_MS     10000
+#define CT_UDP_MS             30000
+#define CT_UDP_REPLIED_MS     120000
+struct CtEntry {
+  uint32_t clientIP;                 // Network byte order
+  uint32_t remoteIP;
+  uint16_t clientPort;
+  uint16_t remotePort;
+  uint8_t proto;                     // 0 = free
+  uint8_t state;
+  uint8_t mac[6];                    // The client's, for the way back
+  uint32_t hash;
+  uint32_t lastSeen;                 // halMillis()
+  uint16_t prev;                     // LRU list, most recent at ctHead
+  uint16_t next;                     // Doubles as the free list link
+};
+struct CtBucket {
+  uint16_t entry;                    // Index + 1, 0 = empty
+  uint16_t tag;                      // High half of the hash
+};
+static_assert(sizeof(CtEntry) == 32, "One entry per 32-byte cache line");
+
+// Storage, set up by the owner before the first ctFlush()
+extern CtEntry* ctEntries;
+extern CtBucket* ctBuckets;
+extern uint16_t ctSize;
+extern uint32_t ctBucketMask;              // Bucket count - 1, a power of two >= 2 * ctSize
+
+extern uint16_t ctUsed;
+extern std::atomic<uint32_t> ctHits;
+extern std::atomic<uint32_t> ctMisses;      // New flows
+extern std::atomic<uint32_t> ctEvictions;
+extern std::atomic<uint32_t> ctExpired;
+extern std::atomic<uint32_t> ctPassed;      // Candidates left to lwIP
+
+static inline uint32_t ctHash(uint8_t proto, uint32_t clientIP, uint32_t remoteIP, uint16_t clientPort, uint16_t remotePort) {
+  uint32_t h = clientIP * 0x9E3779B1u;
+  h ^= remoteIP + 0x7F4A7C15u + (h << 6) + (h >> 2);
+  h ^= (((uint32_t)clientPort << 16) | remotePort) + 0x7F4A7C15u + (h << 6) + (h >> 2);
+  h ^= proto;
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  return h ^ (h >> 13);
+}
+
+static inline uint32_t ctTimeout(const CtEntry& e) {
+  switch (e.state) {
+    case CT_TCP_SYN: return CT_TCP_SYN_MS;
+    case CT_TCP_ESTABLISHED: return CT_TCP_ESTABLISHED_MS;
+    case CT_TCP_CLOSING: return CT_TCP_CLOSING_MS;
+    case CT_UDP_REPLIED: return CT_UDP_REPLIED_MS;
+    default: return CT_UDP_MS;
+  }
+}
+
+static inline bool ctExpiredAt(const CtEntry& e, uint32_t now) {
+  return now - e.lastSeen > ctTimeout(e);
+}
+
+static inline void ctTrackTCP(CtEntry& e, uint8_t flags, bool reply) {
+  if (flags & 0x05) {
+    e.state = CT_TCP_CLOSING;                          // FIN or RST
+  } else if (!reply && (flags & 0x12) == 0x02) {
+    e.state = CT_TCP_SYN;                              // Tuple reused for a new connection
+  } else if (reply && e.state == CT_TCP_SYN && (flags & 0x10)) {
+    e.state = CT_TCP_ESTABLISHED;
+  }
+}
+
+uint16_t ctLookup(uint32_t hash, uint8_t proto, uint32_t clientIP, uint32_t remoteIP,
+                  uint16_t clientPort, uint16_t remotePort);
+uint16_t ctInsert(uint32_t hash, uint8_t proto, uint32_t clientIP, uint32_t remoteIP,
+                  uint16_t clientPort, uint16_t remotePort, const uint8_t* mac, uint32_t now);
+void ctRemove(uint16_t index);
+void ctTouch(uint16_t index);
+void ctFlush();
+
+// Check the next batch of slots for idle flows; returns how many expired
+uint16_t ctSweep(uint16_t batch, uint32_t now);
+
+// Swap one address and port in place, patching the IP and TCP/UDP checksums and
+// taking the hop off the TTL. UDP without a checksum stays without one.
+void ctRewrite(uint8_t* ip, uint8_t* l4, uint8_t proto, uint8_t* addr, uint8_t* port,
+               uint32_t newAddr, uint16_t newPort);
+
+// ICMP error quoting a datagram the fast path sent: the quoted source and the outer
+// destination both become newAddr (newPort for the quoted source port). Every
+// checksum involved is patched, quoted transport one included where the quote
+// (quoted bytes from the inner header on) reaches it, and the TTL loses the hop.
+void ctRewriteICMPError(uint8_t* ip, uint8_t* icmp, uint8_t* inner, size_t quoted,
+                        uint32_t newAddr, uint16_t newPort);
@@ -0,0 +1,81 @@
+/*
+ * Ethernet/IPv4 frame access and RFC 1624 checksum helpers shared by the bridge,
+ * the conntrack fast path and the multicast filter. Header-only: every caller is on
+ * the per-packet path.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Ethernet/IPv4 offsets used by the bridge
+#define FRAME_HDR_LEN       14
+#define FRAME_TYPE_IPV4      0x0800
+#define FRAME_TYPE_ARP       0x0806
+#define ARP_SHA_OFFSET    (FRAME_HDR_LEN + 8)
+#define ARP_SPA_OFFSET    (FRAME_HDR_LEN + 14)
+#define ARP_THA_OFFSET    (FRAME_HDR_LEN + 18)
+#define ARP_TPA_OFFSET    (FRAME_HDR_LEN + 24)
+#define ARP_FRAME_LEN     (FRAME_HDR_LEN + 28)
+
+static inline uint16_t frameType(const uint8_t* frame) {
+  return (frame[12] << 8) | frame[13];
+}
+
+static inline uint32_t readIPv4(const uint8_t* p) {
+  uint32_t addr;
+  memcpy(&addr, p, 4);
+  return addr;
+}
+
+static inline uint16_t readBE16(const uint8_t* p) {
+  return (uint16_t)(p[0] << 8) | p[1];
+}
+
+static inline void writeBE16(uint8_t* p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static inline uint32_t readBE32(const uint8_t* p) {
+  return ((uint32_t)readBE16(p) << 16) | readBE16(p + 2);
+}
+
+// RFC 1624 incremental checksum update, HC' = ~(~HC + ~m + m'), all in host order.
+// Header rewrites go through these instead of summing the whole packet again.
+static inline uint16_t csumReplace16(uint16_t sum, uint16_t from, uint16_t to) {
+  uint32_t acc = (uint16_t)~sum + (uint16_t)~from + (uint32_t)to;
+  acc = (acc & 0xFFFF) + (acc >> 16);
+  acc = (acc & 0xFFFF) + (acc >> 16);
+  return ~acc;
+}
+
+static inline uint16_t csumReplace32(uint16_t sum, uint32_t from, uint32_t to) {
+  sum = csumReplace16(sum, from >> 16, to >> 16);
+  return csumReplace16(sum, from & 0xFFFF, to & 0xFFFF);
+}
+
+// Rewrite a 16-bit field at offset within a checksummed header and patch the checksum.
+// One's complement sums don't care about byte order, so a field at an odd offset just
+// takes part byte-swapped.
+static inline void csumRewrite16(uint8_t* header, uint8_t* csum, size_t offset, uint16_t to) {
+  uint16_t from = readBE16(header + offset);
+  uint16_t sum = readBE16(csum);
+  if (offset & 1) {
+    sum = csumReplace16(sum, __builtin_bswap16(from), __builtin_bswap16(to));
+  } else {
+    sum = csumReplace16(sum, from, to);
+  }
+  writeBE16(header + offset, to);
+  writeBE16(csum, sum);
+}
+
+// Full checksum of an option-less IPv4 header, for frames built from scratch
+static inline uint16_t ipHeaderChecksum(const uint8_t* ip) {
+  uint32_t sum = 0;
+  for (uint8_t i = 0; i < 20; i += 2) sum += readBE16(ip + i);
+  while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+  return ~sum;
+}
@@ -0,0 +1,33 @@
+/*
+ * Thin hardware abstraction for the core logic. On the device these are the Arduino
+ * and ESP-IDF clocks; on a host build (benchmarks, simulation) a monotonic clock.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include "esp_timer.h"
+
+static inline uint32_t halMillis() {
+  return millis();
+}
+
+static inline uint32_t halMicros() {
+  return (uint32_t)esp_timer_get_time();
+}
+#else
+#include <chrono>
+
+static inline uint32_t halMillis() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint32_t halMicros() {
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
@@ -0,0 +1,48 @@
+/*
+ * Lock-free ring between one producer and one consumer task: driver RX buffers to the
+ * forwarding task, BLE and WiFi events to the supervisor, egress queues.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Single-producer/single-consumer ring; N must be a power of two
+template <typename T, size_t N>
+class SpscQueue {
+  static_assert((N & (N - 1)) == 0, "SpscQueue size must be a power of two");
+public:
+  bool push(const T& item) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N) return false;
+    slots[h & (N - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+  
+  bool pop(T& item) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) return false;
+    item = slots[t & (N - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+  
+  // Consumer side: look at the oldest item without taking it
+  T* front() {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) return NULL;
+    return &slots[t & (N - 1)];
+  }
+  
+  uint32_t size() const {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+  
+private:
+  T slots[N];
+  std::atomic<uint32_t> head{0};
+  std::atomic<uint32_t> tail{0};
+};
@@ -0,0 +1,131 @@
+/*
+ * Status change detection and encoding, see status.h.
+ */
+
+#include <stdlib.h>
+#include "status.h"
+
+uint64_t statusChanges(const StatusSnapshot& now, const StatusSnapshot& sent) {
+  uint64_t changed = 0;
+  
+  if (now.primaryConnected != sent.primaryConnected) changed |= 1ULL << STATUS_PRIMARY_CONNECTED;
+  if (now.primarySSIDHash != sent.primarySSIDHash) changed |= 1ULL << STATUS_PRIMARY_SSID;
+  if (now.primaryIP != sent.primaryIP) changed |= 1ULL << STATUS_PRIMARY_IP;
+  if (abs(now.primaryRSSI - sent.primaryRSSI) >= STATUS_RSSI_HYSTERESIS) changed |= 1ULL << STATUS_PRIMARY_RSSI;
+  if (now.uplinkState != sent.uplinkState) changed |= 1ULL << STATUS_UPLINK_STATE;
+  if (now.uplinkRetries != sent.uplinkRetries) changed |= 1ULL << STATUS_UPLINK_RETRIES;
+  if (now.disconnectReason != sent.disconnectReason) changed |= 1ULL << STATUS_DISCONNECT_REASON;
+  if (now.connectMs != sent.connectMs) changed |= 1ULL << STATUS_CONNECT_MS;
+  if (now.apSSIDHash != sent.apSSIDHash) changed |= 1ULL << STATUS_AP_SSID;
+  if (now.apIP != sent.apIP) changed |= 1ULL << STATUS_AP_IP;
+  if (now.clients != sent.clients) changed |= 1ULL << STATUS_CLIENTS;
+  if (now.maxClients != sent.maxClients) changed |= 1ULL << STATUS_MAX_CLIENTS;
+  if (now.napt != sent.napt) changed |= 1ULL << STATUS_NAPT;
+  if (now.forwardMode != sent.forwardMode) changed |= 1ULL << STATUS_FORWARD_MODE;
+  if (now.powerSaving != sent.powerSaving) changed |= 1ULL << STATUS_POWER_SAVING;
+  if (now.powerMode != sent.powerMode) changed |= 1ULL << STATUS_POWER_MODE;
+  if (now.listenInterval != sent.listenInterval) changed |= 1ULL << STATUS_LISTEN_INTERVAL;
+  if (abs((int32_t)(now.freeHeap - sent.freeHeap)) >= STATUS_HEAP_HYSTERESIS) changed |= 1ULL << STATUS_FREE_HEAP;
+  if (now.drops != sent.drops) changed |= 1ULL << STATUS_DROPS;
+  if (now.latencyP99 != sent.latencyP99) changed |= 1ULL << STATUS_LATENCY_P99;
+  if (now.apChannel != sent.apChannel) changed |= 1ULL << STATUS_AP_CHANNEL;
+  if (now.autoChannel != sent.autoChannel) changed |= 1ULL << STATUS_AUTO_CHANNEL;
+  if (now.governor != sent.governor) changed |= 1ULL << STATUS_GOVERNOR;
+  if (now.cpuMhz != sent.cpuMhz) changed |= 1ULL << STATUS_CPU_MHZ;
+  if (abs(now.pool[0] - sent.pool[0]) >= STATUS_POOL_HYSTERESIS || now.pool[1] != sent.pool[1] ||
+      now.pool[2] != sent.pool[2] || now.pool[3] != sent.pool[3]) {
+    changed |= 1ULL << STATUS_POOL;
+  }
+  if (memcmp(now.bleRadio, sent.bleRadio, sizeof(now.bleRadio)) != 0) changed |= 1ULL << STATUS_BLE_RADIO;
+  if (memcmp(now.phy, sent.phy, sizeof(now.phy)) != 0) changed |= 1ULL << STATUS_PHY;
+  if (now.idle != sent.idle) changed |= 1ULL << STATUS_IDLE;
+  if (abs(now.health[0] - sent.health[0]) >= STATUS_HEAP_HYSTERESIS ||
+      abs(now.health[1] - sent.health[1]) >= STATUS_HEAP_HYSTERESIS || now.health[3] != sent.health[3]) {
+    changed |= 1ULL << STATUS_HEALTH;
+  }
+  if (now.clientStatCount != sent.clientStatCount) {
+    changed |= 1ULL << STATUS_CLIENT_QUEUES;
+  } else {
+    for (uint8_t i = 0; i < now.clientStatCount; i++) {
+      const EgressClientStat& a = now.clientStats[i];
+      const EgressClientStat& b = sent.clientStats[i];
+      if (memcmp(a.mac, b.mac, 6) != 0 || a.depth != b.depth ||
+          abs((int32_t)a.kbps - (int32_t)b.kbps) >= STATUS_RATE_HYSTERESIS) {
+        changed |= 1ULL << STATUS_CLIENT_QUEUES;
+        break;
+      }
+    }
+  }
+  
+  // Uptime and traffic counters move all the time; they ride along with real changes
+  if (changed) {
+    changed |= (1ULL << STATUS_UPTIME) | (1ULL << STATUS_FWD_PACKETS_UP) | (1ULL << STATUS_FWD_PACKETS_DOWN) |
+               (1ULL << STATUS_FWD_KBYTES_UP) | (1ULL << STATUS_FWD_KBYTES_DOWN);
+  }
+  
+  return changed;
+}
+
+size_t encodeStatus(const StatusSnapshot& snap, const StatusText& text, uint64_t fields, uint8_t format, uint8_t* buf, size_t cap) {
+  StatusWriter w(buf, cap, format);
+  
+  if (fields & (1ULL << STATUS_PRIMARY_CONNECTED)) w.addBool(STATUS_PRIMARY_CONNECTED, "primaryConnected", snap.primaryConnected);
+  if (fields & (1ULL << STATUS_PRIMARY_SSID)) w.addString(STATUS_PRIMARY_SSID, "primarySSID", text.primarySSID);
+  if (fields & (1ULL << STATUS_PRIMARY_IP)) w.addIP(STATUS_PRIMARY_IP, "primaryIP", snap.primaryIP);
+  if (fields & (1ULL << STATUS_PRIMARY_RSSI)) w.addInt(STATUS_PRIMARY_RSSI, "primaryRSSI", snap.primaryRSSI);
+  if (fields & (1ULL << STATUS_UPLINK_STATE)) w.addInt(STATUS_UPLINK_STATE, "uplinkState", snap.uplinkState);
+  if (fields & (1ULL << STATUS_UPLINK_RETRIES)) w.addInt(STATUS_UPLINK_RETRIES, "uplinkRetries", snap.uplinkRetries);
+  if (fields & (1ULL << STATUS_DISCONNECT_REASON)) w.addInt(STATUS_DISCONNECT_REASON, "disconnectReason", snap.disconnectReason);
+  if (fields & (1ULL << STATUS_CONNECT_MS)) w.addInt(STATUS_CONNECT_MS, "connectMs", snap.connectMs);
+  if (fields & (1ULL << STATUS_AP_SSID)) w.addString(STATUS_AP_SSID, "apSSID", text.apSSID);
+  if (fields & (1ULL << STATUS_AP_IP)) w.addIP(STATUS_AP_IP, "apIP", snap.apIP);
+  if (fields & (1ULL << STATUS_CLIENTS)) w.addInt(STATUS_CLIENTS, "connectedClients", snap.clients);
+  if (fields & (1ULL << STATUS_MAX_CLIENTS)) w.addInt(STATUS_MAX_CLIENTS, "maxClients", snap.maxClients);
+  if (fields & (1ULL << STATUS_NAPT)) w.addBool(STATUS_NAPT, "napt", snap.napt);
+  if (fields & (1ULL << STATUS_FORWARD_MODE)) w.addString(STATUS_FORWARD_MODE, "forwardMode", text.forwardMode);
+  if (fields & (1ULL << STATUS_POWER_SAVING)) w.addBool(STATUS_POWER_SAVING, "powerSaving", snap.powerSaving);
+  if (fields & (1ULL << STATUS_POWER_MODE)) w.addInt(STATUS_POWER_MODE, "powerMode", snap.powerMode);
+  if (fields & (1ULL << STATUS_LISTEN_INTERVAL)) w.addInt(STATUS_LISTEN_INTERVAL, "listenInterval", snap.listenInterval);
+  if (fields & (1ULL << STATUS_FREE_HEAP)) w.addInt(STATUS_FREE_HEAP, "freeHeap", snap.freeHeap);
+  if (fields & (1ULL << STATUS_UPTIME)) w.addInt(STATUS_UPTIME, "uptime", snap.uptime);
+  if (fields & (1ULL << STATUS_FWD_PACKETS_UP)) w.addInt(STATUS_FWD_PACKETS_UP, "upPkts", snap.fwdPackets[0]);
+  if (fields & (1ULL << STATUS_FWD_PACKETS_DOWN)) w.addInt(STATUS_FWD_PACKETS_DOWN, "downPkts", snap.fwdPackets[1]);
+  if (fields & (1ULL << STATUS_FWD_KBYTES_UP)) w.addInt(STATUS_FWD_KBYTES_UP, "upKB", snap.fwdKBytes[0]);
+  if (fields & (1ULL << STATUS_FWD_KBYTES_DOWN)) w.addInt(STATUS_FWD_KBYTES_DOWN, "downKB", snap.fwdKBytes[1]);
+  if (fields & (1ULL << STATUS_DROPS)) w.addInt(STATUS_DROPS, "drops", snap.drops);
+  if (fields & (1ULL << STATUS_LATENCY_P99)) w.addInt(STATUS_LATENCY_P99, "fwdP99Us", snap.latencyP99);
+  if (fields & (1ULL << STATUS_AP_CHANNEL)) w.addInt(STATUS_AP_CHANNEL, "channel", snap.apChannel);
+  if (fields & (1ULL << STATUS_AUTO_CHANNEL)) w.addBool(STATUS_AUTO_CHANNEL, "autoChannel", snap.autoChannel);
+  if (fields & (1ULL << STATUS_GOVERNOR)) w.addString(STATUS_GOVERNOR, "governor", text.governor);
+  if (fields & (1ULL << STATUS_CPU_MHZ)) w.addInt(STATUS_CPU_MHZ, "cpuMhz", snap.cpuMhz);
+  if (fields & (1ULL << STATUS_CLIENT_QUEUES)) w.addClientQueues(STATUS_CLIENT_QUEUES, "clientQueues", snap.clientStats, snap.clientStatCount);
+  if (fields & (1ULL << STATUS_POOL)) w.addIntList(STATUS_POOL, "pool", snap.pool, 4);
+  if (fields & (1ULL << STATUS_BLE_RADIO)) w.addIntList(STATUS_BLE_RADIO, "bleRadio", snap.bleRadio, 4);
+  if (fields & (1ULL << STATUS_PHY)) w.addIntList(STATUS_PHY, "phy", snap.phy, 5);
+  if (fields & (1ULL << STATUS_IDLE)) w.addBool(STATUS_IDLE, "idle", snap.idle);
+  if (fields & (1ULL << STATUS_HEALTH)) w.addIntList(STATUS_HEALTH, "health", snap.health, 4);
+  
+  return w.finish();
+}
+
+size_t encodeStatusFitting(const StatusSnapshot& snap, const StatusText& text, uint64_t fields, uint8_t format,
+                           uint8_t* buf, size_t cap, uint64_t* packed) {
+  uint64_t taken = 0;
+  size_t len = 0;
+  bool bufferHoldsTaken = true;
+  for (uint8_t field = 0; field < STATUS_FIELD_COUNT; field++) {
+    uint64_t bit = 1ULL << field;
+    if (!(fields & bit)) continue;
+    size_t n = encodeStatus(snap, text, taken | bit, format, buf, cap);
+    if (n != 0) {
+      taken |= bit;
+      len = n;
+    }
+    bufferHoldsTaken = n != 0;
+  }
+  
+  // A failed attempt leaves a partial document behind
+  if (!bufferHoldsTaken && taken != 0) len = encodeStatus(snap, text, taken, format, buf, cap);
+  if (packed != NULL) *packed = taken;
+  return len;
+}
@@ -0,0 +1,274 @@
+/*
+ * BLE status model: the snapshot the supervisor collects, which fields changed since
+ * the central last saw it, and the encoder that writes them as JSON or TLV into a
+ * caller-provided buffer without touching the heap.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define STATUS_FORMAT_JSON  0
+#define STATUS_FORMAT_TLV   1
+#define STATUS_TLV_VERSION  1
+#define STATUS_RSSI_HYSTERESIS     4      // dB
+#define STATUS_HEAP_HYSTERESIS     4096   // bytes
+#define STATUS_RATE_HYSTERESIS     64     // kbit/s, per client
+#define STATUS_POOL_HYSTERESIS     4      // buffers in use
+#define STATUS_CLIENT_STATS        10     // One per possible AP client
+// Worst-case full snapshot: every field, STATUS_CLIENT_STATS clients, extreme values and
+// both SSIDs made of 32 control characters (6 bytes each once escaped). JSON is 1521;
+// core_test fails if the encoder ever outgrows this (fixture in tests/worst_status.h).
+#define STATUS_SNAPSHOT_MAX        1536
+
+// Status fields. The value doubles as the TLV tag, so never renumber, only append.
+#define STATUS_PRIMARY_CONNECTED   0
+#define STATUS_PRIMARY_SSID        1
+#define STATUS_PRIMARY_IP          2
+#define STATUS_PRIMARY_RSSI        3
+#define STATUS_UPLINK_STATE        4
+#define STATUS_UPLINK_RETRIES      5
+#define STATUS_DISCONNECT_REASON   6
+#define STATUS_CONNECT_MS          7
+#define STATUS_AP_SSID             8
+#define STATUS_AP_IP               9
+#define STATUS_CLIENTS             10
+#define STATUS_MAX_CLIENTS         11
+#define STATUS_NAPT                12
+#define STATUS_FORWARD_MODE        13
+#define STATUS_POWER_SAVING        14
+#define STATUS_POWER_MODE          15
+#define STATUS_LISTEN_INTERVAL     16
+#define STATUS_FREE_HEAP           17
+#define STATUS_UPTIME              18
+#define STATUS_FWD_PACKETS_UP      19
+#define STATUS_FWD_PACKETS_DOWN    20
+#define STATUS_FWD_KBYTES_UP       21
+#define STATUS_FWD_KBYTES_DOWN     22
+#define STATUS_DROPS               23
+#define STATUS_LATENCY_P99         24
+#define STATUS_AP_CHANNEL          25
+#define STATUS_AUTO_CHANNEL        26
+#define STATUS_GOVERNOR            27
+#define STATUS_CPU_MHZ             28
+#define STATUS_CLIENT_QUEUES       29
+#define STATUS_POOL                30
+#define STATUS_BLE_RADIO           31
+#define STATUS_PHY                 32
+#define STATUS_IDLE                33
+#define STATUS_HEALTH              34
+#define STATUS_FIELD_COUNT         35     // The change mask is a uint64_t
+#define STATUS_ALL_FIELDS          ((1ULL << STATUS_FIELD_COUNT) - 1)
+
+struct EgressClientStat {
+  uint8_t mac[6];
+  uint8_t depth;
+  uint16_t kbps;
+};
+
+struct StatusSnapshot {
+  bool primaryConnected;
+  int8_t primaryRSSI;
+  uint8_t uplinkState;
+  uint8_t uplinkRetries;
+  uint8_t disconnectReason;
+  uint8_t clients;
+  uint8_t maxClients;
+  bool napt;
+  uint8_t forwardMode;
+  bool powerSaving;
+  uint8_t powerMode;        // 0..2 as accepted by parseConfig
+  uint8_t listenInterval;
+  uint32_t primaryIP;       // Network byte order
+  uint32_t apIP;
+  uint32_t connectMs;
+  uint32_t freeHeap;
+  uint32_t uptime;
+  uint32_t primarySSIDHash; // Strings are compared by CRC for change detection
+  uint32_t apSSIDHash;
+  uint32_t fwdPackets[2];   // Forwarding counters, indexed by DIR_* (0 = up, 1 = down)
+  uint32_t fwdKBytes[2];
+  uint32_t drops;           // All reasons
+  uint32_t latencyP99;      // Microseconds, upper bound of the p99 bucket of STAGE_TOTAL
+  uint8_t apChannel;        // Channel the softAP is actually on
+  bool autoChannel;
+  int8_t governor;          // GOV_* level, -1 when the governor is off
+  uint16_t cpuMhz;
+  uint8_t clientStatCount;
+  EgressClientStat clientStats[STATUS_CLIENT_STATS];
+  int32_t pool[4];          // In use, high water, size, misses
+  int32_t bleRadio[4];      // COEX_* policy, ADV_* mode, advertising interval ms, airtime permille
+  int32_t phy[5];           // Tuner on, AP bandwidth MHz, 11b on, TX power dBm, survey neighbours
+  bool idle;
+  int32_t health[4];        // Largest free block, heap low water, fragmentation %, soft restarts
+};
+
+// Strings the snapshot only carries as hashes or codes
+struct StatusText {
+  const char* primarySSID;
+  const char* apSSID;
+  const char* forwardMode;
+  const char* governor;
+};
+
+// Writes status fields straight into a caller-provided buffer, either as a flat JSON
+// object or as a TLV stream (version byte, then tag/len/value with little-endian ints)
+class StatusWriter {
+public:
+  StatusWriter(uint8_t* buf, size_t cap, uint8_t format) : buf(buf), cap(cap), format(format) {
+    if (format == STATUS_FORMAT_TLV) {
+      put(STATUS_TLV_VERSION);
+    } else {
+      put('{');
+    }
+  }
+  
+  void addInt(uint8_t tag, const char* key, int32_t value) {
+    if (format == STATUS_FORMAT_TLV) {
+      uint8_t v[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+      putTLV(tag, v, sizeof(v));
+    } else {
+      char num[12];
+      int n = snprintf(num, sizeof(num), "%ld", (long)value);
+      putKey(key);
+      putRaw(num, n);
+    }
+  }
+  
+  void addBool(uint8_t tag, const char* key, bool value) {
+    if (format == STATUS_FORMAT_TLV) {
+      uint8_t v = value;
+      putTLV(tag, &v, 1);
+    } else {
+      putKey(key);
+      putRaw(value ? "true" : "false", value ? 4 : 5);
+    }
+  }
+  
+  void addString(uint8_t tag, const char* key, const char* value) {
+    size_t n = strlen(value);
+    if (format == STATUS_FORMAT_TLV) {
+      putTLV(tag, (const uint8_t*)value, n > 255 ? 255 : n);
+      return;
+    }
+    putKey(key);
+    put('"');
+    for (size_t i = 0; i < n; i++) {
+      char c = value[i];
+      if (c == '"' || c == '\\') {
+        put('\\');
+        put(c);
+      } else if ((uint8_t)c < 0x20) {
+        char esc[7];
+        snprintf(esc, sizeof(esc), "\\u%04x", c);
+        putRaw(esc, 6);
+      } else {
+        put(c);
+      }
+    }
+    put('"');
+  }
+  
+  void addIP(uint8_t tag, const char* key, uint32_t addr) {
+    const uint8_t* b = (const uint8_t*)&addr;
+    if (format == STATUS_FORMAT_TLV) {
+      putTLV(tag, b, 4);
+    } else {
+      char ip[16];
+      snprintf(ip, sizeof(ip), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+      addString(tag, key, ip);
+    }
+  }
+  
+  void addClientQueues(uint8_t tag, const char* key, const EgressClientStat* stats, uint8_t n) {
+    if (format == STATUS_FORMAT_TLV) {
+      // 9 bytes per client: MAC, queue depth, kbit/s little-endian
+      put(tag);
+      put(n * 9);
+      for (uint8_t i = 0; i < n; i++) {
+        for (uint8_t b = 0; b < 6; b++) put(stats[i].mac[b]);
+        put(stats[i].depth);
+        put(stats[i].kbps);
+        put(stats[i].kbps >> 8);
+      }
+      return;
+    }
+    // [["a4c138f0e1d2",depth,kbps],...]
+    putKey(key);
+    put('[');
+    for (uint8_t i = 0; i < n; i++) {
+      const uint8_t* m = stats[i].mac;
+      char entry[32];
+      int len = snprintf(entry, sizeof(entry), "%s[\"%02x%02x%02x%02x%02x%02x\",%u,%u]", i ? "," : "",
+                         m[0], m[1], m[2], m[3], m[4], m[5], stats[i].depth, stats[i].kbps);
+      putRaw(entry, len);
+    }
+    put(']');
+  }
+  
+  void addIntList(uint8_t tag, const char* key, const int32_t* values, uint8_t n) {
+    if (format == STATUS_FORMAT_TLV) {
+      put(tag);
+      put(n * 4);
+      for (uint8_t i = 0; i < n; i++) {
+        for (uint8_t b = 0; b < 4; b++) put(values[i] >> (8 * b));
+      }
+      return;
+    }
+    putKey(key);
+    put('[');
+    for (uint8_t i = 0; i < n; i++) {
+      char num[13];
+      int len = snprintf(num, sizeof(num), "%s%ld", i ? "," : "", (long)values[i]);
+      putRaw(num, len);
+    }
+    put(']');
+  }
+  
+  // Closes the document; returns its length, or 0 if it did not fit
+  size_t finish() {
+    if (format == STATUS_FORMAT_JSON) put('}');
+    return overflow ? 0 : len;
+  }
+  
+private:
+  void put(uint8_t c) {
+    if (len < cap) buf[len++] = c;
+    else overflow = true;
+  }
+  
+  void putRaw(const char* p, size_t n) {
+    for (size_t i = 0; i < n; i++) put(p[i]);
+  }
+  
+  void putKey(const char* key) {
+    if (fields++ > 0) put(',');
+    put('"');
+    putRaw(key, strlen(key));
+    put('"');
+    put(':');
+  }
+  
+  void putTLV(uint8_t tag, const uint8_t* value, size_t n) {
+    put(tag);
+    put(n);
+    for (size_t i = 0; i < n; i++) put(value[i]);
+  }
+  
+  uint8_t* buf;
+  size_t cap;
+  uint8_t format;
+  size_t len = 0;
+  uint16_t fields = 0;
+  bool overflow = false;
+};
+
+uint64_t statusChanges(const StatusSnapshot& now, const StatusSnapshot& sent);
+size_t encodeStatus(const StatusSnapshot& snap, const StatusText& text, uint64_t fields, uint8_t format, uint8_t* buf, size_t cap);
+// As many of `fields` as fit `cap`, taken in tag order and skipping any that would not
+// fit; *packed gets the fields that made it. Returns 0 only if none did.
+size_t encodeStatusFitting(const StatusSnapshot& snap, const StatusText& text, uint64_t fields, uint8_t format,
+                           uint8_t* buf, size_t cap, uint64_t* packed);
@@ -0,0 +1,201 @@
+/*
+ * Host checks for src/core, run by ctest: the conntrack table against a reference map
+ * with the same LRU rule, the worst-case status snapshot against its buffer, and the
+ * checksums the fast path patches when it translates an ICMP error.
+ */
+
+#include <arpa/inet.h>
+#include <list>
+#include <map>
+#include <random>
+#include <tuple>
+#include <vector>
+#include "conntrack.h"
+#include "frame.h"
+#include "status.h"
+#include "worst_status.h"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                        \
+  do {                                                                     \
+    if (!(cond)) {                                                         \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      failures++;                                                          \
+    }                                                                      \
+  } while (0)
+
+// Checksum over a range, 0 when the range carries a valid one
+uint16_t checksum(const uint8_t* p, size_t len, uint32_t acc = 0) {
+  for (size_t i = 0; i + 1 < len; i += 2) acc += readBE16(p + i);
+  if (len & 1) acc += p[len - 1] << 8;
+  while (acc >> 16) acc = (acc & 0xFFFF) + (acc >> 16);
+  return ~acc;
+}
+
+uint32_t pseudoHeader(const uint8_t* ip, uint8_t proto, uint16_t l4Len) {
+  return readBE16(ip + 12) + readBE16(ip + 14) + readBE16(ip + 16) + readBE16(ip + 18) + proto + l4Len;
+}
+
+typedef std::tuple<uint8_t, uint32_t, uint32_t, uint16_t, uint16_t> Key;
+
+// Random insert, lookup, touch and remove against a full-sized table and a model that
+// evicts the least recently used flow the same way
+void testConntrackMatchesReference() {
+  const uint16_t size = 64;
+  std::vector<CtEntry> entries(size);
+  std::vector<CtBucket> buckets(128);
+  ctEntries = entries.data();
+  ctBuckets = buckets.data();
+  ctSize = size;
+  ctBucketMask = buckets.size() - 1;
+  ctFlush();
+
+  std::map<Key, uint16_t> model;
+  std::list<Key> lru;  // Most recent first
+  std::mt19937 rng(1);
+  const uint8_t mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+  for (int op = 0; op < 200000; op++) {
+    // A small tuple space so hits, misses and reuse all happen often
+    Key k((rng() & 1) ? 6 : 17, 0x0A000000 | (rng() % 4), 0x5DB80000 | (rng() % 8),
+          10000 + rng() % 16, 443);
+    uint32_t hash = ctHash(std::get<0>(k), std::get<1>(k), std::get<2>(k), std::get<3>(k), std::get<4>(k));
+    uint16_t index = ctLookup(hash, std::get<0>(k), std::get<1>(k), std::get<2>(k), std::get<3>(k), std::get<4>(k));
+    auto it = model.find(k);
+    CHECK((it == model.end()) == (index == CT_NONE));
+    if (it != model.end()) CHECK(it->second == index);
+
+    uint32_t action = rng() % 4;
+    if (index == CT_NONE && action != 3) {
+      if (model.size() == size) {
+        model.erase(lru.back());
+        lru.pop_back();
+      }
+      index = ctInsert(hash, std::get<0>(k), std::get<1>(k), std::get<2>(k), std::get<3>(k), std::get<4>(k), mac, 0);
+      CHECK(index < size);
+      model[k] = index;
+      lru.push_front(k);
+    } else if (index != CT_NONE && action == 3) {
+      ctRemove(index);
+      model.erase(k);
+      lru.remove(k);
+    } else if (index != CT_NONE) {
+      ctTouch(index);
+      lru.remove(k);
+      lru.push_front(k);
+    }
+    CHECK(ctUsed == model.size());
+  }
+
+  for (auto& flow : model) {
+    const CtEntry& e = ctEntries[flow.second];
+    CHECK(e.proto == std::get<0>(flow.first) && e.clientIP == std::get<1>(flow.first) &&
+          e.remoteIP == std::get<2>(flow.first) && e.clientPort == std::get<3>(flow.first));
+  }
+  ctEntries = NULL;
+  ctBuckets = NULL;
+  ctSize = 0;
+}
+
+// The worst case has to fit STATUS_SNAPSHOT_MAX, and a GATT-sized cut has to keep most of it
+void testWorstStatusFits() {
+  const StatusSnapshot s = worstStatusSnapshot();
+  const StatusText text = worstStatusText();
+
+  uint8_t buf[STATUS_SNAPSHOT_MAX];
+  for (uint8_t format = STATUS_FORMAT_JSON; format <= STATUS_FORMAT_TLV; format++) {
+    size_t len = encodeStatus(s, text, STATUS_ALL_FIELDS, format, buf, sizeof(buf));
+    CHECK(len != 0 && len <= STATUS_SNAPSHOT_MAX);
+
+    uint64_t packed = 0;
+    len = encodeStatusFitting(s, text, STATUS_ALL_FIELDS, format, buf, 600, &packed);
+    CHECK(len != 0 && len <= 600);
+    CHECK(packed != 0 && (packed & ~STATUS_ALL_FIELDS) == 0);
+    CHECK(encodeStatus(s, text, packed, format, buf, 600) == len);
+  }
+}
+
+// Port unreachable for a datagram the fast path sent from uplink:port, quoting `quoted`
+// bytes of it, translated back to the client
+void checkICMPError(uint8_t proto, size_t quotedL4) {
+  uint8_t packet[20 + 8 + 20 + 20] = { 0 };
+  uint8_t* ip = packet;
+  uint8_t* icmp = ip + 20;
+  uint8_t* inner = icmp + 8;
+  uint8_t* l4 = inner + 20;
+  size_t quoted = 20 + quotedL4;
+  uint16_t total = 20 + 8 + quoted;
+  uint32_t uplink = inet_addr("10.0.0.2");
+  uint32_t remote = inet_addr("8.8.8.8");
+  uint32_t client = inet_addr("192.168.4.7");
+
+  ip[0] = 0x45;
+  writeBE16(ip + 2, total);
+  ip[8] = 64;
+  ip[9] = 1;
+  uint32_t router = inet_addr("10.0.0.1");
+  memcpy(ip + 12, &router, 4);
+  memcpy(ip + 16, &uplink, 4);
+  icmp[0] = 3;
+  icmp[1] = 3;
+  inner[0] = 0x45;
+  writeBE16(inner + 2, 200);
+  inner[8] = 63;
+  inner[9] = proto;
+  memcpy(inner + 12, &uplink, 4);
+  memcpy(inner + 16, &remote, 4);
+  writeBE16(l4, 40007);
+  writeBE16(l4 + 2, 53);
+
+  // The quoted transport checksum as the remote end would have checked it, over a
+  // datagram bigger than the quote
+  uint16_t l4Len = 180;
+  uint8_t full[180] = { 0 };
+  memcpy(full, l4, quotedL4);
+  if (proto == 17) writeBE16(full + 4, l4Len);
+  size_t csumAt = proto == 6 ? 16 : 6;
+  if (proto == 6) full[12] = 0x50;
+  uint16_t before = checksum(full, l4Len, pseudoHeader(inner, proto, l4Len));
+  writeBE16(full + csumAt, before);
+  memcpy(l4, full, quotedL4);
+
+  writeBE16(inner + 10, checksum(inner, 20));
+  writeBE16(icmp + 2, checksum(icmp, total - 20));
+  writeBE16(ip + 10, checksum(ip, 20));
+
+  ctRewriteICMPError(ip, icmp, inner, quoted, client, 5555);
+  CHECK(checksum(ip, 20) == 0);
+  CHECK(checksum(inner, 20) == 0);
+  CHECK(checksum(icmp, total - 20) == 0);
+  CHECK(ip[8] == 63);
+  CHECK(memcmp(ip + 16, &client, 4) == 0 && memcmp(inner + 12, &client, 4) == 0);
+  CHECK(readBE16(l4) == 5555);
+
+  // Where the quote reached it, the inner checksum now holds for the client's tuple
+  if (quotedL4 >= csumAt + 2) {
+    memcpy(full, l4, quotedL4);
+    CHECK(checksum(full, l4Len, pseudoHeader(inner, proto, l4Len)) == 0);
+  }
+}
+
+void testICMPErrorRewrite() {
+  checkICMPError(17, 8);
+  checkICMPError(6, 8);    // RFC 792 minimum: ports only, the TCP checksum isn't quoted
+  checkICMPError(6, 20);
+}
+
+}  // namespace
+
+int main() {
+  testConntrackMatchesReference();
+  testWorstStatusFits();
+  testICMPErrorRewrite();
+  if (failures != 0) {
+    fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("core_test: all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * The largest status document the encoder can produce, shared by core_test (which
+ * asserts it fits STATUS_SNAPSHOT_MAX) and the worst-case encoding benchmark.
+ */
+
+#pragma once
+
+#include <string.h>
+#include "status.h"
+
+// Every client slot, values at their longest decimal width, booleans false (the longer
+// JSON literal)
+static inline StatusSnapshot worstStatusSnapshot() {
+  StatusSnapshot s;
+  memset(&s, 0, sizeof(s));
+  s.primaryRSSI = -128;
+  s.uplinkState = s.uplinkRetries = s.disconnectReason = s.clients = s.maxClients = 255;
+  s.powerMode = s.listenInterval = s.apChannel = 255;
+  s.primaryIP = s.apIP = 0xFFFFFFFF;
+  s.connectMs = s.freeHeap = s.uptime = s.drops = s.latencyP99 = 0x80000000;
+  for (int dir = 0; dir < 2; dir++) s.fwdPackets[dir] = s.fwdKBytes[dir] = 0x80000000;
+  s.governor = -128;
+  s.cpuMhz = 65535;
+  s.clientStatCount = STATUS_CLIENT_STATS;
+  for (uint8_t i = 0; i < STATUS_CLIENT_STATS; i++) {
+    memset(s.clientStats[i].mac, 0xFF, 6);
+    s.clientStats[i].depth = 255;
+    s.clientStats[i].kbps = 65535;
+  }
+  for (int i = 0; i < 4; i++) s.pool[i] = s.bleRadio[i] = s.health[i] = INT32_MIN;
+  for (int i = 0; i < 5; i++) s.phy[i] = INT32_MIN;
+  return s;
+}
+
+// Both SSIDs made of 32 control characters, each escaped to \u00xx
+static inline StatusText worstStatusText() {
+  static char ssid[33];
+  memset(ssid, 0x01, 32);
+  ssid[32] = 0;
+  return StatusText{ ssid, ssid, "bridge", "performance" };
+}